@@ -91,6 +91,8 @@ static std::vector<dost_ImgData> PipelineRunSFML(PipelineOptions &values) {
     values.idAlgo = "py";
     values.attitudeAlgo = "dqm";
     values.databasePath = "my-database.dat";
+    // consecutive frames only turn a little, so follow the stars instead of identifying them every frame
+    values.track = true;
 
     // Set up Pipeline and reserve space for each frame.
     Pipeline pipeline = SetPipeline(values); 
@@ -136,6 +138,10 @@ static std::vector<dost_ImgData> PipelineRunSFML(PipelineOptions &values) {
                 imgData.starIds.emplace_back(id.starIndex, id.catalogIndex);
             }
         }
+        imgData.tracked = out.starIdsTracked;
+        if (pipeline.GetTracker() != NULL && pipeline.GetTracker()->HasRate()) {
+            imgData.angularRate = pipeline.GetTracker()->AngularRate();
+        }
 
         returnData.push_back(imgData);
 
@@ -448,7 +454,9 @@ static int LostMain(int argc, char **argv) {
                     text.setString(
                         "RA: " + std::to_string(RadToDeg(s.ra)) +
                         " DE: " + std::to_string(RadToDeg(s.de)) +
-                        " Roll: " + std::to_string(RadToDeg(s.roll))
+                        " Roll: " + std::to_string(RadToDeg(s.roll)) +
+                        " Rate: " + std::to_string(RadToDeg(imgData[idx].angularRate.Magnitude())) + " deg/frame" +
+                        (imgData[idx].tracked ? " (tracked)" : "")
                     );
                 } else {
                     text.setString("Attitude is UNKNOWN");
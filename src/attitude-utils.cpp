@@ -482,4 +482,13 @@ decimal AngleUnit(const Vec3 &vec1, const Vec3 &vec2) {
     return dot >= 1 ? 0 : dot <= -1 ? DECIMAL_M_PI-DECIMAL(0.0000001) : DECIMAL_ACOS(dot);
 }
 
+/**
+ * Calculate the inner angle of a triangle at one of its vertices.
+ * The triangle is the flat one through the three points, not a spherical triangle, but for stars
+ * that are close together on the unit sphere the two are nearly identical.
+ */
+decimal InnerAngle(const Vec3 &a, const Vec3 &b, const Vec3 &c) {
+    return Angle(b - a, c - a);
+}
+
 }
@@ -175,6 +175,8 @@ void SpatialToSpherical(const Vec3 &, decimal *ra, decimal *de);
 decimal Angle(const Vec3 &, const Vec3 &);
 /// angle between two vectors, /assuming/ that they are already unit length
 decimal AngleUnit(const Vec3 &, const Vec3 &);
+/// inner angle at vertex \p a of the (planar) triangle with vertices \p a, \p b, and \p c
+decimal InnerAngle(const Vec3 &a, const Vec3 &b, const Vec3 &c);
 
 decimal RadToDeg(decimal);
 decimal DegToRad(decimal);
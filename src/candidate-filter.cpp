@@ -0,0 +1,210 @@
+#include "candidate-filter.hpp"
+
+#include <math.h>
+
+#include <algorithm>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace lost {
+
+/**
+ * Candidates are gathered from the catalog into blocks of this many structure-of-arrays lanes
+ * before being tested. 8 fills an AVX register in float mode, or two in double mode.
+ */
+static const int kCandidateBlockSize = 8;
+
+/**
+ * Build a window that passes candidates between minDistance and maxDistance (radians) from
+ * center, inclusive. Distances below 0 or above pi are clamped, so that eg `distance - tolerance`
+ * can be passed without checking.
+ */
+CandidateWindow DistanceWindow(const Vec3 &center, decimal minDistance, decimal maxDistance) {
+    CandidateWindow result;
+    result.center = center;
+    // cosine decreases as the angle increases, so the max distance gives the min cosine
+    result.minCos = maxDistance >= DECIMAL_M_PI ? DECIMAL(-1.0) : DECIMAL_COS(maxDistance);
+    result.maxCos = minDistance <= 0 ? DECIMAL(1.0) : DECIMAL_COS(minDistance);
+    result.hasNormal = false;
+    result.normal = {0, 0, 0};
+    return result;
+}
+
+/// Like the other DistanceWindow, but also requires that candidates be on the positive side of normal.
+CandidateWindow DistanceWindow(const Vec3 &center, decimal minDistance, decimal maxDistance,
+                               const Vec3 &normal) {
+    CandidateWindow result = DistanceWindow(center, minDistance, maxDistance);
+    result.hasNormal = true;
+    result.normal = normal;
+    return result;
+}
+
+/**
+ * The range of cosines of the distances within tolerance of the distance whose cosine is given,
+ * ie `[cos(d + tolerance), cos(d - tolerance)]` where `cos(d) = cosine`, worked out with the angle
+ * sum formulas instead of an arccosine and two cosines. Clamped like DistanceWindow, so the range is
+ * `[-1, 1]` at most.
+ * @param cosine The dot product of two unit vectors, from -1 to 1
+ */
+void CosineBounds(decimal cosine, const CosineTolerance &tolerance, decimal *minCos, decimal *maxCos) {
+    // sin(d) is never negative, since d is from 0 to pi
+    decimal sine = DECIMAL_SQRT(std::max(DECIMAL(0.0), 1 - cosine*cosine));
+    // d < tolerance, so the distance can go all the way to 0
+    *maxCos = cosine >= tolerance.cos ? DECIMAL(1.0) : cosine*tolerance.cos + sine*tolerance.sin;
+    // d > pi - tolerance, so the distance can go all the way to pi
+    *minCos = cosine <= -tolerance.cos ? DECIMAL(-1.0) : cosine*tolerance.cos - sine*tolerance.sin;
+}
+
+// Each of these wraps the intrinsics for one instruction set, so that WindowMask can be written
+// once. Only one of them is compiled in, chosen by the flags the compiler was given (pass
+// LOST_NATIVE=1 to make to build for the current CPU).
+#if defined(__AVX__) && defined(LOST_FLOAT_MODE)
+struct CandidateLanes {
+    typedef __m256 V;
+    static const int kWidth = 8;
+    static V Load(const decimal *p) { return _mm256_load_ps(p); }
+    static V Set(decimal x) { return _mm256_set1_ps(x); }
+    static V Add(V a, V b) { return _mm256_add_ps(a, b); }
+    static V Mul(V a, V b) { return _mm256_mul_ps(a, b); }
+    static V And(V a, V b) { return _mm256_and_ps(a, b); }
+    static V GreaterEqual(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static V LessEqual(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static V Greater(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static unsigned Mask(V a) { return _mm256_movemask_ps(a); }
+};
+#elif defined(__AVX__)
+struct CandidateLanes {
+    typedef __m256d V;
+    static const int kWidth = 4;
+    static V Load(const decimal *p) { return _mm256_load_pd(p); }
+    static V Set(decimal x) { return _mm256_set1_pd(x); }
+    static V Add(V a, V b) { return _mm256_add_pd(a, b); }
+    static V Mul(V a, V b) { return _mm256_mul_pd(a, b); }
+    static V And(V a, V b) { return _mm256_and_pd(a, b); }
+    static V GreaterEqual(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+    static V LessEqual(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+    static V Greater(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+    static unsigned Mask(V a) { return _mm256_movemask_pd(a); }
+};
+#elif defined(__SSE2__) && defined(LOST_FLOAT_MODE)
+struct CandidateLanes {
+    typedef __m128 V;
+    static const int kWidth = 4;
+    static V Load(const decimal *p) { return _mm_load_ps(p); }
+    static V Set(decimal x) { return _mm_set1_ps(x); }
+    static V Add(V a, V b) { return _mm_add_ps(a, b); }
+    static V Mul(V a, V b) { return _mm_mul_ps(a, b); }
+    static V And(V a, V b) { return _mm_and_ps(a, b); }
+    static V GreaterEqual(V a, V b) { return _mm_cmpge_ps(a, b); }
+    static V LessEqual(V a, V b) { return _mm_cmple_ps(a, b); }
+    static V Greater(V a, V b) { return _mm_cmpgt_ps(a, b); }
+    static unsigned Mask(V a) { return _mm_movemask_ps(a); }
+};
+#elif defined(__SSE2__)
+struct CandidateLanes {
+    typedef __m128d V;
+    static const int kWidth = 2;
+    static V Load(const decimal *p) { return _mm_load_pd(p); }
+    static V Set(decimal x) { return _mm_set1_pd(x); }
+    static V Add(V a, V b) { return _mm_add_pd(a, b); }
+    static V Mul(V a, V b) { return _mm_mul_pd(a, b); }
+    static V And(V a, V b) { return _mm_and_pd(a, b); }
+    static V GreaterEqual(V a, V b) { return _mm_cmpge_pd(a, b); }
+    static V LessEqual(V a, V b) { return _mm_cmple_pd(a, b); }
+    static V Greater(V a, V b) { return _mm_cmpgt_pd(a, b); }
+    static unsigned Mask(V a) { return _mm_movemask_pd(a); }
+};
+#else
+/// Plain C++ for other architectures; the compiler may still auto-vectorize it.
+struct CandidateLanes {
+    typedef decimal V;
+    static const int kWidth = 1;
+    static V Load(const decimal *p) { return *p; }
+    static V Set(decimal x) { return x; }
+    static V Add(V a, V b) { return a + b; }
+    static V Mul(V a, V b) { return a * b; }
+    static V And(V a, V b) { return a != 0 && b != 0; }
+    static V GreaterEqual(V a, V b) { return a >= b; }
+    static V LessEqual(V a, V b) { return a <= b; }
+    static V Greater(V a, V b) { return a > b; }
+    static unsigned Mask(V a) { return a != 0; }
+};
+#endif
+
+static_assert(kCandidateBlockSize % CandidateLanes::kWidth == 0, "block must be a whole number of registers");
+
+/// Bit l of the result is set if lane l of the block passes the window.
+static unsigned WindowMask(const decimal *xs, const decimal *ys, const decimal *zs,
+                           const CandidateWindow &window) {
+    typedef CandidateLanes L;
+    const L::V centerX = L::Set(window.center.x);
+    const L::V centerY = L::Set(window.center.y);
+    const L::V centerZ = L::Set(window.center.z);
+    const L::V minCos = L::Set(window.minCos);
+    const L::V maxCos = L::Set(window.maxCos);
+    const L::V normalX = L::Set(window.normal.x);
+    const L::V normalY = L::Set(window.normal.y);
+    const L::V normalZ = L::Set(window.normal.z);
+    const L::V zero = L::Set(0);
+
+    unsigned mask = 0;
+    for (int lane = 0; lane < kCandidateBlockSize; lane += L::kWidth) {
+        L::V x = L::Load(xs + lane);
+        L::V y = L::Load(ys + lane);
+        L::V z = L::Load(zs + lane);
+        L::V cos = L::Add(L::Add(L::Mul(x, centerX), L::Mul(y, centerY)), L::Mul(z, centerZ));
+        L::V pass = L::And(L::GreaterEqual(cos, minCos), L::LessEqual(cos, maxCos));
+        if (window.hasNormal) {
+            L::V side = L::Add(L::Add(L::Mul(x, normalX), L::Mul(y, normalY)), L::Mul(z, normalZ));
+            pass = L::And(pass, L::Greater(side, zero));
+        }
+        mask |= L::Mask(pass) << lane;
+    }
+    return mask;
+}
+
+/**
+ * Keep only the candidate catalog stars which pass the window, without any trigonometry.
+ * Candidates are gathered from the catalog into structure-of-arrays blocks and tested several at a
+ * time with whatever SIMD instructions the build targets.
+ *
+ * @param candidates Catalog indices to test
+ * @param result Where to write the passing catalog indices, in their original order. Must have
+ * room for numCandidates; may be the same array as \p candidates.
+ * @return The number of candidates written to \p result
+ */
+long FilterCandidates(const Catalog &catalog, const CandidateWindow &window,
+                      const int16_t *candidates, long numCandidates, int16_t *result) {
+
+    alignas(32) decimal xs[kCandidateBlockSize];
+    alignas(32) decimal ys[kCandidateBlockSize];
+    alignas(32) decimal zs[kCandidateBlockSize];
+
+    long numPassed = 0;
+    for (long blockStart = 0; blockStart < numCandidates; blockStart += kCandidateBlockSize) {
+        int blockSize = (int)std::min<long>(kCandidateBlockSize, numCandidates - blockStart);
+        for (int lane = 0; lane < blockSize; lane++) {
+            const Vec3 &spatial = catalog[candidates[blockStart + lane]].spatial;
+            xs[lane] = spatial.x;
+            ys[lane] = spatial.y;
+            zs[lane] = spatial.z;
+        }
+        // the lanes past the end don't matter, but shouldn't be uninitialized either
+        for (int lane = blockSize; lane < kCandidateBlockSize; lane++) {
+            xs[lane] = ys[lane] = zs[lane] = 0;
+        }
+
+        unsigned mask = WindowMask(xs, ys, zs, window) & ((1u << blockSize) - 1);
+        // writes never get ahead of reads, so it's fine if result == candidates
+        for (int lane = 0; mask != 0; lane++, mask >>= 1) {
+            if (mask & 1) {
+                result[numPassed++] = candidates[blockStart + lane];
+            }
+        }
+    }
+    return numPassed;
+}
+
+}
@@ -0,0 +1,45 @@
+#ifndef CANDIDATE_FILTER_H
+#define CANDIDATE_FILTER_H
+
+#include <inttypes.h>
+
+#include "attitude-utils.hpp"
+#include "star-utils.hpp"
+
+namespace lost {
+
+/**
+ * A test applied to candidate catalog stars by FilterCandidates.
+ * A candidate `c` passes if `minCos <= center*c <= maxCos` (ie, its angular distance from
+ * `center` is in a certain range) and, when `hasNormal` is set, `normal*c > 0` (ie, it's on a
+ * certain side of a plane through the origin, which is how star-id checks spectrality).
+ */
+struct CandidateWindow {
+    Vec3 center;
+    decimal minCos;
+    decimal maxCos;
+    bool hasNormal;
+    Vec3 normal;
+};
+
+CandidateWindow DistanceWindow(const Vec3 &center, decimal minDistance, decimal maxDistance);
+CandidateWindow DistanceWindow(const Vec3 &center, decimal minDistance, decimal maxDistance,
+                               const Vec3 &normal);
+
+/// The sine and cosine of an angular tolerance, so that CosineBounds needs no trigonometry.
+struct CosineTolerance {
+    explicit CosineTolerance(decimal tolerance)
+        : cos(DECIMAL_COS(tolerance)), sin(DECIMAL_SIN(tolerance)) { };
+
+    decimal cos;
+    decimal sin;
+};
+
+void CosineBounds(decimal cosine, const CosineTolerance &tolerance, decimal *minCos, decimal *maxCos);
+
+long FilterCandidates(const Catalog &catalog, const CandidateWindow &window,
+                      const int16_t *candidates, long numCandidates, int16_t *result);
+
+}
+
+#endif
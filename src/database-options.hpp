@@ -10,6 +10,29 @@ LOST_CLI_OPTION("kvector"                , bool       , kvector
 LOST_CLI_OPTION("kvector-min-distance"   , decimal      , kvectorMinDistance    , 0.5   , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
 LOST_CLI_OPTION("kvector-max-distance"   , decimal      , kvectorMaxDistance    , 15    , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
 LOST_CLI_OPTION("kvector-distance-bins"  , long       , kvectorNumDistanceBins  , 10000 , atol(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("kvector-tolerance"      , decimal    , kvectorTolerance        , 0     , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("kvector-overfetch"      , decimal    , kvectorOverfetch        , 0.05  , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("pair-records"           , bool       , pairRecords             , false , atobool(optarg), true)
+LOST_CLI_OPTION("pair-cosines"           , bool       , pairCosines             , false , atobool(optarg), true)
+LOST_CLI_OPTION("compressed-pairs"       , bool       , compressedPairs         , false , atobool(optarg), true)
+LOST_CLI_OPTION("triple-kvector"             , bool       , tripleKvector              , false , atobool(optarg), true)
+LOST_CLI_OPTION("triple-kvector-min-distance", decimal    , tripleKvectorMinDistance   , 0.5   , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("triple-kvector-max-distance", decimal    , tripleKvectorMaxDistance   , 8     , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("triple-kvector-min-angle"   , decimal    , tripleKvectorMinInnerAngle , 5     , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("triple-kvector-bins"        , long       , tripleKvectorNumBins       , 10000 , atol(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("grid"                       , bool       , grid                       , false , atobool(optarg), true)
+LOST_CLI_OPTION("grid-size"                  , int        , gridSize                   , 32    , atoi(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("grid-pattern-radius"        , decimal    , gridPatternRadius          , 6     , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("grid-buffer-radius"         , decimal    , gridBufferRadius           , 0.25  , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("triangles"                  , bool       , triangles                  , false , atobool(optarg), true)
+LOST_CLI_OPTION("triangles-min-distance"     , decimal    , trianglesMinDistance       , 0.5   , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("triangles-max-distance"     , decimal    , trianglesMaxDistance       , 8     , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("neighbors"                  , bool       , neighbors                  , false , atobool(optarg), true)
+LOST_CLI_OPTION("neighbors-min-distance"     , decimal    , neighborsMinDistance       , 0.5   , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("neighbors-max-distance"     , decimal    , neighborsMaxDistance       , 15    , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("sky-cells"                  , bool       , skyCells                   , false , atobool(optarg), true)
+LOST_CLI_OPTION("sky-cells-per-side"         , int        , skyCellsPerSide            , 3     , atoi(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("threads"                    , int        , threads                    , 0     , atoi(optarg)   , kNoDefaultArgument)
 LOST_CLI_OPTION("swap-integer-endianness", bool       , swapIntegerEndianness   , false , atobool(optarg), true)
 LOST_CLI_OPTION("swap-decimal-endianness", bool       , swapDecimalEndianness   , false , atobool(optarg), true)
 LOST_CLI_OPTION("output"                 , std::string, outputPath              , "-"   , optarg         , kNoDefaultArgument)
@@ -3,10 +3,19 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 #include <cstdint>
 #include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <thread>
+#include <utility>
 
 #include "attitude-utils.hpp"
 #include "serialize-helpers.hpp"
@@ -15,6 +24,15 @@
 namespace lost {
 
 const int32_t PairDistanceKVectorDatabase::kMagicValue = 0x2536f009;
+const int32_t PairRecordKVectorDatabase::kMagicValue = 0x7c45e1d2;
+const int32_t PairCosineKVectorDatabase::kMagicValue = 0x3d9c6b15;
+const int32_t CompressedPairKVectorDatabase::kMagicValue = 0x5a0e83f7;
+const int32_t SkyCellPairDatabase::kMagicValue = 0x48c3e0a6;
+const int32_t TripleInnerKVectorDatabase::kMagicValue = 0x4f1e37d6;
+const decimal TripleInnerKVectorDatabase::kMiddleAngleScale = DECIMAL(65535.0) / DECIMAL_M_PI_2;
+const int32_t GridDatabase::kMagicValue = 0x6a1d3c57;
+const int32_t TriangleDatabase::kMagicValue = 0x3b92e4a1;
+const int32_t NeighborDatabase::kMagicValue = 0x1e8b52c9;
 
 inline bool isFlagSet(uint32_t dbFlags, uint32_t flag) {
    return (dbFlags & flag) != 0;
@@ -26,8 +44,12 @@ struct KVectorPair {
     decimal distance;
 };
 
+/// Orders by distance, then by the stars' indices, so that the order is the same however the pairs are sorted
 bool CompareKVectorPairs(const KVectorPair &p1, const KVectorPair &p2) {
-    return p1.distance < p2.distance;
+    if (p1.distance != p2.distance) {
+        return p1.distance < p2.distance;
+    }
+    return p1.index1 != p2.index1 ? p1.index1 < p2.index1 : p1.index2 < p2.index2;
 }
 
 // just the index part of the kvector, doesn't store the sorted list it refers to. This makes it
@@ -127,15 +149,34 @@ KVectorIndex::KVectorIndex(DeserializeContext *des) {
  * @return the index (starting from zero) of the first value matching the query
  */
 long KVectorIndex::QueryLiberal(decimal minQueryDistance, decimal maxQueryDistance, long *upperIndex) const {
+    long upperBoundary;
+    long lowerBoundary = QueryLiberalBins(minQueryDistance, maxQueryDistance, &upperBoundary);
+    if (lowerBoundary == upperBoundary) {
+        *upperIndex = 0;
+        return 0;
+    }
+    *upperIndex = bins[upperBoundary];
+    return bins[lowerBoundary];
+}
+
+/**
+ * The same query as QueryLiberal, but answered with the bins instead of the values: the values
+ * QueryLiberal would return are those from index bins[lowerBoundary] to bins[upperBoundary], ie, in
+ * bins lowerBoundary+1 through upperBoundary. For databases that store something per bin.
+ * @param upperBoundary[out] Is set to the last bin of the query.
+ * @return The bin before the first bin of the query. Equal to upperBoundary if the query is empty.
+ */
+long KVectorIndex::QueryLiberalBins(decimal minQueryDistance, decimal maxQueryDistance, long *upperBoundary) const {
     assert(maxQueryDistance > minQueryDistance);
     if (maxQueryDistance >= max) {
-        maxQueryDistance = max - DECIMAL(0.00001); // TODO: better way to avoid hitting the bottom bin
+        // half a bin in, so it's in the last bin whatever the units and bin width
+        maxQueryDistance = max - binWidth/2;
     }
     if (minQueryDistance <= min) {
-        minQueryDistance = min + DECIMAL(0.00001);
+        minQueryDistance = min + binWidth/2;
     }
     if (minQueryDistance > max || maxQueryDistance < min) {
-        *upperIndex = 0;
+        *upperBoundary = 0;
         return 0;
     }
     long lowerBin = BinFor(minQueryDistance);
@@ -144,15 +185,63 @@ long KVectorIndex::QueryLiberal(decimal minQueryDistance, decimal maxQueryDistan
     assert(upperBin <= numBins);
     // bins[lowerBin-1]=number of pairs <= r < query distance, so it is the index of the
     // first possible item that might be equal to the query distance
-    int lowerIndex = bins[lowerBin-1];
-    if (lowerIndex >= numValues) {
+    if (bins[lowerBin-1] >= numValues) {
         // all pairs have distance less than queried. Return value is irrelevant as long as
         // numReturned=0
+        *upperBoundary = 0;
         return 0;
     }
     // bins[upperBin]=number of pairs <= r >= query distance
-    *upperIndex = bins[upperBin];
-    return lowerIndex;
+    *upperBoundary = upperBin;
+    return lowerBin-1;
+}
+
+/// How many queries ahead of the one being finished KVectorIndex's batch query prefetches the bins for
+static const long kKVectorPrefetchDistance = 8;
+
+/**
+ * Answer many queries at once, exactly as QueryLiberal would answer each of them.
+ * First the bins of every query are computed, in a loop with no branches or memory accesses besides
+ * the queries themselves, which the compiler can vectorize. Then the bins are looked up in order,
+ * prefetching those of the queries a few ahead, so that the random accesses to the bins overlap
+ * instead of each stalling in turn.
+ * @param result[out] Where the range of each query is written; numQueries long. May not alias `queries`.
+ * @pre Each query's max is greater than its min.
+ */
+void KVectorIndex::QueryLiberal(const KVectorInterval *queries, long numQueries, KVectorRange *result) const {
+    for (long q = 0; q < numQueries; q++) {
+        decimal minQuery = queries[q].min <= min ? min + binWidth/2 : queries[q].min;
+        decimal maxQuery = queries[q].max >= max ? max - binWidth/2 : queries[q].max;
+        bool empty = minQuery > max || maxQuery < min;
+        // clamped so that even a query that's empty stays in bounds; then bin 0 marks it empty,
+        // since no query that isn't has bin 0 for its min
+        long lowerBin = std::min(numBins, std::max(1L, (long)DECIMAL_CEIL((minQuery - min) / binWidth)));
+        long upperBin = std::min(numBins, std::max(0L, (long)DECIMAL_CEIL((maxQuery - min) / binWidth)));
+        result[q].begin = empty ? 0 : lowerBin;
+        result[q].end = upperBin;
+    }
+
+    for (long q = 0; q < std::min(numQueries, kKVectorPrefetchDistance); q++) {
+        PrefetchForRead(&bins[result[q].begin - 1 + (result[q].begin == 0)]);
+        PrefetchForRead(&bins[result[q].end]);
+    }
+    for (long q = 0; q < numQueries; q++) {
+        if (q + kKVectorPrefetchDistance < numQueries) {
+            const KVectorRange &ahead = result[q + kKVectorPrefetchDistance];
+            PrefetchForRead(&bins[ahead.begin - 1 + (ahead.begin == 0)]);
+            PrefetchForRead(&bins[ahead.end]);
+        }
+        long lowerBin = result[q].begin;
+        long upperBin = result[q].end;
+        if (lowerBin == 0 || bins[lowerBin-1] >= numValues) {
+            result[q].begin = 0;
+            result[q].end = 0;
+        } else {
+            assert(upperBin >= lowerBin);
+            result[q].begin = bins[lowerBin-1];
+            result[q].end = bins[upperBin];
+        }
+    }
 }
 
 /// return the lowest-indexed bin that contains the number of pairs with distance <= dist
@@ -164,43 +253,206 @@ long KVectorIndex::BinFor(decimal query) const {
 }
 
 /**
- pair K-vector database layout. The kvector appears before the bulk pair data because it contains the
- number of pairs, which is necessary to read the bulk pair data.
-
-     | size (bytes)             | name         | description                                                 |
-     |--------------------------+--------------+-------------------------------------------------------------|
-     | sizeof kvectorIndex      | kVectorIndex | Serialized KVector index                                    |
-     | 2*sizeof(int16)*numPairs | pairs        | Bulk pair data                                              |
+ * Catalog stars bucketed into a grid of cubes over the unit sphere. The cubes are at least as wide
+ * as the chord of maxDistance, so every star within maxDistance of a star is in one of the 27 cubes
+ * around it, and finding them doesn't take a pass over the whole catalog.
  */
-std::vector<KVectorPair> CatalogToPairDistances(const Catalog &catalog, decimal minDistance, decimal maxDistance) {
-    std::vector<KVectorPair> result;
+class CatalogGrid {
+public:
+    CatalogGrid(const Catalog &catalog, decimal maxDistance);
+
+    /// Every star with a higher index than `star` which could be within maxDistance of it, ascending
+    void Candidates(int16_t star, std::vector<int16_t> *result) const;
+
+private:
+    int CellCoordinate(decimal x) const;
+
+    const Catalog &catalog;
+    int cellsPerAxis;
+    /// The stars in cell c are cellStars[cellStart[c]] up to cellStars[cellStart[c+1]], ascending
+    std::vector<int32_t> cellStart;
+    std::vector<int16_t> cellStars;
+    std::vector<int32_t> starCell;
+};
+
+/// Too many cells would cost more to visit than the comparisons they save
+static const int kMaxCatalogGridCellsPerAxis = 128;
+
+CatalogGrid::CatalogGrid(const Catalog &catalog, decimal maxDistance) : catalog(catalog) {
+    // with a little slack, so that rounding can't hide a pair right at maxDistance
+    decimal chord = maxDistance >= DECIMAL_M_PI ? 2 : 2 * DECIMAL_SIN(maxDistance / 2) * DECIMAL(1.0001);
+    cellsPerAxis = std::max(1, std::min(kMaxCatalogGridCellsPerAxis, (int)DECIMAL_FLOOR(2 / chord)));
+
+    // counting sort of the stars by cell, which keeps each cell in ascending order
+    long numCells = (long)cellsPerAxis * cellsPerAxis * cellsPerAxis;
+    cellStart.assign(numCells + 1, 0);
+    starCell.resize(catalog.size());
+    for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
+        Vec3 direction = catalog[i].spatial.Normalize();
+        starCell[i] = (CellCoordinate(direction.x) * cellsPerAxis + CellCoordinate(direction.y)) * cellsPerAxis
+            + CellCoordinate(direction.z);
+        cellStart[starCell[i] + 1]++;
+    }
+    for (long c = 0; c < numCells; c++) {
+        cellStart[c + 1] += cellStart[c];
+    }
+    cellStars.resize(catalog.size());
+    std::vector<int32_t> next(cellStart.begin(), cellStart.end() - 1);
     for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
-        for (int16_t k = i+1; k < (int16_t)catalog.size(); k++) {
+        cellStars[next[starCell[i]]++] = i;
+    }
+}
+
+int CatalogGrid::CellCoordinate(decimal x) const {
+    int result = (int)DECIMAL_FLOOR((x + 1) / 2 * cellsPerAxis);
+    return std::max(0, std::min(cellsPerAxis - 1, result));
+}
+
+void CatalogGrid::Candidates(int16_t star, std::vector<int16_t> *result) const {
+    result->clear();
+    int cellX = starCell[star] / (cellsPerAxis * cellsPerAxis);
+    int cellY = starCell[star] / cellsPerAxis % cellsPerAxis;
+    int cellZ = starCell[star] % cellsPerAxis;
+    for (int x = std::max(0, cellX - 1); x <= std::min(cellsPerAxis - 1, cellX + 1); x++) {
+        for (int y = std::max(0, cellY - 1); y <= std::min(cellsPerAxis - 1, cellY + 1); y++) {
+            for (int z = std::max(0, cellZ - 1); z <= std::min(cellsPerAxis - 1, cellZ + 1); z++) {
+                int32_t cell = (x * cellsPerAxis + y) * cellsPerAxis + z;
+                // each cell is ascending, so skip straight past the lower indices
+                const int16_t *begin = cellStars.data() + cellStart[cell];
+                const int16_t *end = cellStars.data() + cellStart[cell + 1];
+                result->insert(result->end(), std::upper_bound(begin, end, star), end);
+            }
+        }
+    }
+    std::sort(result->begin(), result->end());
+}
+
+/// Threads to use when asked for 0, ie as many as the hardware runs at once
+static int DatabaseBuildThreads(int numThreads) {
+    if (numThreads > 0) {
+        return numThreads;
+    }
+    return std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+/// Catalog stars are handed out to the threads finding pairs this many at a time
+static const int kPairBlockSize = 64;
+
+/**
+ * Every pair of catalog stars between minDistance and maxDistance apart, in no particular order.
+ * Only stars in neighboring cells of a CatalogGrid are compared, and blocks of stars are spread
+ * over numThreads threads.
+ */
+std::vector<KVectorPair> CatalogToPairDistances(const Catalog &catalog, decimal minDistance, decimal maxDistance,
+                                                int numThreads) {
+    CatalogGrid grid(catalog, maxDistance);
+    int numBlocks = ((int)catalog.size() + kPairBlockSize - 1) / kPairBlockSize;
+    std::vector<std::vector<KVectorPair>> blockPairs(numBlocks);
+    std::atomic<int> nextBlock(0);
 
-            KVectorPair pair = { i, k, AngleUnit(catalog[i].spatial, catalog[k].spatial) };
-            assert(isfinite(pair.distance));
-            assert(pair.distance >= 0);
-            assert(pair.distance <= DECIMAL_M_PI);
+    auto findPairs = [&]() {
+        std::vector<int16_t> candidates;
+        for (int block = nextBlock++; block < numBlocks; block = nextBlock++) {
+            int16_t blockEnd = (int16_t)std::min<long>(catalog.size(), (long)(block + 1) * kPairBlockSize);
+            for (int16_t i = block * kPairBlockSize; i < blockEnd; i++) {
+                grid.Candidates(i, &candidates);
+                for (int16_t k : candidates) {
+                    KVectorPair pair = { i, k, AngleUnit(catalog[i].spatial, catalog[k].spatial) };
+                    assert(isfinite(pair.distance));
+                    assert(pair.distance >= 0);
+                    assert(pair.distance <= DECIMAL_M_PI);
 
-            if (pair.distance >= minDistance && pair.distance <= maxDistance) {
-                // we'll sort later
-                result.push_back(pair);
+                    if (pair.distance >= minDistance && pair.distance <= maxDistance) {
+                        // we'll sort later
+                        blockPairs[block].push_back(pair);
+                    }
+                }
             }
         }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < DatabaseBuildThreads(numThreads); t++) {
+        threads.emplace_back(findPairs);
+    }
+    findPairs();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<KVectorPair> result;
+    for (const std::vector<KVectorPair> &pairs : blockPairs) {
+        result.insert(result.end(), pairs.begin(), pairs.end());
     }
     return result;
 }
 
+/**
+ * Sort pairs with CompareKVectorPairs, using numThreads threads.
+ * The pairs are first distributed into buckets of equal distance range, which are in order already
+ * and so can be sorted independently.
+ */
+static void SortPairDistances(std::vector<KVectorPair> *pairs, decimal minDistance, decimal maxDistance,
+                              int numThreads) {
+    numThreads = DatabaseBuildThreads(numThreads);
+    long numBuckets = std::max<long>(1, std::min<long>(pairs->size() / 1024, 64L * numThreads));
+    decimal bucketScale = numBuckets / std::max(maxDistance - minDistance, DECIMAL(1e-9));
+    auto bucketOf = [&](const KVectorPair &pair) {
+        // monotonic in the distance, so no pair can belong before a pair in an earlier bucket
+        long bucket = (long)((pair.distance - minDistance) * bucketScale);
+        return std::max(0L, std::min(numBuckets - 1, bucket));
+    };
+
+    std::vector<long> bucketStart(numBuckets + 1, 0);
+    for (const KVectorPair &pair : *pairs) {
+        bucketStart[bucketOf(pair) + 1]++;
+    }
+    for (long b = 0; b < numBuckets; b++) {
+        bucketStart[b + 1] += bucketStart[b];
+    }
+    std::vector<KVectorPair> bucketed(pairs->size());
+    std::vector<long> next(bucketStart.begin(), bucketStart.end() - 1);
+    for (const KVectorPair &pair : *pairs) {
+        bucketed[next[bucketOf(pair)]++] = pair;
+    }
+
+    std::atomic<long> nextBucket(0);
+    auto sortBuckets = [&]() {
+        for (long b = nextBucket++; b < numBuckets; b = nextBucket++) {
+            std::sort(bucketed.begin() + bucketStart[b], bucketed.begin() + bucketStart[b + 1], CompareKVectorPairs);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++) {
+        threads.emplace_back(sortBuckets);
+    }
+    sortBuckets();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    pairs->swap(bucketed);
+}
+
+/**
+ pair K-vector database layout. The kvector appears before the bulk pair data because it contains the
+ number of pairs, which is necessary to read the bulk pair data.
+
+     | size (bytes)             | name         | description                                                 |
+     |--------------------------+--------------+-------------------------------------------------------------|
+     | sizeof kvectorIndex      | kVectorIndex | Serialized KVector index                                    |
+     | 2*sizeof(int16)*numPairs | pairs        | Bulk pair data                                              |
+ */
 /**
  * Serialize a pair-distance KVector into buffer.
  * Use SerializeLengthPairDistanceKVector to determine how large the buffer needs to be. See command line documentation for other options.
+ * @param numThreads How many threads to find and sort the pairs with, or 0 for one per hardware
+ * thread. The output is the same however many there are.
  */
-void SerializePairDistanceKVector(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance, long numBins) {
-    std::vector<int32_t> kVector(numBins+1); // numBins = length, all elements zero
-    std::vector<KVectorPair> pairs = CatalogToPairDistances(catalog, minDistance, maxDistance);
+void SerializePairDistanceKVector(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance, long numBins,
+                                  int numThreads) {
+    std::vector<KVectorPair> pairs = CatalogToPairDistances(catalog, minDistance, maxDistance, numThreads);
 
     // sort pairs in increasing order.
-    std::sort(pairs.begin(), pairs.end(), CompareKVectorPairs);
+    SortPairDistances(&pairs, minDistance, maxDistance, numThreads);
     std::vector<decimal> distances;
 
     for (const KVectorPair &pair : pairs) {
@@ -217,6 +469,357 @@ void SerializePairDistanceKVector(SerializeContext *ser, const Catalog &catalog,
     }
 }
 
+/// Serialize a single precision value, which follows the decimal endianness like other floating point values
+static void SerializeFloat(SerializeContext *ser, float val) {
+    unsigned char buf[sizeof(float)];
+    memcpy(buf, &val, sizeof(float));
+    if (ser->swapDecimalEndianness) {
+        SwapEndianness<float>(buf);
+    }
+    SerializePadding<float>(ser);
+    ser->buffer.insert(ser->buffer.end(), buf, buf + sizeof(float));
+}
+
+/// PairVersine of the distance between two catalog stars, from half the squared chord, without the cancellation of 1 - cosine
+static float CatalogVersine(const Catalog &catalog, int16_t index1, int16_t index2) {
+    Vec3 chord = catalog[index1].spatial.Normalize() - catalog[index2].spatial.Normalize();
+    return (float)(chord.MagnitudeSq() / 2);
+}
+
+/**
+ pair cosine K-vector database layout. The same as the pair distance K-vector database, except that
+ the K-vector index is on the versine of each pair's distance.
+
+     | size (bytes)             | name         | description                                                 |
+     |--------------------------+--------------+-------------------------------------------------------------|
+     | sizeof kvectorIndex      | kVectorIndex | Serialized KVector index, on versine                        |
+     | 2*sizeof(int16)*numPairs | pairs        | Bulk pair data                                              |
+ */
+
+/**
+ * Serialize a pair cosine KVector into buffer. The options mean the same as for
+ * SerializePairDistanceKVector (numBins bins evenly spaced in versine between minDistance and
+ * maxDistance), and the pairs are in the same order.
+ */
+void SerializePairCosineKVector(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance, long numBins,
+                                int numThreads) {
+    std::vector<KVectorPair> pairs = CatalogToPairDistances(catalog, minDistance, maxDistance, numThreads);
+    SortPairDistances(&pairs, minDistance, maxDistance, numThreads);
+
+    decimal minVersine = PairVersine(minDistance);
+    decimal maxVersine = PairVersine(maxDistance);
+    std::vector<decimal> versines;
+    for (const KVectorPair &pair : pairs) {
+        decimal versine = std::min(maxVersine, std::max(minVersine, PairVersine(pair.distance)));
+        // the pairs are sorted by distance, so only rounding could make a versine smaller than the last
+        versines.push_back(versines.empty() ? versine : std::max(versines.back(), versine));
+    }
+
+    SerializeKVectorIndex(ser, versines, minVersine, maxVersine, numBins);
+    for (const KVectorPair &pair : pairs) {
+        SerializePrimitive<int16_t>(ser, pair.index1);
+        SerializePrimitive<int16_t>(ser, pair.index2);
+    }
+}
+
+/// Create the database from a serialized buffer.
+PairCosineKVectorDatabase::PairCosineKVectorDatabase(DeserializeContext *des)
+    : index(KVectorIndex(des)) {
+
+    pairs = DeserializeArray<int16_t>(des, 2*index.NumValues());
+}
+
+/**
+ * Return at least all the star pairs the cosine of whose distance is between minCos and maxCos
+ * @param end[out] Is set to one past the last pair returned.
+ * @return Pairs laid out like PairDistanceKVectorDatabase::FindPairsLiberal's.
+ */
+const int16_t *PairCosineKVectorDatabase::FindPairsLiberal(decimal minCos, decimal maxCos, const int16_t **end) const {
+    long upperIndex = -1;
+    long lowerIndex = index.QueryLiberal(1 - maxCos, 1 - minCos, &upperIndex);
+    *end = Pair(upperIndex);
+    return Pair(lowerIndex);
+}
+
+/// Answer many liberal queries of versine at once; see KVectorIndex's batch QueryLiberal.
+void PairCosineKVectorDatabase::FindPairsLiberalVersine(
+    const KVectorInterval *queries, long numQueries, KVectorRange *result) const {
+
+    index.QueryLiberal(queries, numQueries, result);
+    for (long q = 0; q < std::min(numQueries, kKVectorPrefetchDistance); q++) {
+        PrefetchForRead(Pair(result[q].begin));
+    }
+}
+
+/// How many bits it takes to write value, which isn't negative
+static int BitWidth(long value) {
+    int width = 0;
+    while (value >> width != 0) {
+        width++;
+    }
+    return width;
+}
+
+/// Append the low `width` bits of value to bits, as CompressedPairIterator reads them
+static void AppendBits(std::vector<unsigned char> *bytes, long *numBits, long value, int width) {
+    for (int bit = 0; bit < width; bit++, (*numBits)++) {
+        if (*numBits % 8 == 0) {
+            bytes->push_back(0);
+        }
+        bytes->back() |= ((value >> bit) & 1) << (*numBits % 8);
+    }
+}
+
+/**
+ compressed pair K-vector database layout. The kvector is the same as the pair distance K-vector
+ database's. The pairs of each bin are encoded as described at CompressedPairIterator, one bin after
+ another.
+
+     | size (bytes)                | name         | description                                             |
+     |-----------------------------+--------------+---------------------------------------------------------|
+     | sizeof kvectorIndex         | kVectorIndex | Serialized KVector index                                |
+     | sizeof(int32)*(numBins+1)   | groupEnds    | Bit offset in `bytes` of the end of each bin's pairs    |
+     | 2*(numBins+1)               | groupWidths  | Bits per first star and second star difference, per bin |
+     | (groupEnds[numBins]+7)/8+4  | bytes        | Encoded pairs, then padding                             |
+ */
+
+/**
+ * Serialize a compressed pair KVector into buffer. The options mean the same as for
+ * SerializePairDistanceKVector.
+ */
+void SerializeCompressedPairKVector(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance,
+                                    long numBins, int numThreads) {
+    std::vector<KVectorPair> pairs = CatalogToPairDistances(catalog, minDistance, maxDistance, numThreads);
+    SortPairDistances(&pairs, minDistance, maxDistance, numThreads);
+    std::vector<decimal> distances;
+    for (const KVectorPair &pair : pairs) {
+        distances.push_back(pair.distance);
+    }
+    SerializeKVectorIndex(ser, distances, minDistance, maxDistance, numBins);
+
+    // the same bins as SerializeKVectorIndex puts them in
+    decimal binWidth = (maxDistance - minDistance) / numBins;
+    std::vector<int32_t> groupEnds(numBins+1);
+    std::vector<uint8_t> groupWidths(2*(numBins+1), 0);
+    std::vector<unsigned char> bytes;
+    long numBits = 0;
+    size_t groupBegin = 0;
+    for (long bin = 0; bin <= numBins; bin++) {
+        size_t groupEnd = groupBegin;
+        while (groupEnd < pairs.size() && (long)ceil((pairs[groupEnd].distance - minDistance) / binWidth) <= bin) {
+            groupEnd++;
+        }
+        // catalog order within the bin, so that the first stars' differences are small
+        std::sort(pairs.begin() + groupBegin, pairs.begin() + groupEnd, [](const KVectorPair &p1, const KVectorPair &p2) {
+            return p1.index1 != p2.index1 ? p1.index1 < p2.index1 : p1.index2 < p2.index2;
+        });
+        int16_t lastIndex1 = 0;
+        for (size_t p = groupBegin; p < groupEnd; p++) {
+            assert(pairs[p].index2 > pairs[p].index1);
+            groupWidths[2*bin] = std::max(groupWidths[2*bin], (uint8_t)BitWidth(pairs[p].index1 - lastIndex1));
+            groupWidths[2*bin + 1] = std::max(groupWidths[2*bin + 1], (uint8_t)BitWidth(pairs[p].index2 - pairs[p].index1 - 1));
+            lastIndex1 = pairs[p].index1;
+        }
+        lastIndex1 = 0;
+        for (size_t p = groupBegin; p < groupEnd; p++) {
+            AppendBits(&bytes, &numBits, pairs[p].index1 - lastIndex1, groupWidths[2*bin]);
+            AppendBits(&bytes, &numBits, pairs[p].index2 - pairs[p].index1 - 1, groupWidths[2*bin + 1]);
+            lastIndex1 = pairs[p].index1;
+        }
+        groupEnds[bin] = numBits;
+        groupBegin = groupEnd;
+    }
+    assert(groupBegin == pairs.size());
+    // so that CompressedPairIterator can always read 4 bytes at once
+    bytes.insert(bytes.end(), 4, 0);
+
+    for (int32_t groupEnd : groupEnds) {
+        SerializePrimitive<int32_t>(ser, groupEnd);
+    }
+    ser->buffer.insert(ser->buffer.end(), groupWidths.begin(), groupWidths.end());
+    ser->buffer.insert(ser->buffer.end(), bytes.begin(), bytes.end());
+}
+
+/// Create the database from a serialized buffer.
+CompressedPairKVectorDatabase::CompressedPairKVectorDatabase(DeserializeContext *des)
+    : index(KVectorIndex(des)) {
+
+    groupEnds = DeserializeArray<int32_t>(des, index.NumBins()+1);
+    groupWidths = DeserializeArray<uint8_t>(des, 2*(index.NumBins()+1));
+    bytes = DeserializeArray<unsigned char>(des, (groupEnds[index.NumBins()] + 7) / 8 + 4);
+}
+
+/// Return at least all the star pairs whose inter-star distance is between min and max
+CompressedPairIterator CompressedPairKVectorDatabase::FindPairsLiberal(decimal min, decimal max) const {
+    long upperBoundary;
+    long lowerBoundary = index.QueryLiberalBins(min, max, &upperBoundary);
+    return CompressedPairIterator(bytes, groupEnds, groupWidths, lowerBoundary, upperBoundary);
+}
+
+/// Answer many liberal queries at once, prefetching the start of each one's pairs.
+void CompressedPairKVectorDatabase::FindPairsLiberal(
+    const KVectorInterval *queries, long numQueries, KVectorRange *result) const {
+
+    for (long q = 0; q < numQueries; q++) {
+        result[q].begin = index.QueryLiberalBins(queries[q].min, queries[q].max, &result[q].end);
+        if (q < kKVectorPrefetchDistance) {
+            PrefetchPairs(result[q]);
+        }
+    }
+}
+
+/**
+ pair record K-vector database layout.
+
+     | size (bytes)             | name         | description                                                 |
+     |--------------------------+--------------+-------------------------------------------------------------|
+     | sizeof kvectorIndex      | kVectorIndex | Serialized KVector index                                    |
+     | 0-7                      | padding      | So that the records are 8-byte aligned                      |
+     | 8*numPairs               | records      | index1 (int16), index2 (int16), versine (float) of each     |
+     |                          |              | pair                                                        |
+ */
+
+/**
+ * Serialize a pair record KVector into buffer. The options mean the same as for
+ * SerializePairDistanceKVector, and the pairs are in the same order.
+ */
+void SerializePairRecordKVector(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance, long numBins,
+                                int numThreads) {
+    std::vector<KVectorPair> pairs = CatalogToPairDistances(catalog, minDistance, maxDistance, numThreads);
+    SortPairDistances(&pairs, minDistance, maxDistance, numThreads);
+    std::vector<decimal> distances;
+    for (const KVectorPair &pair : pairs) {
+        distances.push_back(pair.distance);
+    }
+
+    SerializeKVectorIndex(ser, distances, minDistance, maxDistance, numBins);
+
+    SerializePadding<PairRecord>(ser);
+    for (const KVectorPair &pair : pairs) {
+        SerializePrimitive<int16_t>(ser, pair.index1);
+        SerializePrimitive<int16_t>(ser, pair.index2);
+        SerializeFloat(ser, CatalogVersine(catalog, pair.index1, pair.index2));
+    }
+}
+
+/// Create the database from a serialized buffer.
+PairRecordKVectorDatabase::PairRecordKVectorDatabase(DeserializeContext *des)
+    : index(KVectorIndex(des)) {
+
+    records = DeserializeArray<PairRecord>(des, index.NumValues());
+}
+
+/**
+ * Return at least all the star pairs whose inter-star distance is between min and max
+ * @param end[out] Is set to one past the last record being returned by the query.
+ */
+const PairRecord *PairRecordKVectorDatabase::FindPairsLiberal(
+    decimal minQueryDistance, decimal maxQueryDistance, const PairRecord **end) const {
+
+    assert(maxQueryDistance <= DECIMAL_M_PI);
+
+    long upperIndex = -1;
+    long lowerIndex = index.QueryLiberal(minQueryDistance, maxQueryDistance, &upperIndex);
+    *end = &records[upperIndex];
+    return &records[lowerIndex];
+}
+
+/**
+ * Return exactly the star pairs whose inter-star distance is between min and max (exclusive, like
+ * PairDistanceKVectorDatabase::FindPairsExact). Records are in ascending order of distance, and
+ * so of versine, so both ends of the liberal range are found by binary search.
+ */
+const PairRecord *PairRecordKVectorDatabase::FindPairsExact(
+    decimal minQueryDistance, decimal maxQueryDistance, const PairRecord **end) const {
+
+    assert(maxQueryDistance <= DECIMAL_M_PI);
+
+    decimal minQueryVersine = PairVersine(std::max(minQueryDistance, DECIMAL(0.0)));
+    decimal maxQueryVersine = PairVersine(maxQueryDistance);
+
+    const PairRecord *liberalEnd;
+    const PairRecord *liberalBegin = FindPairsLiberal(minQueryDistance, maxQueryDistance, &liberalEnd);
+    const PairRecord *begin = std::partition_point(liberalBegin, liberalEnd,
+        [minQueryVersine](const PairRecord &record) { return record.versine <= minQueryVersine; });
+    *end = std::partition_point(begin, liberalEnd,
+        [maxQueryVersine](const PairRecord &record) { return record.versine < maxQueryVersine; });
+    return begin;
+}
+
+/**
+ * How many bins a KVector index from min to max needs so that liberal queries `tolerance` either
+ * side of a value return about `overfetch` (a fraction) more values than exact queries would.
+ * A liberal query returns the whole bin at each end of its range, on average half a bin more than
+ * it asked for at each end, so the bins should be 2*tolerance*overfetch wide.
+ */
+long KVectorBinsForTolerance(decimal min, decimal max, decimal tolerance, decimal overfetch) {
+    assert(tolerance > 0 && overfetch > 0);
+    decimal binWidth = 2 * tolerance * overfetch;
+    return std::max(1L, (long)DECIMAL_CEIL((max - min) / binWidth));
+}
+
+/**
+ * How many bins a PairCosineKVectorDatabase from minDistance to maxDistance (radians) needs for the
+ * same overfetch as KVectorBinsForTolerance. A bin of versine is about its width over the sine of
+ * the distance wide in angle, so the bins are widest at the smallest distance, and are sized for it.
+ */
+long PairCosineKVectorBinsForTolerance(decimal minDistance, decimal maxDistance, decimal tolerance, decimal overfetch) {
+    assert(tolerance > 0 && overfetch > 0);
+    // queries closer to 0 than the tolerance reach down to 0 anyway
+    decimal binWidth = DECIMAL_SIN(std::max(minDistance, tolerance)) * 2 * tolerance * overfetch;
+    return std::max(1L, (long)DECIMAL_CEIL((PairVersine(maxDistance) - PairVersine(minDistance)) / binWidth));
+}
+
+/// How many queries PairDistanceKVectorOverfetch, PairCosineKVectorOverfetch, and SkyCellPairsOverfetch sample
+static const long kOverfetchSamples = 1000;
+
+/**
+ * The fraction of extra pairs a liberal query returns, compared to an exact query, averaged over
+ * queries `tolerance` either side of the distances of evenly spaced stored pairs. Queries are
+ * placed where the pairs are, like star-id's queries, because those are the ones that matter.
+ */
+decimal PairDistanceKVectorOverfetch(const PairDistanceKVectorDatabase &db, const Catalog &catalog, decimal tolerance) {
+    const int16_t *allEnd;
+    const int16_t *all = db.FindPairsLiberal(db.MinDistance(), db.MaxDistance(), &allEnd);
+    long numPairs = (allEnd - all) / 2;
+    long numLiberal = 0;
+    long numExact = 0;
+    for (long sample = 0; sample < std::min(numPairs, kOverfetchSamples); sample++) {
+        const int16_t *pair = all + 2 * (sample * numPairs / std::min(numPairs, kOverfetchSamples));
+        decimal distance = AngleUnit(catalog[pair[0]].spatial, catalog[pair[1]].spatial);
+        const int16_t *end;
+        const int16_t *begin = db.FindPairsLiberal(distance - tolerance, distance + tolerance, &end);
+        numLiberal += (end - begin) / 2;
+        begin = db.FindPairsExact(catalog, distance - tolerance, distance + tolerance, &end);
+        numExact += (end - begin) / 2;
+    }
+    return numExact == 0 ? 0 : (decimal)(numLiberal - numExact) / numExact;
+}
+
+/// The same as PairDistanceKVectorOverfetch, for queries of the cosines `tolerance` either side of a distance
+decimal PairCosineKVectorOverfetch(const PairCosineKVectorDatabase &db, const Catalog &catalog, decimal tolerance) {
+    const int16_t *allEnd;
+    const int16_t *all = db.FindPairsLiberal(db.MinCos(), db.MaxCos(), &allEnd);
+    long numPairs = (allEnd - all) / 2;
+    long numSamples = std::min(numPairs, kOverfetchSamples);
+    long numLiberal = 0;
+    long numExact = 0;
+    for (long sample = 0; sample < numSamples; sample++) {
+        const int16_t *pair = all + 2 * (sample * numPairs / numSamples);
+        decimal distance = AngleUnit(catalog[pair[0]].spatial, catalog[pair[1]].spatial);
+        decimal minCos = DECIMAL_COS(std::min(distance + tolerance, DECIMAL_M_PI));
+        decimal maxCos = DECIMAL_COS(std::max(distance - tolerance, DECIMAL(0.0)));
+        const int16_t *end;
+        for (const int16_t *other = db.FindPairsLiberal(minCos, maxCos, &end); other != end; other += 2) {
+            numLiberal++;
+            if (DECIMAL_ABS(AngleUnit(catalog[other[0]].spatial, catalog[other[1]].spatial) - distance) <= tolerance) {
+                numExact++;
+            }
+        }
+    }
+    return numExact == 0 ? 0 : (decimal)(numLiberal - numExact) / numExact;
+}
+
 /// Create the database from a serialized buffer.
 PairDistanceKVectorDatabase::PairDistanceKVectorDatabase(DeserializeContext *des)
     : index(KVectorIndex(des)) {
@@ -245,6 +848,20 @@ const int16_t *PairDistanceKVectorDatabase::FindPairsLiberal(
     return &pairs[lowerIndex * 2];
 }
 
+/**
+ * Answer many liberal queries at once; see KVectorIndex's batch QueryLiberal.
+ * @param result[out] The range of pairs matching each query. Pair() turns an index into a pair.
+ */
+void PairDistanceKVectorDatabase::FindPairsLiberal(
+    const KVectorInterval *queries, long numQueries, KVectorRange *result) const {
+
+    index.QueryLiberal(queries, numQueries, result);
+    // the caller starts on the first few right away, so get them coming
+    for (long q = 0; q < std::min(numQueries, kKVectorPrefetchDistance); q++) {
+        PrefetchForRead(Pair(result[q].begin));
+    }
+}
+
 const int16_t *PairDistanceKVectorDatabase::FindPairsExact(const Catalog &catalog,
                                                            decimal minQueryDistance, decimal maxQueryDistance, const int16_t **end) const {
 
@@ -294,73 +911,1153 @@ std::vector<decimal> PairDistanceKVectorDatabase::StarDistances(int16_t star, co
     return result;
 }
 
-/**
-   MultiDatabase memory layout:
-
-   | size | name           | description                                 |
-   |------+----------------+---------------------------------------------|
-   |    4 | magicValue     | unique database identifier                  |
-   |    4 | flags          | [X, X, X, isDouble?]                        |
-   |    4 | databaseLength | length in bytes (32-bit unsigned)           |
-   |    n | database       | the entire database. 8-byte aligned         |
-   |  ... | ...            | More databases (each has value, length, db) |
-   |    4 | caboose        | 4 null bytes indicate the end               |
- */
+struct KVectorTriple {
+    int16_t index1; // at the smallest inner angle
+    int16_t index2; // at the middle inner angle
+    int16_t index3; // at the largest inner angle
+    decimal smallestAngle;
+    decimal middleAngle;
+};
 
-/**
- * @brief return a pointer to the start of the database type indicated by the magic value, if such
- * a sub-database is present in the database
- * @param magicValue
- * @return Returns a pointer to the start of the database type indicated by the magic value, null if not found
- */
-const unsigned char *MultiDatabase::SubDatabasePointer(int32_t magicValue) const {
-    DeserializeContext desValue(buffer);
-    DeserializeContext *des = &desValue; // just for naming consistency with how we use `des` elsewhere
+bool CompareKVectorTriples(const KVectorTriple &t1, const KVectorTriple &t2) {
+    return t1.smallestAngle < t2.smallestAngle;
+}
 
-    assert(magicValue != 0);
-    while (true) {
-        int32_t curMagicValue = DeserializePrimitive<int32_t>(des);
-        if (curMagicValue == 0) {
-            return nullptr;
-        }
-        uint32_t dbFlags = DeserializePrimitive<uint32_t>(des);
+/// For each catalog star, every star with a higher index that's between minDistance and maxDistance from it, ascending
+static std::vector<std::vector<int16_t>> CatalogNeighbors(const Catalog &catalog,
+                                                          decimal minDistance, decimal maxDistance) {
+    decimal minCos = DECIMAL_COS(maxDistance);
+    decimal maxCos = DECIMAL_COS(minDistance);
 
-        // Ensure that our database is using the same type as the runtime.
-        #ifdef LOST_FLOAT_MODE
-            if (!isFlagSet(dbFlags, MULTI_DB_FLOAT_FLAG)) {
-                std::cerr << "LOST was compiled in float mode. This database was serialized in double mode and is incompatible." << std::endl;
-                exit(1);
-            }
-        #else
-            if (isFlagSet(dbFlags, MULTI_DB_FLOAT_FLAG)) {
-                std::cerr << "LOST was compiled in double mode. This database was serialized in float mode and is incompatible." << std::endl;
-                exit(1);
+    CatalogGrid grid(catalog, maxDistance);
+    std::vector<int16_t> candidates;
+    std::vector<std::vector<int16_t>> neighbors(catalog.size());
+    for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
+        grid.Candidates(i, &candidates);
+        for (int16_t k : candidates) {
+            decimal pairCos = catalog[i].spatial * catalog[k].spatial;
+            if (pairCos >= minCos && pairCos <= maxCos) {
+                neighbors[i].push_back(k);
             }
-        #endif
-
-        uint32_t dbLength = DeserializePrimitive<uint32_t>(des);
-        assert(dbLength > 0);
-        DeserializePadding<uint64_t>(des); // align to an 8-byte boundary
-        const unsigned char *curSubDatabasePointer = DeserializeArray<unsigned char>(des, dbLength);
-        if (curMagicValue == magicValue) {
-            return curSubDatabasePointer;
         }
     }
-    // shouldn't ever make it here. Compiler should remove this assertion as unreachable.
-    assert(false);
+    return neighbors;
+}
+
+/**
+ * Find all triples of catalog stars where each pair of stars is between minDistance and
+ * maxDistance apart, and whose smallest inner angle is at least minInnerAngle.
+ *
+ * Each star is only compared against the stars that are within range of it, so the work done is
+ * proportional to the number of triples actually in range rather than the cube of the catalog size.
+ */
+std::vector<KVectorTriple> CatalogToTriples(const Catalog &catalog,
+                                            decimal minDistance, decimal maxDistance,
+                                            decimal minInnerAngle) {
+    decimal minCos = DECIMAL_COS(maxDistance);
+    decimal maxCos = DECIMAL_COS(minDistance);
+    std::vector<std::vector<int16_t>> neighbors = CatalogNeighbors(catalog, minDistance, maxDistance);
+
+    std::vector<KVectorTriple> result;
+    for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
+        const std::vector<int16_t> &iNeighbors = neighbors[i];
+        for (size_t jIndex = 0; jIndex < iNeighbors.size(); jIndex++) {
+            for (size_t kIndex = jIndex+1; kIndex < iNeighbors.size(); kIndex++) {
+                int16_t j = iNeighbors[jIndex];
+                int16_t k = iNeighbors[kIndex];
+                decimal jkCos = catalog[j].spatial * catalog[k].spatial;
+                if (jkCos < minCos || jkCos > maxCos) {
+                    continue;
+                }
+
+                // sort the vertices by their inner angle
+                std::pair<decimal, int16_t> vertices[3] = {
+                    { InnerAngle(catalog[i].spatial, catalog[j].spatial, catalog[k].spatial), i },
+                    { InnerAngle(catalog[j].spatial, catalog[i].spatial, catalog[k].spatial), j },
+                    { InnerAngle(catalog[k].spatial, catalog[i].spatial, catalog[j].spatial), k },
+                };
+                std::sort(vertices, vertices+3);
+                if (vertices[0].first < minInnerAngle) {
+                    continue;
+                }
+
+                KVectorTriple triple = {
+                    vertices[0].second, vertices[1].second, vertices[2].second,
+                    // rounding could put an equilateral triangle a hair over the bound
+                    std::min(vertices[0].first, DECIMAL_M_PI/3),
+                    vertices[1].first,
+                };
+                result.push_back(triple);
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ triple inner-angle K-vector database layout.
+
+     | size (bytes)             | name         | description                                            |
+     |--------------------------+--------------+--------------------------------------------------------|
+     | sizeof decimal           | minDistance  | Min distance between any two stars of a stored triple  |
+     | sizeof decimal           | maxDistance  | Max distance between any two stars of a stored triple  |
+     | sizeof kvectorIndex      | kVectorIndex | Serialized KVector index, on the smallest inner angle  |
+     | 4*sizeof(int16)*numTriples | triples    | Catalog indices of the stars at the smallest, middle,  |
+     |                          |              | and largest inner angles, then the quantized middle    |
+     |                          |              | inner angle (see kMiddleAngleScale)                    |
+ */
+
+/**
+ * Serialize a triple inner-angle KVector into buffer. See command line documentation for options.
+ * @param minInnerAngle Triples with a smaller smallest inner angle are not stored. Such nearly
+ * colinear triples have very poorly determined inner angles, so they aren't useful for star-id.
+ */
+void SerializeTripleInnerKVector(SerializeContext *ser, const Catalog &catalog,
+                                 decimal minDistance, decimal maxDistance, decimal minInnerAngle,
+                                 long numBins) {
+    std::vector<KVectorTriple> triples = CatalogToTriples(catalog, minDistance, maxDistance, minInnerAngle);
+    std::sort(triples.begin(), triples.end(), CompareKVectorTriples);
+
+    std::vector<decimal> smallestAngles;
+    for (const KVectorTriple &triple : triples) {
+        smallestAngles.push_back(triple.smallestAngle);
+    }
+
+    SerializePrimitive<decimal>(ser, minDistance);
+    SerializePrimitive<decimal>(ser, maxDistance);
+
+    // index field. The smallest inner angle of a triangle is never more than 60 degrees.
+    SerializeKVectorIndex(ser, smallestAngles, minInnerAngle, DECIMAL_M_PI/3, numBins);
+
+    // bulk triples field
+    for (const KVectorTriple &triple : triples) {
+        SerializePrimitive<int16_t>(ser, triple.index1);
+        SerializePrimitive<int16_t>(ser, triple.index2);
+        SerializePrimitive<int16_t>(ser, triple.index3);
+        SerializePrimitive<int16_t>(ser, (int16_t)(uint16_t)DECIMAL_ROUND(
+                                        triple.middleAngle * TripleInnerKVectorDatabase::kMiddleAngleScale));
+    }
+}
+
+/// Create the database from a serialized buffer.
+TripleInnerKVectorDatabase::TripleInnerKVectorDatabase(DeserializeContext *des)
+    : minDistance(DeserializePrimitive<decimal>(des)),
+      maxDistance(DeserializePrimitive<decimal>(des)),
+      index(KVectorIndex(des)) {
+
+    triples = DeserializeArray<int16_t>(des, 4*index.NumValues());
+}
+
+/**
+ * Return at least all the star triples whose smallest inner angle is between min and max
+ * @param end[out] Is set to an "off-the-end" pointer, one past the last triple being returned by the query.
+ * @return A pointer to the start of the matched triples. Each triple is four 16-bit integers (see
+ * TripleInnerKVectorDatabase), so increment the pointer by four to get to the next triple.
+ */
+const int16_t *TripleInnerKVectorDatabase::FindTriplesLiberal(
+    decimal minQueryAngle, decimal maxQueryAngle, const int16_t **end) const {
+
+    long upperIndex = -1;
+    long lowerIndex = index.QueryLiberal(minQueryAngle, maxQueryAngle, &upperIndex);
+    *end = &triples[upperIndex * 4];
+    return &triples[lowerIndex * 4];
+}
+
+/**
+ * Rasterize where the neighbors of a star are into a gridSize by gridSize bit pattern.
+ * The neighbors are projected onto the plane tangent to the sky at `center`, then rotated so that
+ * the nearest one lies along the positive x axis, which makes the pattern independent of the
+ * attitude. Neighbors within bufferRadius are ignored entirely, since they're too close to orient
+ * the pattern reliably (and are often blended with the center star). The grid spans the tangent
+ * plane out to patternRadius in each direction; cell (x,y) is bit y*gridSize+x.
+ *
+ * The same function makes catalog patterns (with neighbors from the catalog) and image patterns
+ * (with neighbors from the other centroids), so they match exactly in the absence of noise.
+ * @param neighbors Normalized spatial vectors. May include `center` itself, which is ignored.
+ * @param orientation Which neighbor to orient the pattern by: 0 for the nearest, as in the
+ * database, 1 for the second nearest, and so on. Useful for image patterns, in case a false star is
+ * nearer than the true nearest neighbor.
+ * @param pattern[out] GridPatternWords(gridSize) words, which are overwritten.
+ * @param xAxisOut[out] If not null, set to the direction of the grid's x axis on the tangent plane.
+ * @param yAxisOut[out] Likewise for the y axis.
+ * @return false if there's no neighbor to orient the pattern by, in which case it's left empty.
+ */
+bool GridPattern(const Vec3 &center, const Vec3 *neighbors, long numNeighbors,
+                 int gridSize, decimal patternRadius, decimal bufferRadius, int orientation,
+                 uint64_t *pattern, Vec3 *xAxisOut, Vec3 *yAxisOut) {
+    std::fill(pattern, pattern + GridPatternWords(gridSize), 0);
+
+    decimal minCos = DECIMAL_COS(patternRadius);
+    decimal maxCos = DECIMAL_COS(bufferRadius);
+    // the orientation+1 nearest neighbors, nearest first, by insertion
+    std::vector<std::pair<decimal, long>> nearest;
+    for (long n = 0; n < numNeighbors; n++) {
+        decimal cos = neighbors[n] * center;
+        if (cos < minCos || cos >= maxCos) {
+            continue;
+        }
+        if ((int)nearest.size() <= orientation || cos > nearest.back().first) {
+            auto it = std::upper_bound(nearest.begin(), nearest.end(), cos,
+                                       [](decimal c, const std::pair<decimal, long> &p) { return c > p.first; });
+            nearest.insert(it, std::make_pair(cos, n));
+            if ((int)nearest.size() > orientation + 1) {
+                nearest.pop_back();
+            }
+        }
+    }
+    if ((int)nearest.size() <= orientation) {
+        return false;
+    }
+    decimal nearestCos = nearest[orientation].first;
+    long nearestIndex = nearest[orientation].second;
+
+    Vec3 xAxis = (neighbors[nearestIndex] - center * nearestCos).Normalize();
+    Vec3 yAxis = center.CrossProduct(xAxis);
+    if (xAxisOut != NULL) {
+        *xAxisOut = xAxis;
+    }
+    if (yAxisOut != NULL) {
+        *yAxisOut = yAxis;
+    }
+    // gnomonic projection, so that the pattern of an image is undistorted
+    decimal scale = gridSize / (2 * DECIMAL_TAN(patternRadius));
+    for (long n = 0; n < numNeighbors; n++) {
+        decimal cos = neighbors[n] * center;
+        if (cos < minCos || cos >= maxCos) {
+            continue;
+        }
+        int x = (int)DECIMAL_FLOOR(neighbors[n] * xAxis / cos * scale + gridSize / DECIMAL(2.0));
+        int y = (int)DECIMAL_FLOOR(neighbors[n] * yAxis / cos * scale + gridSize / DECIMAL(2.0));
+        if (x < 0 || x >= gridSize || y < 0 || y >= gridSize) {
+            continue;
+        }
+        int cell = y*gridSize + x;
+        pattern[cell / 64] |= (uint64_t)1 << (cell % 64);
+    }
+    return true;
+}
+
+/**
+ grid database layout.
+
+     | size (bytes)                 | name           | description                                  |
+     |------------------------------+----------------+----------------------------------------------|
+     | 4                            | gridSize       | Patterns are gridSize by gridSize cells      |
+     | sizeof decimal               | patternRadius  | See GridPattern                              |
+     | sizeof decimal               | bufferRadius   | See GridPattern                              |
+     | 4                            | numStars       | Number of catalog stars                      |
+     | 4                            | numIndexed     | Total number of set bits in all patterns     |
+     | 8*numWords*numStars          | patterns       | The pattern of each catalog star, in order   |
+     | 4*(gridSize*gridSize+1)      | cellOffsets    | Where each cell's list starts in cellStars   |
+     | 2*numIndexed                 | cellStars      | For each cell, the catalog indices of the    |
+     |                              |                | stars whose pattern has it set, ascending    |
+ */
+
+/**
+ * Serialize a grid database into buffer. See command line documentation for options.
+ */
+void SerializeGrid(SerializeContext *ser, const Catalog &catalog,
+                   int gridSize, decimal patternRadius, decimal bufferRadius) {
+    int numWords = GridPatternWords(gridSize);
+    int numCells = gridSize*gridSize;
+
+    std::vector<Vec3> spatials;
+    spatials.reserve(catalog.size());
+    for (const CatalogStar &star : catalog) {
+        spatials.push_back(star.spatial);
+    }
+    std::vector<uint64_t> patterns(catalog.size() * numWords);
+    for (long i = 0; i < (long)catalog.size(); i++) {
+        GridPattern(spatials[i], spatials.data(), spatials.size(),
+                    gridSize, patternRadius, bufferRadius, 0, &patterns[i*numWords]);
+    }
+
+    // inverted index, bucketed by cell
+    std::vector<int32_t> cellOffsets(numCells + 1, 0);
+    for (long i = 0; i < (long)catalog.size(); i++) {
+        for (int cell = 0; cell < numCells; cell++) {
+            if ((patterns[i*numWords + cell/64] >> (cell % 64)) & 1) {
+                cellOffsets[cell + 1]++;
+            }
+        }
+    }
+    for (int cell = 0; cell < numCells; cell++) {
+        cellOffsets[cell + 1] += cellOffsets[cell];
+    }
+    std::vector<int16_t> cellStars(cellOffsets[numCells]);
+    std::vector<int32_t> cellFill(cellOffsets.begin(), cellOffsets.end() - 1);
+    for (long i = 0; i < (long)catalog.size(); i++) {
+        for (int cell = 0; cell < numCells; cell++) {
+            if ((patterns[i*numWords + cell/64] >> (cell % 64)) & 1) {
+                cellStars[cellFill[cell]++] = (int16_t)i;
+            }
+        }
+    }
+
+    SerializePrimitive<int32_t>(ser, gridSize);
+    SerializePrimitive<decimal>(ser, patternRadius);
+    SerializePrimitive<decimal>(ser, bufferRadius);
+    SerializePrimitive<int32_t>(ser, catalog.size());
+    SerializePrimitive<int32_t>(ser, cellStars.size());
+    for (uint64_t word : patterns) {
+        SerializePrimitive<uint64_t>(ser, word);
+    }
+    for (int32_t offset : cellOffsets) {
+        SerializePrimitive<int32_t>(ser, offset);
+    }
+    for (int16_t star : cellStars) {
+        SerializePrimitive<int16_t>(ser, star);
+    }
+}
+
+/// Create the database from a serialized buffer.
+GridDatabase::GridDatabase(DeserializeContext *des) {
+    gridSize = DeserializePrimitive<int32_t>(des);
+    patternRadius = DeserializePrimitive<decimal>(des);
+    bufferRadius = DeserializePrimitive<decimal>(des);
+    numStars = DeserializePrimitive<int32_t>(des);
+    long numIndexed = DeserializePrimitive<int32_t>(des);
+    numWords = GridPatternWords(gridSize);
+    patterns = DeserializeArray<uint64_t>(des, numStars*numWords);
+    cellOffsets = DeserializeArray<int32_t>(des, gridSize*gridSize + 1);
+    cellStars = DeserializeArray<int16_t>(des, numIndexed);
+}
+
+/**
+ * The catalog stars whose pattern has the given cell set, in ascending order.
+ * @param end[out] Is set to an "off-the-end" pointer.
+ */
+const int16_t *GridDatabase::StarsWithCell(int cell, const int16_t **end) const {
+    assert(cell >= 0 && cell < gridSize*gridSize);
+    *end = cellStars + cellOffsets[cell + 1];
+    return cellStars + cellOffsets[cell];
+}
+
+/// A triangle of catalog stars, before it's serialized into a TriangleDatabase
+struct CatalogTriangle {
+    decimal sides[3]; // ascending
+    int16_t stars[3]; // opposite each side
+};
+
+/// Triangles with at most this many in a subtree aren't split any further, but scanned linearly
+static const long kTriangleLeafSize = 8;
+
+/**
+ * Arrange triangles[begin, end) into an implicit kd-tree, splitting on side `axis` at this level.
+ * Must match TriangleDatabase::FindTriangles.
+ */
+static void BuildTriangleTree(std::vector<CatalogTriangle> *triangles, long begin, long end, int axis) {
+    if (end - begin <= kTriangleLeafSize) {
+        return;
+    }
+    long middle = begin + (end - begin) / 2;
+    std::nth_element(triangles->begin() + begin, triangles->begin() + middle, triangles->begin() + end,
+                     [axis](const CatalogTriangle &t1, const CatalogTriangle &t2) {
+                         return t1.sides[axis] < t2.sides[axis];
+                     });
+    BuildTriangleTree(triangles, begin, middle, (axis + 1) % 3);
+    BuildTriangleTree(triangles, middle + 1, end, (axis + 1) % 3);
+}
+
+/**
+ triangle database layout.
+
+     | size (bytes)                 | name         | description                                    |
+     |------------------------------+--------------+------------------------------------------------|
+     | sizeof decimal               | minDistance  | Min length of any side of a stored triangle    |
+     | sizeof decimal               | maxDistance  | Max length of any side of a stored triangle    |
+     | 4                            | numTriangles |                                                |
+     | 3*sizeof decimal*numTriangles| sides        | Side lengths of each triangle, ascending, in   |
+     |                              |              | implicit kd-tree order (see BuildTriangleTree) |
+     | 3*2*numTriangles             | stars        | Catalog indices of the stars opposite each     |
+     |                              |              | side, in the same order                        |
+ */
+
+/**
+ * Serialize a triangle database into buffer. See command line documentation for options.
+ * Triangles are found the same way as in the triple inner-angle database, so the time and space
+ * taken grow with the number of triangles in range rather than the cube of the catalog size.
+ */
+void SerializeTriangles(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance) {
+    std::vector<std::vector<int16_t>> neighbors = CatalogNeighbors(catalog, minDistance, maxDistance);
+    decimal minCos = DECIMAL_COS(maxDistance);
+    decimal maxCos = DECIMAL_COS(minDistance);
+
+    std::vector<CatalogTriangle> triangles;
+    for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
+        const std::vector<int16_t> &iNeighbors = neighbors[i];
+        for (size_t jIndex = 0; jIndex < iNeighbors.size(); jIndex++) {
+            for (size_t kIndex = jIndex+1; kIndex < iNeighbors.size(); kIndex++) {
+                int16_t j = iNeighbors[jIndex];
+                int16_t k = iNeighbors[kIndex];
+                decimal jkCos = catalog[j].spatial * catalog[k].spatial;
+                if (jkCos < minCos || jkCos > maxCos) {
+                    continue;
+                }
+
+                // each side with the star opposite it, shortest first
+                std::pair<decimal, int16_t> sides[3] = {
+                    { AngleUnit(catalog[j].spatial, catalog[k].spatial), i },
+                    { AngleUnit(catalog[i].spatial, catalog[k].spatial), j },
+                    { AngleUnit(catalog[i].spatial, catalog[j].spatial), k },
+                };
+                std::sort(sides, sides+3);
+                CatalogTriangle triangle = {
+                    { sides[0].first, sides[1].first, sides[2].first },
+                    { sides[0].second, sides[1].second, sides[2].second },
+                };
+                triangles.push_back(triangle);
+            }
+        }
+    }
+    BuildTriangleTree(&triangles, 0, triangles.size(), 0);
+
+    SerializePrimitive<decimal>(ser, minDistance);
+    SerializePrimitive<decimal>(ser, maxDistance);
+    SerializePrimitive<int32_t>(ser, triangles.size());
+    for (const CatalogTriangle &triangle : triangles) {
+        for (decimal side : triangle.sides) {
+            SerializePrimitive<decimal>(ser, side);
+        }
+    }
+    for (const CatalogTriangle &triangle : triangles) {
+        for (int16_t star : triangle.stars) {
+            SerializePrimitive<int16_t>(ser, star);
+        }
+    }
+}
+
+/// Create the database from a serialized buffer.
+TriangleDatabase::TriangleDatabase(DeserializeContext *des) {
+    minDistance = DeserializePrimitive<decimal>(des);
+    maxDistance = DeserializePrimitive<decimal>(des);
+    numTriangles = DeserializePrimitive<int32_t>(des);
+    sides = DeserializeArray<decimal>(des, 3*numTriangles);
+    stars = DeserializeArray<int16_t>(des, 3*numTriangles);
+}
+
+/// Whether every side of the triangle is within the box, inclusive
+static bool TriangleInBox(const decimal *sides, const decimal *minSides, const decimal *maxSides) {
+    return sides[0] >= minSides[0] && sides[0] <= maxSides[0]
+        && sides[1] >= minSides[1] && sides[1] <= maxSides[1]
+        && sides[2] >= minSides[2] && sides[2] <= maxSides[2];
+}
+
+/**
+ * Find every stored triangle whose sorted sides are all within a box.
+ * @param minSides,maxSides Bounds on the shortest, middle, and longest side, inclusive.
+ * @param result[out] The index of each matching triangle, for Sides() and Stars(), is appended here.
+ */
+void TriangleDatabase::FindTriangles(const decimal *minSides, const decimal *maxSides,
+                                     std::vector<long> *result) const {
+    FindTriangles(0, numTriangles, 0, minSides, maxSides, result);
+}
+
+/// Search the subtree in [begin, end), which is split on side `axis`. Mirrors BuildTriangleTree.
+void TriangleDatabase::FindTriangles(long begin, long end, int axis,
+                                     const decimal *minSides, const decimal *maxSides,
+                                     std::vector<long> *result) const {
+    if (end - begin <= kTriangleLeafSize) {
+        for (long t = begin; t < end; t++) {
+            if (TriangleInBox(Sides(t), minSides, maxSides)) {
+                result->push_back(t);
+            }
+        }
+        return;
+    }
+    long middle = begin + (end - begin) / 2;
+    decimal split = Sides(middle)[axis];
+    if (TriangleInBox(Sides(middle), minSides, maxSides)) {
+        result->push_back(middle);
+    }
+    // everything before the middle is <= split on this axis, and everything after is >=
+    if (minSides[axis] <= split) {
+        FindTriangles(begin, middle, (axis + 1) % 3, minSides, maxSides, result);
+    }
+    if (maxSides[axis] >= split) {
+        FindTriangles(middle + 1, end, (axis + 1) % 3, minSides, maxSides, result);
+    }
+}
+
+/**
+   Neighbor database layout.
+
+   | size (bytes)     | name         | description                                             |
+   |------------------+--------------+---------------------------------------------------------|
+   | sizeof decimal   | minDistance  | lower bound on neighbor distance (radians)              |
+   | sizeof decimal   | maxDistance  | upper bound on neighbor distance (radians)              |
+   | 4                | numStars     | number of catalog stars                                 |
+   | 4*(numStars+1)   | offsets      | star s's neighbors are offsets[s] up to offsets[s+1]    |
+   | 2*numNeighbors   | neighbors    | catalog index of each neighbor, nearest first per star  |
+   | 4*numNeighbors   | versines     | PairVersine of each neighbor's distance (float)         |
+ */
+
+/// Serialize a NeighborDatabase of all the neighbors between minDistance and maxDistance (radians) of each catalog star
+void SerializeNeighbors(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance) {
+    std::vector<std::vector<int16_t>> upperNeighbors = CatalogNeighbors(catalog, minDistance, maxDistance);
+    std::vector<std::vector<std::pair<float, int16_t>>> neighbors(catalog.size());
+    for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
+        for (int16_t k : upperNeighbors[i]) {
+            float versine = CatalogVersine(catalog, i, k);
+            neighbors[i].emplace_back(versine, k);
+            neighbors[k].emplace_back(versine, i);
+        }
+    }
+
+    SerializePrimitive<decimal>(ser, minDistance);
+    SerializePrimitive<decimal>(ser, maxDistance);
+    SerializePrimitive<int32_t>(ser, catalog.size());
+    int32_t offset = 0;
+    SerializePrimitive<int32_t>(ser, offset);
+    for (std::vector<std::pair<float, int16_t>> &starNeighbors : neighbors) {
+        // nearest first, and by index among neighbors at the same distance
+        std::sort(starNeighbors.begin(), starNeighbors.end());
+        offset += starNeighbors.size();
+        SerializePrimitive<int32_t>(ser, offset);
+    }
+    for (const std::vector<std::pair<float, int16_t>> &starNeighbors : neighbors) {
+        for (const std::pair<float, int16_t> &neighbor : starNeighbors) {
+            SerializePrimitive<int16_t>(ser, neighbor.second);
+        }
+    }
+    for (const std::vector<std::pair<float, int16_t>> &starNeighbors : neighbors) {
+        for (const std::pair<float, int16_t> &neighbor : starNeighbors) {
+            SerializeFloat(ser, neighbor.first);
+        }
+    }
+}
+
+/// Create the database from a serialized buffer.
+NeighborDatabase::NeighborDatabase(DeserializeContext *des) {
+    minDistance = DeserializePrimitive<decimal>(des);
+    maxDistance = DeserializePrimitive<decimal>(des);
+    numStars = DeserializePrimitive<int32_t>(des);
+    offsets = DeserializeArray<int32_t>(des, numStars+1);
+    neighbors = DeserializeArray<int16_t>(des, offsets[numStars]);
+    versines = DeserializeArray<float>(des, offsets[numStars]);
+}
+
+/**
+ * The neighbors of a catalog star whose distance from it is between min and max (exclusive, like
+ * PairDistanceKVectorDatabase::FindPairsExact), nearest first.
+ * @param end[out] Is set to one past the last neighbor returned.
+ */
+const int16_t *NeighborDatabase::Neighbors(int16_t star, decimal min, decimal max, const int16_t **end) const {
+    assert(star >= 0 && star < numStars);
+    decimal minVersine = PairVersine(std::max(min, DECIMAL(0.0)));
+    decimal maxVersine = PairVersine(std::min(max, DECIMAL_M_PI));
+    const float *begin = versines + offsets[star];
+    const float *starEnd = versines + offsets[star+1];
+    const float *lower = std::partition_point(begin, starEnd, [minVersine](float versine) { return versine <= minVersine; });
+    const float *upper = std::partition_point(lower, starEnd, [maxVersine](float versine) { return versine < maxVersine; });
+    *end = neighbors + (upper - versines);
+    return neighbors + (lower - versines);
+}
+
+/**
+ * Which sky cell a direction is in, with cellsPerSide by cellsPerSide cells on each face of the
+ * cube. Coordinates on a face are in equal angle rather than equal distance along the face, so that
+ * the cells in the corners of a face aren't much smaller than those in the middle.
+ */
+static int SkyCell(const Vec3 &spatial, int cellsPerSide) {
+    decimal x = DECIMAL_ABS(spatial.x);
+    decimal y = DECIMAL_ABS(spatial.y);
+    decimal z = DECIMAL_ABS(spatial.z);
+    int face;
+    decimal u;
+    decimal w;
+    if (x >= y && x >= z) {
+        face = spatial.x > 0 ? 0 : 1;
+        u = spatial.y / x;
+        w = spatial.z / x;
+    } else if (y >= z) {
+        face = spatial.y > 0 ? 2 : 3;
+        u = spatial.z / y;
+        w = spatial.x / y;
+    } else {
+        face = spatial.z > 0 ? 4 : 5;
+        u = spatial.x / z;
+        w = spatial.y / z;
+    }
+    // from -1 to 1 across the face, in equal angle
+    u = DECIMAL_ATAN(u) * 4 / DECIMAL_M_PI;
+    w = DECIMAL_ATAN(w) * 4 / DECIMAL_M_PI;
+    int i = std::max(0, std::min(cellsPerSide - 1, (int)DECIMAL_FLOOR((u + 1) / 2 * cellsPerSide)));
+    int j = std::max(0, std::min(cellsPerSide - 1, (int)DECIMAL_FLOOR((w + 1) / 2 * cellsPerSide)));
+    return (face*cellsPerSide + i)*cellsPerSide + j;
+}
+
+/// The unit vector at (i, j) on a face, in units of cells from the face's corner, the inverse of SkyCell
+static Vec3 SkyCellPoint(int face, decimal i, decimal j, int cellsPerSide) {
+    decimal u = DECIMAL_TAN((2 * i / cellsPerSide - 1) * DECIMAL_M_PI / 4);
+    decimal w = DECIMAL_TAN((2 * j / cellsPerSide - 1) * DECIMAL_M_PI / 4);
+    decimal sign = face % 2 == 0 ? 1 : -1;
+    switch (face / 2) {
+        case 0: return Vec3{sign, u, w}.Normalize();
+        case 1: return Vec3{w, sign, u}.Normalize();
+        default: return Vec3{u, w, sign}.Normalize();
+    }
+}
+
+/// The four corners of a sky cell
+static std::vector<Vec3> SkyCellCorners(int cell, int cellsPerSide) {
+    int face = cell / (cellsPerSide*cellsPerSide);
+    int i = cell / cellsPerSide % cellsPerSide;
+    int j = cell % cellsPerSide;
+    return {
+        SkyCellPoint(face, i, j, cellsPerSide), SkyCellPoint(face, i + 1, j, cellsPerSide),
+        SkyCellPoint(face, i, j + 1, cellsPerSide), SkyCellPoint(face, i + 1, j + 1, cellsPerSide),
+    };
+}
+
+/**
+   Sky cell pair database layout.
+
+   | size (bytes)            | name             | description                                         |
+   |-------------------------+------------------+-----------------------------------------------------|
+   | 4                       | cellsPerSide     | cells along each edge of each face of the cube      |
+   | sizeof decimal          | minDistance      | lower bound on pair distance (radians)              |
+   | sizeof decimal          | maxDistance      | upper bound on pair distance (radians)              |
+   | 4*sizeof decimal*cells  | cellShapes       | center x, y, z and radius (radians) of each cell    |
+   | 4*(cells+1)             | adjacencyOffsets | cell c's adjacent cells are offsets[c] to [c+1]     |
+   | 2*numAdjacent           | adjacency        | indices of adjacent cells                           |
+   | ...                     | cellPairs        | for each cell, a kvector, then its pairs            |
+
+   Each cell's pairs are laid out like a pair distance K-vector database.
+ */
+
+/**
+ * Serialize a SkyCellPairDatabase of the pairs between minDistance and maxDistance (radians), with
+ * cellsPerSide^2 cells on each face of the cube, and a kvector of numBinsPerCell bins for each cell.
+ * Cells are numbered with 16-bit integers, so cellsPerSide can be at most kMaxSkyCellsPerSide.
+ */
+void SerializeSkyCellPairs(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance,
+                           int cellsPerSide, long numBinsPerCell, int numThreads) {
+    assert(cellsPerSide >= 1 && cellsPerSide <= kMaxSkyCellsPerSide);
+    int numCells = 6*cellsPerSide*cellsPerSide;
+    std::vector<std::vector<Vec3>> corners;
+    for (int cell = 0; cell < numCells; cell++) {
+        corners.push_back(SkyCellCorners(cell, cellsPerSide));
+    }
+
+    SerializePrimitive<int32_t>(ser, cellsPerSide);
+    SerializePrimitive<decimal>(ser, minDistance);
+    SerializePrimitive<decimal>(ser, maxDistance);
+    for (int cell = 0; cell < numCells; cell++) {
+        Vec3 center = SkyCellPoint(cell / (cellsPerSide*cellsPerSide), cell / cellsPerSide % cellsPerSide + DECIMAL(0.5),
+                                   cell % cellsPerSide + DECIMAL(0.5), cellsPerSide);
+        // the cell's sides are great circles, so the corners are the furthest from the center
+        decimal radius = 0;
+        for (const Vec3 &corner : corners[cell]) {
+            radius = std::max(radius, AngleUnit(center, corner));
+        }
+        SerializePrimitive<decimal>(ser, center.x);
+        SerializePrimitive<decimal>(ser, center.y);
+        SerializePrimitive<decimal>(ser, center.z);
+        SerializePrimitive<decimal>(ser, radius);
+    }
+
+    // cells are adjacent if they have a corner in common, up to rounding. Sorted by x, each corner
+    // is next to the other cells' copies of it, so there's no need to compare every pair of cells.
+    std::vector<std::pair<Vec3, int16_t>> cellCorners;
+    for (int cell = 0; cell < numCells; cell++) {
+        for (const Vec3 &corner : corners[cell]) {
+            cellCorners.emplace_back(corner, cell);
+        }
+    }
+    std::sort(cellCorners.begin(), cellCorners.end(),
+              [](const std::pair<Vec3, int16_t> &a, const std::pair<Vec3, int16_t> &b) { return a.first.x < b.first.x; });
+    decimal minCornerCos = 1 - DECIMAL(1e-6);
+    // no coordinate of corners that close differs by more than the chord between them
+    decimal maxCornerChord = DECIMAL_SQRT(2 * (1 - minCornerCos));
+    std::vector<std::vector<int16_t>> adjacent(numCells);
+    for (size_t a = 0; a < cellCorners.size(); a++) {
+        for (size_t b = a + 1; b < cellCorners.size() && cellCorners[b].first.x - cellCorners[a].first.x <= maxCornerChord; b++) {
+            if (cellCorners[a].second != cellCorners[b].second && cellCorners[a].first * cellCorners[b].first > minCornerCos) {
+                adjacent[cellCorners[a].second].push_back(cellCorners[b].second);
+                adjacent[cellCorners[b].second].push_back(cellCorners[a].second);
+            }
+        }
+    }
+    for (std::vector<int16_t> &cellAdjacent : adjacent) {
+        std::sort(cellAdjacent.begin(), cellAdjacent.end());
+        cellAdjacent.erase(std::unique(cellAdjacent.begin(), cellAdjacent.end()), cellAdjacent.end());
+    }
+    int32_t offset = 0;
+    SerializePrimitive<int32_t>(ser, offset);
+    for (const std::vector<int16_t> &cellAdjacent : adjacent) {
+        offset += cellAdjacent.size();
+        SerializePrimitive<int32_t>(ser, offset);
+    }
+    for (const std::vector<int16_t> &cellAdjacent : adjacent) {
+        for (int16_t cell : cellAdjacent) {
+            SerializePrimitive<int16_t>(ser, cell);
+        }
+    }
+
+    // still in order of distance within each cell
+    std::vector<KVectorPair> pairs = CatalogToPairDistances(catalog, minDistance, maxDistance, numThreads);
+    SortPairDistances(&pairs, minDistance, maxDistance, numThreads);
+    std::vector<std::vector<KVectorPair>> cellPairs(numCells);
+    for (const KVectorPair &pair : pairs) {
+        cellPairs[SkyCell(catalog[pair.index1].spatial, cellsPerSide)].push_back(pair);
+    }
+    for (const std::vector<KVectorPair> &thisCellPairs : cellPairs) {
+        std::vector<decimal> distances;
+        for (const KVectorPair &pair : thisCellPairs) {
+            distances.push_back(pair.distance);
+        }
+        SerializeKVectorIndex(ser, distances, minDistance, maxDistance, numBinsPerCell);
+        for (const KVectorPair &pair : thisCellPairs) {
+            SerializePrimitive<int16_t>(ser, pair.index1);
+            SerializePrimitive<int16_t>(ser, pair.index2);
+        }
+    }
+}
+
+/// Create the database from a serialized buffer.
+SkyCellPairDatabase::SkyCellPairDatabase(DeserializeContext *des) {
+    cellsPerSide = DeserializePrimitive<int32_t>(des);
+    minDistance = DeserializePrimitive<decimal>(des);
+    maxDistance = DeserializePrimitive<decimal>(des);
+    for (int cell = 0; cell < NumCells(); cell++) {
+        decimal x = DeserializePrimitive<decimal>(des);
+        decimal y = DeserializePrimitive<decimal>(des);
+        decimal z = DeserializePrimitive<decimal>(des);
+        centers.push_back({x, y, z});
+        radii.push_back(DeserializePrimitive<decimal>(des));
+    }
+    adjacencyOffsets = DeserializeArray<int32_t>(des, NumCells()+1);
+    adjacency = DeserializeArray<int16_t>(des, adjacencyOffsets[NumCells()]);
+    for (int cell = 0; cell < NumCells(); cell++) {
+        KVectorIndex index(des);
+        const int16_t *pairs = DeserializeArray<int16_t>(des, 2*index.NumValues());
+        cells.push_back({index, pairs});
+    }
+}
+
+/// The sky cell a direction is in
+int SkyCellPairDatabase::CellOf(const Vec3 &spatial) const {
+    return SkyCell(spatial, cellsPerSide);
+}
+
+/**
+ * Every cell with some part within radius (radians) of center, and maybe a few more. Found by
+ * spreading out through adjacent cells from center's cell, so only the cells near center are looked at.
+ * @param cells[out] Is set to the cells, center's cell first.
+ */
+void SkyCellPairDatabase::CellsNear(const Vec3 &center, decimal radius, std::vector<int> *cells) const {
+    cells->clear();
+    std::vector<bool> seen(NumCells(), false);
+    int first = CellOf(center);
+    seen[first] = true;
+    cells->push_back(first);
+    for (size_t next = 0; next < cells->size(); next++) {
+        const int16_t *end;
+        for (const int16_t *adjacent = AdjacentCells((*cells)[next], &end); adjacent != end; adjacent++) {
+            if (seen[*adjacent]) {
+                continue;
+            }
+            seen[*adjacent] = true;
+            // within radius of the cell's circumscribed circle
+            decimal reach = radius + radii[*adjacent];
+            if (reach >= DECIMAL_M_PI || centers[*adjacent] * center >= DECIMAL_COS(reach)) {
+                cells->push_back(*adjacent);
+            }
+        }
+    }
+}
+
+/**
+ * Return at least all the star pairs whose first star is in the cell and whose distance is between min and max
+ * @param end[out] Is set to one past the last pair returned.
+ */
+const int16_t *SkyCellPairDatabase::FindPairsLiberal(int cell, decimal min, decimal max, const int16_t **end) const {
+    long upperIndex = -1;
+    long lowerIndex = cells[cell].index.QueryLiberal(min, max, &upperIndex);
+    *end = cells[cell].pairs + 2*upperIndex;
+    return cells[cell].pairs + 2*lowerIndex;
+}
+
+/**
+ * The fraction of extra pairs a liberal query of a cell returns, compared to an exact query, like
+ * PairDistanceKVectorOverfetch. Queries are spread over the cells like the pairs are.
+ */
+decimal SkyCellPairsOverfetch(const SkyCellPairDatabase &db, const Catalog &catalog, decimal tolerance) {
+    long numPairs = 0;
+    for (int cell = 0; cell < db.NumCells(); cell++) {
+        numPairs += db.NumPairs(cell);
+    }
+    long numSamples = std::min(numPairs, kOverfetchSamples);
+    long numLiberal = 0;
+    long numExact = 0;
+    int cell = 0;
+    // the first pair of the current cell, counting through all the cells
+    long cellStart = 0;
+    for (long sample = 0; sample < numSamples; sample++) {
+        long pairIndex = sample * numPairs / numSamples;
+        while (pairIndex >= cellStart + db.NumPairs(cell)) {
+            cellStart += db.NumPairs(cell);
+            cell++;
+        }
+        const int16_t *allEnd;
+        const int16_t *pair = db.FindPairsLiberal(cell, db.MinDistance(), db.MaxDistance(), &allEnd)
+            + 2 * (pairIndex - cellStart);
+        decimal distance = AngleUnit(catalog[pair[0]].spatial, catalog[pair[1]].spatial);
+        const int16_t *end;
+        for (const int16_t *other = db.FindPairsLiberal(cell, distance - tolerance, distance + tolerance, &end);
+             other != end; other += 2) {
+
+            numLiberal++;
+            if (DECIMAL_ABS(AngleUnit(catalog[other[0]].spatial, catalog[other[1]].spatial) - distance) <= tolerance) {
+                numExact++;
+            }
+        }
+    }
+    return numExact == 0 ? 0 : (decimal)(numLiberal - numExact) / numExact;
+}
+
+/**
+   MultiDatabase memory layout (version 1):
+
+   | size | name           | description                                          |
+   |------+----------------+------------------------------------------------------|
+   |    4 | formatMagic    | kMultiDatabaseMagicValue                             |
+   |    4 | version        | kMultiDatabaseVersion                                |
+   |    4 | numEntries     | number of sub-databases                              |
+   |    4 | reserved       | 0                                                    |
+   | 32*n | contents       | an entry per sub-database, as below                  |
+   |  ... | databases      | the sub-databases, each 64-byte aligned              |
+
+   Each contents entry:
+
+   | size | name           | description                                          |
+   |------+----------------+------------------------------------------------------|
+   |    4 | magicValue     | unique database identifier                           |
+   |    4 | flags          | [X, X, X, isDouble?]                                 |
+   |    8 | offset         | from the start of the MultiDatabase, a multiple of 64 |
+   |    8 | length         | in bytes                                             |
+   |    4 | checksum       | CRC-32 of the sub-database                           |
+   |    4 | reserved       | 0                                                    |
+
+   Databases from before there was a version (version 0) are just a list of sub-databases:
+
+   | size | name           | description                                 |
+   |------+----------------+---------------------------------------------|
+   |    4 | magicValue     | unique database identifier                  |
+   |    4 | flags          | [X, X, X, isDouble?]                        |
+   |    4 | databaseLength | length in bytes (32-bit unsigned)           |
+   |    n | database       | the entire database. 8-byte aligned         |
+   |  ... | ...            | More databases (each has value, length, db) |
+   |    4 | caboose        | 4 null bytes indicate the end               |
+ */
+
+/// Sub-databases start at a multiple of this many bytes from the start of the MultiDatabase, so
+/// that a MultiDatabase at a cache line (or page) boundary has every sub-database at one too.
+static const long kMultiDatabaseAlignment = 64;
+
+/// Lookup table for Crc32, one entry per byte value
+static std::vector<uint32_t> Crc32Table() {
+    std::vector<uint32_t> table(256);
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        table[n] = c;
+    }
+    return table;
+}
+
+/// CRC-32 (as used by zlib and PNG) of `length` bytes
+static uint32_t Crc32(const unsigned char *bytes, uint64_t length) {
+    static const std::vector<uint32_t> table = Crc32Table();
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint64_t i = 0; i < length; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+/// Exit if a sub-database was serialized with a different decimal type than this build uses.
+static void CheckDecimalFlag(uint32_t dbFlags) {
+#ifdef LOST_FLOAT_MODE
+    if (!isFlagSet(dbFlags, MULTI_DB_FLOAT_FLAG)) {
+        std::cerr << "LOST was compiled in float mode. This database was serialized in double mode and is incompatible." << std::endl;
+        exit(1);
+    }
+#else
+    if (isFlagSet(dbFlags, MULTI_DB_FLOAT_FLAG)) {
+        std::cerr << "LOST was compiled in double mode. This database was serialized in float mode and is incompatible." << std::endl;
+        exit(1);
+    }
+#endif
+}
+
+/**
+ * Read the MultiDatabase's table of contents, or for a version 0 database, walk its list of
+ * sub-databases, so that later lookups don't have to. Exits if the database is from a newer version
+ * of LOST, or was serialized with a different decimal type than this build uses.
+ */
+MultiDatabase::MultiDatabase(const unsigned char *buffer) : buffer(buffer), version(0) {
+    DeserializeContext desValue(buffer);
+    DeserializeContext *des = &desValue; // just for naming consistency with how we use `des` elsewhere
+
+    if (DeserializePrimitive<int32_t>(des) == kMultiDatabaseMagicValue) {
+        version = DeserializePrimitive<uint32_t>(des);
+        if (version > kMultiDatabaseVersion) {
+            std::cerr << "Database is version " << version << ", but this LOST only reads up to version "
+                      << kMultiDatabaseVersion << "." << std::endl;
+            exit(1);
+        }
+        uint32_t numEntries = DeserializePrimitive<uint32_t>(des);
+        DeserializePrimitive<uint32_t>(des); // reserved
+        for (uint32_t i = 0; i < numEntries; i++) {
+            Entry entry;
+            entry.magicValue = DeserializePrimitive<int32_t>(des);
+            entry.flags = DeserializePrimitive<uint32_t>(des);
+            entry.pointer = buffer + DeserializePrimitive<uint64_t>(des);
+            entry.length = DeserializePrimitive<uint64_t>(des);
+            entry.checksum = DeserializePrimitive<uint32_t>(des);
+            DeserializePrimitive<uint32_t>(des); // reserved
+            CheckDecimalFlag(entry.flags);
+            entries.push_back(entry);
+        }
+        return;
+    }
+
+    DeserializeContext legacyDes(buffer);
+    des = &legacyDes;
+    while (true) {
+        Entry entry;
+        entry.magicValue = DeserializePrimitive<int32_t>(des);
+        if (entry.magicValue == 0) {
+            return;
+        }
+        entry.flags = DeserializePrimitive<uint32_t>(des);
+        CheckDecimalFlag(entry.flags);
+        entry.length = DeserializePrimitive<uint32_t>(des);
+        assert(entry.length > 0);
+        DeserializePadding<uint64_t>(des); // align to an 8-byte boundary
+        entry.pointer = DeserializeArray<unsigned char>(des, entry.length);
+        entry.checksum = 0;
+        entries.push_back(entry);
+    }
+}
+
+/**
+ * @brief return a pointer to the start of the database type indicated by the magic value, if such
+ * a sub-database is present in the database
+ * @param magicValue
+ * @return Returns a pointer to the start of the database type indicated by the magic value, null if not found
+ */
+const unsigned char *MultiDatabase::SubDatabasePointer(int32_t magicValue) const {
+    assert(magicValue != 0);
+    // there's one entry per kind of sub-database, so only a handful
+    for (const Entry &entry : entries) {
+        if (entry.magicValue == magicValue) {
+            return entry.pointer;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Whether every sub-database matches the checksum in the table of contents. Reads the whole
+ * database, so it's not done unless asked for. Version 0 databases have no checksums, so they pass.
+ */
+bool MultiDatabase::VerifyChecksums() const {
+    if (version == 0) {
+        return true;
+    }
+    for (const Entry &entry : entries) {
+        if (Crc32(entry.pointer, entry.length) != entry.checksum) {
+            return false;
+        }
+    }
+    return true;
 }
 
 void SerializeMultiDatabase(SerializeContext *ser,
                             const MultiDatabaseDescriptor &dbs,
                             uint32_t flags) {
+    // every offset is relative to the start of the MultiDatabase
+    long start = ser->buffer.size();
+    assert(start % kMultiDatabaseAlignment == 0);
+    long headerLength = 16 + 32 * dbs.size();
+    std::vector<uint64_t> offsets;
+    long offset = (headerLength + kMultiDatabaseAlignment - 1) / kMultiDatabaseAlignment * kMultiDatabaseAlignment;
     for (const MultiDatabaseEntry &multiDbEntry : dbs) {
-        SerializePrimitive<int32_t>(ser, multiDbEntry.magicValue);
+        offsets.push_back(offset);
+        offset += (multiDbEntry.bytes.size() + kMultiDatabaseAlignment - 1) / kMultiDatabaseAlignment * kMultiDatabaseAlignment;
+    }
+
+    SerializePrimitive<int32_t>(ser, kMultiDatabaseMagicValue);
+    SerializePrimitive<uint32_t>(ser, kMultiDatabaseVersion);
+    SerializePrimitive<uint32_t>(ser, dbs.size());
+    SerializePrimitive<uint32_t>(ser, 0);
+    for (int i = 0; i < (int)dbs.size(); i++) {
+        SerializePrimitive<int32_t>(ser, dbs[i].magicValue);
         SerializePrimitive<uint32_t>(ser, flags);
-        SerializePrimitive<uint32_t>(ser, multiDbEntry.bytes.size());
-        SerializePadding<uint64_t>(ser);
-        std::copy(multiDbEntry.bytes.cbegin(), multiDbEntry.bytes.cend(), std::back_inserter(ser->buffer));
+        SerializePrimitive<uint64_t>(ser, offsets[i]);
+        SerializePrimitive<uint64_t>(ser, dbs[i].bytes.size());
+        SerializePrimitive<uint32_t>(ser, Crc32(dbs[i].bytes.data(), dbs[i].bytes.size()));
+        SerializePrimitive<uint32_t>(ser, 0);
+    }
+    for (int i = 0; i < (int)dbs.size(); i++) {
+        ser->buffer.resize(start + offsets[i], 0);
+        std::copy(dbs[i].bytes.cbegin(), dbs[i].bytes.cend(), std::back_inserter(ser->buffer));
+    }
+    ser->buffer.resize(start + offset, 0);
+}
+
+/// Transparent huge pages on x86-64 and arm64 are this big, and only back mappings aligned to it
+static const uintptr_t kHugePageSize = 2 * 1024 * 1024;
+
+/// Map the database file at `path`. Prints an error and exits if it can't.
+MappedDatabase::MappedDatabase(const std::string &path, const DatabaseMapOptions &options) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        std::cerr << "Error reading database! " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    if (fileStat.st_size <= 0) {
+        std::cerr << "Error reading database! The file is empty." << std::endl;
+        exit(1);
+    }
+    size = fileStat.st_size;
+
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (options.populate) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+
+    // To start the mapping on a huge page boundary, reserve a huge page more address space than
+    // the file needs, then map the file over the first aligned address in it.
+    uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t mappedLength = ((uintptr_t)size + pageSize - 1) / pageSize * pageSize;
+    void *reservation = MAP_FAILED;
+    uintptr_t reservationLength = mappedLength + kHugePageSize;
+    void *address = NULL;
+    if (options.hugePages) {
+        reservation = mmap(NULL, reservationLength, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (reservation != MAP_FAILED) {
+            address = (void *)(((uintptr_t)reservation + kHugePageSize - 1) & ~(kHugePageSize - 1));
+            flags |= MAP_FIXED;
+        }
+    }
+
+    void *mapped = mmap(address, size, PROT_READ, flags, fd, 0);
+    int mapErrno = errno;
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Error mapping database! " << strerror(mapErrno) << std::endl;
+        exit(1);
+    }
+    if (reservation != MAP_FAILED) {
+        // give back the reserved address space either side of the file
+        uintptr_t reservationStart = (uintptr_t)reservation;
+        uintptr_t mappedStart = (uintptr_t)mapped;
+        if (mappedStart > reservationStart) {
+            munmap(reservation, mappedStart - reservationStart);
+        }
+        uintptr_t mappedEnd = mappedStart + mappedLength;
+        uintptr_t reservationEnd = reservationStart + reservationLength;
+        if (reservationEnd > mappedEnd) {
+            munmap((void *)mappedEnd, reservationEnd - mappedEnd);
+        }
+    }
+
+    // Both are only hints, so it doesn't matter if the kernel doesn't take them.
+#ifdef MADV_HUGEPAGE
+    if (options.hugePages) {
+        madvise(mapped, size, MADV_HUGEPAGE);
+    }
+#endif
+#ifndef MAP_POPULATE
+    if (options.populate) {
+        madvise(mapped, size, MADV_WILLNEED);
+    }
+#endif
+
+    buffer = (unsigned char *)mapped;
+}
+
+MappedDatabase::~MappedDatabase() {
+    munmap(buffer, size);
+}
+
+PreparedDatabase::PreparedDatabase(const unsigned char *buffer, bool deserializeCatalog)
+    : buffer(buffer), hasCatalog(false), hasCatalogMagnitudes(false) {
+
+    if (buffer == NULL) {
+        return;
+    }
+    MultiDatabase multiDatabase(buffer);
+
+    const unsigned char *catalogBuffer = multiDatabase.SubDatabasePointer(kCatalogMagicValue);
+    if (deserializeCatalog && catalogBuffer != NULL) {
+        DeserializeContext des(catalogBuffer);
+        catalog = DeserializeCatalog(&des, &hasCatalogMagnitudes, NULL);
+        hasCatalog = true;
+    }
+
+    const unsigned char *pairDistanceBuffer = multiDatabase.SubDatabasePointer(PairDistanceKVectorDatabase::kMagicValue);
+    if (pairDistanceBuffer != NULL) {
+        DeserializeContext des(pairDistanceBuffer);
+        pairDistanceKVector.reset(new PairDistanceKVectorDatabase(&des));
+    }
+
+    const unsigned char *pairRecordBuffer = multiDatabase.SubDatabasePointer(PairRecordKVectorDatabase::kMagicValue);
+    if (pairRecordBuffer != NULL) {
+        DeserializeContext des(pairRecordBuffer);
+        pairRecordKVector.reset(new PairRecordKVectorDatabase(&des));
+    }
+
+    const unsigned char *pairCosineBuffer = multiDatabase.SubDatabasePointer(PairCosineKVectorDatabase::kMagicValue);
+    if (pairCosineBuffer != NULL) {
+        DeserializeContext des(pairCosineBuffer);
+        pairCosineKVector.reset(new PairCosineKVectorDatabase(&des));
+    }
+
+    const unsigned char *compressedPairBuffer = multiDatabase.SubDatabasePointer(CompressedPairKVectorDatabase::kMagicValue);
+    if (compressedPairBuffer != NULL) {
+        DeserializeContext des(compressedPairBuffer);
+        compressedPairKVector.reset(new CompressedPairKVectorDatabase(&des));
+    }
+
+    const unsigned char *skyCellBuffer = multiDatabase.SubDatabasePointer(SkyCellPairDatabase::kMagicValue);
+    if (skyCellBuffer != NULL) {
+        DeserializeContext des(skyCellBuffer);
+        skyCellPairs.reset(new SkyCellPairDatabase(&des));
+    }
+
+    const unsigned char *tripleInnerBuffer = multiDatabase.SubDatabasePointer(TripleInnerKVectorDatabase::kMagicValue);
+    if (tripleInnerBuffer != NULL) {
+        DeserializeContext des(tripleInnerBuffer);
+        tripleInnerKVector.reset(new TripleInnerKVectorDatabase(&des));
+    }
+
+    const unsigned char *gridBuffer = multiDatabase.SubDatabasePointer(GridDatabase::kMagicValue);
+    if (gridBuffer != NULL) {
+        DeserializeContext des(gridBuffer);
+        grid.reset(new GridDatabase(&des));
+    }
+
+    const unsigned char *trianglesBuffer = multiDatabase.SubDatabasePointer(TriangleDatabase::kMagicValue);
+    if (trianglesBuffer != NULL) {
+        DeserializeContext des(trianglesBuffer);
+        triangles.reset(new TriangleDatabase(&des));
+    }
+
+    const unsigned char *neighborsBuffer = multiDatabase.SubDatabasePointer(NeighborDatabase::kMagicValue);
+    if (neighborsBuffer != NULL) {
+        DeserializeContext des(neighborsBuffer);
+        neighbors.reset(new NeighborDatabase(&des));
     }
-    SerializePrimitive<int32_t>(ser, 0); // caboose
 }
 
 }
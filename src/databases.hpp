@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <vector>
+#include <memory>
+#include <string>
 
 #include "star-utils.hpp"
 #include "serialize-helpers.hpp"
@@ -14,6 +16,27 @@ const int32_t kCatalogMagicValue = 0xF9A283BC;
 
 inline bool isFlagSet(uint32_t dbFlags, uint32_t flag);
 
+/// Hint that `address` will be read soon, so that it's on its way into the cache by then. Only a hint.
+inline void PrefetchForRead(const void *address) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address, 0);
+#else
+    (void)address;
+#endif
+}
+
+/// An interval of values to query a KVectorIndex for, inclusive
+struct KVectorInterval {
+    decimal min;
+    decimal max;
+};
+
+/// The result of a KVectorIndex query: the indices [begin, end) of the values
+struct KVectorRange {
+    long begin;
+    long end;
+};
+
 /**
  * A data structure enabling constant-time range queries into fixed numerical data.
  * 
@@ -25,6 +48,8 @@ public:
     explicit KVectorIndex(DeserializeContext *des);
 
     long QueryLiberal(decimal minQueryDistance, decimal maxQueryDistance, long *upperIndex) const;
+    void QueryLiberal(const KVectorInterval *queries, long numQueries, KVectorRange *result) const;
+    long QueryLiberalBins(decimal minQueryDistance, decimal maxQueryDistance, long *upperBoundary) const;
 
     /// The number of data points in the data referred to by the kvector
     long NumValues() const { return numValues; };
@@ -44,7 +69,9 @@ private:
     const int32_t *bins;
 };
 
-void SerializePairDistanceKVector(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance, long numBins);
+void SerializePairDistanceKVector(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance, long numBins,
+                                  int numThreads = 1);
+long KVectorBinsForTolerance(decimal min, decimal max, decimal tolerance, decimal overfetch);
 
 /**
  * A database storing distances between pairs of stars.
@@ -56,9 +83,13 @@ public:
     explicit PairDistanceKVectorDatabase(DeserializeContext *des);
 
     const int16_t *FindPairsLiberal(decimal min, decimal max, const int16_t **end) const;
+    void FindPairsLiberal(const KVectorInterval *queries, long numQueries, KVectorRange *result) const;
     const int16_t *FindPairsExact(const Catalog &, decimal min, decimal max, const int16_t **end) const;
     std::vector<decimal> StarDistances(int16_t star, const Catalog &) const;
 
+    /// The pair at the given index of a KVectorRange, as two catalog indices
+    const int16_t *Pair(long index) const { return pairs + 2*index; };
+
     /// Upper bound on stored star pair distances
     decimal MaxDistance() const { return index.Max(); };
     /// Lower bound on stored star pair distances
@@ -76,22 +107,477 @@ private:
     const int16_t *pairs;
 };
 
-// /**
-//  * @brief Stores "inner angles" between star triples
-//  * @details Unsensitive to first-order error in basic camera
-//  * parameters (eg, wrong FOV or principal point), can be sensitive to second-order errors (eg,
-//  * camera distortion, which may cause the effective FOV or principal point to be different in
-//  * different parts of the image). Used for Mortari's Non-Dimensional Star-ID
-//  */
-// class TripleInnerKVectorDatabase {
-// public:
-//     explicit TripleInnerKVectorDatabase(const unsigned char *databaseBytes);
+void SerializePairCosineKVector(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance, long numBins,
+                                 int numThreads = 1);
+
+/**
+ * The same pairs as a PairDistanceKVectorDatabase, in the same order, but with the kvector built on
+ * the versine (1 - cosine, see PairVersine) of their distance instead of the distance itself.
+ * Queries take bounds on the cosine, ie the dot product of the stars' unit vectors, so a caller
+ * which measures distances as dot products can query without ever taking an arccosine.
+ *
+ * Pairs of random stars are uniformly distributed in cosine, so uniform bins of versine hold about
+ * the same number of pairs each, unlike uniform bins of distance.
+ */
+class PairCosineKVectorDatabase {
+public:
+    explicit PairCosineKVectorDatabase(DeserializeContext *des);
+
+    const int16_t *FindPairsLiberal(decimal minCos, decimal maxCos, const int16_t **end) const;
+    /**
+     * Many queries at once, which unlike FindPairsLiberal take intervals of versine, ie
+     * [1 - maxCos, 1 - minCos], since that's what the kvector is built on
+     */
+    void FindPairsLiberalVersine(const KVectorInterval *queries, long numQueries, KVectorRange *result) const;
+
+    /// The pair at the given index of a KVectorRange, as two catalog indices
+    const int16_t *Pair(long index) const { return pairs + 2*index; };
+
+    /// Upper bound on the cosine of stored star pair distances, ie the cosine of the min distance
+    decimal MaxCos() const { return 1 - index.Min(); };
+    /// Lower bound on the cosine of stored star pair distances, ie the cosine of the max distance
+    decimal MinCos() const { return 1 - index.Max(); };
+    /// Exact number of stored pairs
+    long NumPairs() const { return index.NumValues(); };
+    /// Width of a bin, in versine, which is as far past either end of a query as liberal results may go
+    decimal BinWidth() const { return (index.Max() - index.Min()) / index.NumBins(); };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x3d9c6b15
+private:
+    KVectorIndex index;
+    const int16_t *pairs;
+};
+
+long PairCosineKVectorBinsForTolerance(decimal minDistance, decimal maxDistance, decimal tolerance, decimal overfetch);
+decimal PairCosineKVectorOverfetch(const PairCosineKVectorDatabase &, const Catalog &, decimal tolerance);
+
+/**
+ * Reads the pairs of a CompressedPairKVectorDatabase query one at a time, decoding them as it goes.
+ * The pairs of each kvector bin are ordered by their first star and bit packed. Each pair is the
+ * difference of its first star from the last pair's (from 0 for the first pair of a bin), then the
+ * difference of its second star from its first, minus 1, each in as few bits as the largest one in
+ * the bin needs. Bits are packed little end first.
+ */
+class CompressedPairIterator {
+public:
+    CompressedPairIterator(const unsigned char *bytes, const int32_t *groupEnds, const uint8_t *groupWidths,
+                           long lowerBoundary, long upperBoundary)
+        : bytes(bytes), groupEnds(groupEnds), groupWidths(groupWidths), group(lowerBoundary),
+          groupEnd(groupEnds[lowerBoundary]), position(groupEnds[lowerBoundary]), end(groupEnds[upperBoundary]) { };
+
+    bool Next(int16_t *index1, int16_t *index2);
+
+private:
+    long ReadBits(int width);
+
+    const unsigned char *bytes;
+    /// Bit offset of the end of each bin's pairs
+    const int32_t *groupEnds;
+    /// Widths of the two differences of each bin's pairs, in bits
+    const uint8_t *groupWidths;
+    /// The bin being read, after which the first star's differences start over, and its end and widths
+    long group;
+    long groupEnd;
+    int width1 = 0;
+    int width2 = 0;
+    /// Bit offset of the next pair
+    long position;
+    long end;
+    int16_t lastIndex1 = 0;
+};
+
+/// Read the next pair into index1 and index2, or return false if there are no more.
+inline bool CompressedPairIterator::Next(int16_t *index1, int16_t *index2) {
+    if (position >= end) {
+        return false;
+    }
+    while (position >= groupEnd) {
+        group++;
+        groupEnd = groupEnds[group];
+        width1 = groupWidths[2*group];
+        width2 = groupWidths[2*group + 1];
+        lastIndex1 = 0;
+    }
+    lastIndex1 += (int16_t)ReadBits(width1);
+    *index1 = lastIndex1;
+    *index2 = (int16_t)(lastIndex1 + 1 + ReadBits(width2));
+    return true;
+}
+
+/// Read `width` bits (at most 16) starting at `position`, and move past them
+inline long CompressedPairIterator::ReadBits(int width) {
+    // the bits are within 3 bytes, and the encoded pairs are padded so there always are 4
+    const unsigned char *p = bytes + (position >> 3);
+    uint32_t word = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    long result = (word >> (position & 7)) & ((1u << width) - 1);
+    position += width;
+    return result;
+}
+
+void SerializeCompressedPairKVector(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance, long numBins,
+                                    int numThreads = 1);
+
+/**
+ * The same pairs as a PairDistanceKVectorDatabase, with the same kvector, but delta encoded and bit
+ * packed a bin at a time instead of stored as raw star indices (see CompressedPairIterator for the
+ * encoding). Queries return an iterator which decodes the pairs as they are read, so the pairs are
+ * never decompressed all at once. Within a bin, the pairs are in a different order than the
+ * uncompressed database's.
+ */
+class CompressedPairKVectorDatabase {
+public:
+    explicit CompressedPairKVectorDatabase(DeserializeContext *des);
+
+    CompressedPairIterator FindPairsLiberal(decimal min, decimal max) const;
+    /// @param result[out] The range of kvector bin boundaries of each query, to pass to Pairs()
+    void FindPairsLiberal(const KVectorInterval *queries, long numQueries, KVectorRange *result) const;
+    /// The pairs between two kvector bin boundaries
+    CompressedPairIterator Pairs(const KVectorRange &boundaries) const {
+        return CompressedPairIterator(bytes, groupEnds, groupWidths, boundaries.begin, boundaries.end);
+    };
+    /// Hint that the pairs between these bin boundaries will be read soon
+    void PrefetchPairs(const KVectorRange &boundaries) const {
+        PrefetchForRead(bytes + groupEnds[boundaries.begin]/8);
+    };
+
+    /// Upper bound on stored star pair distances
+    decimal MaxDistance() const { return index.Max(); };
+    /// Lower bound on stored star pair distances
+    decimal MinDistance() const { return index.Min(); };
+    /// Exact number of stored pairs
+    long NumPairs() const { return index.NumValues(); };
+    /// Bytes taken by the encoded pairs, not counting the kvector or the per-bin offsets and widths
+    long NumPairBytes() const { return (groupEnds[index.NumBins()] + 7) / 8; };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x5a0e83f7
+private:
+    KVectorIndex index;
+    /// Bit offset of the end of the pairs of each kvector bin
+    const int32_t *groupEnds;
+    const uint8_t *groupWidths;
+    const unsigned char *bytes;
+};
+
+/// A star pair with its distance stored next to it, so that the distance can be checked without the catalog.
+struct PairRecord {
+    int16_t index1;
+    int16_t index2;
+    /// 1 minus the cosine of the angle between the two stars (see PairVersine)
+    float versine;
+};
+
+/**
+ * 1 minus the cosine of an angle, computed as 2sin^2(angle/2) so that it stays precise for small
+ * angles. Increases with the angle from 0 to pi.
+ */
+inline decimal PairVersine(decimal angle) {
+    decimal halfSine = DECIMAL_SIN(angle / 2);
+    return 2 * halfSine * halfSine;
+}
+
+decimal PairDistanceKVectorOverfetch(const PairDistanceKVectorDatabase &, const Catalog &, decimal tolerance);
+
+void SerializePairRecordKVector(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance, long numBins,
+                                int numThreads = 1);
 
-//     void FindTriplesLiberal(decimal min, decimal max, long **begin, long **end) const;
-// private:
-//     KVectorIndex index;
-//     int16_t *triples;
-// };
+/**
+ * The same pairs as a PairDistanceKVectorDatabase, in the same order, but each stored as a
+ * PairRecord of 8 bytes: the two catalog indices followed by the versine (1 - cosine) of their
+ * distance.
+ *
+ * Exact queries trim the liberal range by binary search on the versines, and anything filtering
+ * the pairs of a query makes one linear pass over contiguous memory, rather than looking up
+ * both stars of each pair in the catalog. Twice the size of the plain pair database.
+ *
+ * The versine is stored rather than the cosine because a single precision cosine of a small angle
+ * is nearly 1, and would resolve sub-degree distances to tens of microradians only; the versine
+ * keeps about 7 significant digits of every distance.
+ */
+class PairRecordKVectorDatabase {
+public:
+    explicit PairRecordKVectorDatabase(DeserializeContext *des);
+
+    const PairRecord *FindPairsLiberal(decimal min, decimal max, const PairRecord **end) const;
+    const PairRecord *FindPairsExact(decimal min, decimal max, const PairRecord **end) const;
+
+    /// Upper bound on stored star pair distances
+    decimal MaxDistance() const { return index.Max(); };
+    /// Lower bound on stored star pair distances
+    decimal MinDistance() const { return index.Min(); };
+    /// Exact number of stored pairs
+    long NumPairs() const { return index.NumValues(); };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x7c45e1d2
+private:
+    KVectorIndex index;
+    const PairRecord *records;
+};
+
+void SerializeTripleInnerKVector(SerializeContext *, const Catalog &,
+                                 decimal minDistance, decimal maxDistance, decimal minInnerAngle,
+                                 long numBins);
+
+/**
+ * @brief Stores "inner angles" between star triples
+ * @details Unsensitive to first-order error in basic camera
+ * parameters (eg, wrong FOV or principal point), can be sensitive to second-order errors (eg,
+ * camera distortion, which may cause the effective FOV or principal point to be different in
+ * different parts of the image). Used for Mortari's Non-Dimensional Star-ID
+ *
+ * Each triple is stored as four 16-bit integers: The catalog indices of the star at the smallest,
+ * middle, and largest inner angle, in that order, followed by the middle inner angle quantized
+ * with TripleInnerKVectorDatabase::kMiddleAngleScale. The kvector is built on the smallest inner
+ * angle. Only triples where every pair of stars is between MinDistance() and MaxDistance() apart
+ * are stored, which is what keeps the database from growing with the cube of the catalog size.
+ */
+class TripleInnerKVectorDatabase {
+public:
+    explicit TripleInnerKVectorDatabase(DeserializeContext *des);
+
+    const int16_t *FindTriplesLiberal(decimal min, decimal max, const int16_t **end) const;
+
+    /// Lower bound on the distance between any two stars of a stored triple
+    decimal MinDistance() const { return minDistance; };
+    /// Upper bound on the distance between any two stars of a stored triple
+    decimal MaxDistance() const { return maxDistance; };
+    /// Triples whose smallest inner angle is less than this are not stored
+    decimal MinInnerAngle() const { return index.Min(); };
+    /// Exact number of stored triples
+    long NumTriples() const { return index.NumValues(); };
+
+    /// Convert the fourth field of a stored triple back into the middle inner angle (radians)
+    static decimal MiddleAngle(const int16_t *triple) {
+        return (uint16_t)triple[3] / kMiddleAngleScale;
+    };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x4f1e37d6
+    /// Quantization of the middle inner angle; 65535 / (pi/2)
+    static const decimal kMiddleAngleScale;
+private:
+    decimal minDistance;
+    decimal maxDistance;
+    KVectorIndex index;
+    const int16_t *triples;
+};
+
+/// Number of 64-bit words in a grid pattern with gridSize*gridSize cells
+inline int GridPatternWords(int gridSize) {
+    return (gridSize*gridSize + 63) / 64;
+}
+
+bool GridPattern(const Vec3 &center, const Vec3 *neighbors, long numNeighbors,
+                 int gridSize, decimal patternRadius, decimal bufferRadius, int orientation,
+                 uint64_t *pattern, Vec3 *xAxisOut = NULL, Vec3 *yAxisOut = NULL);
+
+void SerializeGrid(SerializeContext *, const Catalog &,
+                   int gridSize, decimal patternRadius, decimal bufferRadius);
+
+/**
+ * Stores a bit pattern for every catalog star describing where its neighbors are, for the grid
+ * algorithm (Padgett and Kreutz-Delgado, 1997). See GridPattern for how patterns are made.
+ *
+ * Patterns are packed bitsets, so comparing two of them is a few ANDs and popcounts. To avoid
+ * comparing against the whole catalog, there's also an inverted index listing, for each cell of the
+ * grid, the catalog stars whose pattern has that cell set.
+ */
+class GridDatabase {
+public:
+    explicit GridDatabase(DeserializeContext *des);
+
+    /// Patterns are gridSize cells on a side
+    int GridSize() const { return gridSize; };
+    /// Neighbors further than this (radians) are not in the pattern
+    decimal PatternRadius() const { return patternRadius; };
+    /// Neighbors closer than this (radians) are not in the pattern, nor used to orient it
+    decimal BufferRadius() const { return bufferRadius; };
+    /// Number of catalog stars, each of which has a pattern (possibly empty)
+    long NumStars() const { return numStars; };
+    /// Number of 64-bit words in each pattern
+    int NumWords() const { return numWords; };
+
+    /// The pattern of the given catalog star, NumWords() words long
+    const uint64_t *Pattern(int16_t catalogIndex) const { return patterns + (long)catalogIndex*numWords; };
+    const int16_t *StarsWithCell(int cell, const int16_t **end) const;
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x6a1d3c57
+private:
+    int gridSize;
+    decimal patternRadius;
+    decimal bufferRadius;
+    long numStars;
+    int numWords;
+    const uint64_t *patterns;
+    const int32_t *cellOffsets;
+    const int16_t *cellStars;
+};
+
+void SerializeTriangles(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance);
+
+/**
+ * Stores every triangle of catalog stars whose sides are all between MinDistance() and
+ * MaxDistance(), keyed on its side lengths sorted from shortest to longest.
+ *
+ * The triangles are laid out as an implicit kd-tree: the middle triangle of the array splits the
+ * rest on the shortest side, the middle of each half splits that half on the middle side, and so on,
+ * down to small leaves which are scanned in full. Nothing but the triangles themselves is stored,
+ * and one box query on all three sides finds the matching triangles directly, rather than
+ * intersecting the results of a query per side.
+ *
+ * Each triangle is stored as three side lengths (radians, ascending) and the catalog indices of
+ * the stars opposite each side, in the same order.
+ */
+class TriangleDatabase {
+public:
+    explicit TriangleDatabase(DeserializeContext *des);
+
+    void FindTriangles(const decimal *minSides, const decimal *maxSides, std::vector<long> *result) const;
+
+    /// The side lengths of a stored triangle, shortest first
+    const decimal *Sides(long triangle) const { return sides + triangle*3; };
+    /// The catalog indices of the stars opposite each of Sides()
+    const int16_t *Stars(long triangle) const { return stars + triangle*3; };
+
+    /// Lower bound on the sides of a stored triangle
+    decimal MinDistance() const { return minDistance; };
+    /// Upper bound on the sides of a stored triangle
+    decimal MaxDistance() const { return maxDistance; };
+    /// Exact number of stored triangles
+    long NumTriangles() const { return numTriangles; };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x3b92e4a1
+private:
+    void FindTriangles(long begin, long end, int axis,
+                       const decimal *minSides, const decimal *maxSides, std::vector<long> *result) const;
+
+    decimal minDistance;
+    decimal maxDistance;
+    long numTriangles;
+    const decimal *sides;
+    const int16_t *stars;
+};
+
+void SerializeNeighbors(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance);
+
+/**
+ * For each catalog star, every other catalog star between MinDistance() and MaxDistance() from it,
+ * in ascending order of distance.
+ *
+ * Stored like a sparse matrix in compressed rows: an offset per catalog star into one array of
+ * neighbor indices, and a parallel array of their distances, as versines (see PairVersine) in
+ * single precision. Finding the neighbors of one star in a range of distances is a binary search
+ * over its own short list, where the pair databases would return the pairs of every star in that
+ * range. Each pair is stored twice, once for each star.
+ */
+class NeighborDatabase {
+public:
+    explicit NeighborDatabase(DeserializeContext *des);
+
+    const int16_t *Neighbors(int16_t star, decimal min, decimal max, const int16_t **end) const;
+    /// Every neighbor of the star, nearest first
+    const int16_t *AllNeighbors(int16_t star, const int16_t **end) const {
+        *end = neighbors + offsets[star+1];
+        return neighbors + offsets[star];
+    };
+    /// Versine of the distance to each of AllNeighbors(star)
+    const float *Versines(int16_t star) const { return versines + offsets[star]; };
+
+    /// Lower bound on the distance between a star and its neighbors
+    decimal MinDistance() const { return minDistance; };
+    /// Upper bound on the distance between a star and its neighbors
+    decimal MaxDistance() const { return maxDistance; };
+    /// Number of catalog stars, each of which has a (possibly empty) list of neighbors
+    long NumStars() const { return numStars; };
+    /// Total length of all the lists, ie twice the number of pairs
+    long NumNeighbors() const { return offsets[numStars]; };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x1e8b52c9
+private:
+    decimal minDistance;
+    decimal maxDistance;
+    long numStars;
+    const int32_t *offsets;
+    const int16_t *neighbors;
+    const float *versines;
+};
+
+/// The most cells per side of a SkyCellPairDatabase, whose 6*73^2 cells are as many as an int16_t can number
+const int kMaxSkyCellsPerSide = 73;
+
+void SerializeSkyCellPairs(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance,
+                           int cellsPerSide, long numBinsPerCell, int numThreads = 1);
+
+/**
+ * The pairs of a PairDistanceKVectorDatabase, partitioned by where they are in the sky, for when
+ * the attitude is roughly known already (eg while tracking, or with a sky cone from another sensor)
+ * and only the pairs in a small part of the sky matter. Pairs ordered only by distance are
+ * scattered all over the database, but here the pairs near a boresight are in a few contiguous
+ * blocks, so a memory mapped database only needs those few pages in memory.
+ *
+ * The sky is divided into cells by projecting each face of a cube onto the sphere and dividing it
+ * into CellsPerSide() by CellsPerSide() cells of equal angle, so all the cells are about the same
+ * size. Each pair belongs to the cell of its first star, and each cell has its own kvector of its
+ * pairs by distance. There's also a table of which cells touch each other, which CellsNear walks.
+ */
+class SkyCellPairDatabase {
+public:
+    explicit SkyCellPairDatabase(DeserializeContext *des);
+
+    int CellOf(const Vec3 &spatial) const;
+    void CellsNear(const Vec3 &center, decimal radius, std::vector<int> *cells) const;
+    /// The cells which share an edge or a corner with a cell
+    const int16_t *AdjacentCells(int cell, const int16_t **end) const {
+        *end = adjacency + adjacencyOffsets[cell+1];
+        return adjacency + adjacencyOffsets[cell];
+    };
+    const int16_t *FindPairsLiberal(int cell, decimal min, decimal max, const int16_t **end) const;
+
+    int CellsPerSide() const { return cellsPerSide; };
+    int NumCells() const { return 6*cellsPerSide*cellsPerSide; };
+    /// Unit vector to the middle of a cell
+    Vec3 CellCenter(int cell) const { return centers[cell]; };
+    /// Angle (radians) from the middle of a cell to its furthest corner
+    decimal CellRadius(int cell) const { return radii[cell]; };
+    /// Number of pairs whose first star is in a cell
+    long NumPairs(int cell) const { return cells[cell].index.NumValues(); };
+    /// Width of a bin of each cell's kvector (radians), which is as far past either end of a query as liberal results may go
+    decimal BinWidth() const { return (maxDistance - minDistance) / cells[0].index.NumBins(); };
+    /// Upper bound on stored star pair distances
+    decimal MaxDistance() const { return maxDistance; };
+    /// Lower bound on stored star pair distances
+    decimal MinDistance() const { return minDistance; };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x48c3e0a6
+private:
+    struct Cell {
+        KVectorIndex index;
+        const int16_t *pairs;
+    };
+
+    int cellsPerSide;
+    decimal minDistance;
+    decimal maxDistance;
+    std::vector<Vec3> centers;
+    std::vector<decimal> radii;
+    const int32_t *adjacencyOffsets;
+    const int16_t *adjacency;
+    std::vector<Cell> cells;
+};
+
+decimal SkyCellPairsOverfetch(const SkyCellPairDatabase &, const Catalog &, decimal tolerance);
+
+/// First four bytes of a MultiDatabase with a table of contents. Older ones start with the magic
+/// value of their first sub-database instead, which is never this.
+const int32_t kMultiDatabaseMagicValue = 0x4C4F5354;
+/// The newest MultiDatabase format this build reads, and the one it writes
+const uint32_t kMultiDatabaseVersion = 1;
 
 /**
  * A database that contains multiple databases
@@ -104,10 +590,25 @@ private:
 class MultiDatabase {
 public:
     /// Create a multidatabase from a serialized multidatabase.
-    explicit MultiDatabase(const unsigned char *buffer) : buffer(buffer) { };
+    explicit MultiDatabase(const unsigned char *buffer);
     const unsigned char *SubDatabasePointer(int32_t magicValue) const;
+    bool VerifyChecksums() const;
+    /// Format version of the serialized multidatabase; 0 for one from before there was a version
+    uint32_t Version() const { return version; };
+
 private:
+    /// One sub-database, as found in the table of contents
+    struct Entry {
+        int32_t magicValue;
+        uint32_t flags;
+        const unsigned char *pointer;
+        uint64_t length;
+        uint32_t checksum;
+    };
+
     const unsigned char *buffer;
+    uint32_t version;
+    std::vector<Entry> entries;
 };
 
 class MultiDatabaseEntry {
@@ -122,8 +623,94 @@ public:
 
 typedef std::vector<MultiDatabaseEntry> MultiDatabaseDescriptor;
 
+/**
+ * A MultiDatabase with its catalog and sub-databases already located and deserialized.
+ * Finding and deserializing sub-databases is cheap compared to star-id, but not when done once per
+ * frame over a large batch of frames. Create one of these per database and pass it to
+ * StarIdAlgorithm::Go instead. Sub-databases which are not present in the MultiDatabase are NULL.
+ *
+ * The buffer passed to the constructor must outlive the PreparedDatabase, because the
+ * sub-databases point into it. A NULL buffer gives a PreparedDatabase with nothing in it.
+ */
+class PreparedDatabase {
+public:
+    /**
+     * @param buffer A serialized MultiDatabase
+     * @param deserializeCatalog Whether to deserialize the catalog. Star-id algorithms take the
+     * catalog as a separate argument, so there's no need to if the caller has one already.
+     */
+    explicit PreparedDatabase(const unsigned char *buffer, bool deserializeCatalog = true);
+
+    /// The raw MultiDatabase
+    const unsigned char *Buffer() const { return buffer; };
+    /// Whether the MultiDatabase included a catalog (and it was deserialized)
+    bool HasCatalog() const { return hasCatalog; };
+    /// Whether the catalog includes magnitudes. If not, every star has the same placeholder magnitude
+    bool HasCatalogMagnitudes() const { return hasCatalogMagnitudes; };
+    /// The catalog stored in the MultiDatabase. Empty unless HasCatalog()
+    const Catalog &GetCatalog() const { return catalog; };
+
+    const PairDistanceKVectorDatabase *PairDistanceKVector() const { return pairDistanceKVector.get(); };
+    const PairRecordKVectorDatabase *PairRecordKVector() const { return pairRecordKVector.get(); };
+    const PairCosineKVectorDatabase *PairCosineKVector() const { return pairCosineKVector.get(); };
+    const CompressedPairKVectorDatabase *CompressedPairKVector() const { return compressedPairKVector.get(); };
+    const SkyCellPairDatabase *SkyCellPairs() const { return skyCellPairs.get(); };
+    const TripleInnerKVectorDatabase *TripleInnerKVector() const { return tripleInnerKVector.get(); };
+    const GridDatabase *Grid() const { return grid.get(); };
+    const TriangleDatabase *Triangles() const { return triangles.get(); };
+    const NeighborDatabase *Neighbors() const { return neighbors.get(); };
+private:
+    const unsigned char *buffer;
+    bool hasCatalog;
+    bool hasCatalogMagnitudes;
+    Catalog catalog;
+    std::unique_ptr<PairDistanceKVectorDatabase> pairDistanceKVector;
+    std::unique_ptr<PairRecordKVectorDatabase> pairRecordKVector;
+    std::unique_ptr<PairCosineKVectorDatabase> pairCosineKVector;
+    std::unique_ptr<CompressedPairKVectorDatabase> compressedPairKVector;
+    std::unique_ptr<SkyCellPairDatabase> skyCellPairs;
+    std::unique_ptr<TripleInnerKVectorDatabase> tripleInnerKVector;
+    std::unique_ptr<GridDatabase> grid;
+    std::unique_ptr<TriangleDatabase> triangles;
+    std::unique_ptr<NeighborDatabase> neighbors;
+};
+
 void SerializeMultiDatabase(SerializeContext *, const MultiDatabaseDescriptor &dbs, uint32_t flags);
 
+/// How MappedDatabase brings a database file into memory.
+struct DatabaseMapOptions {
+    /// Read the whole file in while mapping it (MAP_POPULATE), so that the first frames don't stall
+    /// on page faults. Startup then takes as long as reading the file, unless it's already cached.
+    bool populate = false;
+    /// Align the mapping to a huge page boundary and ask for transparent huge pages, so that random
+    /// lookups in a big database miss the TLB less. Only a hint; whether the kernel backs a file
+    /// mapping with huge pages depends on its configuration and the filesystem.
+    bool hugePages = false;
+};
+
+/**
+ * A database file mapped read-only and shared into memory, for use as a PreparedDatabase's buffer.
+ * Opening takes about the same time whatever the size of the file, since pages are only read in when
+ * star-id first touches them, and every process that maps the same file shares one copy of it in
+ * the page cache.
+ */
+class MappedDatabase {
+public:
+    MappedDatabase(const std::string &path, const DatabaseMapOptions &);
+    ~MappedDatabase();
+    MappedDatabase(const MappedDatabase &) = delete;
+    MappedDatabase &operator=(const MappedDatabase &) = delete;
+
+    /// The mapped file. Valid as long as this MappedDatabase is.
+    const unsigned char *Buffer() const { return buffer; };
+    /// Length of the file in bytes
+    long Size() const { return size; };
+
+private:
+    unsigned char *buffer;
+    long size;
+};
+
 }
 
 #endif
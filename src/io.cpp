@@ -24,6 +24,7 @@
 #include "attitude-estimators.hpp"
 #include "attitude-utils.hpp"
 #include "databases.hpp"
+#include "logging.hpp"
 #include "decimal.hpp"
 #include "star-id.hpp"
 #include "star-utils.hpp"
@@ -296,6 +297,9 @@ typedef StarIdAlgorithm *(*StarIdAlgorithmFactory)();
 
 typedef AttitudeEstimationAlgorithm *(*AttitudeEstimationAlgorithmFactory)();
 
+/// Tolerance (degrees) that kvector overfetch is reported for, unless --kvector-tolerance is given; the default --angular-tolerance
+static const decimal kDefaultKVectorTolerance = DECIMAL(0.04);
+
 SerializeContext serFromDbValues(const DatabaseOptions &values) {
     return SerializeContext(values.swapIntegerEndianness, values.swapDecimalEndianness);
 }
@@ -304,18 +308,140 @@ MultiDatabaseDescriptor GenerateDatabases(const Catalog &catalog, const Database
     MultiDatabaseDescriptor dbEntries;
 
     SerializeContext catalogSer = serFromDbValues(values);
-    // TODO decide why we have this inclMagnitude and inclName and if we should change that
-    SerializeCatalog(&catalogSer, catalog, false, true);
+    // magnitudes too, which the photometric filter fits centroid brightness against
+    SerializeCatalog(&catalogSer, catalog, true, true);
     dbEntries.emplace_back(kCatalogMagicValue, catalogSer.buffer);
 
+    // how many bins the pair kvectors need for queries of the expected tolerance to be selective,
+    // unless told exactly
+    long kvectorNumBins = values.kvectorNumDistanceBins;
+    decimal kvectorTolerance = DegToRad(values.kvectorTolerance > 0 ? values.kvectorTolerance : kDefaultKVectorTolerance);
+    if (values.kvectorTolerance > 0) {
+        kvectorNumBins = KVectorBinsForTolerance(DegToRad(values.kvectorMinDistance), DegToRad(values.kvectorMaxDistance),
+                                                 kvectorTolerance, values.kvectorOverfetch);
+        LOST_LOG_INFO("Using %ld kvector distance bins for a tolerance of %f degrees", kvectorNumBins, (double)values.kvectorTolerance);
+    }
+
     if (values.kvector) {
         decimal minDistance = DegToRad(values.kvectorMinDistance);
         decimal maxDistance = DegToRad(values.kvectorMaxDistance);
-        long numBins = values.kvectorNumDistanceBins;
+        long numBins = kvectorNumBins;
         SerializeContext ser = serFromDbValues(values);
-        SerializePairDistanceKVector(&ser, catalog, minDistance, maxDistance, numBins);
+        SerializePairDistanceKVector(&ser, catalog, minDistance, maxDistance, numBins, values.threads);
+        DeserializeContext des(ser.buffer.data());
+        PairDistanceKVectorDatabase db(&des);
+        LOST_LOG_INFO("Pair distance kvector has %ld pairs in %ld bytes; queries of +-%f degrees return %.1f%% extra pairs",
+                      db.NumPairs(), (long)ser.buffer.size(), (double)RadToDeg(kvectorTolerance),
+                      (double)(100 * PairDistanceKVectorOverfetch(db, catalog, kvectorTolerance)));
         dbEntries.emplace_back(PairDistanceKVectorDatabase::kMagicValue, ser.buffer);
-    } else {
+    }
+
+    if (values.pairRecords) {
+        decimal minDistance = DegToRad(values.kvectorMinDistance);
+        decimal maxDistance = DegToRad(values.kvectorMaxDistance);
+        long numBins = kvectorNumBins;
+        SerializeContext ser = serFromDbValues(values);
+        SerializePairRecordKVector(&ser, catalog, minDistance, maxDistance, numBins, values.threads);
+        dbEntries.emplace_back(PairRecordKVectorDatabase::kMagicValue, ser.buffer);
+    }
+
+    if (values.pairCosines) {
+        decimal minDistance = DegToRad(values.kvectorMinDistance);
+        decimal maxDistance = DegToRad(values.kvectorMaxDistance);
+        // bins of versine are much wider in angle at small distances, so the same number of bins as
+        // the pair kvector would return far more extra pairs there
+        long numBins = PairCosineKVectorBinsForTolerance(minDistance, maxDistance, kvectorTolerance, values.kvectorOverfetch);
+        SerializeContext ser = serFromDbValues(values);
+        SerializePairCosineKVector(&ser, catalog, minDistance, maxDistance, numBins, values.threads);
+        DeserializeContext des(ser.buffer.data());
+        PairCosineKVectorDatabase db(&des);
+        LOST_LOG_INFO("Pair cosine kvector has %ld pairs and %ld bins in %ld bytes; queries of +-%f degrees return %.1f%% extra pairs",
+                      db.NumPairs(), numBins, (long)ser.buffer.size(), (double)RadToDeg(kvectorTolerance),
+                      (double)(100 * PairCosineKVectorOverfetch(db, catalog, kvectorTolerance)));
+        dbEntries.emplace_back(PairCosineKVectorDatabase::kMagicValue, ser.buffer);
+    }
+
+    if (values.compressedPairs) {
+        decimal minDistance = DegToRad(values.kvectorMinDistance);
+        decimal maxDistance = DegToRad(values.kvectorMaxDistance);
+        long numBins = kvectorNumBins;
+        SerializeContext ser = serFromDbValues(values);
+        SerializeCompressedPairKVector(&ser, catalog, minDistance, maxDistance, numBins, values.threads);
+        DeserializeContext des(ser.buffer.data());
+        CompressedPairKVectorDatabase db(&des);
+        // the uncompressed database takes 4 bytes per pair
+        LOST_LOG_INFO("Compressed pair kvector has %ld pairs in %ld bytes; %.2f bytes per pair instead of %d",
+                      db.NumPairs(), (long)ser.buffer.size(),
+                      db.NumPairs() > 0 ? (double)db.NumPairBytes() / db.NumPairs() : 0.0, (int)(2*sizeof(int16_t)));
+        dbEntries.emplace_back(CompressedPairKVectorDatabase::kMagicValue, ser.buffer);
+    }
+
+    if (values.tripleKvector) {
+        decimal minDistance = DegToRad(values.tripleKvectorMinDistance);
+        decimal maxDistance = DegToRad(values.tripleKvectorMaxDistance);
+        decimal minInnerAngle = DegToRad(values.tripleKvectorMinInnerAngle);
+        long numBins = values.tripleKvectorNumBins;
+        SerializeContext ser = serFromDbValues(values);
+        SerializeTripleInnerKVector(&ser, catalog, minDistance, maxDistance, minInnerAngle, numBins);
+        dbEntries.emplace_back(TripleInnerKVectorDatabase::kMagicValue, ser.buffer);
+    }
+
+    if (values.grid) {
+        decimal patternRadius = DegToRad(values.gridPatternRadius);
+        decimal bufferRadius = DegToRad(values.gridBufferRadius);
+        SerializeContext ser = serFromDbValues(values);
+        SerializeGrid(&ser, catalog, values.gridSize, patternRadius, bufferRadius);
+        dbEntries.emplace_back(GridDatabase::kMagicValue, ser.buffer);
+    }
+
+    if (values.triangles) {
+        decimal minDistance = DegToRad(values.trianglesMinDistance);
+        decimal maxDistance = DegToRad(values.trianglesMaxDistance);
+        SerializeContext ser = serFromDbValues(values);
+        std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+        SerializeTriangles(&ser, catalog, minDistance, maxDistance);
+        std::chrono::time_point<std::chrono::steady_clock> end = std::chrono::steady_clock::now();
+        // the triangle count grows quickly with the max distance, so say how big it got
+        DeserializeContext des(ser.buffer.data());
+        LOST_LOG_INFO("Triangle database has %ld triangles in %ld bytes, built in %.1f ms",
+                      TriangleDatabase(&des).NumTriangles(), (long)ser.buffer.size(),
+                      std::chrono::duration<double, std::milli>(end - start).count());
+        dbEntries.emplace_back(TriangleDatabase::kMagicValue, ser.buffer);
+    }
+
+    if (values.neighbors) {
+        decimal minDistance = DegToRad(values.neighborsMinDistance);
+        decimal maxDistance = DegToRad(values.neighborsMaxDistance);
+        SerializeContext ser = serFromDbValues(values);
+        SerializeNeighbors(&ser, catalog, minDistance, maxDistance);
+        DeserializeContext des(ser.buffer.data());
+        LOST_LOG_INFO("Neighbor database has %ld neighbors in %ld bytes",
+                      NeighborDatabase(&des).NumNeighbors(), (long)ser.buffer.size());
+        dbEntries.emplace_back(NeighborDatabase::kMagicValue, ser.buffer);
+    }
+
+    if (values.skyCells) {
+        if (values.skyCellsPerSide < 1 || values.skyCellsPerSide > kMaxSkyCellsPerSide) {
+            std::cerr << "ERROR: --sky-cells-per-side must be from 1 to " << kMaxSkyCellsPerSide << "." << std::endl;
+            exit(1);
+        }
+        decimal minDistance = DegToRad(values.kvectorMinDistance);
+        decimal maxDistance = DegToRad(values.kvectorMaxDistance);
+        int numCells = 6*values.skyCellsPerSide*values.skyCellsPerSide;
+        // how many extra pairs a query returns depends on how wide the bins are, not how many pairs
+        // there are, so each cell needs as many bins as a pair kvector sized for the tolerance would
+        long numBinsPerCell = KVectorBinsForTolerance(minDistance, maxDistance, kvectorTolerance, values.kvectorOverfetch);
+        SerializeContext ser = serFromDbValues(values);
+        SerializeSkyCellPairs(&ser, catalog, minDistance, maxDistance, values.skyCellsPerSide, numBinsPerCell, values.threads);
+        DeserializeContext des(ser.buffer.data());
+        SkyCellPairDatabase db(&des);
+        LOST_LOG_INFO("Sky cell pair database has %d cells of %ld bins in %ld bytes; queries of +-%f degrees return %.1f%% extra pairs",
+                      numCells, numBinsPerCell, (long)ser.buffer.size(), (double)RadToDeg(kvectorTolerance),
+                      (double)(100 * SkyCellPairsOverfetch(db, catalog, kvectorTolerance)));
+        dbEntries.emplace_back(SkyCellPairDatabase::kMagicValue, ser.buffer);
+    }
+
+    if (dbEntries.size() == 1) {
         std::cerr << "No database builder selected -- no database generated." << std::endl;
         exit(1);
     }
@@ -407,7 +533,7 @@ PipelineInputList GetPngPipelineInput(const PipelineOptions &values) {
     std::string pngPath = values.png;
 
     cairoSurface = cairo_image_surface_create_from_png(pngPath.c_str());
-    std::cerr << "PNG Read status: " << cairo_status_to_string(cairo_surface_status(cairoSurface)) << std::endl;
+    LOST_LOG_INFO("PNG Read status: %s", cairo_status_to_string(cairo_surface_status(cairoSurface)));
     if (cairoSurface == NULL || cairo_surface_status(cairoSurface) != CAIRO_STATUS_SUCCESS) {
         exit(1);
     }
@@ -539,8 +665,8 @@ GeneratedPipelineInput::GeneratedPipelineInput(const Catalog &catalog,
     assert(oversampling >= 1);
     int oversamplingPerAxis = DECIMAL_CEIL(DECIMAL_SQRT(oversampling));
     if (oversamplingPerAxis*oversamplingPerAxis != oversampling) {
-        std::cerr << "WARNING: oversampling was not a perfect square. Rounding up to "
-                  << oversamplingPerAxis*oversamplingPerAxis << "." << std::endl;
+        LOST_LOG_WARNING("oversampling was not a perfect square. Rounding up to %d.",
+                         oversamplingPerAxis*oversamplingPerAxis);
     }
     assert(exposureTime > 0);
     bool motionBlurEnabled = abs(motionBlurDirection.GetQuaternion().Angle()) > DECIMAL(0.001);
@@ -874,10 +1000,47 @@ Pipeline::Pipeline(CentroidAlgorithm *centroidAlgorithm,
     }
     if (database) {
         this->database = std::unique_ptr<unsigned char[]>(database);
+        this->preparedDatabase = std::unique_ptr<PreparedDatabase>(new PreparedDatabase(database));
     }
 }
 
 
+/// Construct the star-id algorithm called \p name (eg, "py"), or return NULL if there isn't one.
+static StarIdAlgorithm *MakeStarIdAlgorithm(const std::string &name, const PipelineOptions &values) {
+    if (name == "dummy") {
+        return new DummyStarIdAlgorithm();
+    } else if (name == "gv") {
+        return new GeometricVotingStarIdAlgorithm(DegToRad(values.angularTolerance));
+    } else if (name == "py") {
+        PyramidVerification verification;
+        if (values.pyramidVerification == "none") {
+            verification = PyramidVerification::kNone;
+        } else if (values.pyramidVerification == "reproject") {
+            verification = PyramidVerification::kReproject;
+        } else if (values.pyramidVerification == "reproject-only") {
+            verification = PyramidVerification::kReprojectOnly;
+        } else {
+            std::cout << "Illegal pyramid verification." << std::endl;
+            exit(1);
+        }
+        return new PyramidStarIdAlgorithm(DegToRad(values.angularTolerance), values.estimatedNumFalseStars, values.maxMismatchProb, values.starIdCutoff, values.pyramidRankedStars, verification);
+    } else if (name == "nd") {
+        return new NonDimensionalStarIdAlgorithm(DegToRad(values.angularTolerance), values.focalLengthTolerance, values.starIdCutoff);
+    } else if (name == "triangle") {
+        return new TriangleStarIdAlgorithm(DegToRad(values.angularTolerance), values.estimatedNumFalseStars, values.maxMismatchProb, values.starIdCutoff);
+    } else if (name == "grid") {
+        return new GridStarIdAlgorithm(DegToRad(values.angularTolerance), values.gridMinMatches);
+    }
+    return NULL;
+}
+
+/// How many identified stars the photometric model needs before it starts ruling out candidates
+static const int kPhotometricMinSamples = 20;
+/// Identifications less likely than this to be correct aren't used to fit the photometric model
+static const decimal kPhotometricMinConfidence = DECIMAL(0.99);
+/// Identifications less likely than this to be correct aren't tracked into the next frame
+static const decimal kTrackMinConfidence = DECIMAL(0.99);
+
 /// Create a pipeline from command line options.
 Pipeline SetPipeline(const PipelineOptions &values) {
     Pipeline result;
@@ -905,30 +1068,85 @@ Pipeline SetPipeline(const PipelineOptions &values) {
 
     // database stage
     if (values.databasePath != "") {
-        std::fstream fs;
-        fs.open(values.databasePath, std::fstream::in | std::fstream::binary);
-        fs.seekg(0, fs.end);
-        long length = fs.tellg();
-        fs.seekg(0, fs.beg);
-        if (fs.fail()) {
-            std::cerr << "Error reading database! " << strerror(errno) << std::endl;
+        // mapped rather than read, so that processes sharing a database share its pages too
+        DatabaseMapOptions mapOptions;
+        mapOptions.populate = values.databasePopulate;
+        mapOptions.hugePages = values.databaseHugePages;
+        std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+        result.mappedDatabase = std::unique_ptr<MappedDatabase>(new MappedDatabase(values.databasePath, mapOptions));
+        if (values.databaseVerify && !MultiDatabase(result.mappedDatabase->Buffer()).VerifyChecksums()) {
+            std::cerr << "Database is corrupt! A sub-database doesn't match its checksum." << std::endl;
             exit(1);
         }
-        std::cerr << "Reading " << length << " bytes of database" << std::endl;
-        result.database = std::unique_ptr<unsigned char[]>(new unsigned char[length]);
-        fs.read((char *)result.database.get(), length);
-        std::cerr << "Done" << std::endl;
-    }
-
-    if (values.idAlgo == "dummy") {
-        result.starIdAlgorithm = std::unique_ptr<StarIdAlgorithm>(new DummyStarIdAlgorithm());
-    } else if (values.idAlgo == "gv") {
-        result.starIdAlgorithm = std::unique_ptr<StarIdAlgorithm>(new GeometricVotingStarIdAlgorithm(DegToRad(values.angularTolerance)));
-    } else if (values.idAlgo == "py") {
-        result.starIdAlgorithm = std::unique_ptr<StarIdAlgorithm>(new PyramidStarIdAlgorithm(DegToRad(values.angularTolerance), values.estimatedNumFalseStars, values.maxMismatchProb, 1000));
+        result.preparedDatabase = std::unique_ptr<PreparedDatabase>(
+            new PreparedDatabase(result.mappedDatabase->Buffer()));
+        std::chrono::time_point<std::chrono::steady_clock> end = std::chrono::steady_clock::now();
+        LOST_LOG_INFO("Mapped %ld bytes of database in %.1f ms", result.mappedDatabase->Size(),
+                      std::chrono::duration<double, std::milli>(end - start).count());
+    }
+
+    const std::string portfolioPrefix = "portfolio:";
+    if (values.idAlgo.compare(0, portfolioPrefix.size(), portfolioPrefix) == 0) {
+        std::vector<std::unique_ptr<StarIdAlgorithm>> algorithms;
+        std::vector<std::string> names;
+        std::stringstream namesStream(values.idAlgo.substr(portfolioPrefix.size()));
+        std::string name;
+        while (std::getline(namesStream, name, ',')) {
+            StarIdAlgorithm *algorithm = MakeStarIdAlgorithm(name, values);
+            if (algorithm == NULL) {
+                std::cout << "Illegal id algorithm in portfolio: " << name << std::endl;
+                exit(1);
+            }
+            algorithms.emplace_back(algorithm);
+            names.push_back(name);
+        }
+        if (algorithms.empty()) {
+            std::cout << "Portfolio needs at least one id algorithm, eg portfolio:py,gv" << std::endl;
+            exit(1);
+        }
+        // each centroid gets the angular tolerance, plus some slack for the error in the attitude
+        result.starIdAlgorithm = std::unique_ptr<StarIdAlgorithm>(new PortfolioStarIdAlgorithm(
+            std::move(algorithms), names, 2*DegToRad(values.angularTolerance), 4));
     } else if (values.idAlgo != "") {
-        std::cout << "Illegal id algorithm." << std::endl;
-        exit(1);
+        result.starIdAlgorithm = std::unique_ptr<StarIdAlgorithm>(MakeStarIdAlgorithm(values.idAlgo, values));
+        if (!result.starIdAlgorithm) {
+            std::cout << "Illegal id algorithm." << std::endl;
+            exit(1);
+        }
+    }
+
+    result.starIdDeadlineMs = values.starIdDeadlineMs;
+    if (values.skyConeRadius > 0) {
+        result.skyConeRadius = DegToRad(values.skyConeRadius);
+        result.skyConeCenter = SphericalToSpatial(DegToRad(values.skyConeRa), DegToRad(values.skyConeDe));
+    }
+    result.centroidBrightnessNoise = values.centroidNoise;
+    result.centroidMinUncertainty = values.centroidMinUncertainty;
+
+    if (values.photometricFilter != "none") {
+        PhotometricScale scale;
+        if (values.photometricFilter == "linear") {
+            scale = PhotometricScale::kLinear;
+        } else if (values.photometricFilter == "log") {
+            scale = PhotometricScale::kLogarithmic;
+        } else {
+            std::cout << "Illegal photometric filter." << std::endl;
+            exit(1);
+        }
+        // otherwise every catalog star has the same placeholder magnitude and the model never fits
+        if (result.preparedDatabase && result.preparedDatabase->HasCatalog()
+            && !result.preparedDatabase->HasCatalogMagnitudes()) {
+            std::cerr << "ERROR: The photometric filter needs catalog magnitudes, but the database's catalog doesn't include them. Regenerate the database." << std::endl;
+            exit(1);
+        }
+        // catalog magnitudes are in hundredths
+        result.photometricModel = std::unique_ptr<PhotometricModel>(
+            new PhotometricModel(scale, values.photometricBand * 100, kPhotometricMinSamples));
+    }
+
+    if (values.track) {
+        result.tracker = std::unique_ptr<Tracker>(
+            new Tracker(values.trackRadius, values.trackMinFraction, values.trackMinStars));
     }
 
     if (values.attitudeAlgo == "dqm") {
@@ -962,14 +1180,11 @@ PipelineOutput Pipeline::Go(const PipelineInput &input) {
     const StarIdentifiers *inputStarIds = input.InputStarIds();
 
     // if database is provided, that's where we get catalog from.
-    if (database) {
-        MultiDatabase multiDatabase(database.get());
-        const unsigned char *catalogBuffer = multiDatabase.SubDatabasePointer(kCatalogMagicValue);
-        if (catalogBuffer != NULL) {
-            DeserializeContext des(catalogBuffer);
-            result.catalog = DeserializeCatalog(&des, NULL, NULL);
+    if (preparedDatabase) {
+        if (preparedDatabase->HasCatalog()) {
+            result.catalog = preparedDatabase->GetCatalog();
         } else {
-            std::cerr << "WARNING: That database does not include a catalog. Proceeding with the full catalog." << std::endl;
+            LOST_LOG_WARNING("That database does not include a catalog. Proceeding with the full catalog.");
             result.catalog = input.GetCatalog();
         }
     } else {
@@ -978,7 +1193,7 @@ PipelineOutput Pipeline::Go(const PipelineInput &input) {
 
     if (centroidAlgorithm && inputImage) {
 
-        std::cout << "Running centroiding algorithm..." << std::endl;
+        LOST_LOG_INFO("Running centroiding algorithm...");
 
         // run centroiding, keeping track of the time it takes
         std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
@@ -1020,19 +1235,74 @@ PipelineOutput Pipeline::Go(const PipelineInput &input) {
         std::cerr << "ERROR: Centroid algorithm specified, but no input image to run it on." << std::endl;
         exit(1);
     } else {
-        std::cout << "Issue found..." << std::endl;
+        LOST_LOG_DEBUG("No centroid algorithm, using input centroids.");
     }
 
-    if (starIdAlgorithm && database && inputStars && input.InputCamera()) {
+    if (starIdAlgorithm && preparedDatabase && inputStars && input.InputCamera()) {
         // TODO: don't copy the vector!
         std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
 
-        result.starIds = std::unique_ptr<StarIdentifiers>(new std::vector<StarIdentifier>(
-            starIdAlgorithm->Go(database.get(), *inputStars, result.catalog, *input.InputCamera())));
+        StarIdConstraints constraints;
+        if (starIdDeadlineMs > 0) {
+            constraints.deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<decimal, std::milli>(starIdDeadlineMs));
+        }
+        // built per frame, since the prior would usually come from another sensor along with the image
+        std::unique_ptr<CatalogMask> allowedStars;
+        if (skyConeRadius > 0) {
+            allowedStars = std::unique_ptr<CatalogMask>(new CatalogMask(
+                SkyConeMask(result.catalog, *input.InputCamera(), skyConeCenter, skyConeRadius)));
+            constraints.allowedStars = allowedStars.get();
+            constraints.skyConeCenter = skyConeCenter;
+            constraints.skyConeRadius = SkyConeStarRadius(*input.InputCamera(), skyConeRadius);
+            LOST_LOG_DEBUG("Sky cone allows %ld of %ld catalog stars.",
+                           allowedStars->Count(), allowedStars->NumStars());
+        }
+        constraints.photometry = photometricModel.get();
+        std::vector<Vec2> uncertainties;
+        if (centroidBrightnessNoise > 0) {
+            uncertainties = CentroidUncertainties(*inputStars, centroidBrightnessNoise, centroidMinUncertainty);
+            constraints.centroidUncertainties = &uncertainties;
+        }
+        StarIdentifiers tracked;
+        if (tracker && tracker->Track(*inputStars, *input.InputCamera(), &tracked)) {
+            result.starIds = std::unique_ptr<StarIdentifiers>(new StarIdentifiers(std::move(tracked)));
+            result.starIdsTracked = true;
+            // the tracker has no error model
+            result.starIdProgress.confidence = 1;
+            LOST_LOG_DEBUG("Tracked %d stars (quality %f).", (int)result.starIds->size(), (double)tracker->Quality());
+        } else {
+            if (tracker && tracker->HasFrame()) {
+                LOST_LOG_INFO("Lost track (quality %f), running star-id.", (double)tracker->Quality());
+            }
+            result.starIds = std::unique_ptr<StarIdentifiers>(new std::vector<StarIdentifier>(
+                starIdAlgorithm->Go(*preparedDatabase, *inputStars, result.catalog, *input.InputCamera(),
+                                    constraints, &result.starIdProgress)));
+        }
+
+        // tracking errors would compound from frame to frame, so only carry sure identifications forward
+        if (tracker) {
+            if (!result.starIdProgress.partial && result.starIdProgress.confidence >= kTrackMinConfidence) {
+                tracker->Update(*inputStars, *input.InputCamera(), *result.starIds);
+            } else {
+                tracker->Reset();
+            }
+        }
 
         std::chrono::time_point<std::chrono::steady_clock> end = std::chrono::steady_clock::now();
         result.starIdTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
 
+        // a wrong identification would skew the fit for every later frame, so only learn from sure ones
+        if (photometricModel
+            && !result.starIdProgress.partial
+            && result.starIdProgress.confidence >= kPhotometricMinConfidence) {
+
+            photometricModel->Add(*result.starIds, *inputStars, result.catalog);
+            LOST_LOG_DEBUG("Photometric model: %ld samples, rms %f, ready %d",
+                           photometricModel->NumSamples(), (double)photometricModel->Rms(),
+                           (int)photometricModel->Ready());
+        }
+
         inputStarIds = result.starIds.get();
     } else if (starIdAlgorithm) {
         std::cerr << "ERROR: Star ID algorithm specified but cannot run because database, centroids, or camera are missing." << std::endl;
@@ -1055,6 +1325,9 @@ PipelineOutput Pipeline::Go(const PipelineInput &input) {
         exit(1);
     }
 
+    // all the timed stages are done, so now it's safe to spend time writing out the logs
+    LogFlush();
+
     return result;
 }
 
@@ -1677,6 +1950,33 @@ static void PipelineComparatorPrintSpeed(std::ostream &os,
     }
     if (starIdTimes.size() > 0) {
         PrintTimeStats(os, "starid", starIdTimes);
+
+        int numDeadlinesReached = 0;
+        decimal coverageSum = 0;
+        long patternsTriedSum = 0;
+        for (const PipelineOutput &output : actual) {
+            numDeadlinesReached += output.starIdProgress.deadlineReached;
+            coverageSum += output.starIdProgress.Coverage();
+            patternsTriedSum += output.starIdProgress.patternsTried;
+        }
+        os << "starid_deadlines_reached " << numDeadlinesReached << std::endl;
+        os << "starid_average_coverage " << coverageSum / actual.size() << std::endl;
+        os << "starid_average_patterns_tried " << (decimal)patternsTriedSum / actual.size() << std::endl;
+    }
+    // for a portfolio, how often each algorithm won and how long it took
+    if (actual.size() > 0 && actual[0].starIdProgress.portfolio.size() > 0) {
+        for (int a = 0; a < (int)actual[0].starIdProgress.portfolio.size(); a++) {
+            const std::string &name = actual[0].starIdProgress.portfolio[a].name;
+            std::vector<long long> memberTimes;
+            int numWins = 0;
+            for (const PipelineOutput &output : actual) {
+                assert(output.starIdProgress.portfolio.size() == actual[0].starIdProgress.portfolio.size());
+                memberTimes.push_back(output.starIdProgress.portfolio[a].timeNs);
+                numWins += output.starIdProgress.portfolio[a].won;
+            }
+            PrintTimeStats(os, "starid_portfolio_" + name, memberTimes);
+            os << "starid_portfolio_" << name << "_win_rate " << (decimal)numWins / actual.size() << std::endl;
+        }
     }
     if (attitudeTimes.size() > 0) {
         PrintTimeStats(os, "attitude", attitudeTimes);
@@ -26,6 +26,7 @@
 #include "attitude-utils.hpp"
 #include "attitude-estimators.hpp"
 #include "databases.hpp"
+#include "tracker.hpp"
 
 namespace lost {
 
@@ -199,6 +200,11 @@ struct PipelineOutput {
     long long starIdTimeNs = -1;
     long long attitudeEstimationTimeNs = -1;
 
+    /// How far the star-id search got, and how confident it is in starIds
+    StarIdProgress starIdProgress;
+    /// Whether starIds were carried over from the last frame by the tracker, rather than from star-id
+    bool starIdsTracked = false;
+
     /**
      * @brief The catalog that the indices in starIds refer to
      * @todo Don't store it here
@@ -240,6 +246,11 @@ public:
     PipelineOutput Go(const PipelineInput &);
     std::vector<PipelineOutput> Go(const PipelineInputList &);
 
+    /// The tracker, eg to read its angular rate after a frame. NULL if tracking is off.
+    const Tracker *GetTracker() const { return tracker.get(); }
+    /// The photometric model fitted so far. NULL if the photometric filter is off.
+    const PhotometricModel *GetPhotometricModel() const { return photometricModel.get(); }
+
 private:
     std::unique_ptr<CentroidAlgorithm> centroidAlgorithm;
 
@@ -248,8 +259,30 @@ private:
     int centroidMinStars = 0;
 
     std::unique_ptr<StarIdAlgorithm> starIdAlgorithm;
+    /// How long star-id may take on each frame before returning its best partial result. 0 for no limit.
+    decimal starIdDeadlineMs = 0;
+    /// Coarse prior on the boresight: star-id only considers catalog stars that could be in an image
+    /// pointed within skyConeRadius (radians) of skyConeCenter. 0 for no prior.
+    decimal skyConeRadius = 0;
+    Vec3 skyConeCenter = {1, 0, 0};
+    /// Noise in Star::magnitude, from which star-id estimates each centroid's positional uncertainty
+    /// and sizes its tolerances to match (see CentroidUncertainties). 0 for one tolerance for all.
+    decimal centroidBrightnessNoise = 0;
+    /// Smallest positional uncertainty (pixels) to assume for any centroid
+    decimal centroidMinUncertainty = 0;
+    /// Fitted to each confident identification, and used to rule out photometrically absurd
+    /// candidates in later frames. NULL to not filter by magnitude.
+    std::unique_ptr<PhotometricModel> photometricModel;
+    /// Carries identifications over from the last frame, so star-id only runs when it loses track.
+    /// NULL to run star-id on every frame.
+    std::unique_ptr<Tracker> tracker;
     std::unique_ptr<AttitudeEstimationAlgorithm> attitudeEstimationAlgorithm;
+    /// The database, if it was passed in as a buffer
     std::unique_ptr<unsigned char[]> database;
+    /// The database, if it was mapped from a file
+    std::unique_ptr<MappedDatabase> mappedDatabase;
+    /// Parsed once when the database is set, rather than on every call to Go
+    std::unique_ptr<PreparedDatabase> preparedDatabase;
 };
 
 Pipeline SetPipeline(const PipelineOptions &values);
@@ -0,0 +1,132 @@
+#include "logging.hpp"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+namespace lost {
+
+/// Number of messages the ring buffer holds. Must be a power of two.
+static const size_t kLogCapacity = 1024;
+/// Longer messages are truncated
+static const size_t kLogMessageLength = 240;
+
+/**
+ * One message in the ring buffer.
+ * `sequence` tells writers and the reader whose turn it is: a writer may fill the slot for ticket t
+ * once sequence == t, and publishes it by setting sequence to t+1. The reader consumes ticket t
+ * once sequence == t+1, then hands the slot to the next lap by setting it to t+kLogCapacity.
+ */
+struct LogSlot {
+    std::atomic<size_t> sequence;
+    LogLevel level;
+    long long timeNs;
+    const char *file;
+    int line;
+    char message[kLogMessageLength];
+};
+
+struct LogRing {
+    LogRing() : writeIndex(0), readIndex(0), numDropped(0), start(std::chrono::steady_clock::now()) {
+        for (size_t i = 0; i < kLogCapacity; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    LogSlot slots[kLogCapacity];
+    std::atomic<size_t> writeIndex;
+    /// Only touched by LogFlush, under flushMutex
+    size_t readIndex;
+    std::atomic<long> numDropped;
+    std::mutex flushMutex;
+    std::chrono::steady_clock::time_point start;
+};
+
+static LogRing &GetLogRing() {
+    static LogRing ring;
+    return ring;
+}
+
+static const char *LogLevelName(LogLevel level) {
+    switch (level) {
+        case LogLevel::kError: return "ERROR";
+        case LogLevel::kWarning: return "WARNING";
+        case LogLevel::kInfo: return "INFO";
+        case LogLevel::kDebug: return "DEBUG";
+    }
+    return "?";
+}
+
+void LogWrite(LogLevel level, const char *file, int line, const char *format, ...) {
+    LogRing &ring = GetLogRing();
+
+    // claim a ticket, unless the slot it maps to hasn't been flushed since the last lap
+    size_t ticket = ring.writeIndex.load(std::memory_order_relaxed);
+    LogSlot *slot;
+    while (true) {
+        slot = &ring.slots[ticket & (kLogCapacity - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t lap = (intptr_t)sequence - (intptr_t)ticket;
+        if (lap == 0) {
+            if (ring.writeIndex.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) {
+                break;
+            }
+            // compare_exchange_weak updated `ticket` for us, try again
+        } else if (lap < 0) {
+            // full. Dropping is better than stalling the caller.
+            ring.numDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            // another writer claimed this ticket first
+            ticket = ring.writeIndex.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    slot->timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - ring.start).count();
+    slot->file = file;
+    slot->line = line;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->message, kLogMessageLength, format, args);
+    va_end(args);
+
+    slot->sequence.store(ticket + 1, std::memory_order_release);
+}
+
+void LogFlush() {
+    LogFlush(stderr);
+}
+
+void LogFlush(FILE *output) {
+    LogRing &ring = GetLogRing();
+    std::lock_guard<std::mutex> lock(ring.flushMutex);
+
+    while (true) {
+        LogSlot *slot = &ring.slots[ring.readIndex & (kLogCapacity - 1)];
+        if (slot->sequence.load(std::memory_order_acquire) != ring.readIndex + 1) {
+            // empty, or the next writer hasn't finished yet
+            break;
+        }
+        const char *fileName = strrchr(slot->file, '/');
+        fileName = fileName == NULL ? slot->file : fileName + 1;
+        fprintf(output, "[%s %.6f %s:%d] %s\n",
+                LogLevelName(slot->level), slot->timeNs / 1e9, fileName, slot->line, slot->message);
+        slot->sequence.store(ring.readIndex + kLogCapacity, std::memory_order_release);
+        ring.readIndex++;
+    }
+
+    long numDropped = ring.numDropped.exchange(0, std::memory_order_relaxed);
+    if (numDropped > 0) {
+        fprintf(output, "[WARNING] %ld log messages dropped because the log buffer was full.\n", numDropped);
+    }
+    fflush(output);
+}
+
+}
@@ -0,0 +1,95 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+/**
+ * Leveled diagnostic logging.
+ *
+ * Log messages are formatted into a fixed-size, lock-free ring buffer in memory instead of being
+ * written to the console, so logging from star-id's inner loops costs about as much as a
+ * snprintf. Nothing is written anywhere until LogFlush is called, which should be done outside of
+ * any timed region (eg, at the end of Pipeline::Go). If the buffer fills up before it is flushed,
+ * new messages are dropped and counted rather than blocking.
+ *
+ * Levels above LOST_LOG_LEVEL compile to nothing, and their arguments are never evaluated. Set it
+ * with `make LOST_LOG_LEVEL=n`:
+ *
+ * | n | logged                           |
+ * |---+----------------------------------|
+ * | 0 | nothing                          |
+ * | 1 | errors                           |
+ * | 2 | errors, warnings                 |
+ * | 3 | errors, warnings, info (default) |
+ * | 4 | everything, including debug      |
+ */
+
+#define LOST_LOG_LEVEL_NONE    0
+#define LOST_LOG_LEVEL_ERROR   1
+#define LOST_LOG_LEVEL_WARNING 2
+#define LOST_LOG_LEVEL_INFO    3
+#define LOST_LOG_LEVEL_DEBUG   4
+
+#ifndef LOST_LOG_LEVEL
+#define LOST_LOG_LEVEL LOST_LOG_LEVEL_INFO
+#endif
+
+#include <stdio.h>
+
+#ifdef __GNUC__
+#define LOST_PRINTF_FORMAT(formatIndex, firstArg) __attribute__((format(printf, formatIndex, firstArg)))
+#else
+#define LOST_PRINTF_FORMAT(formatIndex, firstArg)
+#endif
+
+namespace lost {
+
+enum class LogLevel {
+    kError = LOST_LOG_LEVEL_ERROR,
+    kWarning = LOST_LOG_LEVEL_WARNING,
+    kInfo = LOST_LOG_LEVEL_INFO,
+    kDebug = LOST_LOG_LEVEL_DEBUG,
+};
+
+/**
+ * Format a message and append it to the log buffer. Safe to call from multiple threads at once.
+ * Use the LOST_LOG_* macros instead of calling this directly, so that disabled levels are stripped.
+ * @param file Must be a string literal (or otherwise live forever), since only the pointer is stored.
+ */
+void LogWrite(LogLevel level, const char *file, int line, const char *format, ...) LOST_PRINTF_FORMAT(4, 5);
+
+/// Write all buffered log messages to stderr, oldest first, and report any that were dropped.
+void LogFlush();
+/// Like LogFlush(), but write to output instead of stderr
+void LogFlush(FILE *output);
+
+}
+
+// Disabled levels still type-check their arguments (and count as using them), but the call is dead
+// code, so the compiler removes it and never evaluates the arguments.
+#define LOST_LOG_DISABLED(level, ...) \
+    do { if (0) ::lost::LogWrite(level, __FILE__, __LINE__, __VA_ARGS__); } while (0)
+
+#if LOST_LOG_LEVEL >= LOST_LOG_LEVEL_ERROR
+#define LOST_LOG_ERROR(...) ::lost::LogWrite(::lost::LogLevel::kError, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define LOST_LOG_ERROR(...) LOST_LOG_DISABLED(::lost::LogLevel::kError, __VA_ARGS__)
+#endif
+
+#if LOST_LOG_LEVEL >= LOST_LOG_LEVEL_WARNING
+#define LOST_LOG_WARNING(...) ::lost::LogWrite(::lost::LogLevel::kWarning, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define LOST_LOG_WARNING(...) LOST_LOG_DISABLED(::lost::LogLevel::kWarning, __VA_ARGS__)
+#endif
+
+#if LOST_LOG_LEVEL >= LOST_LOG_LEVEL_INFO
+#define LOST_LOG_INFO(...) ::lost::LogWrite(::lost::LogLevel::kInfo, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define LOST_LOG_INFO(...) LOST_LOG_DISABLED(::lost::LogLevel::kInfo, __VA_ARGS__)
+#endif
+
+#if LOST_LOG_LEVEL >= LOST_LOG_LEVEL_DEBUG
+#define LOST_LOG_DEBUG(...) ::lost::LogWrite(::lost::LogLevel::kDebug, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define LOST_LOG_DEBUG(...) LOST_LOG_DISABLED(::lost::LogLevel::kDebug, __VA_ARGS__)
+#endif
+
+#endif
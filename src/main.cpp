@@ -5,6 +5,7 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -21,6 +22,7 @@
 #include "centroiders.hpp"
 #include "decimal.hpp"
 #include "io.hpp"
+#include "logging.hpp"
 #include "man-database.h"
 #include "man-pipeline.h"
 
@@ -29,7 +31,7 @@ namespace lost {
 /// Create a database and write it to a file based on the command line options in \p values
 static void DatabaseBuild(const DatabaseOptions &values) {
     Catalog narrowedCatalog = NarrowCatalog(CatalogRead(), (int) (values.minMag * 100), values.maxStars, DegToRad(values.minSeparation));
-    std::cerr << "Narrowed catalog has " << narrowedCatalog.size() << " stars." << std::endl;
+    LOST_LOG_INFO("Narrowed catalog has %ld stars.", (long)narrowedCatalog.size());
 
     MultiDatabaseDescriptor dbEntries = GenerateDatabases(narrowedCatalog, values);
     SerializeContext ser = serFromDbValues(values);
@@ -41,8 +43,8 @@ static void DatabaseBuild(const DatabaseOptions &values) {
     // Serialize Flags
     SerializeMultiDatabase(&ser, dbEntries, dbFlags);
 
-    std::cerr << "Generated database with " << ser.buffer.size() << " bytes" << std::endl;
-    std::cerr << "Database flagged with " << std::bitset<8*sizeof(dbFlags)>(dbFlags) << std::endl;
+    LOST_LOG_INFO("Generated database with %ld bytes", (long)ser.buffer.size());
+    LOST_LOG_INFO("Database flagged with %s", std::bitset<8*sizeof(dbFlags)>(dbFlags).to_string().c_str());
 
     UserSpecifiedOutputStream pos = UserSpecifiedOutputStream(values.outputPath, true);
     pos.Stream().write((char *) ser.buffer.data(), ser.buffer.size());
@@ -126,6 +128,8 @@ bool atobool(const char *cstr) {
 
 // This is separate from `main` just because it's in the `lost` namespace
 static int LostMain(int argc, char **argv) {
+    // also catches everything logged before an exit(1)
+    atexit(LogFlush);
 
     if (argc == 1) {
         std::cout << "Usage: ./lost database or ./lost pipeline" << std::endl
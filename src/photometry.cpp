@@ -0,0 +1,84 @@
+#include "photometry.hpp"
+
+#include <math.h>
+
+#include <algorithm>
+
+namespace lost {
+
+/**
+ * Once this many identifications have been added, each new one gets this fraction of the weight,
+ * so that the fit forgets identifications from long ago.
+ */
+static const long kPhotometricMemory = 1000;
+
+/// How many standard deviations of the fit's residuals the band extends past the prediction
+static const decimal kBandSigmas = 4;
+
+decimal PhotometricModel::Brightness(const Star &star) const {
+    switch (scale) {
+        case PhotometricScale::kLinear:
+            return star.magnitude;
+        case PhotometricScale::kLogarithmic:
+            return DECIMAL_LOG(std::max(star.magnitude, 1));
+    }
+    return star.magnitude;
+}
+
+void PhotometricModel::Add(const Star &star, const CatalogStar &catalogStar) {
+    if (numSamples < kPhotometricMemory) {
+        numSamples++;
+    }
+    // exponentially weighted version of Welford's algorithm; exactly the usual (population)
+    // statistics until the memory fills up.
+    decimal weight = DECIMAL(1.0) / numSamples;
+    decimal dx = Brightness(star) - meanX;
+    decimal dy = catalogStar.magnitude - meanY;
+    meanX += weight * dx;
+    meanY += weight * dy;
+    varX = (1 - weight) * (varX + weight * dx * dx);
+    varY = (1 - weight) * (varY + weight * dy * dy);
+    covXY = (1 - weight) * (covXY + weight * dx * dy);
+}
+
+void PhotometricModel::Add(const StarIdentifiers &starIds, const Stars &stars, const Catalog &catalog) {
+    for (const StarIdentifier &starId : starIds) {
+        Add(stars[starId.starIndex], catalog[starId.catalogIndex]);
+    }
+}
+
+bool PhotometricModel::Ready() const {
+    // brighter centroids must go with brighter (smaller magnitude) catalog stars, or the fit is junk
+    return numSamples >= minSamples && varX > 0 && covXY < 0;
+}
+
+decimal PhotometricModel::Predict(const Star &star) const {
+    return meanY + covXY / varX * (Brightness(star) - meanX);
+}
+
+decimal PhotometricModel::Rms() const {
+    if (varX <= 0) {
+        return DECIMAL_SQRT(varY);
+    }
+    return DECIMAL_SQRT(std::max(DECIMAL(0.0), varY - covXY * covXY / varX));
+}
+
+MagnitudeBand PhotometricModel::Band(const Star &star) const {
+    decimal predicted = Predict(star);
+    decimal halfWidth = std::max(minHalfWidth, kBandSigmas * Rms());
+    return { (int)DECIMAL_FLOOR(predicted - halfWidth), (int)DECIMAL_CEIL(predicted + halfWidth) };
+}
+
+std::vector<MagnitudeBand> PhotometricModel::Bands(const Stars &stars) const {
+    std::vector<MagnitudeBand> result;
+    if (!Ready()) {
+        return result;
+    }
+    result.reserve(stars.size());
+    for (const Star &star : stars) {
+        result.push_back(Band(star));
+    }
+    return result;
+}
+
+}
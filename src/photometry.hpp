@@ -0,0 +1,85 @@
+#ifndef PHOTOMETRY_H
+#define PHOTOMETRY_H
+
+#include <vector>
+
+#include "star-utils.hpp"
+
+namespace lost {
+
+/// How the brightness of a centroid (Star::magnitude) relates to the magnitude of its catalog star.
+enum class PhotometricScale {
+    /// Catalog magnitude is linear in centroid brightness, eg for generated centroids
+    kLinear,
+    /// Catalog magnitude is linear in the logarithm of centroid brightness, eg for centroiders that
+    /// sum up pixel values, since magnitude is logarithmic in flux
+    kLogarithmic,
+};
+
+/// A range of catalog magnitudes, in the units of CatalogStar::magnitude, inclusive.
+struct MagnitudeBand {
+    int min;
+    int max;
+
+    bool Contains(int magnitude) const { return magnitude >= min && magnitude <= max; }
+};
+
+/**
+ * Predicts which catalog magnitudes each centroid could have, from its brightness.
+ * The model is a straight line fitted to confirmed identifications as they come in, so it follows
+ * slow changes in exposure and needs no calibration. Recent identifications count the most once
+ * there are plenty of them.
+ *
+ * Star-id uses the bands to throw out candidates which are geometrically plausible but photometrically
+ * absurd, like the brightest star in the catalog for the dimmest centroid in the image.
+ */
+class PhotometricModel {
+public:
+    /**
+     * @param minHalfWidth The band around the predicted magnitude is at least this wide on either
+     * side, in the units of CatalogStar::magnitude, however well the line fits.
+     * @param minSamples How many identifications to fit before predicting anything
+     */
+    PhotometricModel(PhotometricScale scale, decimal minHalfWidth, int minSamples)
+        : scale(scale), minHalfWidth(minHalfWidth), minSamples(minSamples) { };
+
+    void Add(const Star &, const CatalogStar &);
+    void Add(const StarIdentifiers &, const Stars &, const Catalog &);
+
+    /// Whether enough identifications have been added to trust the fit
+    bool Ready() const;
+    /// Catalog magnitude predicted for this centroid. Only meaningful if Ready().
+    decimal Predict(const Star &) const;
+    /// Root mean square difference between the fitted line and the identifications
+    decimal Rms() const;
+    long NumSamples() const { return numSamples; }
+
+    MagnitudeBand Band(const Star &) const;
+    /// The band for each star, or an empty vector if the model isn't Ready() (so everything passes)
+    std::vector<MagnitudeBand> Bands(const Stars &) const;
+
+private:
+    decimal Brightness(const Star &) const;
+
+    PhotometricScale scale;
+    decimal minHalfWidth;
+    int minSamples;
+
+    long numSamples = 0;
+    // (exponentially weighted) means, variances, and covariance of brightness x and catalog magnitude y
+    decimal meanX = 0;
+    decimal meanY = 0;
+    decimal varX = 0;
+    decimal varY = 0;
+    decimal covXY = 0;
+};
+
+/// Whether catalog star `catalogIndex` could be centroid `starIndex`. Everything passes if `bands` is empty.
+inline bool InMagnitudeBand(const std::vector<MagnitudeBand> &bands, const Catalog &catalog,
+                            int starIndex, int catalogIndex) {
+    return bands.empty() || bands[starIndex].Contains(catalog[catalogIndex].magnitude);
+}
+
+}
+
+#endif
@@ -28,10 +28,30 @@ LOST_CLI_OPTION("centroid-dummy-stars"     , int        , centroidDummyNumStars
 LOST_CLI_OPTION("centroid-mag-filter"      , decimal    , centroidMagFilter             , -1  , STR_TO_DECIMAL(optarg)  , 5)
 LOST_CLI_OPTION("centroid-filter-brightest", int        , centroidFilterBrightest       , -1  , atoi(optarg)            , 10)
 LOST_CLI_OPTION("database"                 , std::string, databasePath                  , ""  , optarg                  , kNoDefaultArgument)
+LOST_CLI_OPTION("database-populate"        , bool       , databasePopulate              , false , atobool(optarg)       , true)
+LOST_CLI_OPTION("database-hugepages"       , bool       , databaseHugePages             , false , atobool(optarg)       , true)
+LOST_CLI_OPTION("database-verify"          , bool       , databaseVerify                , false , atobool(optarg)       , true)
 LOST_CLI_OPTION("star-id-algo"             , std::string, idAlgo                        , ""  , optarg                  , "pyramid")
 LOST_CLI_OPTION("angular-tolerance"        , decimal    , angularTolerance              , .04 , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
 LOST_CLI_OPTION("false-stars-estimate"     , int        , estimatedNumFalseStars        , 500 , atoi(optarg)            , kNoDefaultArgument)
 LOST_CLI_OPTION("max-mismatch-probability" , decimal    , maxMismatchProb               , .001, STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("focal-length-tolerance"   , decimal    , focalLengthTolerance          , .05 , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("pyramid-ranked-stars"     , int        , pyramidRankedStars            , 8   , atoi(optarg)            , 10)
+LOST_CLI_OPTION("pyramid-verification"     , std::string, pyramidVerification           , "none", optarg              , "reproject")
+LOST_CLI_OPTION("grid-min-matches"         , int        , gridMinMatches                , 4   , atoi(optarg)            , kNoDefaultArgument)
+LOST_CLI_OPTION("star-id-cutoff"           , long       , starIdCutoff                  , 1000, atol(optarg)            , kNoDefaultArgument)
+LOST_CLI_OPTION("star-id-deadline"         , decimal    , starIdDeadlineMs              , 0   , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("sky-cone-ra"              , decimal    , skyConeRa                     , 0   , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("sky-cone-de"              , decimal    , skyConeDe                     , 0   , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("sky-cone-radius"          , decimal    , skyConeRadius                 , 0   , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("centroid-noise"           , decimal    , centroidNoise                 , 0   , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("centroid-min-uncertainty" , decimal    , centroidMinUncertainty        , 0.1 , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("photometric-filter"       , std::string, photometricFilter             , "none", optarg              , "log")
+LOST_CLI_OPTION("photometric-band"         , decimal    , photometricBand               , 1.0 , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("track"                    , bool       , track                         , false , atobool(optarg)       , true)
+LOST_CLI_OPTION("track-radius"             , decimal    , trackRadius                   , 5   , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("track-min-fraction"       , decimal    , trackMinFraction              , 0.7 , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("track-min-stars"          , int        , trackMinStars                 , 4   , atoi(optarg)            , kNoDefaultArgument)
 LOST_CLI_OPTION("attitude-algo"            , std::string, attitudeAlgo                  , ""  , optarg                  , "dqm")
 
 // OUTPUT COMPARISON
@@ -12,6 +12,8 @@ struct dost_ImgData {
     lost::Attitude attitude;
     std::vector<lost::Star> stars; 
     std::vector<std::pair<int,int>> starIds;
+    bool tracked = false;       // starIds were carried over from the last frame rather than found by star-id
+    lost::Vec3 angularRate = {0, 0, 0}; // radians per frame, camera frame; zero if unknown
 };
 
 
@@ -20,6 +20,7 @@ public:
         : bestAngleFrom90(std::numeric_limits<decimal>::max()), // should be infinity
           bestStar1(0,0), bestStar2(0,0),
           index(index),
+          heapIndex(-1),
           star(&star) {
         identifiedStarsInRange.reserve(10); // this does quite measurably improve performance, at least on desktop
     }
@@ -27,16 +28,18 @@ public:
     // "null" has index=-1
     IRUnidentifiedCentroid()
         : bestStar1(0,0), bestStar2(0,0),
-          index(-1) { }
+          index(-1), heapIndex(-1) { }
 
     decimal bestAngleFrom90; /// For the pair of other centroids forming the triangular angle closest to 90 degrees, how far from 90 degrees it is (in radians)
     StarIdentifier bestStar1; /// One star corresponding to bestAngleFrom90
     StarIdentifier bestStar2; /// The other star corresponding to bestAngleFrom90
     int16_t index; /// Index into list of all centroids
+    int heapIndex; /// Position in the IRCentroidHeap this centroid is in, or -1 if it's not in one
     const Star *star;
 
 private:
-    // possible improvement: Use a tree map here to allow binary search
+    /// The direction (mod pi) from this centroid to each identified centroid in range, sorted by
+    /// direction, so the one closest to perpendicular to a new centroid can be binary searched.
     std::vector<std::pair<decimal, StarIdentifier>> identifiedStarsInRange;
 
 private:
@@ -46,18 +49,152 @@ public:
     void AddIdentifiedStar(const StarIdentifier &starId, const Stars &stars);
 };
 
+/**
+ * Binary min-heap of unidentified centroids on IRUnidentifiedCentroid::bestAngleFrom90.
+ * Each centroid's position in the heap is stored in its heapIndex, so that when identifying a star
+ * lowers some centroid's bestAngleFrom90, that centroid can be moved up the heap in place instead of
+ * searching for it.
+ */
+class IRCentroidHeap {
+public:
+    bool Empty() const { return heap.empty(); };
+    /// The centroid with the lowest bestAngleFrom90
+    IRUnidentifiedCentroid *Top() const { return heap.front(); };
+
+    void Push(IRUnidentifiedCentroid *);
+    IRUnidentifiedCentroid *Pop();
+    /// Call after decreasing the bestAngleFrom90 of a centroid that's in the heap.
+    void DecreaseKey(IRUnidentifiedCentroid *);
+private:
+    void Place(int heapIndex, IRUnidentifiedCentroid *);
+    void SiftUp(int heapIndex);
+    void SiftDown(int heapIndex);
+
+    std::vector<IRUnidentifiedCentroid *> heap;
+};
+
 std::vector<int16_t> IdentifyThirdStar(const PairDistanceKVectorDatabase &db,
                                        const Catalog &catalog,
                                        int16_t catalogIndex1, int16_t catalogIndex2,
                                        decimal distance1, decimal distance2,
                                        decimal tolerance);
+std::vector<int16_t> IdentifyThirdStar(const PairRecordKVectorDatabase &db,
+                                       const Catalog &catalog,
+                                       int16_t catalogIndex1, int16_t catalogIndex2,
+                                       decimal distance1, decimal distance2,
+                                       decimal tolerance);
+std::vector<int16_t> IdentifyThirdStar(const NeighborDatabase &db,
+                                       const Catalog &catalog,
+                                       int16_t catalogIndex1, int16_t catalogIndex2,
+                                       decimal distance1, decimal distance2,
+                                       decimal tolerance);
+
+/**
+ * The angular tolerance for the distance between each pair of centroids.
+ * A centroid's position error moves the distance to another centroid only by its component along
+ * the line between them, so each centroid's uncertainty ellipse is projected onto that line, and
+ * converted to radians with the plate scale where the centroid is. The pair's tolerance is a few
+ * standard deviations of the combined error, capped at the algorithm's usual tolerance.
+ */
+class PairTolerances {
+public:
+    /// The same tolerance for every pair
+    explicit PairTolerances(decimal tolerance)
+        : tolerance(tolerance), stars(NULL), uncertainties(NULL) { };
+    /// @param uncertainties See StarIdConstraints::centroidUncertainties. If NULL, the same tolerance for every pair.
+    PairTolerances(decimal tolerance, const Stars &, const Camera &, const std::vector<Vec2> *uncertainties);
 
+    /// Tolerance (radians) for the distance between centroids i and j
+    decimal Get(int i, int j) const;
+    /**
+     * One tolerance for the whole triangle ijk: the geometric mean of its sides' tolerances, so the
+     * volume of the region of matching triangles is the same as with each side's own tolerance.
+     */
+    decimal Triangle(int i, int j, int k) const;
+    /// No pair's tolerance is larger than this
+    decimal Max() const { return tolerance; };
+
+private:
+    decimal tolerance;
+    const Stars *stars;
+    const std::vector<Vec2> *uncertainties;
+    /// Radians per pixel at each centroid, in the direction it's largest: across the line from the
+    /// principal point. Along that line a pixel subtends less, so this never underestimates a tolerance.
+    std::vector<decimal> radiansPerPixel;
+};
+
+/// Centroid indices of a pyramid, as tried by PyramidStarIdAlgorithm. Its mismatch probability depends on the triangle ijk.
+struct PyramidIndices {
+    int i;
+    int j;
+    int k;
+    int r;
+};
+
+/**
+ * Every pyramid of numStars centroids, once each, in the order described in the Pyramid paper.
+ * Briefly: i is always the lowest index, then dj, dk and dr are how many indexes ahead the j-th star
+ * is from the i-th, the k-th from the j-th and the r-th from the k-th. In addition, they start some
+ * way in, so that the pyramids are not weird lines in wide FOV images.
+ */
+class PyramidIterator {
+public:
+    explicit PyramidIterator(int numStars);
+
+    /// Set *pyramid to the next pyramid and return true, or return false once there are no more.
+    bool Next(PyramidIndices *pyramid);
+
+private:
+    int numStars;
+    /// Roughly how many centroids are across the FOV horizontally
+    int across;
+    int halfwayAcross;
+    int jIter;
+    int kIter;
+    int rIter;
+    int iIter;
+};
+
+/**
+ * Pyramid's estimate of how many catalog patterns would match a pattern whose triangle is ijk, by
+ * chance. See Analytic_Star_Pattern_Probability on the HSL wiki for details.
+ * @param spatials Normalized spatial vectors of each centroid
+ */
+decimal PyramidExpectedMismatches(const std::vector<Vec3> &spatials, int i, int j, int k,
+                                  decimal tolerance, int numFalseStars);
+/// Like the other PyramidExpectedMismatches, but with the tolerance of each side of the triangle
+decimal PyramidExpectedMismatches(const std::vector<Vec3> &spatials, int i, int j, int k,
+                                  const PairTolerances &tolerances, int numFalseStars);
+
+/// Indices of the numBrightest brightest centroids, brightest first
+std::vector<int> BrightestStars(const Stars &, int numBrightest);
+
+/**
+ * Every pyramid of the given centroids that is unlikely enough to be mismatched, and whose
+ * distances are all between minDistance and maxDistance, in the order PyramidStarIdAlgorithm
+ * should try them: least likely to be mismatched (ie, smallest and least collinear) first.
+ * @param spatials Normalized spatial vectors of every centroid
+ */
+std::vector<PyramidIndices> RankPyramids(const std::vector<int> &starIndices,
+                                         const std::vector<Vec3> &spatials,
+                                         decimal minDistance, decimal maxDistance,
+                                         const PairTolerances &tolerances, int numFalseStars,
+                                         decimal maxMismatchProbability);
+
+/**
+ * Identify as many of the other centroids as possible from the ones already in *identifiers, and
+ * add them to it. Third stars are looked up in the database's neighbor lists if it has them, else
+ * its pair records, else its pair distance kvector.
+ * @param bands See MagnitudeBands. If NULL, no candidates are ruled out by magnitude.
+ * @return How many centroids were identified.
+ */
 int IdentifyRemainingStarsPairDistance(StarIdentifiers *,
                                        const Stars &,
-                                       const PairDistanceKVectorDatabase &,
+                                       const PreparedDatabase &,
                                        const Catalog &,
                                        const Camera &,
-                                       decimal tolerance);
+                                       decimal tolerance,
+                                       const std::vector<MagnitudeBand> *bands);
 
 }
 
@@ -1,128 +1,346 @@
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
+#include <limits.h>
 #include <vector>
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 
 #include "star-id.hpp"
 #include "star-id-private.hpp"
 #include "databases.hpp"
 #include "attitude-utils.hpp"
+#include "attitude-estimators.hpp"
+#include "logging.hpp"
+#include "candidate-filter.hpp"
 
 namespace lost {
 
-StarIdentifiers DummyStarIdAlgorithm::Go(
-    const unsigned char *, const Stars &stars, const Catalog &catalog, const Camera &) const {
+StarIdentifiers StarIdAlgorithm::Go(
+    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera) const {
 
-    StarIdentifiers result;
+    PreparedDatabase preparedDatabase(database, false);
+    return Go(preparedDatabase, stars, catalog, camera);
+}
 
-    unsigned int randomSeed = 123456;
-    for (int i = 0; i < (int)stars.size(); i++) {
-        result.push_back(StarIdentifier(i, rand_r(&randomSeed) % catalog.size()));
+StarIdentifiers StarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    const StarIdConstraints &, StarIdProgress *progress) const {
+
+    StarIdentifiers result = Go(database, stars, catalog, camera);
+    if (progress != NULL) {
+        *progress = StarIdProgress();
+        progress->confidence = result.empty() ? 0 : 1;
     }
+    return result;
+}
 
+std::vector<StarIdentifiers> StarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Catalog &catalog, const StarIdFrame *frames, long numFrames) const {
+
+    std::vector<StarIdentifiers> result;
+    result.reserve(numFrames);
+    for (long i = 0; i < numFrames; i++) {
+        result.push_back(Go(database, *frames[i].stars, catalog, *frames[i].camera));
+    }
     return result;
 }
 
-StarIdentifiers GeometricVotingStarIdAlgorithm::Go(
-    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera) const {
+/**
+ * Pattern searches only read the clock every this many patterns. Reading it costs about as much as
+ * a few of the pattern's distance calculations, and a pattern is quick, so this is plenty often.
+ */
+static const long kDeadlineCheckInterval = 8;
 
-    StarIdentifiers identified;
-    MultiDatabase multiDatabase(database);
-    const unsigned char *databaseBuffer = multiDatabase.SubDatabasePointer(PairDistanceKVectorDatabase::kMagicValue);
-    if (databaseBuffer == NULL) {
-        return identified;
+/**
+ * Whether a search which has tried `patternsTried` patterns so far should stop, because it was
+ * cancelled or the deadline passed. If so, records why in \p progress.
+ * @param checkInterval Only read the clock when patternsTried is a multiple of this
+ */
+static bool StopRequested(const StarIdConstraints &constraints, long patternsTried, StarIdProgress *progress,
+                          long checkInterval = kDeadlineCheckInterval) {
+    if (constraints.Cancelled()) {
+        LOST_LOG_DEBUG("Cancelled after %ld patterns.", patternsTried);
+        progress->patternsTried = patternsTried;
+        progress->cancelled = true;
+        return true;
     }
-    DeserializeContext des(databaseBuffer);
-    PairDistanceKVectorDatabase vectorDatabase(&des);
+    if (constraints.HasDeadline()
+        && patternsTried % checkInterval == 0
+        && std::chrono::steady_clock::now() >= constraints.deadline) {
+
+        LOST_LOG_INFO("Deadline reached after %ld patterns.", patternsTried);
+        progress->patternsTried = patternsTried;
+        progress->deadlineReached = true;
+        return true;
+    }
+    return false;
+}
 
-    for (int i = 0; i < (int)stars.size(); i++) {
-        std::vector<int16_t> votes(catalog.size(), 0);
-        Vec3 iSpatial = camera.CameraToSpatial(stars[i].position).Normalize();
-        for (int j = 0; j < (int)stars.size(); j++) {
-            if (i != j) {
-                // TODO: find a faster way to do this:
-                std::vector<bool> votedInPair(catalog.size(), false);
-                Vec3 jSpatial = camera.CameraToSpatial(stars[j].position).Normalize();
-                decimal greatCircleDistance = AngleUnit(iSpatial, jSpatial);
-                //give a greater range for min-max Query for bigger radius (GreatCircleDistance)
-                decimal lowerBoundRange = greatCircleDistance - tolerance;
-                decimal upperBoundRange = greatCircleDistance + tolerance;
-                const int16_t *upperBoundSearch;
-                const int16_t *lowerBoundSearch = vectorDatabase.FindPairsLiberal(
-                    lowerBoundRange, upperBoundRange, &upperBoundSearch);
-                //loop from lowerBoundSearch till numReturnedPairs, add one vote to each star in the pairs in the datastructure
-                for (const int16_t *k = lowerBoundSearch; k != upperBoundSearch; k++) {
-                    if ((k - lowerBoundSearch) % 2 == 0) {
-                        decimal actualAngle = AngleUnit(catalog[*k].spatial, catalog[*(k+1)].spatial);
-                        assert(actualAngle <= greatCircleDistance + tolerance * 2);
-                        assert(actualAngle >= greatCircleDistance - tolerance * 2);
-                    }
-                    if (!votedInPair[*k] || true) {
-                        // if (i == 542 && *k == 9085) {
-                        //     printf("INC, distance %f from query %f to %f\n", greatCircleDistance,
-                        //         lowerBoundRange, upperBoundRange);
-                        // }
-                        votes[*k]++;
-                        votedInPair[*k] = true;
-                    }
+/// Number of 4-star patterns among numStars stars, each of which Pyramid-style iteration visits once.
+static long NumFourStarPatterns(long numStars) {
+    return numStars < 4 ? 0 : numStars*(numStars-1)*(numStars-2)*(numStars-3)/24;
+}
+
+PyramidIterator::PyramidIterator(int numStars)
+    : numStars(numStars), across(floor(sqrt(numStars))*2), halfwayAcross(floor(sqrt(numStars)/2)),
+      jIter(0), kIter(0), rIter(0), iIter(-1) { }
+
+bool PyramidIterator::Next(PyramidIndices *pyramid) {
+    // the loops of a nested for over jIter, kIter, rIter and iIter, resumed where the last call left off
+    iIter++;
+    int jMax = numStars - 3;
+    for (; jIter < jMax; jIter++, kIter = 0) {
+        int dj = 1+(jIter+halfwayAcross)%jMax;
+
+        int kMax = numStars-dj-2;
+        for (; kIter < kMax; kIter++, rIter = 0) {
+            int dk = 1+(kIter+across)%kMax;
+
+            int rMax = numStars-dj-dk-1;
+            for (; rIter < rMax; rIter++, iIter = 0) {
+                int dr = 1+(rIter+halfwayAcross)%rMax;
+
+                int iMax = numStars-dj-dk-dr-1;
+                if (iIter <= iMax) {
+                    int i = (iIter + iMax/2)%(iMax+1); // start near the center of the photo
+                    *pyramid = { i, i+dj, i+dj+dk, i+dj+dk+dr };
+                    return true;
                 }
-                // US voting system
             }
         }
-        // Find star w most votes
-        int16_t maxVotes = votes[0];
-        int indexOfMax = 0;
-        for (int v = 1; v < (int)votes.size(); v++) {
-            if (votes[v] > maxVotes) {
-                maxVotes = votes[v];
-                indexOfMax = v;
-            }
+    }
+    return false;
+}
+
+/// Cosine of the angle from the boresight to the furthest corner of the image
+static decimal MinCornerCos(const Camera &camera) {
+    decimal minCornerCos = 1;
+    decimal corners[4][2] = {
+        {0, 0}, {(decimal)camera.XResolution(), 0},
+        {0, (decimal)camera.YResolution()}, {(decimal)camera.XResolution(), (decimal)camera.YResolution()},
+    };
+    for (const decimal *corner : corners) {
+        minCornerCos = std::min(minCornerCos, camera.CameraToSpatial({corner[0], corner[1]}).Normalize().x);
+    }
+    return minCornerCos;
+}
+
+long CatalogMask::Count() const {
+    long result = 0;
+    for (uint64_t word : words) {
+        result += __builtin_popcountll(word);
+    }
+    return result;
+}
+
+/// How far (radians) from the center of a sky cone of `radius` (radians) the stars in an image whose boresight is in the cone can be
+decimal SkyConeStarRadius(const Camera &camera, decimal radius) {
+    return radius + DECIMAL_ACOS(MinCornerCos(camera));
+}
+
+/**
+ * The catalog stars that could be in an image whose boresight is within `radius` (radians) of
+ * `boresight`, ie, those within `radius` plus the angle to the image's furthest corner.
+ * The fraction of the catalog that passes, and so the number of candidates star-id has to look
+ * at, is about the fraction of the sky that the widened cone covers.
+ * @param boresight Must be normalized
+ */
+CatalogMask SkyConeMask(const Catalog &catalog, const Camera &camera, const Vec3 &boresight, decimal radius) {
+    CatalogMask result(catalog.size());
+    decimal maxDistance = SkyConeStarRadius(camera, radius);
+    decimal minCos = maxDistance >= DECIMAL_M_PI ? DECIMAL(-1.0) : DECIMAL_COS(maxDistance);
+    for (int i = 0; i < (int)catalog.size(); i++) {
+        if (catalog[i].spatial * boresight >= minCos) {
+            result.Set(i);
         }
-        // if (i == 542) {
-        //     for (decimal dist : vectorDatabase.StarDistances(9085, catalog)) {
-        //         printf("Actual 9085 distance: %f\n", dist);
-        //     }
-        //     puts("Debug star.");
-        //     for (int i = 0; i < (int)votes.size(); i++) {
-        //         if (votes[i] > maxVotes/2) {
-        //             printf("Star %4d received %d votes.\n", catalog[i].name, votes[i]);
-        //         }
-        //     }
-        //     printf("Debug star: Actually voted for %d with %d votes\n",
-        //            catalog[indexOfMax].name, maxVotes);
-        // }
-        // printf("Max votes: %d\n", maxVotes);
-        //starIndex = i, catalog index = indexOfMax
-        StarIdentifier newStar(i, indexOfMax);
-        // Set identified[i] to value of catalog index of star w most votesr
-        identified.push_back(newStar);
     }
+    return result;
+}
+
+/**
+ * Estimate how precisely each centroid's position is known, from its size and brightness.
+ * A centroid's position is the average over its blob, so its error is about the blob's radius
+ * divided by its signal to noise ratio.
+ * @param brightnessNoise Standard deviation of the noise in Star::magnitude, in the centroider's
+ * units, eg the read noise times the square root of the number of pixels in a typical star.
+ * @param minUncertainty No centroid is more precise than this (pixels), eg because of the
+ * centroider's own bias, or the camera's distortion.
+ * @return The uncertainty (pixels) along x and y of each centroid. Infinite for centroids with no
+ * positive brightness, which then just get the usual tolerance.
+ */
+std::vector<Vec2> CentroidUncertainties(const Stars &stars, decimal brightnessNoise, decimal minUncertainty) {
+    std::vector<Vec2> result;
+    result.reserve(stars.size());
+    for (const Star &star : stars) {
+        if (star.magnitude <= 0) {
+            result.push_back({INFINITY, INFINITY});
+            continue;
+        }
+        decimal snr = star.magnitude / brightnessNoise;
+        result.push_back({
+            std::max(minUncertainty, star.radiusX / snr),
+            std::max(minUncertainty, star.radiusY / snr),
+        });
+    }
+    return result;
+}
+
+/// How many standard deviations of a pair's combined position error its tolerance allows
+static const decimal kPairToleranceSigmas = 3;
+
+PairTolerances::PairTolerances(decimal tolerance, const Stars &stars, const Camera &camera,
+                               const std::vector<Vec2> *uncertainties)
+    : tolerance(tolerance), stars(&stars), uncertainties(uncertainties) {
+
+    if (uncertainties == NULL) {
+        return;
+    }
+    assert(uncertainties->size() == stars.size());
+    radiansPerPixel.reserve(stars.size());
+    for (const Star &star : stars) {
+        // CameraToSpatial has an x component of 1, so its length is sqrt(f^2 + r^2) / f. A pixel
+        // across the line of sight from the principal point subtends 1/sqrt(f^2 + r^2) radians,
+        // and one along it even less.
+        radiansPerPixel.push_back(1 / (camera.FocalLength() * camera.CameraToSpatial(star.position).Magnitude()));
+    }
+}
+
+decimal PairTolerances::Get(int i, int j) const {
+    if (uncertainties == NULL) {
+        return tolerance;
+    }
+    Vec2 direction = (*stars)[j].position - (*stars)[i].position;
+    decimal lengthSq = direction.MagnitudeSq();
+    if (lengthSq <= 0) {
+        return tolerance;
+    }
+    const Vec2 &iUncertainty = (*uncertainties)[i];
+    const Vec2 &jUncertainty = (*uncertainties)[j];
+    // variance of each centroid's error along the line between them, in radians squared
+    decimal iVariance = ((iUncertainty.x*direction.x)*(iUncertainty.x*direction.x)
+                         + (iUncertainty.y*direction.y)*(iUncertainty.y*direction.y))
+        / lengthSq * radiansPerPixel[i] * radiansPerPixel[i];
+    decimal jVariance = ((jUncertainty.x*direction.x)*(jUncertainty.x*direction.x)
+                         + (jUncertainty.y*direction.y)*(jUncertainty.y*direction.y))
+        / lengthSq * radiansPerPixel[j] * radiansPerPixel[j];
+    // infinite for centroids with no estimate, which std::min takes care of
+    return std::min(tolerance, kPairToleranceSigmas * DECIMAL_SQRT(iVariance + jVariance));
+}
+
+decimal PairTolerances::Triangle(int i, int j, int k) const {
+    return DECIMAL_POW(Get(i, j) * Get(i, k) * Get(j, k), DECIMAL(1.0) / 3);
+}
+
+/**
+ * Point *begin and *end at just the pairs from a pair distance query where both stars are allowed.
+ * Leaves them alone if `allowed` is NULL, otherwise copies the allowed pairs into \p scratch.
+ */
+static void FilterPairs(const CatalogMask *allowed, const int16_t **begin, const int16_t **end,
+                        std::vector<int16_t> *scratch) {
+    if (allowed == NULL) {
+        return;
+    }
+    scratch->clear();
+    for (const int16_t *pair = *begin; pair != *end; pair += 2) {
+        if (allowed->Test(pair[0]) && allowed->Test(pair[1])) {
+            scratch->push_back(pair[0]);
+            scratch->push_back(pair[1]);
+        }
+    }
+    *begin = scratch->data();
+    *end = scratch->data() + scratch->size();
+}
+
+/**
+ * Like FilterPairs on an exact pair distance query, but made from the pair records. The stored
+ * distances trim the query without looking anything up in the catalog, and the allowed pairs are
+ * copied into \p scratch in one pass over the records.
+ */
+static void FindRecordPairs(const PairRecordKVectorDatabase &db, const KVectorInterval &query,
+                            const CatalogMask *allowed, const int16_t **begin, const int16_t **end,
+                            std::vector<int16_t> *scratch) {
+    const PairRecord *recordsEnd;
+    const PairRecord *records = db.FindPairsExact(query.min, query.max, &recordsEnd);
+    scratch->clear();
+    for (const PairRecord *record = records; record != recordsEnd; record++) {
+        if (allowed == NULL || (allowed->Test(record->index1) && allowed->Test(record->index2))) {
+            scratch->push_back(record->index1);
+            scratch->push_back(record->index2);
+        }
+    }
+    *begin = scratch->data();
+    *end = scratch->data() + scratch->size();
+}
+
+/// The magnitude band of each centroid, or an empty vector if the constraints don't restrict magnitudes.
+static std::vector<MagnitudeBand> MagnitudeBands(const StarIdConstraints &constraints, const Stars &stars) {
+    return constraints.photometry == NULL ? std::vector<MagnitudeBand>() : constraints.photometry->Bands(stars);
+}
+
+StarIdentifiers DummyStarIdAlgorithm::Go(
+    const PreparedDatabase &, const Stars &stars, const Catalog &catalog, const Camera &) const {
+
+    StarIdentifiers result;
+
+    unsigned int randomSeed = 123456;
+    for (int i = 0; i < (int)stars.size(); i++) {
+        result.push_back(StarIdentifier(i, rand_r(&randomSeed) % catalog.size()));
+    }
+
+    return result;
+}
+
+/// Buffers used by geometric voting, kept between frames of a batch to avoid reallocating them.
+struct GeometricVotingScratch {
+    std::vector<int16_t> votes;
+    std::vector<Vec3> spatials;
+    std::vector<int16_t> pairs;
+    std::vector<int16_t> decoded;
+    std::vector<KVectorInterval> queries;
+    std::vector<KVectorRange> ranges;
+};
+
+/// How many queries ahead of the one being tallied geometric voting prefetches the pairs of
+static const long kVotingPrefetchDistance = 4;
+
+/**
+ * Keep only the identifications which agree with most of the others: Each pair of identified stars
+ * whose catalog distance is within tolerance of their distance in the image gives both a vote, and
+ * the stars with close to the most votes are kept. Used by algorithms that identify each star
+ * independently, where a few of them are bound to be wrong.
+ */
+static StarIdentifiers VerifyByPairVotes(const StarIdentifiers &identified, const Stars &stars,
+                                         const Catalog &catalog, const Camera &camera, decimal tolerance) {
     //optimizations? N^2
     //https://www.researchgate.net/publication/3007679_Geometric_voting_algorithm_for_star_trackers
     //
     // Do we have a metric for localization uncertainty? Star brighntess?
     //loop i from 1 through n
     std::vector<int16_t> verificationVotes(identified.size(), 0);
+    std::vector<Vec3> spatials;
+    for (const StarIdentifier &starId : identified) {
+        spatials.push_back(camera.CameraToSpatial(stars[starId.starIndex].position).Normalize());
+    }
+    CosineTolerance cosineTolerance(tolerance);
     for (int i = 0; i < (int)identified.size(); i++) {
         //loop j from i+1 through n
         for (int j = i + 1; j < (int)identified.size(); j++) {
-            // Calculate distance between catalog stars
-            CatalogStar first = catalog[identified[i].catalogIndex];
-            CatalogStar second = catalog[identified[j].catalogIndex];
-            decimal cDist = AngleUnit(first.spatial, second.spatial);
-
-            Star firstIdentified = stars[identified[i].starIndex];
-            Star secondIdentified = stars[identified[j].starIndex];
-            Vec3 firstSpatial = camera.CameraToSpatial(firstIdentified.position);
-            Vec3 secondSpatial = camera.CameraToSpatial(secondIdentified.position);
-            decimal sDist = Angle(firstSpatial, secondSpatial);
+            // Compare the cosine of the distance between the catalog stars with the cosines of the
+            // distances within tolerance of the one between the stars in the image
+            decimal minCos;
+            decimal maxCos;
+            CosineBounds(spatials[i] * spatials[j], cosineTolerance, &minCos, &maxCos);
+            decimal catalogCos = catalog[identified[i].catalogIndex].spatial * catalog[identified[j].catalogIndex].spatial;
 
             //if sDist is in the range of (distance between stars in the image +- R)
             //add a vote for the match
-            if (DECIMAL_ABS(sDist - cDist) < tolerance) {
+            if (catalogCos > minCos && catalogCos < maxCos) {
                 verificationVotes[i]++;
                 verificationVotes[j]++;
             }
@@ -141,7 +359,7 @@ StarIdentifiers GeometricVotingStarIdAlgorithm::Go(
     // maximal votes = maxVotes
     StarIdentifiers verified;
     int thresholdVotes = maxVotes * 3 / 4;
-    printf("Verification threshold: %d\n", thresholdVotes);
+    LOST_LOG_DEBUG("Verification threshold: %d", thresholdVotes);
     for (int i = 0; i < (int)verificationVotes.size(); i++) {
         if (verificationVotes[i] > thresholdVotes) {
             verified.push_back(identified[i]);
@@ -151,621 +369,2402 @@ StarIdentifiers GeometricVotingStarIdAlgorithm::Go(
     return verified;
 }
 
-/*
- * Strategies:
- * 1. For each star, enumerate all stars which have the same combination of distances to some
- *  other stars, getting down to a hopefully small (<10) list of candidates for each star, then
- *  do a quad-nested loop to correlate them.
- * 2. Loop through all possible stars in the catalog for star i. Then look at edge ij, using
- * this to select possible j-th stars. If ever there is not a possible j-th star, continue the
- * i-loop. When a possible ij combination is found, loop through k stars according to ik. IF
- * none are found, continue the outer i loop. If some are found, check jk for each one. For each possible ijk triangle,
- */
-
 /**
- * Given a list of star pairs, finds all those pairs which involve a certain star.
- * Here "involve" means that one of the two stars in the pair is the given star.
+ * A pair database as geometric voting looks pairs up in it. Each kind of pair database is queried
+ * in its own units and stores its pairs its own way, which subclasses hide.
  */
-class PairDistanceInvolvingIterator {
+class VotingPairs {
 public:
+    virtual ~VotingPairs() { };
+
+    /// The query for two centroids the cosine of whose distance is given
+    virtual KVectorInterval Query(decimal cosine, decimal tolerance, const CosineTolerance &) const = 0;
+    /// Look up many queries at once, so that their lookups overlap
+    virtual void FindPairsLiberal(const KVectorInterval *queries, long numQueries, KVectorRange *result) const = 0;
+    /// Hint that the pairs of a query will be read soon
+    virtual void Prefetch(const KVectorRange &) const { };
     /**
-     * Create a "past-the-end" iterator.
-     * If another PairDistanceInvolvingIterator is equal to this, then it is done iterating.
+     * The pairs of a query, as consecutive catalog indices. Databases which don't store them that
+     * way put them in `buffer`, which is reused for every query.
      */
-    PairDistanceInvolvingIterator()
-        : pairs(NULL), end(NULL) { };
+    virtual void Pairs(const KVectorRange &, std::vector<int16_t> *buffer,
+                       const int16_t **begin, const int16_t **end) const = 0;
+    /// Whether a pair returned for a query is as close to it as a liberal query promises
+    virtual bool Near(const KVectorInterval &query, decimal tolerance, const Vec3 &, const Vec3 &) const = 0;
+};
 
-    /**
-     * The main constructor.
-     * @param pairs Start of an array of star pairs
-     * @param end "past-the-end" pointer for \p pairs
-     * @param The catalog index that we want to be involved in the outputted pairs.
-     */
-    PairDistanceInvolvingIterator(const int16_t *pairs, const int16_t *end, int16_t involving)
-        : pairs(pairs), end(end), involving(involving) {
+/// Pairs looked up by their distance, within the tolerance either side of the centroids'
+class DistanceVotingPairs : public VotingPairs {
+public:
+    KVectorInterval Query(decimal cosine, decimal tolerance, const CosineTolerance &) const override {
+        decimal greatCircleDistance = cosine >= 1 ? 0 : cosine <= -1 ? DECIMAL_M_PI : DECIMAL_ACOS(cosine);
+        //give a greater range for min-max Query for bigger radius (GreatCircleDistance)
+        return { greatCircleDistance - tolerance, greatCircleDistance + tolerance };
+    }
 
-        assert((end-pairs)%2 == 0);
-        ForwardUntilInvolving();
-    };
+    bool Near(const KVectorInterval &query, decimal tolerance,
+              const Vec3 &spatial1, const Vec3 &spatial2) const override {
+        decimal actualAngle = AngleUnit(spatial1, spatial2);
+        return actualAngle <= query.max + tolerance && actualAngle >= query.min - tolerance;
+    }
+};
 
-    // PairDistanceInvolvingIterator operator++() {
-    //     PairDistanceInvolvingIterator result(*this);
-    //     ++(*this);
-    //     return result;
-    // }
+class PairDistanceVotingPairs : public DistanceVotingPairs {
+public:
+    explicit PairDistanceVotingPairs(const PairDistanceKVectorDatabase &db) : db(db) { };
 
-    /// Move to the next matching pair.
-    PairDistanceInvolvingIterator &operator++() {
-        assert(HasValue());
-        pairs += 2;
-        ForwardUntilInvolving();
-        return *this;
+    void FindPairsLiberal(const KVectorInterval *queries, long numQueries, KVectorRange *result) const override {
+        db.FindPairsLiberal(queries, numQueries, result);
     }
-
-    /// Access the curent pair.
-    int16_t operator*() const {
-        return curValue;
+    void Prefetch(const KVectorRange &range) const override {
+        PrefetchForRead(db.Pair(range.begin));
     }
-
-    /// Whether the iterator is currently on a value. (false if iteration is complete)
-    bool HasValue() {
-        return pairs != end;
+    void Pairs(const KVectorRange &range, std::vector<int16_t> *,
+               const int16_t **begin, const int16_t **end) const override {
+        *begin = db.Pair(range.begin);
+        *end = db.Pair(range.end);
     }
 
-    // bool operator==(const PairDistanceInvolvingIterator &other) const {
-    //     return ()other.pairs == pairs;
-    // }
-
-    // bool operator!=(const PairDistanceInvolvingIterator &other) const {
-    //     return !(*this == other);
-    // }
 private:
-    const int16_t *pairs;
-    const int16_t *end;
-    int16_t involving;
-    int16_t curValue;
+    const PairDistanceKVectorDatabase &db;
+};
 
-    /// like postfix++, except it's a no-op if already on a valid spot.
-    void ForwardUntilInvolving() {
-        while (pairs != end) {
-            if (pairs[0] == involving) {
-                curValue = pairs[1];
-                return;
-            }
-            if (pairs[1] == involving) {
-                curValue = pairs[0];
-                return;
-            }
-            pairs += 2;
+/// Decodes the pairs of each query into the buffer
+class CompressedVotingPairs : public DistanceVotingPairs {
+public:
+    explicit CompressedVotingPairs(const CompressedPairKVectorDatabase &db) : db(db) { };
+
+    void FindPairsLiberal(const KVectorInterval *queries, long numQueries, KVectorRange *result) const override {
+        db.FindPairsLiberal(queries, numQueries, result);
+    }
+    void Prefetch(const KVectorRange &range) const override {
+        db.PrefetchPairs(range);
+    }
+    void Pairs(const KVectorRange &range, std::vector<int16_t> *decoded,
+               const int16_t **begin, const int16_t **end) const override {
+        decoded->clear();
+        CompressedPairIterator pairs = db.Pairs(range);
+        int16_t index1;
+        int16_t index2;
+        while (pairs.Next(&index1, &index2)) {
+            decoded->push_back(index1);
+            decoded->push_back(index2);
         }
+        *begin = decoded->data();
+        *end = decoded->data() + decoded->size();
     }
-};
 
-std::vector<int16_t> ConsumeInvolvingIterator(PairDistanceInvolvingIterator it) {
-    std::vector<int16_t> result;
-    for (; it.HasValue(); ++it) {
-        result.push_back(*it);
-    }
-    return result;
-}
+private:
+    const CompressedPairKVectorDatabase &db;
+};
 
 /**
- * Given the result of a pair-distance kvector query, build a hashmultimap of stars to other stars
- * that appeared with it in the query.
- * 
- * The resulting map is "symmetrical" in the sense that if a star B is in the map for star A, then
- * star A is also in the map for star B.
+ * The pairs of a SkyCellPairDatabase in the cells near a sky cone. Each query is a query of each of
+ * those cells, whose pairs are gathered into the buffer.
  */
-std::unordered_multimap<int16_t, int16_t> PairDistanceQueryToMap(const int16_t *pairs, const int16_t *end) {
-    std::unordered_multimap<int16_t, int16_t> result;
-    for (const int16_t *p = pairs; p != end; p += 2) {
-        result.emplace(p[0], p[1]);
-        result.emplace(p[1], p[0]);
+class SkyCellVotingPairs : public DistanceVotingPairs {
+public:
+    SkyCellVotingPairs(const SkyCellPairDatabase &db, const Vec3 &center, decimal radius) : db(db) {
+        db.CellsNear(center, radius, &cells);
     }
-    return result;
-}
 
-decimal IRUnidentifiedCentroid::VerticalAnglesToAngleFrom90(decimal v1, decimal v2) {
-    return DECIMAL_ABS(DecimalModulo(v1-v2, DECIMAL_M_PI) - DECIMAL_M_PI_2);
+    /// Query each cell for each query. The range of each query is just its own index, for Pairs.
+    void FindPairsLiberal(const KVectorInterval *queries, long numQueries, KVectorRange *result) const override {
+        cellPairs.resize(2*numQueries*cells.size());
+        for (long q = 0; q < numQueries; q++) {
+            for (size_t c = 0; c < cells.size(); c++) {
+                const int16_t **pairs = &cellPairs[2*(q*cells.size() + c)];
+                pairs[0] = db.FindPairsLiberal(cells[c], queries[q].min, queries[q].max, &pairs[1]);
+            }
+            result[q] = { q, q + 1 };
+        }
+    }
+
+    // no Prefetch, since the pairs of each query are in several places, and gathering them brings them in anyway
+    void Pairs(const KVectorRange &range, std::vector<int16_t> *gathered,
+               const int16_t **begin, const int16_t **end) const override {
+        gathered->clear();
+        for (size_t c = 0; c < cells.size(); c++) {
+            const int16_t *const *cellRange = &cellPairs[2*(range.begin*cells.size() + c)];
+            gathered->insert(gathered->end(), cellRange[0], cellRange[1]);
+        }
+        *begin = gathered->data();
+        *end = gathered->data() + gathered->size();
+    }
+
+    /// Within a bin, which was sized for the tolerance the database was generated with rather than star-id's
+    bool Near(const KVectorInterval &query, decimal,
+              const Vec3 &spatial1, const Vec3 &spatial2) const override {
+        // a little extra for rounding, like for a pair cosine database
+        decimal slack = db.BinWidth() + DECIMAL(1e-9);
+        decimal actualAngle = AngleUnit(spatial1, spatial2);
+        return actualAngle <= query.max + slack && actualAngle >= query.min - slack;
+    }
+
+private:
+    const SkyCellPairDatabase &db;
+    std::vector<int> cells;
+    /// The begin and end of the pairs in each cell for each query of the last FindPairsLiberal
+    mutable std::vector<const int16_t *> cellPairs;
+};
+
+/// Pairs looked up by the versine of their distance, which needs no arccosine
+class CosineVotingPairs : public VotingPairs {
+public:
+    explicit CosineVotingPairs(const PairCosineKVectorDatabase &db) : db(db) { };
+
+    KVectorInterval Query(decimal cosine, decimal, const CosineTolerance &cosineTolerance) const override {
+        decimal minCos;
+        decimal maxCos;
+        CosineBounds(cosine, cosineTolerance, &minCos, &maxCos);
+        return { 1 - maxCos, 1 - minCos };
+    }
+    void FindPairsLiberal(const KVectorInterval *queries, long numQueries, KVectorRange *result) const override {
+        db.FindPairsLiberalVersine(queries, numQueries, result);
+    }
+    void Prefetch(const KVectorRange &range) const override {
+        PrefetchForRead(db.Pair(range.begin));
+    }
+    void Pairs(const KVectorRange &range, std::vector<int16_t> *,
+               const int16_t **begin, const int16_t **end) const override {
+        *begin = db.Pair(range.begin);
+        *end = db.Pair(range.end);
+    }
+    /// Within a bin, since bins of versine are wider than the tolerance at the smallest distances
+    bool Near(const KVectorInterval &query, decimal,
+              const Vec3 &spatial1, const Vec3 &spatial2) const override {
+        decimal actualVersine = 1 - spatial1*spatial2;
+        // a little extra for rounding, since the database's versines weren't computed from the dot product
+        decimal slack = db.BinWidth() + DECIMAL(1e-9);
+        return actualVersine <= query.max + slack && actualVersine >= query.min - slack;
+    }
+
+private:
+    const PairCosineKVectorDatabase &db;
+};
+
+/**
+ * The pairs geometric voting should look up, from the best pair database there is: the sky cells
+ * near the sky cone, if there is one, since only the pairs near it matter; then pair cosines, which
+ * answer the same queries without an arccosine for each pair of centroids; then pair distances;
+ * then compressed pairs, which a database built for a small memory might have instead.
+ * @return NULL if there's no pair database to use
+ */
+static std::unique_ptr<VotingPairs> MakeVotingPairs(const PreparedDatabase &database,
+                                                    const StarIdConstraints &constraints) {
+    const SkyCellPairDatabase *skyCellDatabase = database.SkyCellPairs();
+    if (skyCellDatabase != NULL && constraints.skyConeRadius > 0 && constraints.allowedStars != NULL) {
+        return std::unique_ptr<VotingPairs>(
+            new SkyCellVotingPairs(*skyCellDatabase, constraints.skyConeCenter, constraints.skyConeRadius));
+    }
+    if (database.PairCosineKVector() != NULL) {
+        return std::unique_ptr<VotingPairs>(new CosineVotingPairs(*database.PairCosineKVector()));
+    }
+    if (database.PairDistanceKVector() != NULL) {
+        return std::unique_ptr<VotingPairs>(new PairDistanceVotingPairs(*database.PairDistanceKVector()));
+    }
+    if (database.CompressedPairKVector() != NULL) {
+        return std::unique_ptr<VotingPairs>(new CompressedVotingPairs(*database.CompressedPairKVector()));
+    }
+    return std::unique_ptr<VotingPairs>();
+}
+
+/**
+ * Identify each star by the catalog star which is in the most pairs that match the distances from
+ * it to the others.
+ */
+static StarIdentifiers GeometricVoting(const VotingPairs &vectorDatabase,
+                                       const Stars &stars, const Catalog &catalog, const Camera &camera,
+                                       decimal tolerance, GeometricVotingScratch *scratch,
+                                       const StarIdConstraints &constraints, StarIdProgress *progress) {
+
+    StarIdentifiers identified;
+    std::vector<int16_t> &votes = scratch->votes;
+    votes.resize(catalog.size());
+    std::vector<Vec3> &spatials = scratch->spatials;
+    spatials.clear();
+    for (const Star &star : stars) {
+        spatials.push_back(camera.CameraToSpatial(star.position).Normalize());
+    }
+    std::vector<MagnitudeBand> bands = MagnitudeBands(constraints, stars);
+    CosineTolerance cosineTolerance(tolerance);
+
+    progress->patternsTotal = stars.size();
+    for (int i = 0; i < (int)stars.size(); i++) {
+        // each star's votes take a whole row of database queries, so check the clock every time
+        if (StopRequested(constraints, i, progress, 1)) {
+            return StarIdentifiers();
+        }
+        std::fill(votes.begin(), votes.end(), 0);
+        const Vec3 &iSpatial = spatials[i];
+        // the whole row of queries at once, so that their lookups overlap
+        scratch->queries.resize(stars.size());
+        scratch->ranges.resize(stars.size());
+        for (int j = 0; j < (int)stars.size(); j++) {
+            // (a star isn't paired with itself, but still gets a query, to keep the indices lined up;
+            // one at a right angle, which no pair database goes out to)
+            decimal cosine = i != j ? iSpatial * spatials[j] : 0;
+            scratch->queries[j] = vectorDatabase.Query(cosine, tolerance, cosineTolerance);
+        }
+        vectorDatabase.FindPairsLiberal(scratch->queries.data(), stars.size(), scratch->ranges.data());
+        for (int j = 0; j < (int)stars.size(); j++) {
+            if (j + kVotingPrefetchDistance < (long)stars.size()) {
+                vectorDatabase.Prefetch(scratch->ranges[j + kVotingPrefetchDistance]);
+            }
+            if (i != j) {
+                const int16_t *upperBoundSearch;
+                const int16_t *lowerBoundSearch;
+                vectorDatabase.Pairs(scratch->ranges[j], &scratch->decoded, &lowerBoundSearch, &upperBoundSearch);
+                FilterPairs(constraints.allowedStars, &lowerBoundSearch, &upperBoundSearch, &scratch->pairs);
+                //loop from lowerBoundSearch till numReturnedPairs, add one vote to each star in the pairs in the datastructure
+                for (const int16_t *k = lowerBoundSearch; k != upperBoundSearch; k++) {
+                    // depending on parity, the first or second star in the pair is the "other" one
+                    int16_t other;
+                    if ((k - lowerBoundSearch) % 2 == 0) {
+                        assert(vectorDatabase.Near(scratch->queries[j], tolerance,
+                                                   catalog[*k].spatial, catalog[*(k+1)].spatial));
+                        other = k[1];
+                    } else {
+                        other = k[-1];
+                    }
+                    // if (i == 542 && *k == 9085) {
+                    //     printf("INC, distance %f from query %f to %f\n", greatCircleDistance,
+                    //         lowerBoundRange, upperBoundRange);
+                    // }
+                    if (InMagnitudeBand(bands, catalog, i, *k) && InMagnitudeBand(bands, catalog, j, other)) {
+                        votes[*k]++;
+                    }
+                }
+                // US voting system
+            }
+        }
+        // Find star w most votes
+        int16_t maxVotes = votes[0];
+        int indexOfMax = 0;
+        for (int v = 1; v < (int)votes.size(); v++) {
+            if (votes[v] > maxVotes) {
+                maxVotes = votes[v];
+                indexOfMax = v;
+            }
+        }
+        // if (i == 542) {
+        //     for (decimal dist : vectorDatabase.StarDistances(9085, catalog)) {
+        //         printf("Actual 9085 distance: %f\n", dist);
+        //     }
+        //     puts("Debug star.");
+        //     for (int i = 0; i < (int)votes.size(); i++) {
+        //         if (votes[i] > maxVotes/2) {
+        //             printf("Star %4d received %d votes.\n", catalog[i].name, votes[i]);
+        //         }
+        //     }
+        //     printf("Debug star: Actually voted for %d with %d votes\n",
+        //            catalog[indexOfMax].name, maxVotes);
+        // }
+        // printf("Max votes: %d\n", maxVotes);
+        //starIndex = i, catalog index = indexOfMax
+        StarIdentifier newStar(i, indexOfMax);
+        // Set identified[i] to value of catalog index of star w most votesr
+        identified.push_back(newStar);
+    }
+    StarIdentifiers verified = VerifyByPairVotes(identified, stars, catalog, camera, tolerance);
+
+    progress->patternsTried = stars.size();
+    progress->confidence = verified.empty() ? 0 : 1;
+    return verified;
+}
+
+StarIdentifiers GeometricVotingStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera) const {
+
+    return Go(database, stars, catalog, camera, StarIdConstraints(), NULL);
+}
+
+StarIdentifiers GeometricVotingStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    const StarIdConstraints &constraints, StarIdProgress *progress) const {
+
+    StarIdProgress unusedProgress;
+    if (progress == NULL) {
+        progress = &unusedProgress;
+    }
+    *progress = StarIdProgress();
+
+    std::unique_ptr<VotingPairs> pairs = MakeVotingPairs(database, constraints);
+    if (!pairs) {
+        return StarIdentifiers();
+    }
+    GeometricVotingScratch scratch;
+    return GeometricVoting(*pairs, stars, catalog, camera, tolerance, &scratch, constraints, progress);
+}
+
+std::vector<StarIdentifiers> GeometricVotingStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Catalog &catalog, const StarIdFrame *frames, long numFrames) const {
+
+    std::vector<StarIdentifiers> result(numFrames);
+    // batch frames have no sky cone, so this never picks sky cells
+    std::unique_ptr<VotingPairs> pairs = MakeVotingPairs(database, StarIdConstraints());
+    if (!pairs) {
+        return result;
+    }
+    GeometricVotingScratch scratch;
+    StarIdProgress progress;
+    for (long i = 0; i < numFrames; i++) {
+        result[i] = GeometricVoting(*pairs, *frames[i].stars, catalog, *frames[i].camera, tolerance, &scratch,
+                                    StarIdConstraints(), &progress);
+    }
+    return result;
+}
+
+/*
+ * Strategies:
+ * 1. For each star, enumerate all stars which have the same combination of distances to some
+ *  other stars, getting down to a hopefully small (<10) list of candidates for each star, then
+ *  do a quad-nested loop to correlate them.
+ * 2. Loop through all possible stars in the catalog for star i. Then look at edge ij, using
+ * this to select possible j-th stars. If ever there is not a possible j-th star, continue the
+ * i-loop. When a possible ij combination is found, loop through k stars according to ik. IF
+ * none are found, continue the outer i loop. If some are found, check jk for each one. For each possible ijk triangle,
+ */
+
+/**
+ * Given a list of star pairs, finds all those pairs which involve a certain star.
+ * Here "involve" means that one of the two stars in the pair is the given star.
+ */
+class PairDistanceInvolvingIterator {
+public:
+    /**
+     * Create a "past-the-end" iterator.
+     * If another PairDistanceInvolvingIterator is equal to this, then it is done iterating.
+     */
+    PairDistanceInvolvingIterator()
+        : pairs(NULL), end(NULL) { };
+
+    /**
+     * The main constructor.
+     * @param pairs Start of an array of star pairs
+     * @param end "past-the-end" pointer for \p pairs
+     * @param The catalog index that we want to be involved in the outputted pairs.
+     */
+    PairDistanceInvolvingIterator(const int16_t *pairs, const int16_t *end, int16_t involving)
+        : pairs(pairs), end(end), involving(involving) {
+
+        assert((end-pairs)%2 == 0);
+        ForwardUntilInvolving();
+    };
+
+    // PairDistanceInvolvingIterator operator++() {
+    //     PairDistanceInvolvingIterator result(*this);
+    //     ++(*this);
+    //     return result;
+    // }
+
+    /// Move to the next matching pair.
+    PairDistanceInvolvingIterator &operator++() {
+        assert(HasValue());
+        pairs += 2;
+        ForwardUntilInvolving();
+        return *this;
+    }
+
+    /// Access the curent pair.
+    int16_t operator*() const {
+        return curValue;
+    }
+
+    /// Whether the iterator is currently on a value. (false if iteration is complete)
+    bool HasValue() {
+        return pairs != end;
+    }
+
+    // bool operator==(const PairDistanceInvolvingIterator &other) const {
+    //     return ()other.pairs == pairs;
+    // }
+
+    // bool operator!=(const PairDistanceInvolvingIterator &other) const {
+    //     return !(*this == other);
+    // }
+private:
+    const int16_t *pairs;
+    const int16_t *end;
+    int16_t involving;
+    int16_t curValue;
+
+    /// like postfix++, except it's a no-op if already on a valid spot.
+    void ForwardUntilInvolving() {
+        while (pairs != end) {
+            if (pairs[0] == involving) {
+                curValue = pairs[1];
+                return;
+            }
+            if (pairs[1] == involving) {
+                curValue = pairs[0];
+                return;
+            }
+            pairs += 2;
+        }
+    }
+};
+
+std::vector<int16_t> ConsumeInvolvingIterator(PairDistanceInvolvingIterator it) {
+    std::vector<int16_t> result;
+    for (; it.HasValue(); ++it) {
+        result.push_back(*it);
+    }
+    return result;
+}
+
+/**
+ * Given the result of a pair-distance kvector query, build a hashmultimap of stars to other stars
+ * that appeared with it in the query.
+ * 
+ * The resulting map is "symmetrical" in the sense that if a star B is in the map for star A, then
+ * star A is also in the map for star B.
+ */
+std::unordered_multimap<int16_t, int16_t> PairDistanceQueryToMap(const int16_t *pairs, const int16_t *end) {
+    std::unordered_multimap<int16_t, int16_t> result;
+    for (const int16_t *p = pairs; p != end; p += 2) {
+        result.emplace(p[0], p[1]);
+        result.emplace(p[1], p[0]);
+    }
+    return result;
+}
+
+/**
+ * Like the other PairDistanceQueryToMap, but only maps catalog star A to B if A could be centroid
+ * `fromStar` and B could be centroid `toStar` judging by their magnitudes (see InMagnitudeBand),
+ * so the map isn't symmetrical unless `bands` is empty.
+ */
+static std::unordered_multimap<int16_t, int16_t> PairDistanceQueryToMap(
+    const int16_t *pairs, const int16_t *end,
+    const Catalog &catalog, const std::vector<MagnitudeBand> &bands, int fromStar, int toStar) {
+
+    if (bands.empty()) {
+        return PairDistanceQueryToMap(pairs, end);
+    }
+    std::unordered_multimap<int16_t, int16_t> result;
+    for (const int16_t *p = pairs; p != end; p += 2) {
+        if (InMagnitudeBand(bands, catalog, fromStar, p[0]) && InMagnitudeBand(bands, catalog, toStar, p[1])) {
+            result.emplace(p[0], p[1]);
+        }
+        if (InMagnitudeBand(bands, catalog, fromStar, p[1]) && InMagnitudeBand(bands, catalog, toStar, p[0])) {
+            result.emplace(p[1], p[0]);
+        }
+    }
+    return result;
+}
+
+decimal IRUnidentifiedCentroid::VerticalAnglesToAngleFrom90(decimal v1, decimal v2) {
+    return DECIMAL_ABS(DecimalModulo(v1-v2, DECIMAL_M_PI) - DECIMAL_M_PI_2);
+}
+
+/**
+ * When a centroid within range of this centroid is identified, call this function. This function
+ * does /not/ check whether the centroid is within range.
+ */
+void IRUnidentifiedCentroid::AddIdentifiedStar(const StarIdentifier &starId, const Stars &stars) {
+    const Star &otherStar = stars[starId.starIndex];
+    Vec2 positionDifference = otherStar.position - star->position;
+    // only the direction of the line matters when looking for perpendicular pairs, so reduce mod pi.
+    decimal angleFromVertical = DecimalModulo(DECIMAL_ATAN2(positionDifference.y, positionDifference.x), DECIMAL_M_PI);
+
+    if (!identifiedStarsInRange.empty()) {
+        // The best partner is the identified star whose direction is closest to perpendicular, ie
+        // closest to `target` on a circle of circumference pi. Only the neighbors on either side
+        // of where `target` would be inserted can be closest.
+        decimal target = DecimalModulo(angleFromVertical + DECIMAL_M_PI_2, DECIMAL_M_PI);
+        auto after = std::lower_bound(identifiedStarsInRange.begin(), identifiedStarsInRange.end(), target,
+            [](const std::pair<decimal, StarIdentifier> &pair, decimal angle) {
+                return pair.first < angle;
+            });
+        auto before = after == identifiedStarsInRange.begin() ? identifiedStarsInRange.end() : after;
+        --before;
+        if (after == identifiedStarsInRange.end()) {
+            after = identifiedStarsInRange.begin();
+        }
+
+        for (auto candidate : {before, after}) {
+            decimal curAngleFrom90 = VerticalAnglesToAngleFrom90(candidate->first, angleFromVertical);
+            if (curAngleFrom90 < bestAngleFrom90) {
+                bestAngleFrom90 = curAngleFrom90;
+                bestStar1 = starId;
+                bestStar2 = candidate->second;
+            }
+        }
+    }
+
+    auto insertAt = std::upper_bound(identifiedStarsInRange.begin(), identifiedStarsInRange.end(), angleFromVertical,
+        [](decimal angle, const std::pair<decimal, StarIdentifier> &pair) {
+            return angle < pair.first;
+        });
+    identifiedStarsInRange.emplace(insertAt, angleFromVertical, starId);
+}
+
+void IRCentroidHeap::Place(int heapIndex, IRUnidentifiedCentroid *centroid) {
+    heap[heapIndex] = centroid;
+    centroid->heapIndex = heapIndex;
+}
+
+void IRCentroidHeap::SiftUp(int heapIndex) {
+    IRUnidentifiedCentroid *centroid = heap[heapIndex];
+    while (heapIndex > 0) {
+        int parent = (heapIndex - 1) / 2;
+        if (heap[parent]->bestAngleFrom90 <= centroid->bestAngleFrom90) {
+            break;
+        }
+        Place(heapIndex, heap[parent]);
+        heapIndex = parent;
+    }
+    Place(heapIndex, centroid);
+}
+
+void IRCentroidHeap::SiftDown(int heapIndex) {
+    IRUnidentifiedCentroid *centroid = heap[heapIndex];
+    int size = (int)heap.size();
+    while (true) {
+        int child = 2*heapIndex + 1;
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size && heap[child + 1]->bestAngleFrom90 < heap[child]->bestAngleFrom90) {
+            child++;
+        }
+        if (centroid->bestAngleFrom90 <= heap[child]->bestAngleFrom90) {
+            break;
+        }
+        Place(heapIndex, heap[child]);
+        heapIndex = child;
+    }
+    Place(heapIndex, centroid);
+}
+
+void IRCentroidHeap::Push(IRUnidentifiedCentroid *centroid) {
+    assert(centroid->heapIndex == -1);
+    heap.push_back(centroid);
+    SiftUp(heap.size() - 1);
+}
+
+IRUnidentifiedCentroid *IRCentroidHeap::Pop() {
+    assert(!heap.empty());
+    IRUnidentifiedCentroid *result = heap.front();
+    IRUnidentifiedCentroid *last = heap.back();
+    heap.pop_back();
+    if (!heap.empty()) {
+        Place(0, last);
+        SiftDown(0);
+    }
+    result->heapIndex = -1;
+    return result;
+}
+
+void IRCentroidHeap::DecreaseKey(IRUnidentifiedCentroid *centroid) {
+    assert(centroid->heapIndex >= 0 && heap[centroid->heapIndex] == centroid);
+    SiftUp(centroid->heapIndex);
+}
+
+/**
+ * Add a newly identified star to all the unidentified centroids within the requested distance of
+ * it, updating their positions in the heap.
+ *
+ * Centroids which already have a pair of identified stars closer than angleFrom90Threshold to
+ * perpendicular are not updated, for performance.
+ */
+void AddToAllUnidentifiedCentroids(const StarIdentifier &starId, const Stars &stars,
+                                   const std::vector<Vec3> &spatials,
+                                   std::vector<IRUnidentifiedCentroid> *allCentroids,
+                                   IRCentroidHeap *heap,
+                                   decimal minDistance, decimal maxDistance,
+                                   decimal angleFrom90Threshold) {
+
+    const Vec3 &ourSpatial = spatials[starId.starIndex];
+    decimal minCos = DECIMAL_COS(maxDistance);
+    decimal maxCos = DECIMAL_COS(minDistance);
+
+    for (IRUnidentifiedCentroid &centroid : *allCentroids) {
+        if (centroid.heapIndex < 0 || centroid.bestAngleFrom90 <= angleFrom90Threshold) {
+            continue;
+        }
+        decimal angleCos = ourSpatial * spatials[centroid.index];
+        if (angleCos < minCos || angleCos > maxCos) {
+            continue;
+        }
+        decimal oldAngleFrom90 = centroid.bestAngleFrom90;
+        centroid.AddIdentifiedStar(starId, stars);
+        if (centroid.bestAngleFrom90 < oldAngleFrom90) {
+            heap->DecreaseKey(&centroid);
+        }
+    }
+}
+
+/**
+ * Given two already-identified centroids, and the distance from each to an as-yet unidentified
+ * third centroid, return a list of candidate catalog stars that could be the third centroid.
+ *
+ * The order in which the two centroids are passed in /does/ matter wrt spectral-ness. If the first
+ * supplied catalog star is `a`, second is `b`, and the unidentified is `c`, then (`a` crossproduct
+ * `b`) dot `c` will be positive for all returned `c`. Intuitively, if the triangle is fairly small
+ * on the surface of the sphere, then viewed from the origin, the vertices `a`, `b`, and `c` should
+ * be clockwise (then, the cross product of `a` and `b` will point mostly towards `c`, and a little
+ * outwards, so that dot product with `c` captures that positive outward part).
+ */
+std::vector<int16_t> IdentifyThirdStar(const PairDistanceKVectorDatabase &db,
+                                       const Catalog &catalog,
+                                       int16_t catalogIndex1, int16_t catalogIndex2,
+                                       decimal distance1, decimal distance2,
+                                       decimal tolerance) {
+
+    const int16_t *query1End;
+    const int16_t *query1 = db.FindPairsExact(catalog, distance1-tolerance, distance1+tolerance, &query1End);
+
+    const Vec3 &spatial1 = catalog[catalogIndex1].spatial;
+    const Vec3 &spatial2 = catalog[catalogIndex2].spatial;
+    const Vec3 cross = spatial1.CrossProduct(spatial2);
+
+    // Use PairDistanceInvolvingIterator to find catalog candidates for the unidentified centroid
+    // from the first star, then keep only those at the right distance from the second star.
+    std::vector<int16_t> result = ConsumeInvolvingIterator(PairDistanceInvolvingIterator(query1, query1End, catalogIndex1));
+
+    // also check spectrality.
+    // if they are nearly coplanar, don't need to check spectrality
+    // TODO: Implement ^^. Not high priority, since always checking spectrality is conservative.
+    CandidateWindow window = DistanceWindow(spatial2, distance2-tolerance, distance2+tolerance, cross);
+    result.resize(FilterCandidates(catalog, window, result.data(), result.size(), result.data()));
+
+    return result;
+}
+
+/**
+ * Like the other IdentifyThirdStar, but with the distances stored in the pair records, the distance
+ * band is trimmed exactly and the pairs involving the first star are found in one pass over the
+ * records, without looking anything up in the catalog.
+ */
+std::vector<int16_t> IdentifyThirdStar(const PairRecordKVectorDatabase &db,
+                                       const Catalog &catalog,
+                                       int16_t catalogIndex1, int16_t catalogIndex2,
+                                       decimal distance1, decimal distance2,
+                                       decimal tolerance) {
+
+    const PairRecord *query1End;
+    const PairRecord *query1 = db.FindPairsExact(distance1-tolerance, distance1+tolerance, &query1End);
+
+    std::vector<int16_t> result;
+    for (const PairRecord *record = query1; record != query1End; record++) {
+        if (record->index1 == catalogIndex1) {
+            result.push_back(record->index2);
+        } else if (record->index2 == catalogIndex1) {
+            result.push_back(record->index1);
+        }
+    }
+
+    const Vec3 cross = catalog[catalogIndex1].spatial.CrossProduct(catalog[catalogIndex2].spatial);
+    CandidateWindow window = DistanceWindow(catalog[catalogIndex2].spatial, distance2-tolerance, distance2+tolerance, cross);
+    result.resize(FilterCandidates(catalog, window, result.data(), result.size(), result.data()));
+
+    return result;
+}
+
+/**
+ * Like the other IdentifyThirdStar, but the candidates are the neighbors of the first star at the
+ * right distance, found by binary search in its own list rather than in the pairs of every star.
+ */
+std::vector<int16_t> IdentifyThirdStar(const NeighborDatabase &db,
+                                       const Catalog &catalog,
+                                       int16_t catalogIndex1, int16_t catalogIndex2,
+                                       decimal distance1, decimal distance2,
+                                       decimal tolerance) {
+
+    const int16_t *neighborsEnd;
+    const int16_t *neighbors = db.Neighbors(catalogIndex1, distance1-tolerance, distance1+tolerance, &neighborsEnd);
+    std::vector<int16_t> result(neighbors, neighborsEnd);
+
+    const Vec3 cross = catalog[catalogIndex1].spatial.CrossProduct(catalog[catalogIndex2].spatial);
+    CandidateWindow window = DistanceWindow(catalog[catalogIndex2].spatial, distance2-tolerance, distance2+tolerance, cross);
+    result.resize(FilterCandidates(catalog, window, result.data(), result.size(), result.data()));
+
+    return result;
+}
+
+const decimal kAngleFrom90SoftThreshold = DECIMAL_M_PI_4; // TODO: tune this
+
+/**
+ * IdentifyRemainingStarsPairDistance, looking third stars up in db, which is any database with an
+ * IdentifyThirdStar overload. Only pairs within db's distance range are used.
+ *
+ * Iterates through the unidentified centroids in an intelligent order, identifying them one by one:
+ * Always the centroid whose best pair of identified stars is closest to perpendicular, because that
+ * pair locates it most precisely.
+ * @param bands If not NULL, the magnitude band of each centroid (see InMagnitudeBand)
+ */
+template <typename ThirdStarDatabase>
+static int IdentifyRemainingStars(StarIdentifiers *identifiers,
+                                  const Stars &stars,
+                                  const ThirdStarDatabase &db,
+                                  const Catalog &catalog,
+                                  const Camera &camera,
+                                  decimal tolerance,
+                                  const std::vector<MagnitudeBand> *bands) {
+#if LOST_LOG_LEVEL >= LOST_LOG_LEVEL_DEBUG
+    auto startTimestamp = std::chrono::steady_clock::now();
+#endif
+    // pairs further apart than the database stores can't be looked up
+    decimal minDistance = db.MinDistance();
+    decimal maxDistance = db.MaxDistance();
+
+    std::vector<Vec3> spatials;
+    spatials.reserve(stars.size());
+    for (const Star &star : stars) {
+        spatials.push_back(camera.CameraToSpatial(star.position).Normalize());
+    }
+
+    // initialize all unidentified centroids. Pointers to these are kept in the heap, so it must not
+    // be resized after this.
+    std::vector<IRUnidentifiedCentroid> allUnidentifiedCentroids;
+    allUnidentifiedCentroids.reserve(stars.size());
+    for (size_t i = 0; i < stars.size(); i++) {
+        allUnidentifiedCentroids.push_back(IRUnidentifiedCentroid(stars[i], i));
+    }
+    IRCentroidHeap unidentifiedCentroids;
+    for (IRUnidentifiedCentroid &centroid : allUnidentifiedCentroids) {
+        // only add if index is not equal to any starIndex in identifiers already
+        if (std::find_if(identifiers->begin(), identifiers->end(),
+            [&centroid](const StarIdentifier &identifier) {
+                return identifier.starIndex == centroid.index;
+            }) == identifiers->end()) {
+
+            unidentifiedCentroids.Push(&centroid);
+        }
+    }
+
+    // for each identified star, add it to the list of identified stars for each unidentified centroid within range
+    for (const auto &starId : *identifiers) {
+        AddToAllUnidentifiedCentroids(starId, stars, spatials,
+                                      &allUnidentifiedCentroids, &unidentifiedCentroids,
+                                      minDistance, maxDistance,
+                                      kAngleFrom90SoftThreshold);
+    }
+
+    int numExtraIdentifiedStars = 0;
+
+    // keep getting the best unidentified centroid and identifying it.
+    // 10 is arbitrary; but really it should be less than DECIMAL_M_PI_2 when set
+    while (!unidentifiedCentroids.Empty() && unidentifiedCentroids.Top()->bestAngleFrom90 < 10) {
+        IRUnidentifiedCentroid *nextUnidentifiedCentroid = unidentifiedCentroids.Pop();
+
+        // find angle between the two best identified stars and current unidentified centroid
+        const Vec3 &unidentifiedSpatial = spatials[nextUnidentifiedCentroid->index];
+        const Vec3 &spatial1 = spatials[nextUnidentifiedCentroid->bestStar1.starIndex];
+        const Vec3 &spatial2 = spatials[nextUnidentifiedCentroid->bestStar2.starIndex];
+        decimal d1 = AngleUnit(spatial1, unidentifiedSpatial);
+        decimal d2 = AngleUnit(spatial2, unidentifiedSpatial);
+        decimal spectralTorch = spatial1.CrossProduct(spatial2) * unidentifiedSpatial;
+
+        // find all the catalog stars that are in both annuli
+        // flip arguments for appropriate spectrality.
+        int16_t catalogIndex1 = nextUnidentifiedCentroid->bestStar1.catalogIndex;
+        int16_t catalogIndex2 = nextUnidentifiedCentroid->bestStar2.catalogIndex;
+        if (spectralTorch <= 0) {
+            std::swap(catalogIndex1, catalogIndex2);
+            std::swap(d1, d2);
+        }
+        std::vector<int16_t> candidates = IdentifyThirdStar(db, catalog, catalogIndex1, catalogIndex2, d1, d2, tolerance);
+        if (bands != NULL) {
+            int starIndex = nextUnidentifiedCentroid->index;
+            candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                            [&](int16_t candidate) {
+                                                return !InMagnitudeBand(*bands, catalog, starIndex, candidate);
+                                            }),
+                             candidates.end());
+        }
+
+        if (candidates.size() != 1) { // if there is not exactly one candidate, we can't identify the star. Just remove it from the list.
+            if (candidates.size() > 1) {
+                LOST_LOG_WARNING("Multiple catalog stars matched during identify remaining stars. This should be rare.");
+            }
+        } else {
+            // identify the centroid
+            identifiers->emplace_back(nextUnidentifiedCentroid->index, candidates[0]);
+
+            // update nearby unidentified centroids with the new identified star
+            AddToAllUnidentifiedCentroids(identifiers->back(), stars, spatials,
+                                          &allUnidentifiedCentroids, &unidentifiedCentroids,
+                                          minDistance, maxDistance,
+                                          // TODO should probably tune this:
+                                          kAngleFrom90SoftThreshold);
+
+            ++numExtraIdentifiedStars;
+        }
+    }
+
+#if LOST_LOG_LEVEL >= LOST_LOG_LEVEL_DEBUG
+    auto endTimestamp = std::chrono::steady_clock::now();
+    LOST_LOG_DEBUG("IdentifyRemainingStarsPairDistance took %lldus",
+                   (long long)std::chrono::duration_cast<std::chrono::microseconds>(endTimestamp - startTimestamp).count());
+#endif
+
+    return numExtraIdentifiedStars;
+}
+
+int IdentifyRemainingStarsPairDistance(StarIdentifiers *identifiers,
+                                       const Stars &stars,
+                                       const PreparedDatabase &database,
+                                       const Catalog &catalog,
+                                       const Camera &camera,
+                                       decimal tolerance,
+                                       const std::vector<MagnitudeBand> *bands) {
+    // all find the same candidates, the neighbor lists fastest, then the pair records
+    if (database.Neighbors() != NULL) {
+        return IdentifyRemainingStars(identifiers, stars, *database.Neighbors(), catalog, camera, tolerance, bands);
+    }
+    if (database.PairRecordKVector() != NULL) {
+        return IdentifyRemainingStars(identifiers, stars, *database.PairRecordKVector(), catalog, camera, tolerance, bands);
+    }
+    assert(database.PairDistanceKVector() != NULL);
+    return IdentifyRemainingStars(identifiers, stars, *database.PairDistanceKVector(), catalog, camera, tolerance, bands);
+}
+
+decimal PyramidExpectedMismatches(const std::vector<Vec3> &spatials, int i, int j, int k,
+                                         decimal tolerance, int numFalseStars) {
+    return PyramidExpectedMismatches(spatials, i, j, k, PairTolerances(tolerance), numFalseStars);
+}
+
+decimal PyramidExpectedMismatches(const std::vector<Vec3> &spatials, int i, int j, int k,
+                                  const PairTolerances &tolerances, int numFalseStars) {
+    const Vec3 &iSpatial = spatials[i];
+    const Vec3 &jSpatial = spatials[j];
+    const Vec3 &kSpatial = spatials[k];
+
+    // the derivation assumes one tolerance for every side
+    decimal tolerance = tolerances.Triangle(i, j, k);
+
+    // smallest normal single-precision decimal is around 10^-38 so we should be all good.
+    decimal expectedMismatchesConstant = DECIMAL_POW(numFalseStars, 4) * DECIMAL_POW(tolerance, 5) / 2 / DECIMAL_POW(DECIMAL_M_PI, 2);
+
+    decimal ijDist = AngleUnit(iSpatial, jSpatial);
+
+    decimal iSinInner = DECIMAL_SIN(Angle(jSpatial - iSpatial, kSpatial - iSpatial));
+    decimal jSinInner = DECIMAL_SIN(Angle(iSpatial - jSpatial, kSpatial - jSpatial));
+    decimal kSinInner = DECIMAL_SIN(Angle(iSpatial - kSpatial, jSpatial - kSpatial));
+
+    return expectedMismatchesConstant
+        * DECIMAL_SIN(ijDist)
+        / kSinInner
+        / std::max(std::max(iSinInner, jSinInner), kSinInner);
+}
+
+std::vector<int> BrightestStars(const Stars &stars, int numBrightest) {
+    std::vector<int> result;
+    for (int i = 0; i < (int)stars.size(); i++) {
+        result.push_back(i);
+    }
+    // stable, so that stars of equal brightness stay in the centroider's order
+    std::stable_sort(result.begin(), result.end(), [&stars](int a, int b) {
+        return stars[a].magnitude > stars[b].magnitude;
+    });
+    if ((int)result.size() > numBrightest) {
+        result.resize(numBrightest);
+    }
+    return result;
+}
+
+std::vector<PyramidIndices> RankPyramids(const std::vector<int> &starIndices,
+                                         const std::vector<Vec3> &spatials,
+                                         decimal minDistance, decimal maxDistance,
+                                         const PairTolerances &tolerances, int numFalseStars,
+                                         decimal maxMismatchProbability) {
+    std::vector<PyramidIndices> result;
+    std::vector<decimal> expectedMismatches;
+    int numCandidates = (int)starIndices.size();
+    for (int a = 0; a < numCandidates; a++) {
+        for (int b = a+1; b < numCandidates; b++) {
+            for (int c = b+1; c < numCandidates; c++) {
+                for (int d = c+1; d < numCandidates; d++) {
+                    const int quad[4] = { starIndices[a], starIndices[b], starIndices[c], starIndices[d] };
+
+                    // a pyramid with any distance outside the database would just be skipped
+                    bool inRange = true;
+                    for (int p = 0; p < 4; p++) {
+                        for (int q = p+1; q < 4; q++) {
+                            decimal distance = AngleUnit(spatials[quad[p]], spatials[quad[q]]);
+                            inRange = inRange && distance >= minDistance && distance <= maxDistance;
+                        }
+                    }
+                    if (!inRange) {
+                        continue;
+                    }
+
+                    // Only the triangle ijk enters into the mismatch probability, so pick whichever
+                    // star is r, and whichever vertex of the triangle is k, gives the best odds.
+                    PyramidIndices best = {0, 0, 0, 0};
+                    decimal bestMismatches = INFINITY;
+                    for (int rPos = 0; rPos < 4; rPos++) {
+                        for (int kPos = 0; kPos < 4; kPos++) {
+                            if (kPos == rPos) {
+                                continue;
+                            }
+                            int ijPos[2];
+                            int numIj = 0;
+                            for (int pos = 0; pos < 4; pos++) {
+                                if (pos != rPos && pos != kPos) {
+                                    ijPos[numIj++] = pos;
+                                }
+                            }
+                            PyramidIndices pyramid = { quad[ijPos[0]], quad[ijPos[1]], quad[kPos], quad[rPos] };
+                            decimal mismatches = PyramidExpectedMismatches(spatials, pyramid.i, pyramid.j, pyramid.k,
+                                                                           tolerances, numFalseStars);
+                            if (mismatches < bestMismatches) {
+                                best = pyramid;
+                                bestMismatches = mismatches;
+                            }
+                        }
+                    }
+
+                    if (bestMismatches <= maxMismatchProbability) {
+                        result.push_back(best);
+                        expectedMismatches.push_back(bestMismatches);
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<int> order;
+    for (int i = 0; i < (int)result.size(); i++) {
+        order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&expectedMismatches](int a, int b) {
+        return expectedMismatches[a] < expectedMismatches[b];
+    });
+    std::vector<PyramidIndices> sortedResult;
+    for (int i : order) {
+        sortedResult.push_back(result[i]);
+    }
+    return sortedResult;
+}
+
+/**
+ * Centroids bucketed by position, in compressed rows: the centroids in cell c are
+ * `indices[cellStarts[c]]` up to `indices[cellStarts[c+1]]`.
+ */
+struct CentroidGrid {
+    decimal cellSize;
+    int numCellsX;
+    int numCellsY;
+    std::vector<int> cellStarts;
+    std::vector<int> indices;
+
+    int CellX(decimal x) const { return std::min(std::max((int)(x / cellSize), 0), numCellsX - 1); }
+    int CellY(decimal y) const { return std::min(std::max((int)(y / cellSize), 0), numCellsY - 1); }
+};
+
+static CentroidGrid MakeCentroidGrid(const Stars &stars, const Camera &camera, decimal minCellSize) {
+    CentroidGrid grid;
+    // about 4 cells per centroid, unless that's smaller than the match radius
+    decimal area = (decimal)camera.XResolution() * camera.YResolution();
+    grid.cellSize = std::max(minCellSize, DECIMAL_SQRT(area / (4 * std::max((int)stars.size(), 1))));
+    grid.numCellsX = (int)(camera.XResolution() / grid.cellSize) + 1;
+    grid.numCellsY = (int)(camera.YResolution() / grid.cellSize) + 1;
+
+    // counting sort by cell
+    grid.cellStarts.assign(grid.numCellsX*grid.numCellsY + 1, 0);
+    std::vector<int> cells;
+    for (const Star &star : stars) {
+        int cell = grid.CellY(star.position.y)*grid.numCellsX + grid.CellX(star.position.x);
+        cells.push_back(cell);
+        grid.cellStarts[cell + 1]++;
+    }
+    for (int c = 0; c < grid.numCellsX*grid.numCellsY; c++) {
+        grid.cellStarts[c + 1] += grid.cellStarts[c];
+    }
+    grid.indices.resize(stars.size());
+    std::vector<int> nextInCell(grid.cellStarts.begin(), grid.cellStarts.end() - 1);
+    for (int i = 0; i < (int)stars.size(); i++) {
+        grid.indices[nextInCell[cells[i]]++] = i;
+    }
+    return grid;
+}
+
+/**
+ * Check a few star identifications against the rest of the image.
+ * @param seed The identifications to check. Needs at least 2.
+ * @param identified[out] If accepted, the seed plus every other centroid that a catalog star landed
+ * on. May be NULL.
+ */
+ReprojectionOutcome ReprojectionVerifier::Verify(const StarIdentifiers &seed, const Stars &stars,
+                                                 const Catalog &catalog, const Camera &camera,
+                                                 StarIdentifiers *identified) const {
+    if (seed.size() < 2) {
+        return ReprojectionOutcome::kInconclusive;
+    }
+
+    Attitude attitude = TriadAlgorithm().Go(camera, stars, catalog, seed);
+    Mat3 dcm = attitude.GetDCM();
+    // the camera's x axis, in the celestial frame
+    Vec3 boresight = dcm.Row(0);
+
+    // cosine of the angle from the boresight to the furthest corner, so most of the catalog can be
+    // skipped with a dot product
+    decimal minBoresightCos = std::max(DECIMAL(0.0), MinCornerCos(camera));
+
+    // close enough to use the focal length throughout the image
+    decimal radius = tolerance * camera.FocalLength();
+    CentroidGrid grid = MakeCentroidGrid(stars, camera, radius);
+
+    // each catalog star lands on at most its closest centroid, and each centroid keeps the closest
+    // catalog star that landed on it
+    std::vector<int> bestCatalogIndex(stars.size(), -1);
+    std::vector<decimal> bestDistanceSq(stars.size(), radius*radius);
+    for (int c = 0; c < (int)catalog.size(); c++) {
+        if (catalog[c].spatial * boresight <= minBoresightCos) {
+            continue;
+        }
+        Vec2 projected = camera.SpatialToCamera(dcm * catalog[c].spatial);
+        if (!camera.InSensor(projected)) {
+            continue;
+        }
+        // the closest centroid within the radius, if any
+        int closest = -1;
+        decimal closestDistanceSq = radius*radius;
+        int cellX = grid.CellX(projected.x);
+        int cellY = grid.CellY(projected.y);
+        for (int y = std::max(cellY - 1, 0); y <= std::min(cellY + 1, grid.numCellsY - 1); y++) {
+            for (int x = std::max(cellX - 1, 0); x <= std::min(cellX + 1, grid.numCellsX - 1); x++) {
+                int cell = y*grid.numCellsX + x;
+                for (int n = grid.cellStarts[cell]; n < grid.cellStarts[cell + 1]; n++) {
+                    int i = grid.indices[n];
+                    Vec2 offset = stars[i].position - projected;
+                    decimal distanceSq = offset.x*offset.x + offset.y*offset.y;
+                    if (distanceSq <= closestDistanceSq) {
+                        closest = i;
+                        closestDistanceSq = distanceSq;
+                    }
+                }
+            }
+        }
+        if (closest != -1 && closestDistanceSq <= bestDistanceSq[closest]) {
+            bestDistanceSq[closest] = closestDistanceSq;
+            bestCatalogIndex[closest] = c;
+        }
+    }
+
+    // the seed must at least agree with itself
+    std::vector<bool> inSeed(stars.size(), false);
+    for (const StarIdentifier &starId : seed) {
+        if (bestCatalogIndex[starId.starIndex] != starId.catalogIndex) {
+            return ReprojectionOutcome::kReject;
+        }
+        inSeed[starId.starIndex] = true;
+    }
+
+    int numChecked = 0;
+    int numMatched = 0;
+    for (int i = 0; i < (int)stars.size(); i++) {
+        if (!inSeed[i]) {
+            numChecked++;
+            numMatched += bestCatalogIndex[i] != -1;
+        }
+    }
+    LOST_LOG_DEBUG("Reprojection matched %d of %d other centroids.", numMatched, numChecked);
+    if (numChecked < minChecks) {
+        return ReprojectionOutcome::kInconclusive;
+    }
+    if (numMatched < minMatchFraction * numChecked) {
+        return ReprojectionOutcome::kReject;
+    }
+
+    if (identified != NULL) {
+        *identified = seed;
+        for (int i = 0; i < (int)stars.size(); i++) {
+            if (!inSeed[i] && bestCatalogIndex[i] != -1) {
+                identified->push_back(StarIdentifier(i, bestCatalogIndex[i]));
+            }
+        }
+    }
+    return ReprojectionOutcome::kAccept;
+}
+
+/// What came of trying to match one pyramid of centroids
+enum class PyramidOutcome {
+    /// Not tried, because some distance is too close to the edge of the database's range
+    kSkipped,
+    /// No catalog pyramid matched
+    kNoMatch,
+    /// More than one catalog pyramid matched
+    kNotUnique,
+    /// Exactly one catalog pyramid matched
+    kUnique,
+};
+
+/**
+ * Matches pyramids of centroids against a PairDistanceKVectorDatabase using all six distances
+ * between their stars. Keeps its scratch buffers between calls, so make one per search.
+ */
+class PyramidMatcher {
+public:
+    /// @param records If not NULL, the same pairs as db with their distances, to find each side's candidates with
+    /// @param spatials Normalized spatial vectors of each centroid
+    /// @param allowed If not NULL, only match these catalog stars
+    /// @param bands Magnitude band of each centroid, or empty to allow any magnitude
+    PyramidMatcher(const PairDistanceKVectorDatabase &db, const PairRecordKVectorDatabase *records, const Catalog &catalog,
+                   const std::vector<Vec3> &spatials, const PairTolerances &tolerances, const CatalogMask *allowed,
+                   const std::vector<MagnitudeBand> &bands)
+        : db(db), records(records), catalog(catalog), spatials(spatials), tolerances(tolerances), allowed(allowed),
+          bands(bands) { };
+
+    PyramidOutcome Match(const PyramidIndices &pyramid, int16_t *pyramidMatch,
+                         long *numTriangleMatches, int16_t *triangleMatch);
+
+private:
+    const PairDistanceKVectorDatabase &db;
+    const PairRecordKVectorDatabase *records;
+    const Catalog &catalog;
+    const std::vector<Vec3> &spatials;
+    const PairTolerances &tolerances;
+    const CatalogMask *allowed;
+    const std::vector<MagnitudeBand> &bands;
+    // scratch space for candidate filtering, reused between pyramids
+    std::vector<int16_t> ijPairs, ikPairs, irPairs;
+    std::vector<int16_t> kCandidates, rCandidates, krCandidates;
+};
+
+/**
+ * Find the catalog stars matching a pyramid of centroids.
+ * @param pyramidMatch[out] When the match is unique, the catalog indices matching i, j, k, and r.
+ * @param numTriangleMatches[out] How many catalog triangles matched ijk, whether or not any fourth
+ * star matched r.
+ * @param triangleMatch[out] The catalog indices matching i, j, and k in one of those triangles.
+ */
+PyramidOutcome PyramidMatcher::Match(const PyramidIndices &pyramid, int16_t *pyramidMatch,
+                                     long *numTriangleMatches, int16_t *triangleMatch) {
+    *numTriangleMatches = 0;
+
+    const Vec3 &iSpatial = spatials[pyramid.i];
+    const Vec3 &jSpatial = spatials[pyramid.j];
+    const Vec3 &kSpatial = spatials[pyramid.k];
+    const Vec3 &rSpatial = spatials[pyramid.r];
+
+    // sign of determinant, to detect flipped patterns
+    bool spectralTorch = iSpatial.CrossProduct(jSpatial)*kSpatial > 0;
+
+    decimal ijDist = AngleUnit(iSpatial, jSpatial);
+    decimal ikDist = AngleUnit(iSpatial, kSpatial);
+    decimal irDist = AngleUnit(iSpatial, rSpatial);
+    decimal jkDist = AngleUnit(jSpatial, kSpatial);
+    decimal jrDist = AngleUnit(jSpatial, rSpatial);
+    decimal krDist = AngleUnit(kSpatial, rSpatial); // TODO: we don't really need to
+                                                  // check krDist, if k has been
+                                                  // verified by i and j it's fine.
+    decimal ijTolerance = tolerances.Get(pyramid.i, pyramid.j);
+    decimal ikTolerance = tolerances.Get(pyramid.i, pyramid.k);
+    decimal irTolerance = tolerances.Get(pyramid.i, pyramid.r);
+    decimal jkTolerance = tolerances.Get(pyramid.j, pyramid.k);
+    decimal jrTolerance = tolerances.Get(pyramid.j, pyramid.r);
+    decimal krTolerance = tolerances.Get(pyramid.k, pyramid.r);
+
+    // we check the distances with the extra tolerance requirement to ensure that
+    // there isn't some pyramid that's just outside the database's bounds, but
+    // within measurement tolerance of the observed pyramid, since that would
+    // possibly cause a non-unique pyramid to be identified as unique.
+#define _CHECK_DISTANCE(_dist, _tolerance) if (_dist < db.MinDistance() + _tolerance || _dist > db.MaxDistance() - _tolerance) { return PyramidOutcome::kSkipped; }
+    _CHECK_DISTANCE(ikDist, ikTolerance);
+    _CHECK_DISTANCE(irDist, irTolerance);
+    _CHECK_DISTANCE(jkDist, jkTolerance);
+    _CHECK_DISTANCE(jrDist, jrTolerance);
+    _CHECK_DISTANCE(krDist, krTolerance);
+#undef _CHECK_DISTANCE
+
+    // one batch, so that the three lookups overlap
+    KVectorInterval queries[3] = {
+        { ijDist - ijTolerance, ijDist + ijTolerance },
+        { ikDist - ikTolerance, ikDist + ikTolerance },
+        { irDist - irTolerance, irDist + irTolerance },
+    };
+    const int16_t *ijQuery, *ijEnd, *ikQuery, *ikEnd, *irQuery, *irEnd;
+    if (records != NULL) {
+        // exact, so no i or j candidate is tried that's just outside the tolerance
+        FindRecordPairs(*records, queries[0], allowed, &ijQuery, &ijEnd, &ijPairs);
+        FindRecordPairs(*records, queries[1], allowed, &ikQuery, &ikEnd, &ikPairs);
+        FindRecordPairs(*records, queries[2], allowed, &irQuery, &irEnd, &irPairs);
+    } else {
+        KVectorRange ranges[3];
+        db.FindPairsLiberal(queries, 3, ranges);
+        ijQuery = db.Pair(ranges[0].begin);
+        ijEnd = db.Pair(ranges[0].end);
+        ikQuery = db.Pair(ranges[1].begin);
+        ikEnd = db.Pair(ranges[1].end);
+        irQuery = db.Pair(ranges[2].begin);
+        irEnd = db.Pair(ranges[2].end);
+        FilterPairs(allowed, &ijQuery, &ijEnd, &ijPairs);
+        FilterPairs(allowed, &ikQuery, &ikEnd, &ikPairs);
+        FilterPairs(allowed, &irQuery, &irEnd, &irPairs);
+    }
+
+    std::unordered_multimap<int16_t, int16_t> ikMap =
+        PairDistanceQueryToMap(ikQuery, ikEnd, catalog, bands, pyramid.i, pyramid.k);
+    std::unordered_multimap<int16_t, int16_t> irMap =
+        PairDistanceQueryToMap(irQuery, irEnd, catalog, bands, pyramid.i, pyramid.r);
+
+    // the cosine bounds are the same for every candidate; only the centers change
+    Vec3 origin = {0, 0, 0};
+    CandidateWindow kWindow = DistanceWindow(origin, jkDist - jkTolerance, jkDist + jkTolerance, origin);
+    CandidateWindow jrWindow = DistanceWindow(origin, jrDist - jrTolerance, jrDist + jrTolerance);
+    CandidateWindow krWindow = DistanceWindow(origin, krDist - krTolerance, krDist + krTolerance);
+
+    PyramidOutcome outcome = PyramidOutcome::kNoMatch;
+    for (const int16_t *iCandidateQuery = ijQuery; iCandidateQuery != ijEnd; iCandidateQuery++) {
+        int iCandidate = *iCandidateQuery;
+        // depending on parity, the first or second star in the pair is the "other" one
+        int jCandidate = (iCandidateQuery - ijQuery) % 2 == 0
+            ? iCandidateQuery[1]
+            : iCandidateQuery[-1];
+        if (!InMagnitudeBand(bands, catalog, pyramid.i, iCandidate)
+            || !InMagnitudeBand(bands, catalog, pyramid.j, jCandidate)) {
+            continue;
+        }
+
+        const Vec3 &iCandidateSpatial = catalog[iCandidate].spatial;
+        const Vec3 &jCandidateSpatial = catalog[jCandidate].spatial;
+
+        Vec3 ijCandidateCross = iCandidateSpatial.CrossProduct(jCandidateSpatial);
+
+        // k candidates must be at the right distance from both i and j, and have
+        // the same spectrality as the centroids.
+        kCandidates.clear();
+        for (auto kCandidateIt = ikMap.equal_range(iCandidate); kCandidateIt.first != kCandidateIt.second; kCandidateIt.first++) {
+            // kCandidate.first is iterator, then ->second is the value (other star)
+            kCandidates.push_back(kCandidateIt.first->second);
+        }
+        kWindow.center = jCandidateSpatial;
+        kWindow.normal = spectralTorch ? ijCandidateCross : ijCandidateCross * DECIMAL(-1.0);
+        kCandidates.resize(FilterCandidates(catalog, kWindow, kCandidates.data(), kCandidates.size(), kCandidates.data()));
+        if (kCandidates.empty()) {
+            continue;
+        }
+        *numTriangleMatches += kCandidates.size();
+        triangleMatch[0] = iCandidate;
+        triangleMatch[1] = jCandidate;
+        triangleMatch[2] = kCandidates[0];
+
+        // r candidates only depend on i and j, so filter them once for all the k-s
+        rCandidates.clear();
+        for (auto rCandidateIt = irMap.equal_range(iCandidate); rCandidateIt.first != rCandidateIt.second; rCandidateIt.first++) {
+            rCandidates.push_back(rCandidateIt.first->second);
+        }
+        jrWindow.center = jCandidateSpatial;
+        rCandidates.resize(FilterCandidates(catalog, jrWindow, rCandidates.data(), rCandidates.size(), rCandidates.data()));
+        if (rCandidates.empty()) {
+            continue;
+        }
+
+        krCandidates.resize(rCandidates.size());
+        for (int16_t kCandidate : kCandidates) {
+            krWindow.center = catalog[kCandidate].spatial;
+            long numKrCandidates = FilterCandidates(catalog, krWindow, rCandidates.data(), rCandidates.size(), krCandidates.data());
+            for (long rCandidateIndex = 0; rCandidateIndex < numKrCandidates; rCandidateIndex++) {
+                // we have a match!
+                if (outcome == PyramidOutcome::kUnique) {
+                    // uh-oh, stinky!
+                    // TODO: test duplicate detection, it's hard to cause it in the real catalog...
+                    return PyramidOutcome::kNotUnique;
+                }
+                outcome = PyramidOutcome::kUnique;
+                pyramidMatch[0] = iCandidate;
+                pyramidMatch[1] = jCandidate;
+                pyramidMatch[2] = kCandidate;
+                pyramidMatch[3] = krCandidates[rCandidateIndex];
+            }
+        }
+    }
+
+    return outcome;
+}
+
+StarIdentifiers PyramidStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera) const {
+
+    return Go(database, stars, catalog, camera, StarIdConstraints(), NULL);
+}
+
+StarIdentifiers PyramidStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    const StarIdConstraints &constraints, StarIdProgress *progress) const {
+
+    StarIdProgress unusedProgress;
+    if (progress == NULL) {
+        progress = &unusedProgress;
+    }
+    *progress = StarIdProgress();
+    progress->patternsTotal = NumFourStarPatterns(stars.size());
+
+    StarIdentifiers identified;
+    if (database.PairDistanceKVector() == NULL || stars.size() < 4) {
+        LOST_LOG_WARNING("Not enough stars, or database missing.");
+        return identified;
+    }
+    const PairDistanceKVectorDatabase &vectorDatabase = *database.PairDistanceKVector();
+
+    std::vector<Vec3> spatials;
+    for (const Star &star : stars) {
+        spatials.push_back(camera.CameraToSpatial(star.position).Normalize());
+    }
+    std::vector<MagnitudeBand> bands = MagnitudeBands(constraints, stars);
+    PairTolerances tolerances(tolerance, stars, camera, constraints.centroidUncertainties);
+    PyramidMatcher matcher(vectorDatabase, database.PairRecordKVector(), catalog, spatials, tolerances,
+                           constraints.allowedStars, bands);
+
+    long totalIterations = 0;
+    // the partial result to return if the deadline passes before any pyramid matches
+    StarIdentifiers bestTriangle;
+    decimal bestTriangleMismatches = INFINITY;
+
+    // Try one pyramid. Returns whether the search is over, in which case `identified` and
+    // `*progress` hold the result.
+    auto tryPyramid = [&](const PyramidIndices &pyramid) -> bool {
+        if (StopRequested(constraints, totalIterations, progress)) {
+            if (!bestTriangle.empty()) {
+                progress->partial = true;
+                progress->confidence = std::max(DECIMAL(0.0), 1 - bestTriangleMismatches);
+            }
+            identified = bestTriangle;
+            return true;
+        }
+
+        // identification failure due to cutoff
+        if (totalIterations >= cutoff) {
+            LOST_LOG_INFO("Cutoff reached.");
+            progress->patternsTried = totalIterations;
+            return true;
+        }
+        totalIterations++;
+
+        assert(pyramid.i != pyramid.j && pyramid.j != pyramid.k && pyramid.k != pyramid.r
+               && pyramid.i != pyramid.k && pyramid.i != pyramid.r && pyramid.j != pyramid.r);
+
+        // check that this match would not often occur due to chance, before spending any time
+        // matching it.
+        decimal expectedMismatches = PyramidExpectedMismatches(spatials, pyramid.i, pyramid.j, pyramid.k,
+                                                               tolerances, numFalseStars);
+        if (expectedMismatches > maxMismatchProbability) {
+            LOST_LOG_DEBUG("skip: mismatch prob.");
+            return false;
+        }
+
+        int16_t pyramidMatch[4];
+        long numTriangleMatches;
+        int16_t triangleMatch[3];
+        PyramidOutcome outcome = matcher.Match(pyramid, pyramidMatch, &numTriangleMatches, triangleMatch);
+
+        if (outcome == PyramidOutcome::kNotUnique) {
+            LOST_LOG_INFO("Pyramid not unique, skipping...");
+            return false;
+        }
+
+        if (outcome == PyramidOutcome::kNoMatch && numTriangleMatches == 1) {
+            // A triangle is missing the check on the fourth star, which a random star passes with
+            // probability about numFalseStars*tolerance^2, so it's that many times more likely to
+            // mismatch. Same tolerance as PyramidExpectedMismatches used.
+            decimal triangleTolerance = tolerances.Triangle(pyramid.i, pyramid.j, pyramid.k);
+            decimal triangleMismatches = expectedMismatches / (numFalseStars * triangleTolerance * triangleTolerance);
+            if (triangleMismatches < bestTriangleMismatches) {
+                bestTriangleMismatches = triangleMismatches;
+                bestTriangle = {
+                    StarIdentifier(pyramid.i, triangleMatch[0]),
+                    StarIdentifier(pyramid.j, triangleMatch[1]),
+                    StarIdentifier(pyramid.k, triangleMatch[2]),
+                };
+            }
+        }
+
+        if (outcome != PyramidOutcome::kUnique) {
+            return false;
+        }
+
+        StarIdentifiers pyramidIds = {
+            StarIdentifier(pyramid.i, pyramidMatch[0]),
+            StarIdentifier(pyramid.j, pyramidMatch[1]),
+            StarIdentifier(pyramid.k, pyramidMatch[2]),
+            StarIdentifier(pyramid.r, pyramidMatch[3]),
+        };
+
+        ReprojectionOutcome reprojection = ReprojectionOutcome::kInconclusive;
+        StarIdentifiers reprojected;
+        if (verification != PyramidVerification::kNone) {
+            reprojection = verifier.Verify(pyramidIds, stars, catalog, camera, &reprojected);
+            if (reprojection == ReprojectionOutcome::kReject) {
+                LOST_LOG_INFO("Unique pyramid rejected by reprojection, skipping...");
+                return false;
+            }
+        }
+
+        LOST_LOG_INFO("Matched unique pyramid! Expected mismatches: %e", (double)expectedMismatches);
+        if (verification == PyramidVerification::kReprojectOnly && reprojection == ReprojectionOutcome::kAccept) {
+            identified = std::move(reprojected);
+            LOST_LOG_INFO("Reprojection identified an additional %d stars.", (int)identified.size()-4);
+        } else {
+            identified = std::move(pyramidIds);
+            int numAdditionallyIdentified = IdentifyRemainingStarsPairDistance(&identified, stars, database, catalog, camera, tolerance, &bands);
+            LOST_LOG_INFO("Identified an additional %d stars.", numAdditionallyIdentified);
+            assert(numAdditionallyIdentified == (int)identified.size()-4);
+        }
+
+        progress->patternsTried = totalIterations;
+        progress->confidence = std::max(DECIMAL(0.0), 1 - expectedMismatches);
+        return true;
+    };
+
+    int numStars = (int)stars.size();
+
+    // First try the pyramids among the brightest stars, which are the least likely to be false,
+    // best conditioned first.
+    std::vector<bool> isRanked(numStars, false);
+    if (numRankedStars >= 4) {
+        std::vector<int> brightest = BrightestStars(stars, numRankedStars);
+        for (int star : brightest) {
+            isRanked[star] = true;
+        }
+        // same margins as PyramidMatcher::Match
+        std::vector<PyramidIndices> rankedPyramids =
+            RankPyramids(brightest, spatials,
+                         vectorDatabase.MinDistance() + tolerance, vectorDatabase.MaxDistance() - tolerance,
+                         tolerances, numFalseStars, maxMismatchProbability);
+        for (const PyramidIndices &pyramid : rankedPyramids) {
+            if (tryPyramid(pyramid)) {
+                return identified;
+            }
+        }
+        // the unranked ones would have been skipped anyway; that counts as trying them
+        totalIterations += NumFourStarPatterns(brightest.size()) - rankedPyramids.size();
+    }
+
+    PyramidIterator pyramids(numStars);
+    PyramidIndices pyramid;
+    while (pyramids.Next(&pyramid)) {
+        if (isRanked[pyramid.i] && isRanked[pyramid.j] && isRanked[pyramid.k] && isRanked[pyramid.r]) {
+            // already tried above
+            continue;
+        }
+        if (tryPyramid(pyramid)) {
+            return identified;
+        }
+    }
+
+    LOST_LOG_INFO("Tried all pyramids; none matched.");
+    progress->patternsTried = totalIterations;
+    return identified;
+}
+
+/// Catalog stars matched to the three vertices of a triangle of centroids, in the same order as the centroids.
+struct TriangleMatch {
+    int16_t catalogIndex1;
+    int16_t catalogIndex2;
+    int16_t catalogIndex3;
+};
+
+/// All orderings of three vertices, and whether each one flips the orientation of the triangle.
+static const int kTrianglePermutations[6][3] = {
+    {0, 1, 2}, {1, 2, 0}, {2, 0, 1}, {0, 2, 1}, {2, 1, 0}, {1, 0, 2}
+};
+static const bool kTrianglePermutationFlips[6] = { false, false, false, true, true, true };
+
+/**
+ * Matches triangles of centroids against a TripleInnerKVectorDatabase using only their inner
+ * angles, so that the matches don't depend on the focal length.
+ */
+class InnerAngleTriangleMatcher {
+public:
+    /// @param spatials Normalized spatial vectors of each centroid
+    /// @param allowed If not NULL, only match these catalog stars
+    InnerAngleTriangleMatcher(const TripleInnerKVectorDatabase &db, const Catalog &catalog,
+                              const std::vector<Vec3> &spatials,
+                              decimal tolerance, decimal focalLengthTolerance,
+                              const CatalogMask *allowed)
+        : db(db), catalog(catalog), spatials(spatials),
+          tolerance(tolerance), focalLengthTolerance(focalLengthTolerance), allowed(allowed) { };
+
+    bool Match(int i, int j, int k, std::vector<TriangleMatch> *result) const;
+    bool Consistent(int i, int j, int k,
+                    int16_t catalogIndex1, int16_t catalogIndex2, int16_t catalogIndex3) const;
+
+private:
+    bool InnerAngles(int i, int j, int k, decimal *angles, decimal *tolerances, decimal *distances) const;
+    bool DistancesConsistent(const decimal *distances,
+                             const Vec3 &spatial1, const Vec3 &spatial2, const Vec3 &spatial3) const;
+
+    const TripleInnerKVectorDatabase &db;
+    const Catalog &catalog;
+    const std::vector<Vec3> &spatials;
+    decimal tolerance;
+    decimal focalLengthTolerance;
+    const CatalogMask *allowed;
+};
+
+/**
+ * Calculate the inner angles of a triangle of centroids at each of its vertices, and how far off
+ * each one could be due to centroiding error.
+ * @param distances[out] Lengths of sides ij, ik, and jk.
+ * @return Whether the true triangle is certain to be in the database's range, assuming the centroids
+ * are true stars.
+ */
+bool InnerAngleTriangleMatcher::InnerAngles(int i, int j, int k,
+                                            decimal *angles, decimal *tolerances, decimal *distances) const {
+    const Vec3 &iSpatial = spatials[i];
+    const Vec3 &jSpatial = spatials[j];
+    const Vec3 &kSpatial = spatials[k];
+
+    decimal ijDist = AngleUnit(iSpatial, jSpatial);
+    decimal ikDist = AngleUnit(iSpatial, kSpatial);
+    decimal jkDist = AngleUnit(jSpatial, kSpatial);
+    distances[0] = ijDist;
+    distances[1] = ikDist;
+    distances[2] = jkDist;
+
+    angles[0] = InnerAngle(iSpatial, jSpatial, kSpatial);
+    angles[1] = InnerAngle(jSpatial, iSpatial, kSpatial);
+    angles[2] = InnerAngle(kSpatial, iSpatial, jSpatial);
+
+    // moving either end of a side by `tolerance` turns it by up to about tolerance/length
+    tolerances[0] = tolerance * (1/ijDist + 1/ikDist);
+    tolerances[1] = tolerance * (1/ijDist + 1/jkDist);
+    tolerances[2] = tolerance * (1/ikDist + 1/jkDist);
+
+    // Distances, unlike inner angles, do depend on the focal length. The database only has triples
+    // with all sides in range, so don't rely on triangles that might be just outside of it.
+    for (decimal dist : { ijDist, ikDist, jkDist }) {
+        if (dist / (1 + focalLengthTolerance) - tolerance < db.MinDistance()
+            || dist * (1 + focalLengthTolerance) + tolerance > db.MaxDistance()) {
+            return false;
+        }
+    }
+    // same for triangles that are almost too close to colinear to be stored
+    for (int m = 0; m < 3; m++) {
+        if (angles[m] - tolerances[m] < db.MinInnerAngle()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Whether the sides of a catalog triangle could be the sides of our triangle (see InnerAngles) given
+ * the focal length tolerance. This doesn't make the algorithm any more sensitive to focal length
+ * error, as long as the error is within tolerance, but rules out most triangles that happen to
+ * have similar shapes but very different sizes.
+ */
+bool InnerAngleTriangleMatcher::DistancesConsistent(const decimal *distances,
+                                                    const Vec3 &spatial1, const Vec3 &spatial2, const Vec3 &spatial3) const {
+    decimal catalogDistances[3] = {
+        AngleUnit(spatial1, spatial2), AngleUnit(spatial1, spatial3), AngleUnit(spatial2, spatial3)
+    };
+    for (int m = 0; m < 3; m++) {
+        if (DECIMAL_ABS(catalogDistances[m] - distances[m]) > distances[m]*focalLengthTolerance + 2*tolerance) {
+            return false;
+        }
+    }
+    return true;
 }
 
 /**
- * When a centroid within range of this centroid is identified, call this function. This function
- * does /not/ check whether the centroid is within range.
+ * Find all catalog triangles with the same inner angles and orientation as the triangle of
+ * centroids i, j, k.
+ * @param result[out] Each match lists the catalog stars in the same order as i, j, k.
+ * @return false if this triangle of centroids can't be reliably matched against the database, eg
+ * because its sides are too long.
  */
-void IRUnidentifiedCentroid::AddIdentifiedStar(const StarIdentifier &starId, const Stars &stars) {
-    const Star &otherStar = stars[starId.starIndex];
-    Vec2 positionDifference = otherStar.position - star->position;
-    decimal angleFromVertical = DECIMAL_ATAN2(positionDifference.y, positionDifference.x);
+bool InnerAngleTriangleMatcher::Match(int i, int j, int k, std::vector<TriangleMatch> *result) const {
+    result->clear();
+
+    decimal angles[3];
+    decimal tolerances[3];
+    decimal distances[3];
+    if (!InnerAngles(i, j, k, angles, tolerances, distances)) {
+        return false;
+    }
+    bool spectralTorch = spatials[i].CrossProduct(spatials[j])*spatials[k] > 0;
+
+    // The database is keyed on the smallest inner angle. If two of our angles are similar, the
+    // catalog triangle's smallest angle may correspond to either of them.
+    decimal minQuery = std::min(std::min(angles[0]-tolerances[0], angles[1]-tolerances[1]), angles[2]-tolerances[2]);
+    decimal maxQuery = std::min(std::min(angles[0]+tolerances[0], angles[1]+tolerances[1]), angles[2]+tolerances[2]);
+    // Sorting angles can't move any of them further than the largest tolerance, so the stored
+    // middle angle makes for a quick check before calculating the candidate's inner angles.
+    decimal maxTolerance = std::max(std::max(tolerances[0], tolerances[1]), tolerances[2]);
+    decimal middleAngle = std::max(std::min(angles[0], angles[1]),
+                                   std::min(std::max(angles[0], angles[1]), angles[2]));
+    decimal middleAngleTolerance = maxTolerance + 1 / TripleInnerKVectorDatabase::kMiddleAngleScale;
+
+    const int16_t *end;
+    for (const int16_t *triple = db.FindTriplesLiberal(minQuery, maxQuery, &end); triple != end; triple += 4) {
+        if (DECIMAL_ABS(TripleInnerKVectorDatabase::MiddleAngle(triple) - middleAngle) > middleAngleTolerance) {
+            continue;
+        }
+        if (allowed != NULL
+            && !(allowed->Test(triple[0]) && allowed->Test(triple[1]) && allowed->Test(triple[2]))) {
+            continue;
+        }
 
-    for (const auto &otherPair : identifiedStarsInRange) {
-        decimal curAngleFrom90 = VerticalAnglesToAngleFrom90(otherPair.first, angleFromVertical);
-        if (curAngleFrom90 < bestAngleFrom90) {
-            bestAngleFrom90 = curAngleFrom90;
-            bestStar1 = starId;
-            bestStar2 = otherPair.second;
+        const Vec3 &spatial1 = catalog[triple[0]].spatial;
+        const Vec3 &spatial2 = catalog[triple[1]].spatial;
+        const Vec3 &spatial3 = catalog[triple[2]].spatial;
+        decimal candidateAngles[3] = {
+            InnerAngle(spatial1, spatial2, spatial3),
+            InnerAngle(spatial2, spatial1, spatial3),
+            InnerAngle(spatial3, spatial1, spatial2),
+        };
+        bool candidateSpectralTorch = spatial1.CrossProduct(spatial2)*spatial3 > 0;
+
+        // try every way of assigning the catalog stars to our centroids
+        for (int p = 0; p < 6; p++) {
+            const int *permutation = kTrianglePermutations[p];
+            if (DECIMAL_ABS(candidateAngles[permutation[0]] - angles[0]) > tolerances[0]
+                || DECIMAL_ABS(candidateAngles[permutation[1]] - angles[1]) > tolerances[1]
+                || DECIMAL_ABS(candidateAngles[permutation[2]] - angles[2]) > tolerances[2]
+                || (candidateSpectralTorch != kTrianglePermutationFlips[p]) != spectralTorch) {
+                continue;
+            }
+            const Vec3 *candidateSpatials[3] = { &spatial1, &spatial2, &spatial3 };
+            if (!DistancesConsistent(distances,
+                                     *candidateSpatials[permutation[0]],
+                                     *candidateSpatials[permutation[1]],
+                                     *candidateSpatials[permutation[2]])) {
+                continue;
+            }
+            TriangleMatch match = { triple[permutation[0]], triple[permutation[1]], triple[permutation[2]] };
+            result->push_back(match);
         }
     }
+    return true;
+}
+
+/// Whether the given catalog stars have the same inner angles, orientation, and (within focal length
+/// tolerance) size as centroids i, j, k (in that order). Doesn't use the database.
+bool InnerAngleTriangleMatcher::Consistent(int i, int j, int k,
+                                           int16_t catalogIndex1, int16_t catalogIndex2, int16_t catalogIndex3) const {
+    decimal angles[3];
+    decimal tolerances[3];
+    decimal distances[3];
+    InnerAngles(i, j, k, angles, tolerances, distances); // ok if not in range of the database
 
-    identifiedStarsInRange.emplace_back(angleFromVertical, starId);
+    const Vec3 &spatial1 = catalog[catalogIndex1].spatial;
+    const Vec3 &spatial2 = catalog[catalogIndex2].spatial;
+    const Vec3 &spatial3 = catalog[catalogIndex3].spatial;
+    return DECIMAL_ABS(InnerAngle(spatial1, spatial2, spatial3) - angles[0]) <= tolerances[0]
+        && DECIMAL_ABS(InnerAngle(spatial2, spatial1, spatial3) - angles[1]) <= tolerances[1]
+        && DECIMAL_ABS(InnerAngle(spatial3, spatial1, spatial2) - angles[2]) <= tolerances[2]
+        && (spatial1.CrossProduct(spatial2)*spatial3 > 0) == (spatials[i].CrossProduct(spatials[j])*spatials[k] > 0)
+        && DistancesConsistent(distances, spatial1, spatial2, spatial3);
 }
 
 /**
- * Return all the unidentified centroids within the requested distance bounds from `star`
+ * Given some identified stars, attempt to identify the rest using triangles formed with two
+ * already-identified stars.
  *
- * The returned vector has pointers into the vector passed as an argument. Thus, it's important not
- * to modify the `centroids` argument after calling.
+ * A centroid is identified when exactly one catalog star forms a matching triangle with the two
+ * identified stars. It is given up on if there are zero (probably a false star) or several.
+ * When possible, the identification is double checked with another identified star.
+ * Centroids that don't form a usable triangle with any pair of identified stars yet are retried
+ * as more stars get identified.
+ * @param numChecked[out] How many centroids formed a usable triangle, whether or not they were identified.
  */
-std::vector<std::vector<IRUnidentifiedCentroid *>::iterator> FindUnidentifiedCentroidsInRange(
-    std::vector<IRUnidentifiedCentroid *> *centroids, const Star &star, const Camera &camera,
-    decimal minDistance, decimal maxDistance) {
+static int IdentifyRemainingStarsTriangles(StarIdentifiers *identifiers, int numStars,
+                                           const InnerAngleTriangleMatcher &matcher,
+                                           int *numChecked) {
+    std::vector<bool> finished(numStars, false);
+    for (const StarIdentifier &starId : *identifiers) {
+        finished[starId.starIndex] = true;
+    }
 
-    Vec3 ourSpatial = camera.CameraToSpatial(star.position).Normalize();
+    int numExtraIdentifiedStars = 0;
+    *numChecked = 0;
+    std::vector<TriangleMatch> matches;
+    std::vector<int16_t> candidates;
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (int x = 0; x < numStars; x++) {
+            for (size_t a = 0; !finished[x] && a < identifiers->size(); a++) {
+                for (size_t b = a+1; !finished[x] && b < identifiers->size(); b++) {
+                    StarIdentifier idA = (*identifiers)[a];
+                    StarIdentifier idB = (*identifiers)[b];
+                    if (!matcher.Match(idA.starIndex, idB.starIndex, x, &matches)) {
+                        continue;
+                    }
 
-    decimal minCos = DECIMAL_COS(maxDistance);
-    decimal maxCos = DECIMAL_COS(minDistance);
+                    candidates.clear();
+                    for (const TriangleMatch &match : matches) {
+                        if (match.catalogIndex1 == idA.catalogIndex && match.catalogIndex2 == idB.catalogIndex
+                            && std::find(candidates.begin(), candidates.end(), match.catalogIndex3) == candidates.end()) {
+                            candidates.push_back(match.catalogIndex3);
+                        }
+                    }
 
-    std::vector<std::vector<IRUnidentifiedCentroid *>::iterator> result;
-    for (auto it = centroids->begin(); it != centroids->end(); ++it) {
-        Vec3 theirSpatial = camera.CameraToSpatial((*it)->star->position).Normalize();
-        decimal angleCos = ourSpatial * theirSpatial;
-        if (angleCos >= minCos && angleCos <= maxCos) {
-            result.push_back(it);
+                    finished[x] = true;
+                    ++*numChecked;
+                    // double check against a third identified star, which is cheap since it doesn't
+                    // need a database query, and catches most centroids whose true star isn't in
+                    // the catalog but which happened to match something else anyway.
+                    for (size_t c = 0; candidates.size() == 1 && c < identifiers->size(); c++) {
+                        if (c != a && c != b) {
+                            StarIdentifier idC = (*identifiers)[c];
+                            if (!matcher.Consistent(idA.starIndex, idC.starIndex, x,
+                                                    idA.catalogIndex, idC.catalogIndex, candidates[0])) {
+                                candidates.clear();
+                            }
+                            break;
+                        }
+                    }
+                    if (candidates.size() == 1) {
+                        identifiers->emplace_back(x, candidates[0]);
+                        ++numExtraIdentifiedStars;
+                        progress = true;
+                    }
+                }
+            }
         }
     }
 
-    return result;
-
-    // TODO: optimize by sorting on x-coordinate (like in tracking), or maybe even kd-tree
-
-    // // Find the first centroid that is within range of the given centroid.
-    // auto firstInRange = std::lower_bound(centroids->begin(), centroids->end(), star.position.x - maxDistance,
-    //     [](const IRUnidentifiedCentroid &centroid, decimal x) {
-    //         return centroid.star.position.x < x;
-    //     });
-
-    // // Find the first centroid that is not within range of the given centroid.
-    // auto firstNotInRange = std::lower_bound(firstInRange, centroids->end(), star.position.x + maxDistance,
-    //     [](const IRUnidentifiedCentroid &centroid, decimal x) {
-    //         return centroid.star.position.x <= x;
-    //     });
-
-    // // Copy the pointers to the stars into the result vector.
-    // for (auto it = firstInRange; it != firstNotInRange; ++it) {
-    //     decimal distance = Distance(star.position, it->star.position);
-    //     if (distance >= minDistance && distance <= maxDistance) {
-    //         result.push_back(&*it);
-    //     }
-    // }
+    return numExtraIdentifiedStars;
 }
 
-/**
- * Given a list of unidentified centroids not yet at the soft threshold, and a list of unidentified
- * centroids already below the soft threshold, appropriately add the given centroid to all the
- * unidentified centroids still above the threshold, and perhaps move them to the below threshold
- * list.
- *
- * @param angleFrom90Threshold Once an IRUnidentifiedCentroid's best angle from 90 goes below this threshold
- */
-void AddToAllUnidentifiedCentroids(const StarIdentifier &starId, const Stars &stars,
-                                   std::vector<IRUnidentifiedCentroid *> *aboveThresholdCentroids,
-                                   std::vector<IRUnidentifiedCentroid *> *belowThresholdCentroids,
-                                   decimal minDistance, decimal maxDistance,
-                                   decimal angleFrom90Threshold,
-                                   const Camera &camera) {
+StarIdentifiers NonDimensionalStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera) const {
 
-    std::vector<int16_t> nowBelowThreshold; // centroid indices newly moved above the threshold
-    // don't need to iterate through the centroids that are already below the threshold, for performance.
-    for (auto centroidIt : FindUnidentifiedCentroidsInRange(aboveThresholdCentroids, stars[starId.starIndex], camera, minDistance, maxDistance)) {
-        (*centroidIt)->AddIdentifiedStar(starId, stars);
-        if ((*centroidIt)->bestAngleFrom90 <= angleFrom90Threshold) {
-            belowThresholdCentroids->push_back(*centroidIt);
-            nowBelowThreshold.push_back((*centroidIt)->index);
-        }
-    }
-    // remove all centroids with indices in nowBelowThreshold from aboveThresholdCentroids
-    aboveThresholdCentroids->erase(std::remove_if(aboveThresholdCentroids->begin(), aboveThresholdCentroids->end(),
-        [&nowBelowThreshold](const IRUnidentifiedCentroid *centroid) {
-            return std::find(nowBelowThreshold.begin(), nowBelowThreshold.end(), centroid->index) != nowBelowThreshold.end();
-        }), aboveThresholdCentroids->end());
+    return Go(database, stars, catalog, camera, StarIdConstraints(), NULL);
 }
 
-/**
- * Given two already-identified centroids, and the distance from each to an as-yet unidentified
- * third centroid, return a list of candidate catalog stars that could be the third centroid.
- *
- * The order in which the two centroids are passed in /does/ matter wrt spectral-ness. If the first
- * supplied catalog star is `a`, second is `b`, and the unidentified is `c`, then (`a` crossproduct
- * `b`) dot `c` will be positive for all returned `c`. Intuitively, if the triangle is fairly small
- * on the surface of the sphere, then viewed from the origin, the vertices `a`, `b`, and `c` should
- * be clockwise (then, the cross product of `a` and `b` will point mostly towards `c`, and a little
- * outwards, so that dot product with `c` captures that positive outward part).
- */
-std::vector<int16_t> IdentifyThirdStar(const PairDistanceKVectorDatabase &db,
-                                       const Catalog &catalog,
-                                       int16_t catalogIndex1, int16_t catalogIndex2,
-                                       decimal distance1, decimal distance2,
-                                       decimal tolerance) {
+StarIdentifiers NonDimensionalStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    const StarIdConstraints &constraints, StarIdProgress *progress) const {
 
-    const int16_t *query1End;
-    const int16_t *query1 = db.FindPairsExact(catalog, distance1-tolerance, distance1+tolerance, &query1End);
+    StarIdProgress unusedProgress;
+    if (progress == NULL) {
+        progress = &unusedProgress;
+    }
+    *progress = StarIdProgress();
+    progress->patternsTotal = NumFourStarPatterns(stars.size());
 
-    const Vec3 &spatial1 = catalog[catalogIndex1].spatial;
-    const Vec3 &spatial2 = catalog[catalogIndex2].spatial;
-    const Vec3 cross = spatial1.CrossProduct(spatial2);
+    StarIdentifiers identified;
+    if (database.TripleInnerKVector() == NULL || stars.size() < 4) {
+        LOST_LOG_WARNING("Not enough stars, or database missing.");
+        return identified;
+    }
+    const TripleInnerKVectorDatabase &tripleDatabase = *database.TripleInnerKVector();
 
-    // Use PairDistanceInvolvingIterator to find catalog candidates for the unidentified centroid from both sides.
+    std::vector<Vec3> spatials;
+    for (const Star &star : stars) {
+        spatials.push_back(camera.CameraToSpatial(star.position).Normalize());
+    }
+    InnerAngleTriangleMatcher matcher(tripleDatabase, catalog, spatials, tolerance, focalLengthTolerance,
+                                      constraints.allowedStars);
 
-    std::vector<int16_t> result;
-    // find all the catalog stars that are in both annuli
-    for (PairDistanceInvolvingIterator candidateIt(query1, query1End, catalogIndex1);
-         candidateIt.HasValue();
-         ++candidateIt) {
+    // same iteration order as Pyramid
+    int numStars = (int)stars.size();
+    long totalIterations = 0;
 
-        Vec3 candidateSpatial = catalog[*candidateIt].spatial;
+    std::vector<TriangleMatch> ijkMatches;
+    std::vector<TriangleMatch> ijrMatches;
+
+    PyramidIterator pyramids(numStars);
+    PyramidIndices pyramid;
+    while (pyramids.Next(&pyramid)) {
+        int i = pyramid.i;
+        int j = pyramid.j;
+        int k = pyramid.k;
+        int r = pyramid.r;
+
+        // A unique triangle is much weaker evidence here than in Pyramid, since inner angles
+        // don't pin down the triangle's size, so there's no partial result to return.
+        if (StopRequested(constraints, totalIterations, progress)) {
+            return identified;
+        }
 
-        decimal angle2 = AngleUnit(candidateSpatial, spatial2);
+        // identification failure due to cutoff
+        if (totalIterations >= cutoff) {
+            LOST_LOG_INFO("Cutoff reached.");
+            progress->patternsTried = totalIterations;
+            return identified;
+        }
+        totalIterations++;
 
-        // check distance to second star
-        if (!(angle2 >= distance2-tolerance && angle2 <= distance2+tolerance)) {
+        if (!matcher.Match(i, j, k, &ijkMatches) || ijkMatches.empty()
+            || !matcher.Match(i, j, r, &ijrMatches) || ijrMatches.empty()) {
             continue;
         }
 
-        // check spectrality
-        decimal spectralTorch = cross * candidateSpatial;
-        // if they are nearly coplanar, don't need to check spectrality
-        // TODO: Implement ^^. Not high priority, since always checking spectrality is conservative.
-        if (spectralTorch <= 0) {
+        // A four-star match needs triangles ijk and ijr to agree on i and j, and then
+        // triangle ikr to match too, at which point all six distances are consistent.
+        int numMatches = 0;
+        TriangleMatch ijkMatch = ijkMatches[0];
+        int16_t rMatch = -1;
+        for (const TriangleMatch &ijk : ijkMatches) {
+            for (const TriangleMatch &ijr : ijrMatches) {
+                if (ijr.catalogIndex1 == ijk.catalogIndex1 && ijr.catalogIndex2 == ijk.catalogIndex2
+                    && ijr.catalogIndex3 != ijk.catalogIndex3
+                    && matcher.Consistent(i, k, r, ijk.catalogIndex1, ijk.catalogIndex3, ijr.catalogIndex3)) {
+
+                    numMatches++;
+                    ijkMatch = ijk;
+                    rMatch = ijr.catalogIndex3;
+                }
+            }
+        }
+
+        if (numMatches > 1) {
+            LOST_LOG_INFO("Non-dimensional pattern not unique, skipping...");
+        }
+        if (numMatches != 1) {
             continue;
         }
 
-        // we've made it through the gauntlet!
-        result.push_back(*candidateIt);
-    }
+        identified.push_back(StarIdentifier(i, ijkMatch.catalogIndex1));
+        identified.push_back(StarIdentifier(j, ijkMatch.catalogIndex2));
+        identified.push_back(StarIdentifier(k, ijkMatch.catalogIndex3));
+        identified.push_back(StarIdentifier(r, rMatch));
+
+        // Inner angles alone are a weaker check than Pyramid's distances, so a pattern
+        // including a star that's not in the catalog can occasionally match uniquely
+        // anyway. A wrong pattern won't agree with the rest of the image, though, so we
+        // require it to explain most of the other stars it's able to check.
+        int numChecked;
+        int numAdditionallyIdentified = IdentifyRemainingStarsTriangles(&identified, numStars, matcher, &numChecked);
+        if (numAdditionallyIdentified*2 < numChecked) {
+            LOST_LOG_INFO("Non-dimensional pattern not confirmed by other stars, skipping...");
+            identified.clear();
+            continue;
+        }
 
-    return result;
-}
+        LOST_LOG_INFO("Matched unique non-dimensional pattern! Identified an additional %d stars.",
+                      numAdditionallyIdentified);
 
-IRUnidentifiedCentroid *SelectNextUnidentifiedCentroid(std::vector<IRUnidentifiedCentroid *> *aboveThresholdCentroids,
-                                                      std::vector<IRUnidentifiedCentroid *> *belowThresholdCentroids) {
-    if (!belowThresholdCentroids->empty()) {
-        auto result = belowThresholdCentroids->back();
-        belowThresholdCentroids->pop_back();
-        return result;
+        // there's no analytic mismatch probability for inner angles, so estimate it
+        // from how many of the other stars agreed (Laplace's rule of succession)
+        progress->patternsTried = totalIterations;
+        progress->confidence = (decimal)(numAdditionallyIdentified + 1) / (numChecked + 2);
+        return identified;
     }
 
-    // need to find the best in aboveThreshold, if any
-    auto bestAboveThreshold = std::min_element(aboveThresholdCentroids->begin(), aboveThresholdCentroids->end(),
-        [](const IRUnidentifiedCentroid *a, const IRUnidentifiedCentroid *b) {
-            return a->bestAngleFrom90 < b->bestAngleFrom90;
-        });
+    LOST_LOG_INFO("Tried all patterns; none matched.");
+    progress->patternsTried = totalIterations;
+    return identified;
+}
 
-    // 10 is arbitrary; but really it should be less than DECIMAL_M_PI_2 when set
-    if (bestAboveThreshold != aboveThresholdCentroids->end() && (*bestAboveThreshold)->bestAngleFrom90 < 10) {
-        auto result = *bestAboveThreshold;
-        aboveThresholdCentroids->erase(bestAboveThreshold);
-        return result;
-    }
+/**
+ * Matches triangles of centroids against a TriangleDatabase by their side lengths, with a single
+ * kd-tree query per triangle.
+ */
+class SideLengthTriangleMatcher {
+public:
+    /// @param spatials Normalized spatial vectors of each centroid
+    /// @param allowed,bands As in StarIdConstraints, already resolved
+    SideLengthTriangleMatcher(const TriangleDatabase &db, const Catalog &catalog,
+                              const std::vector<Vec3> &spatials, decimal tolerance,
+                              const CatalogMask *allowed, const std::vector<MagnitudeBand> &bands)
+        : db(db), catalog(catalog), spatials(spatials), tolerance(tolerance),
+          allowed(allowed), bands(bands) { };
 
-    return NULL;
-}
+    bool Match(int i, int j, int k, std::vector<TriangleMatch> *result);
 
-const decimal kAngleFrom90SoftThreshold = DECIMAL_M_PI_4; // TODO: tune this
+private:
+    const TriangleDatabase &db;
+    const Catalog &catalog;
+    const std::vector<Vec3> &spatials;
+    decimal tolerance;
+    const CatalogMask *allowed;
+    const std::vector<MagnitudeBand> &bands;
+    std::vector<long> found;
+};
 
 /**
- * Given some identified stars, attempt to identify the rest.
- *
- * Requires a pair distance database to be present. Iterates through the unidentified centroids in
- * an intelligent order, identifying them one by one.
+ * Find all catalog triangles with the same side lengths and orientation as the triangle of
+ * centroids i, j, k.
+ * @param result[out] Each match lists the catalog stars in the same order as i, j, k.
+ * @return false if some side is too close to the database's range to be sure of finding the triangle.
  */
-int IdentifyRemainingStarsPairDistance(StarIdentifiers *identifiers,
-                                       const Stars &stars,
-                                       const PairDistanceKVectorDatabase &db,
-                                       const Catalog &catalog,
-                                       const Camera &camera,
-                                       decimal tolerance) {
-#ifdef LOST_DEBUG_PERFORMANCE
-    auto startTimestamp = std::chrono::steady_clock::now();
-#endif
-    // initialize all unidentified centroids
-    std::vector<IRUnidentifiedCentroid> allUnidentifiedCentroids;
-    std::vector<IRUnidentifiedCentroid *> aboveThresholdUnidentifiedCentroids;
-    std::vector<IRUnidentifiedCentroid *> belowThresholdUnidentifiedCentroids;
-    allUnidentifiedCentroids.reserve(stars.size());
-    for (size_t i = 0; i < stars.size(); i++) {
-        allUnidentifiedCentroids.push_back(IRUnidentifiedCentroid(stars[i], i));
+bool SideLengthTriangleMatcher::Match(int i, int j, int k, std::vector<TriangleMatch> *result) {
+    result->clear();
+
+    // indexed by the vertex opposite each side, like the database
+    int vertices[3] = { i, j, k };
+    decimal sides[3] = {
+        AngleUnit(spatials[j], spatials[k]),
+        AngleUnit(spatials[i], spatials[k]),
+        AngleUnit(spatials[i], spatials[j]),
+    };
+    for (decimal side : sides) {
+        // same margins as PyramidMatcher::Match
+        if (side < db.MinDistance() + tolerance || side > db.MaxDistance() - tolerance) {
+            return false;
+        }
+    }
+    bool spectralTorch = spatials[i].CrossProduct(spatials[j])*spatials[k] > 0;
+
+    // Sorting can't move a side further than the tolerance from the catalog side it matches, so the
+    // box can be built from our sides sorted the same way.
+    decimal sortedSides[3] = { sides[0], sides[1], sides[2] };
+    std::sort(sortedSides, sortedSides+3);
+    decimal minSides[3];
+    decimal maxSides[3];
+    for (int m = 0; m < 3; m++) {
+        minSides[m] = sortedSides[m] - tolerance;
+        maxSides[m] = sortedSides[m] + tolerance;
     }
-    // add everything from allUnidentifiedCentroids to above threshold
-    aboveThresholdUnidentifiedCentroids.reserve(allUnidentifiedCentroids.size());
-    for (size_t i = 0; i < allUnidentifiedCentroids.size(); i++) {
-        // only add if index is not equal to any starIndex in identifiers already
-        if (std::find_if(identifiers->begin(), identifiers->end(),
-            [&allUnidentifiedCentroids, i](const StarIdentifier &identifier) {
-                return identifier.starIndex == allUnidentifiedCentroids[i].index;
-            }) == identifiers->end()) {
 
-            aboveThresholdUnidentifiedCentroids.push_back(&allUnidentifiedCentroids[i]);
+    found.clear();
+    db.FindTriangles(minSides, maxSides, &found);
+    for (long triangle : found) {
+        const decimal *candidateSides = db.Sides(triangle);
+        const int16_t *candidateStars = db.Stars(triangle);
+        if (allowed != NULL
+            && !(allowed->Test(candidateStars[0]) && allowed->Test(candidateStars[1]) && allowed->Test(candidateStars[2]))) {
+            continue;
+        }
+        bool candidateSpectralTorch = catalog[candidateStars[0]].spatial.CrossProduct(catalog[candidateStars[1]].spatial)
+            * catalog[candidateStars[2]].spatial > 0;
+
+        // Usually only the identity fits, but the sorted order of nearly equal sides may differ.
+        // Assigning catalog vertex permutation[m] to our vertex m pairs up the sides opposite them.
+        for (int p = 0; p < 6; p++) {
+            const int *permutation = kTrianglePermutations[p];
+            if (DECIMAL_ABS(candidateSides[permutation[0]] - sides[0]) > tolerance
+                || DECIMAL_ABS(candidateSides[permutation[1]] - sides[1]) > tolerance
+                || DECIMAL_ABS(candidateSides[permutation[2]] - sides[2]) > tolerance
+                || (candidateSpectralTorch != kTrianglePermutationFlips[p]) != spectralTorch) {
+                continue;
+            }
+            if (!InMagnitudeBand(bands, catalog, vertices[0], candidateStars[permutation[0]])
+                || !InMagnitudeBand(bands, catalog, vertices[1], candidateStars[permutation[1]])
+                || !InMagnitudeBand(bands, catalog, vertices[2], candidateStars[permutation[2]])) {
+                continue;
+            }
+            TriangleMatch match = {
+                candidateStars[permutation[0]], candidateStars[permutation[1]], candidateStars[permutation[2]]
+            };
+            result->push_back(match);
         }
     }
+    return true;
+}
 
-    // sort unidentified centroids by x coordinate
-    // Don't need this until we fix the Find thing
-    // std::sort(unidentifiedCentroids.begin(), unidentifiedCentroids.end(),
-    //     [](const IRUnidentifiedCentroid &a, const IRUnidentifiedCentroid &b) {
-    //         return a.star->position.x < b.star->position.x;
-    //     });
+StarIdentifiers TriangleStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera) const {
 
-    // for each identified star, add it to the list of identified stars for each unidentified centroid within range
-    for (const auto &starId : *identifiers) {
-        AddToAllUnidentifiedCentroids(starId, stars,
-                                      &aboveThresholdUnidentifiedCentroids, &belowThresholdUnidentifiedCentroids,
-                                      db.MinDistance(), db.MaxDistance(),
-                                      kAngleFrom90SoftThreshold,
-                                      camera);
+    return Go(database, stars, catalog, camera, StarIdConstraints(), NULL);
+}
+
+StarIdentifiers TriangleStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    const StarIdConstraints &constraints, StarIdProgress *progress) const {
+
+    StarIdProgress unusedProgress;
+    if (progress == NULL) {
+        progress = &unusedProgress;
     }
+    *progress = StarIdProgress();
+    progress->patternsTotal = NumFourStarPatterns(stars.size());
 
-    int numExtraIdentifiedStars = 0;
+    StarIdentifiers identified;
+    if (database.Triangles() == NULL || stars.size() < 4) {
+        LOST_LOG_WARNING("Not enough stars, or database missing.");
+        return identified;
+    }
 
-    // keep getting the best unidentified centroid and identifying it
-    while (!belowThresholdUnidentifiedCentroids.empty() || !aboveThresholdUnidentifiedCentroids.empty()) {
-        IRUnidentifiedCentroid *nextUnidentifiedCentroid
-            = SelectNextUnidentifiedCentroid(&aboveThresholdUnidentifiedCentroids, &belowThresholdUnidentifiedCentroids);
-        if (nextUnidentifiedCentroid == NULL) {
-            break;
-        }
+    std::vector<Vec3> spatials;
+    for (const Star &star : stars) {
+        spatials.push_back(camera.CameraToSpatial(star.position).Normalize());
+    }
+    std::vector<MagnitudeBand> bands = MagnitudeBands(constraints, stars);
+    SideLengthTriangleMatcher matcher(*database.Triangles(), catalog, spatials, tolerance,
+                                      constraints.allowedStars, bands);
 
-        // Project next stars to 3d, find angle between them and current unidentified centroid
-        Vec3 unidentifiedSpatial = camera.CameraToSpatial(nextUnidentifiedCentroid->star->position);
-        Vec3 spatial1 = camera.CameraToSpatial(stars[nextUnidentifiedCentroid->bestStar1.starIndex].position);
-        Vec3 spatial2 = camera.CameraToSpatial(stars[nextUnidentifiedCentroid->bestStar2.starIndex].position);
-        decimal d1 = Angle(spatial1, unidentifiedSpatial);
-        decimal d2 = Angle(spatial2, unidentifiedSpatial);
-        decimal spectralTorch = spatial1.CrossProduct(spatial2) * unidentifiedSpatial;
+    // same iteration order as Pyramid
+    int numStars = (int)stars.size();
+    long totalIterations = 0;
 
-        // find all the catalog stars that are in both annuli
-        // flip arguments for appropriate spectrality.
-        std::vector<int16_t> candidates =
-            spectralTorch > 0
-            ? IdentifyThirdStar(db,
-                                catalog,
-                                nextUnidentifiedCentroid->bestStar1.catalogIndex,
-                                nextUnidentifiedCentroid->bestStar2.catalogIndex,
-                                d1, d2, tolerance)
-            : IdentifyThirdStar(db,
-                                catalog,
-                                nextUnidentifiedCentroid->bestStar2.catalogIndex,
-                                nextUnidentifiedCentroid->bestStar1.catalogIndex,
-                                d2, d1, tolerance);
+    std::vector<TriangleMatch> ijkMatches;
+    std::vector<TriangleMatch> ijrMatches;
 
-        if (candidates.size() != 1) { // if there is not exactly one candidate, we can't identify the star. Just remove it from the list.
-            if (candidates.size() > 1) {
-                std::cerr << "WARNING: Multiple catalog stars matched during identify remaining stars. This should be rare." << std::endl;
-            }
-        } else {
-            // identify the centroid
-            identifiers->emplace_back(nextUnidentifiedCentroid->index, candidates[0]);
+    PyramidIterator pyramids(numStars);
+    PyramidIndices pyramid;
+    while (pyramids.Next(&pyramid)) {
+        int i = pyramid.i;
+        int j = pyramid.j;
+        int k = pyramid.k;
+        int r = pyramid.r;
 
-            // update nearby unidentified centroids with the new identified star
-            AddToAllUnidentifiedCentroids(identifiers->back(), stars,
-                                          &aboveThresholdUnidentifiedCentroids, &belowThresholdUnidentifiedCentroids,
-                                          db.MinDistance(), db.MaxDistance(),
-                                          // TODO should probably tune this:
-                                          kAngleFrom90SoftThreshold,
-                                          camera);
+        if (StopRequested(constraints, totalIterations, progress)) {
+            return identified;
+        }
 
-            ++numExtraIdentifiedStars;
+        // identification failure due to cutoff
+        if (totalIterations >= cutoff) {
+            LOST_LOG_INFO("Cutoff reached.");
+            progress->patternsTried = totalIterations;
+            return identified;
         }
-    }
+        totalIterations++;
 
-    // Select() should always empty out this list
-    assert(belowThresholdUnidentifiedCentroids.empty());
+        decimal expectedMismatches = PyramidExpectedMismatches(spatials, i, j, k, tolerance, numFalseStars);
+        if (expectedMismatches > maxMismatchProbability) {
+            LOST_LOG_DEBUG("skip: mismatch prob.");
+            continue;
+        }
 
-#ifdef LOST_DEBUG_PERFORMANCE
-    auto endTimestamp = std::chrono::steady_clock::now();
-    std::cout << "IdentifyRemainingStarsPairDistance took " << std::chrono::duration_cast<std::chrono::microseconds>(endTimestamp - startTimestamp).count() << "us" << std::endl;
-#endif
+        if (!matcher.Match(i, j, k, &ijkMatches) || ijkMatches.empty()
+            || !matcher.Match(i, j, r, &ijrMatches) || ijrMatches.empty()) {
+            continue;
+        }
 
-    return numExtraIdentifiedStars;
-}
+        // Triangles ijk and ijr must agree on i and j, and then the catalog distance
+        // between k and r must match too, at which point all six distances agree.
+        decimal krDistance = AngleUnit(spatials[k], spatials[r]);
+        int numMatches = 0;
+        TriangleMatch ijkMatch = ijkMatches[0];
+        int16_t rMatch = -1;
+        for (const TriangleMatch &ijk : ijkMatches) {
+            for (const TriangleMatch &ijr : ijrMatches) {
+                if (ijr.catalogIndex1 == ijk.catalogIndex1 && ijr.catalogIndex2 == ijk.catalogIndex2
+                    && ijr.catalogIndex3 != ijk.catalogIndex3
+                    && DECIMAL_ABS(AngleUnit(catalog[ijk.catalogIndex3].spatial,
+                                             catalog[ijr.catalogIndex3].spatial) - krDistance) <= tolerance) {
+
+                    numMatches++;
+                    ijkMatch = ijk;
+                    rMatch = ijr.catalogIndex3;
+                }
+            }
+        }
 
-StarIdentifiers PyramidStarIdAlgorithm::Go(
-    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera) const {
+        if (numMatches > 1) {
+            LOST_LOG_INFO("Triangle pattern not unique, skipping...");
+        }
+        if (numMatches != 1) {
+            continue;
+        }
 
-    StarIdentifiers identified;
-    MultiDatabase multiDatabase(database);
-    const unsigned char *databaseBuffer = multiDatabase.SubDatabasePointer(PairDistanceKVectorDatabase::kMagicValue);
-    if (databaseBuffer == NULL || stars.size() < 4) {
-        std::cerr << "Not enough stars, or database missing." << std::endl;
+        StarIdentifiers pyramidIds = {
+            StarIdentifier(i, ijkMatch.catalogIndex1),
+            StarIdentifier(j, ijkMatch.catalogIndex2),
+            StarIdentifier(k, ijkMatch.catalogIndex3),
+            StarIdentifier(r, rMatch),
+        };
+        // there's no pair database to identify the other stars from, but reprojecting
+        // the catalog identifies them just as well
+        StarIdentifiers reprojected;
+        ReprojectionOutcome reprojection = verifier.Verify(pyramidIds, stars, catalog, camera, &reprojected);
+        if (reprojection == ReprojectionOutcome::kReject) {
+            LOST_LOG_INFO("Unique triangle pattern rejected by reprojection, skipping...");
+            continue;
+        }
+
+        identified = reprojection == ReprojectionOutcome::kAccept ? std::move(reprojected) : std::move(pyramidIds);
+        LOST_LOG_INFO("Matched unique triangle pattern! Identified an additional %d stars.",
+                      (int)identified.size()-4);
+        progress->patternsTried = totalIterations;
+        progress->confidence = std::max(DECIMAL(0.0), 1 - expectedMismatches);
         return identified;
     }
-    DeserializeContext des(databaseBuffer);
-    PairDistanceKVectorDatabase vectorDatabase(&des);
 
-    // smallest normal single-precision decimal is around 10^-38 so we should be all good. See
-    // Analytic_Star_Pattern_Probability on the HSL wiki for details.
-    decimal expectedMismatchesConstant = DECIMAL_POW(numFalseStars, 4) * DECIMAL_POW(tolerance, 5) / 2 / DECIMAL_POW(DECIMAL_M_PI, 2);
+    LOST_LOG_INFO("Tried all patterns; none matched.");
+    progress->patternsTried = totalIterations;
+    return identified;
+}
 
-    // this iteration technique is described in the Pyramid paper. Briefly: i will always be the
-    // lowest index, then dj and dk are how many indexes ahead the j-th star is from the i-th, and
-    // k-th from the j-th. In addition, we here add some other numbers so that the pyramids are not
-    // weird lines in wide FOV images. TODO: Select the starting points to ensure that the first pyramids are all within measurement tolerance.
-    int numStars = (int)stars.size();
-    // the idea is that the square root is about across the FOV horizontally
-    int across = floor(sqrt(numStars))*2;
-    int halfwayAcross = floor(sqrt(numStars)/2);
-    long totalIterations = 0;
+/**
+ * Set every cell next to (including diagonally) a set cell of `pattern`, so that neighbors which
+ * centroiding error pushed into an adjacent cell still match.
+ */
+static void DilateGridPattern(const uint64_t *pattern, int gridSize, uint64_t *dilated) {
+    int numWords = GridPatternWords(gridSize);
+    std::fill(dilated, dilated + numWords, 0);
+    for (int w = 0; w < numWords; w++) {
+        for (uint64_t word = pattern[w]; word != 0; word &= word - 1) {
+            int cell = w*64 + __builtin_ctzll(word);
+            int x = cell % gridSize;
+            int y = cell / gridSize;
+            for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, gridSize - 1); ny++) {
+                for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, gridSize - 1); nx++) {
+                    int neighborCell = ny*gridSize + nx;
+                    dilated[neighborCell / 64] |= (uint64_t)1 << (neighborCell % 64);
+                }
+            }
+        }
+    }
+}
 
-    int jMax = numStars - 3;
-    for (int jIter = 0; jIter < jMax; jIter++) {
-        int dj = 1+(jIter+halfwayAcross)%jMax;
+/**
+ * How many of each centroid's nearest neighbors the grid algorithm tries orienting its pattern by.
+ * The catalog patterns are all oriented by the nearest neighbor, which in the image may be
+ * preceded by a false star or a star too dim for the catalog.
+ */
+static const int kGridOrientations = 3;
 
-        int kMax = numStars-dj-2;
-        for (int kIter = 0; kIter < kMax; kIter++) {
-            int dk = 1+(kIter+across)%kMax;
+/**
+ * Set the cells of a grid pattern whose centers the camera can see, so that catalog neighbors
+ * outside the image aren't held against a candidate.
+ * @param center,xAxis,yAxis The pattern's frame, in the camera's spatial coordinates, as from GridPattern
+ */
+static void GridFootprint(const Vec3 &center, const Vec3 &xAxis, const Vec3 &yAxis,
+                          int gridSize, decimal patternRadius, const Camera &camera,
+                          uint64_t *footprint) {
+    std::fill(footprint, footprint + GridPatternWords(gridSize), 0);
+    decimal halfWidth = DECIMAL_TAN(patternRadius);
+    decimal cellSize = 2 * halfWidth / gridSize;
+    // Vec3 has no operator+, hence the negated offsets
+    for (int y = 0; y < gridSize; y++) {
+        Vec3 row = center - yAxis * (halfWidth - (y + DECIMAL(0.5)) * cellSize);
+        for (int x = 0; x < gridSize; x++) {
+            Vec3 spatial = row - xAxis * (halfWidth - (x + DECIMAL(0.5)) * cellSize);
+            if (spatial.x > 0 && camera.InSensor(camera.SpatialToCamera(spatial))) {
+                int cell = y*gridSize + x;
+                footprint[cell / 64] |= (uint64_t)1 << (cell % 64);
+            }
+        }
+    }
+}
 
-            int rMax = numStars-dj-dk-1;
-            for (int rIter = 0; rIter < rMax; rIter++) {
-                int dr = 1+(rIter+halfwayAcross)%rMax;
+/**
+ * How well a catalog pattern explains an image pattern: two points for each catalog neighbor in a
+ * (dilated) image cell, less one for each catalog neighbor the camera should have seen but didn't.
+ * Without the penalty, catalog stars in crowded parts of the sky would match everything.
+ * No branches, so the compiler can vectorize it.
+ * @param overlap[out] The number of catalog neighbors in image cells
+ */
+static int GridPatternScore(const uint64_t *dilated, const uint64_t *footprint, const uint64_t *catalogPattern,
+                            int numWords, int *overlap) {
+    int matched = 0;
+    int missed = 0;
+    for (int w = 0; w < numWords; w++) {
+        matched += __builtin_popcountll(dilated[w] & catalogPattern[w]);
+        missed += __builtin_popcountll(footprint[w] & catalogPattern[w] & ~dilated[w]);
+    }
+    *overlap = matched;
+    return 2*matched - missed;
+}
 
-                int iMax = numStars-dj-dk-dr-1;
-                for (int iIter = 0; iIter <= iMax; iIter++) {
-                    int i = (iIter + iMax/2)%(iMax+1); // start near the center of the photo
+StarIdentifiers GridStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera) const {
 
-                    // identification failure due to cutoff
-                    if (++totalIterations > cutoff) {
-                        std::cerr << "Cutoff reached." << std::endl;
-                        return identified;
-                    }
+    return Go(database, stars, catalog, camera, StarIdConstraints(), NULL);
+}
 
-                    int j = i+dj;
-                    int k = j+dk;
-                    int r = k+dr;
+StarIdentifiers GridStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    const StarIdConstraints &constraints, StarIdProgress *progress) const {
 
-                    assert(i != j && j != k && k != r && i != k && i != r && j != r);
+    StarIdProgress unusedProgress;
+    if (progress == NULL) {
+        progress = &unusedProgress;
+    }
+    *progress = StarIdProgress();
 
-                    // TODO: move this out of the loop?
-                    Vec3 iSpatial = camera.CameraToSpatial(stars[i].position).Normalize();
-                    Vec3 jSpatial = camera.CameraToSpatial(stars[j].position).Normalize();
-                    Vec3 kSpatial = camera.CameraToSpatial(stars[k].position).Normalize();
+    const GridDatabase *grid = database.Grid();
+    if (grid == NULL || grid->NumStars() != (long)catalog.size()) {
+        LOST_LOG_WARNING("Grid database missing, or built from a different catalog.");
+        return StarIdentifiers();
+    }
 
-                    decimal ijDist = AngleUnit(iSpatial, jSpatial);
+    std::vector<Vec3> spatials;
+    for (const Star &star : stars) {
+        spatials.push_back(camera.CameraToSpatial(star.position).Normalize());
+    }
+    std::vector<MagnitudeBand> bands = MagnitudeBands(constraints, stars);
 
-                    decimal iSinInner = DECIMAL_SIN(Angle(jSpatial - iSpatial, kSpatial - iSpatial));
-                    decimal jSinInner = DECIMAL_SIN(Angle(iSpatial - jSpatial, kSpatial - jSpatial));
-                    decimal kSinInner = DECIMAL_SIN(Angle(iSpatial - kSpatial, jSpatial - kSpatial));
+    int numWords = grid->NumWords();
+    std::vector<uint64_t> pattern(numWords);
+    std::vector<uint64_t> dilated(numWords);
+    std::vector<uint64_t> footprint(numWords);
+    // the last pattern each catalog star was a candidate for, to gather candidates without duplicates
+    std::vector<long> lastCandidateFor(catalog.size(), -1);
+    std::vector<int16_t> candidates;
 
-                    // if we made it this far, all 6 angles are confirmed! Now check
-                    // that this match would not often occur due to chance.
-                    // See Analytic_Star_Pattern_Probability on the HSL wiki for details
-                    decimal expectedMismatches = expectedMismatchesConstant
-                        * DECIMAL_SIN(ijDist)
-                        / kSinInner
-                        / std::max(std::max(iSinInner, jSinInner), kSinInner);
+    StarIdentifiers identified;
+    progress->patternsTotal = stars.size();
+    for (int i = 0; i < (int)stars.size(); i++) {
+        if (StopRequested(constraints, i, progress, 1)) {
+            return StarIdentifiers();
+        }
 
-                    if (expectedMismatches > maxMismatchProbability) {
-                        std::cout << "skip: mismatch prob." << std::endl;
-                        continue;
+        int16_t best = -1;
+        int bestScore = INT_MIN;
+        int bestOverlap = 0;
+        // best score of any other catalog star
+        int secondScore = INT_MIN;
+        for (int orientation = 0; orientation < kGridOrientations; orientation++) {
+            Vec3 xAxis, yAxis;
+            if (!GridPattern(spatials[i], spatials.data(), spatials.size(),
+                             grid->GridSize(), grid->PatternRadius(), grid->BufferRadius(), orientation,
+                             pattern.data(), &xAxis, &yAxis)) {
+                break;
+            }
+            DilateGridPattern(pattern.data(), grid->GridSize(), dilated.data());
+            GridFootprint(spatials[i], xAxis, yAxis, grid->GridSize(), grid->PatternRadius(), camera,
+                          footprint.data());
+
+            // only catalog stars sharing at least one exact cell are worth comparing
+            long patternId = (long)i*kGridOrientations + orientation;
+            candidates.clear();
+            for (int w = 0; w < numWords; w++) {
+                for (uint64_t word = pattern[w]; word != 0; word &= word - 1) {
+                    const int16_t *end;
+                    for (const int16_t *c = grid->StarsWithCell(w*64 + __builtin_ctzll(word), &end); c != end; c++) {
+                        if (lastCandidateFor[*c] == patternId) {
+                            continue;
+                        }
+                        lastCandidateFor[*c] = patternId;
+                        if ((constraints.allowedStars == NULL || constraints.allowedStars->Test(*c))
+                            && InMagnitudeBand(bands, catalog, i, *c)) {
+                            candidates.push_back(*c);
+                        }
                     }
+                }
+            }
 
-                    Vec3 rSpatial = camera.CameraToSpatial(stars[r].position).Normalize();
-
-                    // sign of determinant, to detect flipped patterns
-                    bool spectralTorch = iSpatial.CrossProduct(jSpatial)*kSpatial > 0;
-
-                    decimal ikDist = AngleUnit(iSpatial, kSpatial);
-                    decimal irDist = AngleUnit(iSpatial, rSpatial);
-                    decimal jkDist = AngleUnit(jSpatial, kSpatial);
-                    decimal jrDist = AngleUnit(jSpatial, rSpatial);
-                    decimal krDist = AngleUnit(kSpatial, rSpatial); // TODO: we don't really need to
-                                                                  // check krDist, if k has been
-                                                                  // verified by i and j it's fine.
-
-                    // we check the distances with the extra tolerance requirement to ensure that
-                    // there isn't some pyramid that's just outside the database's bounds, but
-                    // within measurement tolerance of the observed pyramid, since that would
-                    // possibly cause a non-unique pyramid to be identified as unique.
-#define _CHECK_DISTANCE(_dist) if (_dist < vectorDatabase.MinDistance() + tolerance || _dist > vectorDatabase.MaxDistance() - tolerance) { continue; }
-                    _CHECK_DISTANCE(ikDist);
-                    _CHECK_DISTANCE(irDist);
-                    _CHECK_DISTANCE(jkDist);
-                    _CHECK_DISTANCE(jrDist);
-                    _CHECK_DISTANCE(krDist);
-#undef _CHECK_DISTANCE
-
-                    const int16_t *ijEnd, *ikEnd, *irEnd;
-                    const int16_t *const ijQuery = vectorDatabase.FindPairsLiberal(ijDist - tolerance, ijDist + tolerance, &ijEnd);
-                    const int16_t *const ikQuery = vectorDatabase.FindPairsLiberal(ikDist - tolerance, ikDist + tolerance, &ikEnd);
-                    const int16_t *const irQuery = vectorDatabase.FindPairsLiberal(irDist - tolerance, irDist + tolerance, &irEnd);
-
-                    std::unordered_multimap<int16_t, int16_t> ikMap = PairDistanceQueryToMap(ikQuery, ikEnd);
-                    std::unordered_multimap<int16_t, int16_t> irMap = PairDistanceQueryToMap(irQuery, irEnd);
-
-                    int iMatch = -1, jMatch = -1, kMatch = -1, rMatch = -1;
-                    for (const int16_t *iCandidateQuery = ijQuery; iCandidateQuery != ijEnd; iCandidateQuery++) {
-                        int iCandidate = *iCandidateQuery;
-                        // depending on parity, the first or second star in the pair is the "other" one
-                        int jCandidate = (iCandidateQuery - ijQuery) % 2 == 0
-                            ? iCandidateQuery[1]
-                            : iCandidateQuery[-1];
-
-                        const Vec3 &iCandidateSpatial = catalog[iCandidate].spatial;
-                        const Vec3 &jCandidateSpatial = catalog[jCandidate].spatial;
-
-                        Vec3 ijCandidateCross = iCandidateSpatial.CrossProduct(jCandidateSpatial);
-
-                        for (auto kCandidateIt = ikMap.equal_range(iCandidate); kCandidateIt.first != kCandidateIt.second; kCandidateIt.first++) {
-                            // kCandidate.first is iterator, then ->second is the value (other star)
-                            int kCandidate = kCandidateIt.first->second;
-                            Vec3 kCandidateSpatial = catalog[kCandidate].spatial;
-                            bool candidateSpectralTorch = ijCandidateCross*kCandidateSpatial > 0;
-                            // checking the spectral-ity early to fail fast
-                            if (candidateSpectralTorch != spectralTorch) {
-                                continue;
-                            }
+            for (int16_t candidate : candidates) {
+                int overlap;
+                int score = GridPatternScore(dilated.data(), footprint.data(), grid->Pattern(candidate),
+                                             numWords, &overlap);
+                if (candidate == best) {
+                    if (score > bestScore) {
+                        bestScore = score;
+                        bestOverlap = overlap;
+                    }
+                } else if (score > bestScore) {
+                    secondScore = bestScore;
+                    bestScore = score;
+                    bestOverlap = overlap;
+                    best = candidate;
+                } else if (score > secondScore) {
+                    secondScore = score;
+                }
+            }
+        }
+        // a tie means the pattern doesn't tell them apart
+        if (best >= 0 && bestOverlap >= minMatches && bestScore > secondScore) {
+            identified.push_back(StarIdentifier(i, best));
+        }
+    }
 
-                            // small optimization: We can calculate jk before iterating through r, so we will!
-                            decimal jkCandidateDist = AngleUnit(jCandidateSpatial, kCandidateSpatial);
-                            if (jkCandidateDist < jkDist - tolerance || jkCandidateDist > jkDist + tolerance) {
-                                continue;
-                            }
+    StarIdentifiers verified = VerifyByPairVotes(identified, stars, catalog, camera, tolerance);
+    LOST_LOG_INFO("Grid matched %d stars, %d of which agree.", (int)identified.size(), (int)verified.size());
+    // a pair of wrong matches can agree by chance, but three rarely do
+    if (verified.size() < 3) {
+        verified.clear();
+    }
 
-                            // TODO: if there are no jr matches, there's no reason to
-                            // continue iterating through all the other k-s. Possibly
-                            // enumarete all r matches, according to ir, before this loop
-                            for (auto rCandidateIt = irMap.equal_range(iCandidate); rCandidateIt.first != rCandidateIt.second; rCandidateIt.first++) {
-                                int rCandidate = rCandidateIt.first->second;
-                                const Vec3 &rCandidateSpatial = catalog[rCandidate].spatial;
-                                decimal jrCandidateDist = AngleUnit(jCandidateSpatial, rCandidateSpatial);
-                                decimal krCandidateDist;
-                                if (jrCandidateDist < jrDist - tolerance || jrCandidateDist > jrDist + tolerance) {
-                                    continue;
-                                }
-                                krCandidateDist = AngleUnit(kCandidateSpatial, rCandidateSpatial);
-                                if (krCandidateDist < krDist - tolerance || krCandidateDist > krDist + tolerance) {
-                                    continue;
-                                }
+    progress->patternsTried = stars.size();
+    progress->confidence = verified.empty() ? 0 : 1;
+    return verified;
+}
 
-                                // we have a match!
-
-                                if (iMatch == -1) {
-                                    iMatch = iCandidate;
-                                    jMatch = jCandidate;
-                                    kMatch = kCandidate;
-                                    rMatch = rCandidate;
-                                } else {
-                                    // uh-oh, stinky!
-                                    // TODO: test duplicate detection, it's hard to cause it in the real catalog...
-                                    std::cerr << "Pyramid not unique, skipping..." << std::endl;
-                                    goto sensorContinue;
-                                }
-                            }
-                        }
+/**
+ * Check that star identifications agree with each other, by estimating the attitude from all of them
+ * and then checking that it puts every identified catalog star where its centroid is.
+ * @param residualTolerance How far (radians) each centroid may be from where the attitude puts its
+ * catalog star
+ * @param minStars Fewer identifications than this never pass, since a couple of wrong ones can
+ * always be fit by some attitude
+ */
+bool VerifyStarIdentifiers(const StarIdentifiers &starIds, const Stars &stars, const Catalog &catalog,
+                           const Camera &camera, decimal residualTolerance, int minStars) {
+    if ((int)starIds.size() < minStars || starIds.size() < 2) {
+        return false;
+    }
 
+    Attitude attitude = DavenportQAlgorithm().Go(camera, stars, catalog, starIds);
+    if (!attitude.IsKnown()) {
+        return false;
+    }
+    for (const StarIdentifier &starId : starIds) {
+        Vec3 expected = attitude.Rotate(catalog[starId.catalogIndex].spatial);
+        Vec3 actual = camera.CameraToSpatial(stars[starId.starIndex].position).Normalize();
+        if (AngleUnit(expected, actual) > residualTolerance) {
+            return false;
+        }
+    }
+    return true;
+}
 
-                    }
+StarIdentifiers PortfolioStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera) const {
 
-                    if (iMatch != -1) {
-                        std::cout.precision(6);
-                        std::cout << "Matched unique pyramid!" << std::endl << "Expected mismatches: " << std::scientific << expectedMismatches << std::endl << std::fixed;
-                        identified.push_back(StarIdentifier(i, iMatch));
-                        identified.push_back(StarIdentifier(j, jMatch));
-                        identified.push_back(StarIdentifier(k, kMatch));
-                        identified.push_back(StarIdentifier(r, rMatch));
+    return Go(database, stars, catalog, camera, StarIdConstraints(), NULL);
+}
 
-                        int numAdditionallyIdentified = IdentifyRemainingStarsPairDistance(&identified, stars, vectorDatabase, catalog, camera, tolerance);
-                        printf("Identified an additional %d stars.\n", numAdditionallyIdentified);
-                        assert(numAdditionallyIdentified == (int)identified.size()-4);
+StarIdentifiers PortfolioStarIdAlgorithm::Go(
+    const PreparedDatabase &database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    const StarIdConstraints &constraints, StarIdProgress *progress) const {
 
-                        return identified;
-                    }
+    StarIdProgress unusedProgress;
+    if (progress == NULL) {
+        progress = &unusedProgress;
+    }
+    *progress = StarIdProgress();
+
+    int numAlgorithms = (int)algorithms.size();
+    std::vector<StarIdentifiers> results(numAlgorithms);
+    std::vector<StarIdProgress> progresses(numAlgorithms);
+    std::vector<PortfolioEntry> entries(numAlgorithms);
+
+    // everything below is guarded by mutex, except the cancel flag
+    std::mutex mutex;
+    std::condition_variable finished;
+    int numFinished = 0;
+    int winner = -1;
+    std::atomic<bool> cancel(constraints.Cancelled());
+
+    StarIdConstraints memberConstraints = constraints;
+    memberConstraints.cancel = &cancel;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int a = 0; a < numAlgorithms; a++) {
+        threads.emplace_back([&, a]() {
+            StarIdentifiers result = algorithms[a]->Go(database, stars, catalog, camera,
+                                                       memberConstraints, &progresses[a]);
+            // no point verifying a result nobody is waiting for
+            bool verified = !cancel.load() && VerifyStarIdentifiers(result, stars, catalog, camera,
+                                                                    residualTolerance, minStars);
+            long long timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            results[a] = std::move(result);
+            entries[a] = {names[a], timeNs, verified, false};
+            if (verified && winner == -1) {
+                winner = a;
+                cancel.store(true);
+            }
+            numFinished++;
+            finished.notify_one();
+        });
+    }
 
-                sensorContinue:;
-                }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (winner == -1 && numFinished < numAlgorithms) {
+            // the algorithms can't see the caller's cancel flag, so pass it on to them
+            finished.wait_for(lock, std::chrono::milliseconds(1));
+            if (constraints.Cancelled()) {
+                cancel.store(true);
             }
         }
+        cancel.store(true);
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
     }
 
-    std::cerr << "Tried all pyramids; none matched." << std::endl;
+    StarIdentifiers identified;
+    if (winner != -1) {
+        LOST_LOG_INFO("Portfolio won by %s.", names[winner].c_str());
+        entries[winner].won = true;
+        identified = std::move(results[winner]);
+        *progress = progresses[winner];
+    } else {
+        LOST_LOG_INFO("No algorithm in the portfolio produced a verified result.");
+        for (const StarIdProgress &memberProgress : progresses) {
+            progress->deadlineReached = progress->deadlineReached || memberProgress.deadlineReached;
+        }
+        progress->cancelled = constraints.Cancelled();
+    }
+    progress->portfolio = entries;
     return identified;
 }
 
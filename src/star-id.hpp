@@ -1,23 +1,175 @@
 #ifndef STAR_ID_H
 #define STAR_ID_H
 
+#include <assert.h>
+#include <inttypes.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "centroiders.hpp"
+#include "photometry.hpp"
 #include "star-utils.hpp"
 #include "camera.hpp"
 
 namespace lost {
 
+class PreparedDatabase;
+
+/// One frame of a batch passed to StarIdAlgorithm::Go, which identifies it without any StarIdConstraints. Neither pointer is owned.
+struct StarIdFrame {
+    const Stars *stars;
+    const Camera *camera;
+};
+
+/**
+ * A set of catalog stars, one bit per catalog index.
+ * Cheap enough to test in star-id's inner loops, where it's used to throw out candidate stars that
+ * couldn't be in the image.
+ */
+class CatalogMask {
+public:
+    /// An empty mask with room for `numStars` catalog stars
+    explicit CatalogMask(long numStars) : numStars(numStars), words((numStars + 63) / 64, 0) { };
+
+    void Set(long catalogIndex) {
+        assert(catalogIndex >= 0 && catalogIndex < numStars);
+        words[catalogIndex / 64] |= (uint64_t)1 << (catalogIndex % 64);
+    }
+    bool Test(long catalogIndex) const {
+        return (words[catalogIndex / 64] >> (catalogIndex % 64)) & 1;
+    }
+    /// Number of catalog indices in the mask
+    long Count() const;
+    long NumStars() const { return numStars; }
+
+private:
+    long numStars;
+    std::vector<uint64_t> words;
+};
+
+decimal SkyConeStarRadius(const Camera &, decimal radius);
+CatalogMask SkyConeMask(const Catalog &, const Camera &, const Vec3 &boresight, decimal radius);
+
+std::vector<Vec2> CentroidUncertainties(const Stars &, decimal brightnessNoise, decimal minUncertainty);
+
+/**
+ * Limits on how much work a single call to StarIdAlgorithm::Go may do.
+ * A default-constructed StarIdConstraints imposes none.
+ */
+struct StarIdConstraints {
+    /// Stop searching and return the best result found so far once this time has passed. The
+    /// clock's epoch (the default) means no deadline.
+    std::chrono::steady_clock::time_point deadline;
+
+    /// Stop searching as soon as this becomes true, eg because another algorithm got there first.
+    /// NULL (the default) means never. Not owned.
+    const std::atomic<bool> *cancel = NULL;
+
+    /// Only consider these catalog stars, eg those near a coarse attitude from another sensor (see
+    /// SkyConeMask). NULL (the default) means the whole catalog. Not owned.
+    const CatalogMask *allowedStars = NULL;
+
+    /// The cone that allowedStars was made from: catalog stars within skyConeRadius (radians) of
+    /// skyConeCenter (see SkyConeStarRadius). Algorithms that support it look up pairs only in the
+    /// part of a SkyCellPairDatabase near the cone. A radius of 0 (the default) means no cone.
+    Vec3 skyConeCenter = {1, 0, 0};
+    decimal skyConeRadius = 0;
+
+    /// Rule out catalog stars whose magnitude is inconsistent with their centroid's brightness.
+    /// NULL (the default), or a model that isn't PhotometricModel::Ready(), rules out none. Not owned.
+    const PhotometricModel *photometry = NULL;
+
+    /// Positional uncertainty of each centroid, in pixels (one standard deviation along x and y; see
+    /// CentroidUncertainties). Algorithms that support it size each pair's tolerance from the
+    /// uncertainties of its two centroids, but never wider than their usual tolerance. NULL (the
+    /// default) means the usual tolerance for every pair. Not owned.
+    const std::vector<Vec2> *centroidUncertainties = NULL;
+
+    bool HasDeadline() const { return deadline != std::chrono::steady_clock::time_point(); }
+    bool Cancelled() const { return cancel != NULL && cancel->load(std::memory_order_relaxed); }
+};
+
+/// How one algorithm in a PortfolioStarIdAlgorithm did on one frame.
+struct PortfolioEntry {
+    std::string name;
+    /// Nanoseconds from the start of the race until this algorithm returned
+    long long timeNs;
+    /// Whether its result passed verification
+    bool verified;
+    /// Whether its result was the one returned
+    bool won;
+};
+
+/// How far a call to StarIdAlgorithm::Go got, and how much to trust what it returned.
+struct StarIdProgress {
+    /**
+     * Estimated probability that every returned identification is correct, from 0 to 1. 0 if
+     * nothing was identified; algorithms with no error model report 1 for any non-empty result.
+     */
+    decimal confidence = 0;
+    /// Number of star patterns that were tried
+    long patternsTried = 0;
+    /// Number of star patterns in the whole search space, or 0 if the algorithm doesn't search patterns
+    long patternsTotal = 0;
+    /// Whether the search stopped because the deadline passed
+    bool deadlineReached = false;
+    /// Whether the search stopped because StarIdConstraints::cancel was set
+    bool cancelled = false;
+    /// Whether the result is a partial match that the search didn't get to confirm (eg, a triangle
+    /// without Pyramid's fourth star), rather than the algorithm's usual result.
+    bool partial = false;
+    /// For a PortfolioStarIdAlgorithm, how each of its algorithms did, in order
+    std::vector<PortfolioEntry> portfolio;
+
+    /// Fraction of the search space that was tried, from 0 to 1
+    decimal Coverage() const {
+        return patternsTotal > 0 ? (decimal)patternsTried / patternsTotal : DECIMAL(1.0);
+    }
+};
+
 /**
  * A star idenification algorithm.
  * An algorithm which takes a list of centroids plus some (possibly algorithm-specific) database, and then determines which centroids corresponds to which catalog stars.
+ *
+ * Subclasses override the PreparedDatabase version of Go, and should say `using StarIdAlgorithm::Go;` so that the other overloads remain visible.
  */
 class StarIdAlgorithm {
 public:
     /// Actualy perform the star idenification. This is the "main" function for StarIdAlgorithm
     virtual StarIdentifiers Go(
-        const unsigned char *database, const Stars &, const Catalog &, const Camera &) const = 0;
+        const PreparedDatabase &, const Stars &, const Catalog &, const Camera &) const = 0;
+
+    /**
+     * Identify a single frame, stopping early if the constraints say to.
+     * Algorithms which search through star patterns check the deadline every few patterns, and once
+     * it passes return the best partial result found so far instead of nothing. The default
+     * implementation ignores the constraints.
+     * @param progress[out] How much of the search was done, and how confident the result is. May be NULL.
+     */
+    virtual StarIdentifiers Go(
+        const PreparedDatabase &, const Stars &, const Catalog &, const Camera &,
+        const StarIdConstraints &, StarIdProgress *progress) const;
+
+    /**
+     * Identify a single frame straight from a serialized MultiDatabase.
+     * Convenient, but locates and deserializes the sub-databases on every call. Prefer preparing
+     * the database once when identifying more than one frame.
+     */
+    StarIdentifiers Go(
+        const unsigned char *database, const Stars &, const Catalog &, const Camera &) const;
+
+    /**
+     * Identify many frames against the same database, back to back.
+     * The default implementation just calls Go on each frame; subclasses with per-frame scratch
+     * buffers override it to reuse them between frames.
+     * @return Star identifiers for each frame, in the same order as \p frames
+     */
+    virtual std::vector<StarIdentifiers> Go(
+        const PreparedDatabase &, const Catalog &, const StarIdFrame *frames, long numFrames) const;
 
     virtual ~StarIdAlgorithm() { };
 };
@@ -25,7 +177,8 @@ public:
 /// A star-id algorithm that returns random results. For debugging.
 class DummyStarIdAlgorithm final : public StarIdAlgorithm {
 public:
-    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &) const;
+    using StarIdAlgorithm::Go;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &) const override;
 };
 
 /**
@@ -34,7 +187,19 @@ public:
  */
 class GeometricVotingStarIdAlgorithm : public StarIdAlgorithm {
 public:
-    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &) const;
+    using StarIdAlgorithm::Go;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &) const override;
+    /// Votes have no meaning until every star has voted, so stopping early returns nothing.
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &,
+                       const StarIdConstraints &, StarIdProgress *) const override;
+    /**
+     * Reuses the vote buffers across frames.
+     * Batch frames have no StarIdConstraints, and so no sky cone, so this never looks pairs up in a
+     * SkyCellPairDatabase: it needs a pair distance, pair cosine, or compressed pair database.
+     * Identify frames with a sky cone one at a time instead.
+     */
+    std::vector<StarIdentifiers> Go(
+        const PreparedDatabase &, const Catalog &, const StarIdFrame *frames, long numFrames) const override;
 
     /**
      * @param tolerance Angular tolerance (Two inter-star distances are considered the same if within this many radians)
@@ -45,31 +210,210 @@ private:
 };
 
 
+/// What ReprojectionVerifier decided about some star identifications.
+enum class ReprojectionOutcome {
+    /// Enough of the other centroids land on catalog stars
+    kAccept,
+    /// The identifications don't reproject onto their own centroids, or too few others match
+    kReject,
+    /// Too few other centroids to tell either way
+    kInconclusive,
+};
+
+/**
+ * Checks a few star identifications (eg, a pyramid) against the rest of the image.
+ * It computes the attitude they imply with TRIAD, projects every catalog star in the field of view
+ * into the image, and counts how many of the other centroids they land on. Centroids are bucketed
+ * into a grid of cells at least as large as the match radius, so each projected star only looks at
+ * the centroids in the 3x3 cells around it, and the whole check takes microseconds.
+ */
+class ReprojectionVerifier {
+public:
+    /**
+     * @param tolerance How far (radians) a centroid may be from a projected catalog star and still
+     * match it. Should allow for the error of a two-star attitude, not just of one centroid.
+     * @param minMatchFraction Accept if at least this fraction of the centroids not among the
+     * identifications being checked match some catalog star.
+     * @param minChecks Fewer than this many other centroids is inconclusive.
+     */
+    ReprojectionVerifier(decimal tolerance, decimal minMatchFraction, int minChecks)
+        : tolerance(tolerance), minMatchFraction(minMatchFraction), minChecks(minChecks) { };
+
+    ReprojectionOutcome Verify(const StarIdentifiers &seed, const Stars &, const Catalog &, const Camera &,
+                               StarIdentifiers *identified) const;
+private:
+    decimal tolerance;
+    decimal minMatchFraction;
+    int minChecks;
+};
+
+/// How PyramidStarIdAlgorithm checks a unique pyramid before accepting it.
+enum class PyramidVerification {
+    /// Uniqueness and the mismatch probability are enough
+    kNone,
+    /// Reject pyramids that ReprojectionVerifier rejects, and keep searching
+    kReproject,
+    /// Like kReproject, but when reprojection accepts, its matches replace the slower pass that
+    /// identifies the remaining stars from pair distances
+    kReprojectOnly,
+};
+
 /**
  * The "de facto" star-id algorithm used in many real-world missions.
  * Pyramid searches through groups of 4 stars in the image. For each one it tries to find a corresponding 4-star pattern in the database. Four stars is enough that pyramid is often able to uniquely match the first 4-star pattern it tries, making it fast and reliable. However, this only holds true if the camera is calibrated and has low centroid error.
+ * If the deadline passes before any pyramid matches, Pyramid returns the uniquely matched triangle
+ * (a pyramid whose fourth star didn't match) with the fewest expected mismatches, if there was one.
  */
 class PyramidStarIdAlgorithm final : public StarIdAlgorithm {
 public:
-    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &) const;
+    using StarIdAlgorithm::Go;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &) const override;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &,
+                       const StarIdConstraints &, StarIdProgress *) const override;
     /**
      * @param tolerance Angular tolerance (Two inter-star distances are considered the same if within this many radians)
      * @param numFalseStars an estimate of the number of false stars in the whole celestial sphere
      * (not just the field of view). Eg, if you estimate 10 dead pixels in a 40 degree FOV, you'd
      * want to multiply that up to a hundred-something numFalseStars.
      * @param maxMismatchProbability The maximum allowable probability for any star to be mis-id'd.
-     * @param cutoff Maximum number of pyramids to iterate through before giving up.
+     * @param cutoff Maximum number of pyramids to iterate through before giving up. Unlike a
+     * deadline, reaching the cutoff returns nothing.
+     * @param numRankedStars Before anything else, try the pyramids formed by this many of the
+     * brightest centroids, best conditioned first. Bright centroids are less likely to be false
+     * stars. With fewer than 4, pyramids are tried in the order of the centroids.
+     * @param verification How to check a unique pyramid before accepting it. Reprojection uses
+     * three times the angular tolerance, to allow for the error in the TRIAD attitude.
+     */
+    PyramidStarIdAlgorithm(decimal tolerance, int numFalseStars, decimal maxMismatchProbability, long cutoff,
+                           int numRankedStars = 0, PyramidVerification verification = PyramidVerification::kNone)
+        : tolerance(tolerance), numFalseStars(numFalseStars),
+          maxMismatchProbability(maxMismatchProbability), cutoff(cutoff),
+          numRankedStars(numRankedStars), verification(verification),
+          verifier(3*tolerance, DECIMAL(0.5), 4) { };
+private:
+    decimal tolerance;
+    int numFalseStars;
+    decimal maxMismatchProbability;
+    long cutoff;
+    int numRankedStars;
+    PyramidVerification verification;
+    ReprojectionVerifier verifier;
+};
+
+/**
+ * Mortari's Non-Dimensional star-id, matching triangles of stars by their inner angles.
+ * The inner angles of a small triangle of stars barely change when the focal length is wrong, so
+ * unlike Pyramid this algorithm keeps working on a camera whose focal length has drifted (eg, with
+ * temperature). Each triangle is confirmed with a fourth star, which must form triangles matching
+ * the same catalog stars, then the remaining stars are identified one at a time using triangles
+ * with two already-identified stars. Requires a TripleInnerKVectorDatabase.
+ */
+class NonDimensionalStarIdAlgorithm final : public StarIdAlgorithm {
+public:
+    using StarIdAlgorithm::Go;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &) const override;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &,
+                       const StarIdConstraints &, StarIdProgress *) const override;
+    /**
+     * @param tolerance Angular tolerance of centroid positions (radians). Inner angle tolerances
+     * are derived from this and the lengths of the triangle's sides.
+     * @param focalLengthTolerance Largest expected relative error in the focal length (eg, 0.05 for
+     * 5%). Only used to avoid relying on triangles which may be just outside the database's range.
+     * @param cutoff Maximum number of four-star patterns to try before giving up.
      */
-    PyramidStarIdAlgorithm(decimal tolerance, int numFalseStars, decimal maxMismatchProbability, long cutoff)
+    NonDimensionalStarIdAlgorithm(decimal tolerance, decimal focalLengthTolerance, long cutoff)
+        : tolerance(tolerance), focalLengthTolerance(focalLengthTolerance), cutoff(cutoff) { };
+private:
+    decimal tolerance;
+    decimal focalLengthTolerance;
+    long cutoff;
+};
+
+/**
+ * Pyramid, but matching each triangle with a single query of a TriangleDatabase on all three side
+ * lengths, rather than three pair distance queries whose results are then intersected. Candidates
+ * that only fail on the third side never come back from the database. Each triangle is confirmed
+ * with a fourth star, then the rest of the stars are identified by reprojecting the catalog with
+ * ReprojectionVerifier, which can also reject the pattern.
+ */
+class TriangleStarIdAlgorithm final : public StarIdAlgorithm {
+public:
+    using StarIdAlgorithm::Go;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &) const override;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &,
+                       const StarIdConstraints &, StarIdProgress *) const override;
+    /// See PyramidStarIdAlgorithm for the parameters
+    TriangleStarIdAlgorithm(decimal tolerance, int numFalseStars, decimal maxMismatchProbability, long cutoff)
         : tolerance(tolerance), numFalseStars(numFalseStars),
-          maxMismatchProbability(maxMismatchProbability), cutoff(cutoff) { };
+          maxMismatchProbability(maxMismatchProbability), cutoff(cutoff),
+          verifier(3*tolerance, DECIMAL(0.5), 4) { };
 private:
     decimal tolerance;
     int numFalseStars;
     decimal maxMismatchProbability;
     long cutoff;
+    ReprojectionVerifier verifier;
+};
+
+/**
+ * The grid algorithm (Padgett and Kreutz-Delgado, 1997). Each centroid's neighbors are rasterized
+ * into a bit pattern the same way as the catalog's in the GridDatabase, and the catalog star whose
+ * pattern shares the most set bits is its match. Unlike the pattern searches, every centroid is
+ * matched on its own, and a little positional noise only loses a few bits, so it degrades gracefully
+ * on dense, noisy fields. Matches are then checked against each other with pair distances.
+ */
+class GridStarIdAlgorithm final : public StarIdAlgorithm {
+public:
+    using StarIdAlgorithm::Go;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &) const override;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &,
+                       const StarIdConstraints &, StarIdProgress *) const override;
+    /**
+     * @param tolerance Angular tolerance used to check the matches against each other (radians)
+     * @param minMatches Minimum number of pattern bits a match must share with its centroid
+     */
+    GridStarIdAlgorithm(decimal tolerance, int minMatches)
+        : tolerance(tolerance), minMatches(minMatches) { };
+private:
+    decimal tolerance;
+    int minMatches;
+};
+
+/**
+ * Runs several star-id algorithms on the same frame at once, each on its own thread, and returns the
+ * first result that passes VerifyStarIdentifiers. The other algorithms are then cancelled through
+ * StarIdConstraints::cancel, which the pattern searches check between patterns.
+ * Different frames favor different algorithms (eg, geometric voting on dense fields, pyramid on
+ * sparse ones), so the portfolio is about as fast as the best algorithm for each frame.
+ */
+class PortfolioStarIdAlgorithm final : public StarIdAlgorithm {
+public:
+    using StarIdAlgorithm::Go;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &) const override;
+    StarIdentifiers Go(const PreparedDatabase &, const Stars &, const Catalog &, const Camera &,
+                       const StarIdConstraints &, StarIdProgress *) const override;
+
+    /**
+     * @param algorithms The algorithms to race. Takes ownership.
+     * @param names What to call each algorithm in StarIdProgress::portfolio
+     * @param residualTolerance See VerifyStarIdentifiers
+     * @param minStars See VerifyStarIdentifiers
+     */
+    PortfolioStarIdAlgorithm(std::vector<std::unique_ptr<StarIdAlgorithm>> algorithms,
+                             std::vector<std::string> names,
+                             decimal residualTolerance, int minStars)
+        : algorithms(std::move(algorithms)), names(std::move(names)),
+          residualTolerance(residualTolerance), minStars(minStars) { };
+private:
+    std::vector<std::unique_ptr<StarIdAlgorithm>> algorithms;
+    std::vector<std::string> names;
+    decimal residualTolerance;
+    int minStars;
 };
 
+bool VerifyStarIdentifiers(const StarIdentifiers &, const Stars &, const Catalog &, const Camera &,
+                           decimal residualTolerance, int minStars);
+
 }
 
 #endif
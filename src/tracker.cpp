@@ -0,0 +1,155 @@
+#include "tracker.hpp"
+
+#include <math.h>
+#include <inttypes.h>
+
+#include <unordered_map>
+#include <utility>
+
+#include "attitude-estimators.hpp"
+
+namespace lost {
+
+/// Key of the spatial hash cell with the given coordinates
+static int64_t TrackerCellKey(int cellX, int cellY) {
+    return ((int64_t)cellX << 32) ^ (uint32_t)cellY;
+}
+
+/**
+ * Match this frame's centroids to the last frame's identified centroids, predicting where each of
+ * those moved to with the angular rate.
+ * @param tracked[out] The identified centroids of this frame, which keep the catalog stars they
+ * were matched to. Cleared if tracking fails.
+ * @return Whether enough of the predicted stars were matched to trust the result. If not, run
+ * full star-id.
+ */
+bool Tracker::Track(const Stars &stars, const Camera &camera, StarIdentifiers *tracked) {
+    tracked->clear();
+    quality = 0;
+    if (!HasFrame()) {
+        return false;
+    }
+
+    // Cells are as big as the match radius, so each prediction only has to look at the 3x3 cells
+    // around it. A hash rather than a grid, so it doesn't matter how big the image is.
+    std::unordered_map<int64_t, std::vector<int>> cells;
+    for (int i = 0; i < (int)stars.size(); i++) {
+        int cellX = (int)DECIMAL_FLOOR(stars[i].position.x / matchRadius);
+        int cellY = (int)DECIMAL_FLOOR(stars[i].position.y / matchRadius);
+        cells[TrackerCellKey(cellX, cellY)].push_back(i);
+    }
+
+    // the prediction each centroid was matched to, or -1 if none, or -2 if more than one
+    std::vector<int> matchedPrediction(stars.size(), -1);
+    int numPredicted = 0;
+    for (int s = 0; s < (int)lastSpatials.size(); s++) {
+        // constant rate: it turns as much as it did between the last two frames
+        Vec3 predicted = rotation.Rotate(lastSpatials[s]);
+        if (predicted.x <= 0) {
+            continue;
+        }
+        Vec2 position = camera.SpatialToCamera(predicted);
+        if (!camera.InSensor(position)) {
+            // not a failure to match, it's just left the image
+            continue;
+        }
+        numPredicted++;
+
+        int cellX = (int)DECIMAL_FLOOR(position.x / matchRadius);
+        int cellY = (int)DECIMAL_FLOOR(position.y / matchRadius);
+        int match = -1;
+        int numInRadius = 0;
+        for (int neighborY = cellY - 1; neighborY <= cellY + 1; neighborY++) {
+            for (int neighborX = cellX - 1; neighborX <= cellX + 1; neighborX++) {
+                auto cell = cells.find(TrackerCellKey(neighborX, neighborY));
+                if (cell == cells.end()) {
+                    continue;
+                }
+                for (int i : cell->second) {
+                    Vec2 offset = stars[i].position - position;
+                    if (offset.MagnitudeSq() <= matchRadius*matchRadius) {
+                        match = i;
+                        numInRadius++;
+                    }
+                }
+            }
+        }
+        // With two centroids near the prediction, or two predictions near one centroid, the nearest
+        // one is often the wrong one. Leave them for the next star-id rather than carry a mistake forward.
+        if (numInRadius == 1) {
+            matchedPrediction[match] = matchedPrediction[match] == -1 ? s : -2;
+        }
+    }
+
+    for (int i = 0; i < (int)stars.size(); i++) {
+        if (matchedPrediction[i] >= 0) {
+            tracked->emplace_back(i, lastCatalogIndices[matchedPrediction[i]]);
+        }
+    }
+
+    quality = numPredicted > 0 ? (decimal)tracked->size() / numPredicted : 0;
+    if ((int)tracked->size() < minStars || quality < minFraction) {
+        tracked->clear();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Remember this frame's identifications (whether from Track or from full star-id) for the next call
+ * to Track, and measure the angular rate from the stars it has in common with the last frame.
+ */
+void Tracker::Update(const Stars &stars, const Camera &camera, const StarIdentifiers &starIds) {
+    std::vector<Vec3> spatials;
+    std::vector<int> catalogIndices;
+    for (const StarIdentifier &starId : starIds) {
+        spatials.push_back(camera.CameraToSpatial(stars[starId.starIndex].position).Normalize());
+        catalogIndices.push_back(starId.catalogIndex);
+    }
+
+    // The rotation between the frames is the attitude of this frame relative to the last, so any
+    // attitude estimator can find it, using the last frame's vectors as the "catalog".
+    std::unordered_map<int, int> lastIndexOf;
+    for (int l = 0; l < (int)lastCatalogIndices.size(); l++) {
+        lastIndexOf[lastCatalogIndices[l]] = l;
+    }
+    Catalog lastFrame;
+    StarIdentifiers common;
+    for (const StarIdentifier &starId : starIds) {
+        auto last = lastIndexOf.find(starId.catalogIndex);
+        if (last != lastIndexOf.end()) {
+            CatalogStar lastStar;
+            lastStar.spatial = lastSpatials[last->second];
+            lastFrame.push_back(lastStar);
+            common.emplace_back(starId.starIndex, (int)lastFrame.size() - 1);
+        }
+    }
+    hasRate = common.size() >= 2;
+    if (hasRate) {
+        rotation = DavenportQAlgorithm().Go(camera, stars, lastFrame, common).GetQuaternion();
+    } else {
+        rotation = Quaternion(1, 0, 0, 0);
+    }
+
+    lastSpatials = std::move(spatials);
+    lastCatalogIndices = std::move(catalogIndices);
+}
+
+void Tracker::Reset() {
+    lastSpatials.clear();
+    lastCatalogIndices.clear();
+    rotation = Quaternion(1, 0, 0, 0);
+    hasRate = false;
+    quality = 0;
+}
+
+Vec3 Tracker::AngularRate() const {
+    Quaternion canonical = rotation.Canonicalize();
+    decimal angle = canonical.Angle();
+    if (angle <= 0) {
+        return {0, 0, 0};
+    }
+    return canonical.Vector().Normalize() * angle;
+}
+
+}
@@ -0,0 +1,69 @@
+#ifndef TRACKER_H
+#define TRACKER_H
+
+#include <vector>
+
+#include "attitude-utils.hpp"
+#include "camera.hpp"
+#include "star-utils.hpp"
+
+namespace lost {
+
+/**
+ * Carries star identifications from one frame to the next without the database.
+ * Between consecutive frames of a continuously running star tracker, the sky only turns a little,
+ * and usually about as much as it did between the last two frames. The tracker predicts where each
+ * identified centroid of the last frame should be now with that constant rate model, and matches
+ * it to the centroid of the new frame within a small radius, found with a spatial hash of the
+ * centroids. Each match keeps its catalog star; ambiguous ones are dropped. The matches also give
+ * the rotation between the frames, which is the angular rate for the next prediction.
+ *
+ * When too few of the predictions find a centroid (eg, after a sudden slew, or when most of the
+ * identified stars have left the image), Track fails and full star-id should be run instead.
+ */
+class Tracker {
+public:
+    /**
+     * @param matchRadius How far (pixels) a centroid may be from where its star was predicted to be
+     * @param minFraction Tracking fails if fewer than this fraction of the predicted stars that are
+     * still in the image are matched.
+     * @param minStars Tracking fails if fewer than this many stars are matched.
+     */
+    Tracker(decimal matchRadius, decimal minFraction, int minStars)
+        : matchRadius(matchRadius), minFraction(minFraction), minStars(minStars) { };
+
+    bool Track(const Stars &, const Camera &, StarIdentifiers *tracked);
+    void Update(const Stars &, const Camera &, const StarIdentifiers &);
+    /// Forget the last frame, eg because its identifications weren't trustworthy
+    void Reset();
+
+    /// Whether Update has been called since the last Reset, so there's something to track
+    bool HasFrame() const { return !lastCatalogIndices.empty(); };
+    /// Fraction of the predicted stars that the last call to Track matched, from 0 to 1
+    decimal Quality() const { return quality; };
+    /// Whether there have been two consecutive frames with enough stars in common to measure the rate
+    bool HasRate() const { return hasRate; };
+    /**
+     * The rotation between the last two frames, as a rotation vector (axis times angle in radians)
+     * in the camera frame. This is how the stars appear to turn, which is the opposite of how the
+     * camera turns. Per frame, so divide by the frame interval to get radians per second.
+     */
+    Vec3 AngularRate() const;
+
+private:
+    decimal matchRadius;
+    decimal minFraction;
+    int minStars;
+
+    /// Spatial vectors (in the camera frame) and catalog indices of the last frame's identified centroids
+    std::vector<Vec3> lastSpatials;
+    std::vector<int> lastCatalogIndices;
+    /// Rotates the spatial vectors of the frame before the last onto the last frame's
+    Quaternion rotation = Quaternion(1, 0, 0, 0);
+    bool hasRate = false;
+    decimal quality = 0;
+};
+
+}
+
+#endif
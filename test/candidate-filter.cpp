@@ -0,0 +1,79 @@
+#include <random>
+
+#include <catch.hpp>
+
+#include "candidate-filter.hpp"
+#include "attitude-utils.hpp"
+#include "io.hpp"
+
+#include "utils.hpp"
+
+using namespace lost; // NOLINT
+
+// Compare against the obvious implementation with acos. Candidates right on the edge of a window can
+// go either way due to rounding, so those are skipped.
+TEST_CASE("FilterCandidates agrees with AngleUnit", "[candidate-filter] [fast]") {
+    const Catalog &catalog = CatalogRead();
+    std::default_random_engine rng(GENERATE(take(10, random(0, 1000000))));
+    std::uniform_int_distribution<int> starDist(0, catalog.size() - 1);
+    std::uniform_int_distribution<int> numCandidatesDist(0, 200);
+    std::uniform_real_distribution<decimal> distanceDist(DECIMAL(0.0), DECIMAL_M_PI);
+    std::bernoulli_distribution useNormalDist(0.5);
+
+    const Vec3 &center = catalog[starDist(rng)].spatial;
+    const Vec3 &other = catalog[starDist(rng)].spatial;
+    Vec3 normal = center.CrossProduct(other);
+    decimal minDistance = distanceDist(rng);
+    decimal maxDistance = minDistance + distanceDist(rng)/2;
+    bool useNormal = useNormalDist(rng);
+    CandidateWindow window = useNormal
+        ? DistanceWindow(center, minDistance, maxDistance, normal)
+        : DistanceWindow(center, minDistance, maxDistance);
+
+    std::vector<int16_t> candidates;
+    int numCandidates = numCandidatesDist(rng);
+    for (int i = 0; i < numCandidates; i++) {
+        candidates.push_back(starDist(rng));
+    }
+
+    std::vector<int16_t> filtered(candidates.size());
+    long numFiltered = FilterCandidates(catalog, window, candidates.data(), candidates.size(), filtered.data());
+    filtered.resize(numFiltered);
+
+    std::vector<int16_t> expected;
+    bool ambiguous = false;
+    for (int16_t candidate : candidates) {
+        decimal distance = AngleUnit(center, catalog[candidate].spatial);
+        decimal side = normal * catalog[candidate].spatial;
+        if (DECIMAL_ABS(distance - minDistance) < DECIMAL(1e-6) || DECIMAL_ABS(distance - maxDistance) < DECIMAL(1e-6)
+            || (useNormal && DECIMAL_ABS(side) < DECIMAL(1e-9))) {
+            ambiguous = true;
+        }
+        if (minDistance <= distance && distance <= maxDistance && (!useNormal || side > 0)) {
+            expected.push_back(candidate);
+        }
+    }
+    if (!ambiguous) {
+        REQUIRE(filtered == expected);
+    }
+
+    // filtering in place gives the same answer
+    long numFilteredInPlace = FilterCandidates(catalog, window, candidates.data(), candidates.size(), candidates.data());
+    candidates.resize(numFilteredInPlace);
+    CHECK(candidates == filtered);
+}
+
+TEST_CASE("CosineBounds are the cosines of the distance plus and minus the tolerance", "[candidate-filter] [fast]") {
+    decimal tolerance = GENERATE(DECIMAL(1e-4), DECIMAL(0.01), DECIMAL(0.3));
+    CosineTolerance cosineTolerance(tolerance);
+    for (int i = 0; i <= 1000; i++) {
+        decimal distance = DECIMAL_M_PI * i / 1000;
+        decimal minCos;
+        decimal maxCos;
+        CosineBounds(DECIMAL_COS(distance), cosineTolerance, &minCos, &maxCos);
+        CHECK(minCos == Approx(distance + tolerance >= DECIMAL_M_PI ? -1 : DECIMAL_COS(distance + tolerance)).margin(1e-6));
+        CHECK(maxCos == Approx(distance - tolerance <= 0 ? 1 : DECIMAL_COS(distance - tolerance)).margin(1e-6));
+        CHECK(minCos >= -1);
+        CHECK(maxCos <= 1);
+    }
+}
@@ -167,10 +167,24 @@ TEST_CASE("IdentifyRemainingStars fuzz", "[identify-remaining] [fuzz]") {
 
     SerializeContext ser;
     SerializePairDistanceKVector(&ser, fakeCatalog, 0, DECIMAL_M_PI, 1000);
-    DeserializeContext des(ser.buffer.data());
-    PairDistanceKVectorDatabase db(&des);
+    MultiDatabaseDescriptor dbEntries = {MultiDatabaseEntry(PairDistanceKVectorDatabase::kMagicValue, ser.buffer)};
+    // whichever database the candidates come from, the same stars are identified
+    int candidateSource = GENERATE(0, 1, 2);
+    if (candidateSource == 1) {
+        SerializeContext recordSer;
+        SerializePairRecordKVector(&recordSer, fakeCatalog, 0, DECIMAL_M_PI, 1000);
+        dbEntries.emplace_back(PairRecordKVectorDatabase::kMagicValue, recordSer.buffer);
+    } else if (candidateSource == 2) {
+        SerializeContext neighborSer;
+        SerializeNeighbors(&neighborSer, fakeCatalog, 0, DECIMAL_M_PI);
+        dbEntries.emplace_back(NeighborDatabase::kMagicValue, neighborSer.buffer);
+    }
+    SerializeContext multiSer;
+    SerializeMultiDatabase(&multiSer, dbEntries, 0);
+    PreparedDatabase db(multiSer.buffer.data());
 
-    int numIdentified = IdentifyRemainingStarsPairDistance(&someFakeStarIds, fakeCentroids, db, fakeCatalog, smolCamera, DECIMAL(1e-5));
+    int numIdentified = IdentifyRemainingStarsPairDistance(&someFakeStarIds, fakeCentroids, db, fakeCatalog, smolCamera, DECIMAL(1e-5),
+                                                           NULL);
 
     REQUIRE(numIdentified == numFakeStars - fakePatternSize);
     REQUIRE(AreStarIdentifiersEquivalent(fakeStarIds, someFakeStarIds));
@@ -181,3 +195,34 @@ TEST_CASE("IdentifyRemainingStars fuzz", "[identify-remaining] [fuzz]") {
 // TODO: Test when some stars can't be identified.
 
 // TODO: Test with false stars.
+
+TEST_CASE("IRCentroidHeap pops in order after decreasing keys", "[identify-remaining] [fast]") {
+    std::default_random_engine rng(GENERATE(take(5, random(0, 1000000))));
+    std::uniform_real_distribution<decimal> angleDist(DECIMAL(0.0), DECIMAL_M_PI_2);
+
+    Star star(0, 0, 1);
+    std::vector<IRUnidentifiedCentroid> centroids;
+    for (int i = 0; i < 50; i++) {
+        centroids.emplace_back(star, i);
+        centroids.back().bestAngleFrom90 = angleDist(rng);
+    }
+    IRCentroidHeap heap;
+    for (IRUnidentifiedCentroid &centroid : centroids) {
+        heap.Push(&centroid);
+    }
+    for (int i = 0; i < 50; i += 3) {
+        centroids[i].bestAngleFrom90 /= 2;
+        heap.DecreaseKey(&centroids[i]);
+    }
+
+    decimal lastAngleFrom90 = -1;
+    int numPopped = 0;
+    while (!heap.Empty()) {
+        IRUnidentifiedCentroid *centroid = heap.Pop();
+        CHECK(centroid->heapIndex == -1);
+        CHECK(centroid->bestAngleFrom90 >= lastAngleFrom90);
+        lastAngleFrom90 = centroid->bestAngleFrom90;
+        numPopped++;
+    }
+    CHECK(numPopped == 50);
+}
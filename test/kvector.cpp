@@ -1,3 +1,13 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <random>
+#include <utility>
+#include <vector>
+
 #include <catch.hpp>
 
 #include "databases.hpp"
@@ -9,6 +19,16 @@
 
 using namespace lost; // NOLINT
 
+/// numStars stars scattered uniformly over the sky, all of magnitude 0 and named by their index
+static Catalog RandomCatalog(std::default_random_engine &rng, int numStars) {
+    std::normal_distribution<decimal> coordinateDist(0, 1);
+    Catalog catalog;
+    for (int i = 0; i < numStars; i++) {
+        catalog.emplace_back(Vec3{coordinateDist(rng), coordinateDist(rng), coordinateDist(rng)}.Normalize(), 0, i);
+    }
+    return catalog;
+}
+
 TEST_CASE("Kvector full database stuff", "[kvector]") {
     const Catalog &catalog = CatalogRead();
     std::vector<unsigned char> dbBytes;
@@ -101,6 +121,488 @@ TEST_CASE("Tighter tolerance test", "[kvector]") {
     }
 }
 
+TEST_CASE("Pair database built from a grid on several threads has exactly every pair", "[kvector] [fast]") {
+    std::default_random_engine rng(GENERATE(take(3, random(0, 1000000))));
+    Catalog catalog = RandomCatalog(rng, 1000);
+    decimal minDistance = DegToRad(GENERATE(DECIMAL(0.0), DECIMAL(0.5)));
+    decimal maxDistance = DegToRad(GENERATE(DECIMAL(4.0), DECIMAL(20.0), DECIMAL(180.0)));
+
+    std::vector<std::pair<int16_t, int16_t>> expected;
+    for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
+        for (int16_t k = i+1; k < (int16_t)catalog.size(); k++) {
+            decimal distance = AngleUnit(catalog[i].spatial, catalog[k].spatial);
+            if (distance >= minDistance && distance <= maxDistance) {
+                expected.emplace_back(i, k);
+            }
+        }
+    }
+
+    SerializeContext ser1;
+    SerializePairDistanceKVector(&ser1, catalog, minDistance, maxDistance, 1000, 1);
+    SerializeContext ser4;
+    SerializePairDistanceKVector(&ser4, catalog, minDistance, maxDistance, 1000, 4);
+    CHECK(ser1.buffer == ser4.buffer);
+
+    DeserializeContext des(ser4.buffer.data());
+    PairDistanceKVectorDatabase db(&des);
+    REQUIRE(db.NumPairs() == (long)expected.size());
+    const int16_t *end;
+    const int16_t *pairs = db.FindPairsLiberal(minDistance, maxDistance, &end);
+    REQUIRE((end - pairs)/2 == (long)expected.size());
+    std::vector<std::pair<int16_t, int16_t>> found;
+    decimal lastDistance = -1;
+    bool ascending = true;
+    for (const int16_t *pair = pairs; pair != end; pair += 2) {
+        found.emplace_back(pair[0], pair[1]);
+        decimal distance = AngleUnit(catalog[pair[0]].spatial, catalog[pair[1]].spatial);
+        ascending = ascending && distance >= lastDistance;
+        lastDistance = distance;
+    }
+    CHECK(ascending);
+    std::sort(found.begin(), found.end());
+    CHECK(found == expected);
+}
+
+TEST_CASE("Threaded database builders give the same bytes on any number of threads", "[kvector] [fast]") {
+    std::default_random_engine rng(GENERATE(1, 2, 3));
+    Catalog catalog = RandomCatalog(rng, 2000);
+    decimal minDistance = DegToRad(DECIMAL(0.5));
+    decimal maxDistance = DegToRad(DECIMAL(15.0));
+
+    std::vector<unsigned char> pairBuffers[2], recordBuffers[2], cosineBuffers[2], compressedBuffers[2], skyCellBuffers[2];
+    int threadCounts[] = {1, GENERATE(2, 3, 8)};
+    for (int i = 0; i < 2; i++) {
+        SerializeContext pairSer;
+        SerializePairDistanceKVector(&pairSer, catalog, minDistance, maxDistance, 1000, threadCounts[i]);
+        pairBuffers[i] = pairSer.buffer;
+        SerializeContext recordSer;
+        SerializePairRecordKVector(&recordSer, catalog, minDistance, maxDistance, 1000, threadCounts[i]);
+        recordBuffers[i] = recordSer.buffer;
+        SerializeContext cosineSer;
+        SerializePairCosineKVector(&cosineSer, catalog, minDistance, maxDistance, 1000, threadCounts[i]);
+        cosineBuffers[i] = cosineSer.buffer;
+        SerializeContext compressedSer;
+        SerializeCompressedPairKVector(&compressedSer, catalog, minDistance, maxDistance, 1000, threadCounts[i]);
+        compressedBuffers[i] = compressedSer.buffer;
+        SerializeContext skyCellSer;
+        SerializeSkyCellPairs(&skyCellSer, catalog, minDistance, maxDistance, 4, 100, threadCounts[i]);
+        skyCellBuffers[i] = skyCellSer.buffer;
+    }
+    CHECK(pairBuffers[0] == pairBuffers[1]);
+    CHECK(recordBuffers[0] == recordBuffers[1]);
+    CHECK(cosineBuffers[0] == cosineBuffers[1]);
+    CHECK(compressedBuffers[0] == compressedBuffers[1]);
+    CHECK(skyCellBuffers[0] == skyCellBuffers[1]);
+}
+
+TEST_CASE("Pair record database has the pair database's pairs, with their distances", "[kvector]") {
+    const Catalog &catalog = CatalogRead();
+    decimal minDistance = DegToRad(DECIMAL(0.5));
+    decimal maxDistance = DegToRad(DECIMAL(5.0));
+    SerializeContext pairSer;
+    SerializePairDistanceKVector(&pairSer, catalog, minDistance, maxDistance, 1000);
+    DeserializeContext pairDes(pairSer.buffer.data());
+    PairDistanceKVectorDatabase pairDb(&pairDes);
+    SerializeContext recordSer;
+    SerializePairRecordKVector(&recordSer, catalog, minDistance, maxDistance, 1000);
+    DeserializeContext recordDes(recordSer.buffer.data());
+    PairRecordKVectorDatabase recordDb(&recordDes);
+    REQUIRE(recordDb.NumPairs() == pairDb.NumPairs());
+
+    const int16_t *pairsEnd;
+    const int16_t *pairs = pairDb.FindPairsLiberal(minDistance, maxDistance, &pairsEnd);
+    const PairRecord *recordsEnd;
+    const PairRecord *records = recordDb.FindPairsLiberal(minDistance, maxDistance, &recordsEnd);
+    REQUIRE(recordsEnd - records == recordDb.NumPairs());
+    bool samePairs = true;
+    bool sameDistances = true;
+    for (long i = 0; i < recordDb.NumPairs(); i++) {
+        samePairs = samePairs && records[i].index1 == pairs[2*i] && records[i].index2 == pairs[2*i+1];
+        decimal versine = PairVersine(AngleUnit(catalog[pairs[2*i]].spatial, catalog[pairs[2*i+1]].spatial));
+        sameDistances = sameDistances && std::abs(records[i].versine - versine) <= versine * DECIMAL(1e-6);
+    }
+    CHECK(samePairs);
+    CHECK(sameDistances);
+
+    // exact queries find the same pairs as the pair database's, which looks them up in the catalog
+    for (decimal min = DECIMAL(0.6); min < DECIMAL(4.9); min += DECIMAL(0.37)) {
+        decimal queryMin = DegToRad(min);
+        decimal queryMax = DegToRad(min + DECIMAL(0.01));
+        const int16_t *exactPairsEnd;
+        const int16_t *exactPairs = pairDb.FindPairsExact(catalog, queryMin, queryMax, &exactPairsEnd);
+        const PairRecord *exactRecordsEnd;
+        const PairRecord *exactRecords = recordDb.FindPairsExact(queryMin, queryMax, &exactRecordsEnd);
+        REQUIRE(exactRecords != exactRecordsEnd);
+        CHECK(exactRecords - records == (exactPairs - pairs)/2);
+        CHECK(exactRecordsEnd - records == (exactPairsEnd - pairs)/2);
+    }
+}
+
+TEST_CASE("Neighbor database lists each star's neighbors nearest first", "[kvector] [fast]") {
+    std::default_random_engine rng(GENERATE(take(3, random(0, 1000000))));
+    Catalog catalog = RandomCatalog(rng, 1000);
+    decimal minDistance = DegToRad(DECIMAL(0.5));
+    decimal maxDistance = DegToRad(DECIMAL(15.0));
+    SerializeContext ser;
+    SerializeNeighbors(&ser, catalog, minDistance, maxDistance);
+    DeserializeContext des(ser.buffer.data());
+    NeighborDatabase db(&des);
+    REQUIRE(db.NumStars() == (long)catalog.size());
+
+    std::uniform_real_distribution<decimal> queryDist(minDistance, maxDistance);
+    long totalNeighbors = 0;
+    for (int16_t star = 0; star < (int16_t)catalog.size(); star++) {
+        std::vector<int16_t> expected;
+        for (int16_t other = 0; other < (int16_t)catalog.size(); other++) {
+            decimal distance = AngleUnit(catalog[star].spatial, catalog[other].spatial);
+            if (other != star && distance >= minDistance && distance <= maxDistance) {
+                expected.push_back(other);
+            }
+        }
+        const int16_t *end;
+        const int16_t *neighbors = db.AllNeighbors(star, &end);
+        std::vector<int16_t> found(neighbors, end);
+        totalNeighbors += found.size();
+        bool nearestFirst = true;
+        for (size_t n = 0; n + 1 < found.size(); n++) {
+            nearestFirst = nearestFirst && db.Versines(star)[n] <= db.Versines(star)[n+1];
+        }
+        CHECK(nearestFirst);
+        std::sort(found.begin(), found.end());
+        CHECK(found == expected);
+
+        // a range query is exactly the neighbors in the range
+        decimal queryMin = queryDist(rng);
+        decimal queryMax = queryMin + DegToRad(DECIMAL(1.0));
+        neighbors = db.Neighbors(star, queryMin, queryMax, &end);
+        std::vector<int16_t> inRange;
+        for (int16_t other : expected) {
+            decimal distance = AngleUnit(catalog[star].spatial, catalog[other].spatial);
+            if (distance > queryMin && distance < queryMax) {
+                inRange.push_back(other);
+            }
+        }
+        found.assign(neighbors, end);
+        std::sort(found.begin(), found.end());
+        CHECK(found == inRange);
+    }
+    CHECK(totalNeighbors == db.NumNeighbors());
+}
+
+TEST_CASE("Batched pair queries return what one query at a time does", "[kvector] [fast]") {
+    std::default_random_engine rng(GENERATE(1, 2, 3));
+    Catalog catalog = RandomCatalog(rng, 1000);
+    SerializeContext ser;
+    SerializePairDistanceKVector(&ser, catalog, DegToRad(DECIMAL(1.0)), DegToRad(DECIMAL(15.0)), 1000);
+    DeserializeContext des(ser.buffer.data());
+    PairDistanceKVectorDatabase db(&des);
+
+    // including queries that overlap either end of the database, or miss it entirely
+    std::uniform_real_distribution<decimal> centerDist(0, DegToRad(DECIMAL(17.0)));
+    std::uniform_real_distribution<decimal> radiusDist(DECIMAL(1e-6), DegToRad(DECIMAL(0.5)));
+    std::vector<KVectorInterval> queries;
+    for (int q = 0; q < 1000; q++) {
+        decimal center = centerDist(rng);
+        decimal radius = radiusDist(rng);
+        queries.push_back({ center - radius, center + radius });
+    }
+    std::vector<KVectorRange> ranges(queries.size());
+    db.FindPairsLiberal(queries.data(), queries.size(), ranges.data());
+
+    bool same = true;
+    for (size_t q = 0; q < queries.size(); q++) {
+        const int16_t *end;
+        const int16_t *begin = db.FindPairsLiberal(queries[q].min, queries[q].max, &end);
+        same = same && db.Pair(ranges[q].begin) == begin && db.Pair(ranges[q].end) == end;
+    }
+    CHECK(same);
+}
+
+TEST_CASE("Pair cosine database has the pair database's pairs, queried by cosine", "[kvector] [fast]") {
+    std::default_random_engine rng(GENERATE(1, 2, 3));
+    Catalog catalog = RandomCatalog(rng, 1000);
+    decimal minDistance = DegToRad(DECIMAL(1.0));
+    decimal maxDistance = DegToRad(DECIMAL(15.0));
+    SerializeContext ser;
+    SerializePairDistanceKVector(&ser, catalog, minDistance, maxDistance, 1000);
+    DeserializeContext des(ser.buffer.data());
+    PairDistanceKVectorDatabase db(&des);
+    SerializeContext cosineSer;
+    SerializePairCosineKVector(&cosineSer, catalog, minDistance, maxDistance, 1000);
+    DeserializeContext cosineDes(cosineSer.buffer.data());
+    PairCosineKVectorDatabase cosineDb(&cosineDes);
+
+    REQUIRE(cosineDb.NumPairs() == db.NumPairs());
+    CHECK(cosineDb.MaxCos() == Approx(DECIMAL_COS(minDistance)));
+    CHECK(cosineDb.MinCos() == Approx(DECIMAL_COS(maxDistance)));
+    // the same pairs in the same order, so both cover the whole database the same way
+    const int16_t *end;
+    const int16_t *pairs = db.FindPairsLiberal(minDistance, maxDistance, &end);
+    const int16_t *cosineEnd;
+    const int16_t *cosinePairs = cosineDb.FindPairsLiberal(cosineDb.MinCos(), cosineDb.MaxCos(), &cosineEnd);
+    REQUIRE(cosineEnd - cosinePairs == end - pairs);
+    CHECK(std::equal(pairs, end, cosinePairs));
+
+    // every pair whose cosine is in the query is returned, and the batched query agrees
+    std::uniform_real_distribution<decimal> centerDist(0, DegToRad(DECIMAL(17.0)));
+    std::uniform_real_distribution<decimal> radiusDist(DECIMAL(1e-6), DegToRad(DECIMAL(0.5)));
+    bool complete = true;
+    bool same = true;
+    for (int q = 0; q < 200; q++) {
+        decimal center = centerDist(rng);
+        decimal radius = radiusDist(rng);
+        decimal minCos = DECIMAL_COS(center + radius);
+        decimal maxCos = DECIMAL_COS(std::max(DECIMAL(0.0), center - radius));
+        const int16_t *liberalEnd;
+        const int16_t *liberal = cosineDb.FindPairsLiberal(minCos, maxCos, &liberalEnd);
+        long numLiberal = 0;
+        for (const int16_t *k = liberal; k != liberalEnd; k += 2) {
+            decimal cosine = catalog[k[0]].spatial * catalog[k[1]].spatial;
+            numLiberal += minCos <= cosine && cosine <= maxCos;
+        }
+        long numExact = 0;
+        for (const int16_t *k = pairs; k != end; k += 2) {
+            decimal cosine = catalog[k[0]].spatial * catalog[k[1]].spatial;
+            numExact += minCos <= cosine && cosine <= maxCos;
+        }
+        complete = complete && numLiberal == numExact;
+
+        KVectorInterval query = { 1 - maxCos, 1 - minCos };
+        KVectorRange range;
+        cosineDb.FindPairsLiberalVersine(&query, 1, &range);
+        same = same && cosineDb.Pair(range.begin) == liberal && cosineDb.Pair(range.end) == liberalEnd;
+    }
+    CHECK(complete);
+    CHECK(same);
+}
+
+TEST_CASE("Kvector bins chosen for a tolerance give about the requested overfetch", "[kvector] [fast]") {
+    std::default_random_engine rng(GENERATE(1, 2));
+    Catalog catalog = RandomCatalog(rng, 2000);
+    decimal minDistance = DegToRad(DECIMAL(0.5));
+    decimal maxDistance = DegToRad(DECIMAL(20.0));
+    decimal tolerance = DegToRad(DECIMAL(0.1));
+    decimal overfetch = GENERATE(DECIMAL(0.02), DECIMAL(0.1), DECIMAL(0.5));
+
+    long numBins = KVectorBinsForTolerance(minDistance, maxDistance, tolerance, overfetch);
+    CHECK(numBins == (long)DECIMAL_CEIL((maxDistance - minDistance) / (2 * tolerance * overfetch)));
+    SerializeContext ser;
+    SerializePairDistanceKVector(&ser, catalog, minDistance, maxDistance, numBins);
+    DeserializeContext des(ser.buffer.data());
+    PairDistanceKVectorDatabase db(&des);
+    CHECK(PairDistanceKVectorOverfetch(db, catalog, tolerance) == Approx(overfetch).epsilon(0.25));
+}
+
+TEST_CASE("Batched pair query throughput", "[kvector] [.benchmark]") {
+    const Catalog &catalog = CatalogRead();
+    SerializeContext ser;
+    SerializePairDistanceKVector(&ser, catalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(15.0)), 10000);
+    DeserializeContext des(ser.buffer.data());
+    PairDistanceKVectorDatabase db(&des);
+
+    std::default_random_engine rng(1234);
+    std::uniform_real_distribution<decimal> centerDist(DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(15.0)));
+    std::vector<KVectorInterval> queries;
+    for (int q = 0; q < 1000000; q++) {
+        decimal center = centerDist(rng);
+        queries.push_back({ center - DegToRad(DECIMAL(0.01)), center + DegToRad(DECIMAL(0.01)) });
+    }
+
+    // like voting, each query's pairs are read right after the query
+    long checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const KVectorInterval &query : queries) {
+        const int16_t *end;
+        const int16_t *begin = db.FindPairsLiberal(query.min, query.max, &end);
+        checksum += begin == end ? 0 : begin[0];
+    }
+    double oneAtATime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    long batchedChecksum = 0;
+    const long batchSize = 64;
+    std::vector<KVectorRange> ranges(batchSize);
+    start = std::chrono::steady_clock::now();
+    for (size_t batch = 0; batch < queries.size(); batch += batchSize) {
+        db.FindPairsLiberal(&queries[batch], batchSize, ranges.data());
+        for (const KVectorRange &range : ranges) {
+            batchedChecksum += range.begin == range.end ? 0 : db.Pair(range.begin)[0];
+        }
+    }
+    double batched = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    CHECK(batchedChecksum == checksum);
+    WARN("One at a time: " << queries.size() / oneAtATime << " queries per second; batches of " << batchSize
+         << ": " << queries.size() / batched << " queries per second");
+}
+
+TEST_CASE("Compressed pair database returns the same pairs as the pair database", "[kvector] [fast]") {
+    std::default_random_engine rng(GENERATE(1, 2, 3));
+    Catalog catalog = RandomCatalog(rng, 2000);
+    decimal minDistance = DegToRad(DECIMAL(1.0));
+    decimal maxDistance = DegToRad(DECIMAL(15.0));
+    long numBins = GENERATE(10, 1000);
+    SerializeContext ser;
+    SerializePairDistanceKVector(&ser, catalog, minDistance, maxDistance, numBins);
+    DeserializeContext des(ser.buffer.data());
+    PairDistanceKVectorDatabase db(&des);
+    SerializeContext compressedSer;
+    SerializeCompressedPairKVector(&compressedSer, catalog, minDistance, maxDistance, numBins);
+    DeserializeContext compressedDes(compressedSer.buffer.data());
+    CompressedPairKVectorDatabase compressedDb(&compressedDes);
+
+    REQUIRE(compressedDb.NumPairs() == db.NumPairs());
+    CHECK(compressedSer.buffer.size() < ser.buffer.size());
+
+    // including queries of the whole database, and ones that overlap either end of it or miss it entirely
+    std::uniform_real_distribution<decimal> centerDist(0, DegToRad(DECIMAL(17.0)));
+    std::uniform_real_distribution<decimal> radiusDist(DECIMAL(1e-6), DegToRad(DECIMAL(0.5)));
+    std::vector<KVectorInterval> queries = { { minDistance, maxDistance } };
+    for (int q = 0; q < 200; q++) {
+        decimal center = centerDist(rng);
+        decimal radius = radiusDist(rng);
+        queries.push_back({ center - radius, center + radius });
+    }
+    std::vector<KVectorRange> ranges(queries.size());
+    compressedDb.FindPairsLiberal(queries.data(), queries.size(), ranges.data());
+
+    bool same = true;
+    for (size_t q = 0; q < queries.size(); q++) {
+        const int16_t *end;
+        const int16_t *begin = db.FindPairsLiberal(queries[q].min, queries[q].max, &end);
+        std::vector<std::pair<int16_t, int16_t>> expected;
+        for (const int16_t *k = begin; k != end; k += 2) {
+            expected.emplace_back(k[0], k[1]);
+        }
+
+        // pairs are in a different order within each bin
+        for (const CompressedPairIterator &start : { compressedDb.FindPairsLiberal(queries[q].min, queries[q].max),
+                                                     compressedDb.Pairs(ranges[q]) }) {
+            CompressedPairIterator pairs = start;
+            std::vector<std::pair<int16_t, int16_t>> actual;
+            int16_t index1;
+            int16_t index2;
+            while (pairs.Next(&index1, &index2)) {
+                actual.emplace_back(index1, index2);
+            }
+            std::sort(expected.begin(), expected.end());
+            std::sort(actual.begin(), actual.end());
+            same = same && actual == expected;
+        }
+    }
+    CHECK(same);
+}
+
+TEST_CASE("Compressed pair query throughput", "[kvector] [.benchmark]") {
+    const Catalog &catalog = CatalogRead();
+    SerializeContext ser;
+    SerializePairDistanceKVector(&ser, catalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(15.0)), 10000);
+    DeserializeContext des(ser.buffer.data());
+    PairDistanceKVectorDatabase db(&des);
+    SerializeContext compressedSer;
+    SerializeCompressedPairKVector(&compressedSer, catalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(15.0)), 10000);
+    DeserializeContext compressedDes(compressedSer.buffer.data());
+    CompressedPairKVectorDatabase compressedDb(&compressedDes);
+
+    std::default_random_engine rng(1234);
+    std::uniform_real_distribution<decimal> centerDist(DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(15.0)));
+    std::vector<KVectorInterval> queries;
+    for (int q = 0; q < 1000000; q++) {
+        decimal center = centerDist(rng);
+        queries.push_back({ center - DegToRad(DECIMAL(0.01)), center + DegToRad(DECIMAL(0.01)) });
+    }
+
+    // every pair of each query is read, like voting does
+    long checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const KVectorInterval &query : queries) {
+        const int16_t *end;
+        for (const int16_t *k = db.FindPairsLiberal(query.min, query.max, &end); k != end; k++) {
+            checksum += *k;
+        }
+    }
+    double uncompressed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    long compressedChecksum = 0;
+    start = std::chrono::steady_clock::now();
+    for (const KVectorInterval &query : queries) {
+        CompressedPairIterator pairs = compressedDb.FindPairsLiberal(query.min, query.max);
+        int16_t index1;
+        int16_t index2;
+        while (pairs.Next(&index1, &index2)) {
+            compressedChecksum += index1 + index2;
+        }
+    }
+    double compressed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    CHECK(compressedChecksum == checksum);
+    WARN("Uncompressed: " << ser.buffer.size() << " bytes, " << queries.size() / uncompressed << " queries per second; "
+         << "compressed: " << compressedSer.buffer.size() << " bytes, " << queries.size() / compressed << " queries per second");
+}
+
+TEST_CASE("Sky cell database has each pair once, in the cell of its first star", "[kvector] [fast]") {
+    std::default_random_engine rng(GENERATE(1, 2, 3));
+    Catalog catalog = RandomCatalog(rng, 2000);
+    decimal minDistance = DegToRad(DECIMAL(1.0));
+    decimal maxDistance = DegToRad(DECIMAL(15.0));
+    int cellsPerSide = GENERATE(1, 4);
+    SerializeContext ser;
+    SerializePairDistanceKVector(&ser, catalog, minDistance, maxDistance, 1000);
+    DeserializeContext des(ser.buffer.data());
+    PairDistanceKVectorDatabase db(&des);
+    SerializeContext skyCellSer;
+    SerializeSkyCellPairs(&skyCellSer, catalog, minDistance, maxDistance, cellsPerSide, 100);
+    DeserializeContext skyCellDes(skyCellSer.buffer.data());
+    SkyCellPairDatabase skyCellDb(&skyCellDes);
+
+    REQUIRE(skyCellDb.NumCells() == 6*cellsPerSide*cellsPerSide);
+    std::vector<std::pair<int16_t, int16_t>> expected;
+    const int16_t *end;
+    for (const int16_t *k = db.FindPairsLiberal(minDistance, maxDistance, &end); k != end; k += 2) {
+        expected.emplace_back(k[0], k[1]);
+    }
+    std::vector<std::pair<int16_t, int16_t>> actual;
+    bool inCell = true;
+    bool adjacencySymmetric = true;
+    for (int cell = 0; cell < skyCellDb.NumCells(); cell++) {
+        for (const int16_t *k = skyCellDb.FindPairsLiberal(cell, minDistance, maxDistance, &end); k != end; k += 2) {
+            actual.emplace_back(k[0], k[1]);
+            inCell = inCell && skyCellDb.CellOf(catalog[k[0]].spatial) == cell
+                && AngleUnit(catalog[k[0]].spatial, skyCellDb.CellCenter(cell)) <= skyCellDb.CellRadius(cell);
+        }
+        const int16_t *adjacentEnd;
+        const int16_t *adjacent = skyCellDb.AdjacentCells(cell, &adjacentEnd);
+        // 8 around each cell, but only 7 around those at the corners of the cube, and 4 when each face is one cell
+        long numAdjacent = adjacentEnd - adjacent;
+        CHECK((cellsPerSide == 1 ? numAdjacent == 4 : numAdjacent == 8 || numAdjacent == 7));
+        for (; adjacent != adjacentEnd; adjacent++) {
+            const int16_t *backEnd;
+            const int16_t *back = skyCellDb.AdjacentCells(*adjacent, &backEnd);
+            adjacencySymmetric = adjacencySymmetric && std::find(back, backEnd, cell) != backEnd;
+        }
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    CHECK(actual == expected);
+    CHECK(inCell);
+    CHECK(adjacencySymmetric);
+
+    // every star in a cone is in one of the cells near it
+    std::uniform_int_distribution<int> starDist(0, catalog.size() - 1);
+    std::uniform_real_distribution<decimal> radiusDist(0, DegToRad(DECIMAL(40.0)));
+    bool covered = true;
+    for (int cone = 0; cone < 20; cone++) {
+        Vec3 center = catalog[starDist(rng)].spatial;
+        decimal radius = radiusDist(rng);
+        std::vector<int> cells;
+        skyCellDb.CellsNear(center, radius, &cells);
+        for (const CatalogStar &star : catalog) {
+            covered = covered && (AngleUnit(star.spatial, center) > radius
+                                  || std::find(cells.begin(), cells.end(), skyCellDb.CellOf(star.spatial)) != cells.end());
+        }
+    }
+    CHECK(covered);
+}
+
 TEST_CASE("3-star database, check exact results", "[kvector] [fast]") {
     Catalog tripleCatalog = {
         CatalogStar(DegToRad(2), DegToRad(-3), DECIMAL(3.0), 42),
@@ -133,3 +635,191 @@ TEST_CASE("3-star database, check exact results", "[kvector] [fast]") {
         }
     }
 }
+
+TEST_CASE("MultiDatabase table of contents, checksums, and the format before it", "[kvector] [fast]") {
+    MultiDatabaseDescriptor dbEntries;
+    dbEntries.emplace_back(kCatalogMagicValue, std::vector<unsigned char>(13, 1));
+    dbEntries.emplace_back(PairDistanceKVectorDatabase::kMagicValue, std::vector<unsigned char>(100, 2));
+    dbEntries.emplace_back(GridDatabase::kMagicValue, std::vector<unsigned char>(64, 3));
+
+    SerializeContext ser;
+    SerializeMultiDatabase(&ser, dbEntries, 0);
+    REQUIRE(ser.buffer.size() % 64 == 0);
+    MultiDatabase multiDatabase(ser.buffer.data());
+    CHECK(multiDatabase.Version() == kMultiDatabaseVersion);
+    for (const MultiDatabaseEntry &entry : dbEntries) {
+        const unsigned char *subDatabase = multiDatabase.SubDatabasePointer(entry.magicValue);
+        REQUIRE(subDatabase != NULL);
+        CHECK((subDatabase - ser.buffer.data()) % 64 == 0);
+        CHECK(std::equal(entry.bytes.begin(), entry.bytes.end(), subDatabase));
+    }
+    CHECK(multiDatabase.SubDatabasePointer(TriangleDatabase::kMagicValue) == NULL);
+    CHECK(multiDatabase.VerifyChecksums());
+
+    // flip one bit of the pair database
+    unsigned char *pairs = (unsigned char *)multiDatabase.SubDatabasePointer(PairDistanceKVectorDatabase::kMagicValue);
+    pairs[50] ^= 4;
+    CHECK(!multiDatabase.VerifyChecksums());
+
+    // the same, written the way it was before the table of contents
+    SerializeContext legacySer;
+    for (const MultiDatabaseEntry &entry : dbEntries) {
+        SerializePrimitive<int32_t>(&legacySer, entry.magicValue);
+        SerializePrimitive<uint32_t>(&legacySer, 0);
+        SerializePrimitive<uint32_t>(&legacySer, entry.bytes.size());
+        SerializePadding<uint64_t>(&legacySer);
+        std::copy(entry.bytes.cbegin(), entry.bytes.cend(), std::back_inserter(legacySer.buffer));
+    }
+    SerializePrimitive<int32_t>(&legacySer, 0);
+    MultiDatabase legacy(legacySer.buffer.data());
+    CHECK(legacy.Version() == 0);
+    for (const MultiDatabaseEntry &entry : dbEntries) {
+        const unsigned char *subDatabase = legacy.SubDatabasePointer(entry.magicValue);
+        REQUIRE(subDatabase != NULL);
+        CHECK(std::equal(entry.bytes.begin(), entry.bytes.end(), subDatabase));
+    }
+    CHECK(legacy.SubDatabasePointer(TriangleDatabase::kMagicValue) == NULL);
+    CHECK(legacy.VerifyChecksums());
+}
+
+TEST_CASE("Mapped database has the same contents as the file", "[kvector] [fast]") {
+    Catalog tripleCatalog = {
+        CatalogStar(DegToRad(2), DegToRad(-3), DECIMAL(3.0), 42),
+        CatalogStar(DegToRad(4), DegToRad(7), DECIMAL(2.0), 43),
+        CatalogStar(DegToRad(2), DegToRad(6), DECIMAL(4.0), 44),
+    };
+    MultiDatabaseDescriptor dbEntries;
+    SerializeContext catalogSer;
+    SerializeCatalog(&catalogSer, tripleCatalog, true, true);
+    dbEntries.emplace_back(kCatalogMagicValue, catalogSer.buffer);
+    SerializeContext pairSer;
+    SerializePairDistanceKVector(&pairSer, tripleCatalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(20.0)), 1000);
+    dbEntries.emplace_back(PairDistanceKVectorDatabase::kMagicValue, pairSer.buffer);
+    SerializeContext ser;
+    SerializeMultiDatabase(&ser, dbEntries, 0);
+
+    char path[] = "/tmp/lost-test-database-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    REQUIRE(write(fd, ser.buffer.data(), ser.buffer.size()) == (ssize_t)ser.buffer.size());
+    close(fd);
+
+    DatabaseMapOptions options;
+    options.populate = GENERATE(false, true);
+    options.hugePages = GENERATE(false, true);
+    {
+        MappedDatabase mapped(path, options);
+        REQUIRE(mapped.Size() == (long)ser.buffer.size());
+        CHECK(std::equal(ser.buffer.begin(), ser.buffer.end(), mapped.Buffer()));
+        if (options.hugePages) {
+            CHECK((uintptr_t)mapped.Buffer() % (2 * 1024 * 1024) == 0);
+        }
+
+        PreparedDatabase database(mapped.Buffer());
+        REQUIRE(database.HasCatalog());
+        CHECK(database.GetCatalog().size() == tripleCatalog.size());
+        REQUIRE(database.PairDistanceKVector() != NULL);
+        CHECK(database.PairDistanceKVector()->NumPairs() == 3);
+    }
+    unlink(path);
+}
+
+TEST_CASE("Triple inner kvector database", "[kvector]") {
+    const Catalog &catalog = CatalogRead();
+    decimal minDistance = DegToRad(DECIMAL(1.0));
+    decimal maxDistance = DegToRad(DECIMAL(3.0));
+    decimal minInnerAngle = DegToRad(DECIMAL(5.0));
+    SerializeContext ser;
+    SerializeTripleInnerKVector(&ser, catalog, minDistance, maxDistance, minInnerAngle, 1000);
+    DeserializeContext des(ser.buffer.data());
+    TripleInnerKVectorDatabase db(&des);
+    REQUIRE(db.NumTriples() > 0);
+
+    SECTION("triples are in range and sorted by inner angle") {
+        const int16_t *end;
+        const int16_t *triples = db.FindTriplesLiberal(db.MinInnerAngle(), DECIMAL_M_PI/3, &end);
+        REQUIRE((end - triples)/4 == db.NumTriples());
+        for (const int16_t *triple = triples; triple != end; triple += 4) {
+            const Vec3 &a = catalog[triple[0]].spatial;
+            const Vec3 &b = catalog[triple[1]].spatial;
+            const Vec3 &c = catalog[triple[2]].spatial;
+            for (decimal distance : {AngleUnit(a, b), AngleUnit(a, c), AngleUnit(b, c)}) {
+                CHECK(minDistance - DECIMAL(1e-5) <= distance);
+                CHECK(distance <= maxDistance + DECIMAL(1e-5));
+            }
+            decimal smallest = InnerAngle(a, b, c);
+            decimal middle = InnerAngle(b, a, c);
+            decimal largest = InnerAngle(c, a, b);
+            CHECK(minInnerAngle - DECIMAL(1e-5) <= smallest);
+            CHECK(smallest <= middle + DECIMAL(1e-5));
+            CHECK(middle <= largest + DECIMAL(1e-5));
+            CHECK(TripleInnerKVectorDatabase::MiddleAngle(triple) == Approx(middle).margin(1e-4));
+        }
+    }
+
+    SECTION("form a partition") {
+        long totalReturnedTriples = 0;
+        decimal binWidth = (DECIMAL_M_PI/3 - db.MinInnerAngle()) / 1000;
+        for (int i = 0; i < 1000; i += 10) {
+            const int16_t *end;
+            const int16_t *triples = db.FindTriplesLiberal(db.MinInnerAngle() + i*binWidth + DECIMAL(1e-7),
+                                                           db.MinInnerAngle() + (i+10)*binWidth - DECIMAL(1e-7),
+                                                           &end);
+            totalReturnedTriples += (end - triples)/4;
+        }
+        REQUIRE(totalReturnedTriples == db.NumTriples());
+    }
+}
+
+TEST_CASE("Triangle database", "[kvector]") {
+    const Catalog &catalog = CatalogRead();
+    decimal minDistance = DegToRad(DECIMAL(1.0));
+    decimal maxDistance = DegToRad(DECIMAL(3.0));
+    SerializeContext ser;
+    SerializeTriangles(&ser, catalog, minDistance, maxDistance);
+    DeserializeContext des(ser.buffer.data());
+    TriangleDatabase db(&des);
+    REQUIRE(db.NumTriangles() > 0);
+
+    SECTION("triangles are in range, with sorted sides opposite their stars") {
+        for (long t = 0; t < db.NumTriangles(); t++) {
+            const decimal *sides = db.Sides(t);
+            const int16_t *stars = db.Stars(t);
+            CHECK(minDistance - DECIMAL(1e-5) <= sides[0]);
+            CHECK(sides[0] <= sides[1]);
+            CHECK(sides[1] <= sides[2]);
+            CHECK(sides[2] <= maxDistance + DECIMAL(1e-5));
+            CHECK(sides[0] == Approx(AngleUnit(catalog[stars[1]].spatial, catalog[stars[2]].spatial)).margin(1e-6));
+            CHECK(sides[1] == Approx(AngleUnit(catalog[stars[0]].spatial, catalog[stars[2]].spatial)).margin(1e-6));
+            CHECK(sides[2] == Approx(AngleUnit(catalog[stars[0]].spatial, catalog[stars[1]].spatial)).margin(1e-6));
+        }
+    }
+
+    SECTION("box queries return exactly the triangles in the box") {
+        std::vector<long> found;
+        for (long t = 0; t < db.NumTriangles(); t += db.NumTriangles()/50 + 1) {
+            decimal minSides[3];
+            decimal maxSides[3];
+            for (int m = 0; m < 3; m++) {
+                minSides[m] = db.Sides(t)[m] - DegToRad(DECIMAL(0.05));
+                maxSides[m] = db.Sides(t)[m] + DegToRad(DECIMAL(0.05));
+            }
+            found.clear();
+            db.FindTriangles(minSides, maxSides, &found);
+            std::sort(found.begin(), found.end());
+
+            std::vector<long> expected;
+            for (long u = 0; u < db.NumTriangles(); u++) {
+                bool inBox = true;
+                for (int m = 0; m < 3; m++) {
+                    inBox = inBox && minSides[m] <= db.Sides(u)[m] && db.Sides(u)[m] <= maxSides[m];
+                }
+                if (inBox) {
+                    expected.push_back(u);
+                }
+            }
+            CHECK(std::binary_search(found.begin(), found.end(), t));
+            CHECK(found == expected);
+        }
+    }
+}
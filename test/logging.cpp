@@ -0,0 +1,145 @@
+// Only errors and warnings, whatever the rest of the build logs, to check that the other levels are stripped
+#undef LOST_LOG_LEVEL
+#define LOST_LOG_LEVEL LOST_LOG_LEVEL_WARNING
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch.hpp>
+
+#include "logging.hpp"
+
+using namespace lost; // NOLINT
+
+/// Flush the log into a temporary file, and return each line written, without its newline
+static std::vector<std::string> FlushedLines() {
+    FILE *output = tmpfile();
+    REQUIRE(output != NULL);
+    LogFlush(output);
+    rewind(output);
+    std::vector<std::string> lines;
+    char line[1024];
+    while (fgets(line, sizeof(line), output) != NULL) {
+        lines.push_back(std::string(line, strcspn(line, "\n")));
+    }
+    fclose(output);
+    return lines;
+}
+
+/// The message of a flushed log line, ie everything after the level, time and location
+static std::string Message(const std::string &line) {
+    size_t end = line.find("] ");
+    return end == std::string::npos ? "" : line.substr(end + 2);
+}
+
+/// How many messages a flushed log says were dropped, or 0 if it doesn't say
+static long NumDropped(const std::vector<std::string> &lines) {
+    long numDropped = 0;
+    for (const std::string &line : lines) {
+        sscanf(line.c_str(), "[WARNING] %ld log messages dropped", &numDropped);
+    }
+    return numDropped;
+}
+
+TEST_CASE("Log keeps messages in order as the ring wraps around", "[logging] [fast]") {
+    // whatever earlier tests left behind
+    FlushedLines();
+
+    // each batch is less than the ring holds, but together they go around it several times
+    int numWritten = 0;
+    for (int batch = 0; batch < 10; batch++) {
+        for (int m = 0; m < 300; m++) {
+            LOST_LOG_WARNING("message %d", numWritten++);
+        }
+        std::vector<std::string> lines = FlushedLines();
+        REQUIRE(lines.size() == 300);
+        for (int m = 0; m < 300; m++) {
+            CHECK(Message(lines[m]) == "message " + std::to_string(numWritten - 300 + m));
+        }
+    }
+    CHECK(FlushedLines().empty());
+}
+
+TEST_CASE("Log drops and counts the newest messages when it's full", "[logging] [fast]") {
+    FlushedLines();
+
+    int numWritten = 5000;
+    for (int m = 0; m < numWritten; m++) {
+        LOST_LOG_WARNING("message %d", m);
+    }
+    std::vector<std::string> lines = FlushedLines();
+    long numDropped = NumDropped(lines);
+    REQUIRE(numDropped > 0);
+    // every message but the dropped ones, oldest first, then the count
+    REQUIRE((long)lines.size() - 1 + numDropped == numWritten);
+    for (int m = 0; m < (int)lines.size() - 1; m++) {
+        CHECK(Message(lines[m]) == "message " + std::to_string(m));
+    }
+
+    // the count is reset, and there's room again
+    LOST_LOG_WARNING("after");
+    lines = FlushedLines();
+    REQUIRE(lines.size() == 1);
+    CHECK(Message(lines[0]) == "after");
+}
+
+TEST_CASE("Log strips levels above LOST_LOG_LEVEL without evaluating their arguments", "[logging] [fast]") {
+    FlushedLines();
+
+    int numEvaluated = 0;
+    LOST_LOG_ERROR("error %d", ++numEvaluated);
+    LOST_LOG_WARNING("warning %d", ++numEvaluated);
+    LOST_LOG_INFO("info %d", ++numEvaluated);
+    LOST_LOG_DEBUG("debug %d", ++numEvaluated);
+    CHECK(numEvaluated == 2);
+
+    std::vector<std::string> lines = FlushedLines();
+    REQUIRE(lines.size() == 2);
+    CHECK(lines[0].compare(0, 7, "[ERROR ") == 0);
+    CHECK(Message(lines[0]) == "error 1");
+    CHECK(lines[1].compare(0, 9, "[WARNING ") == 0);
+    CHECK(Message(lines[1]) == "warning 2");
+}
+
+TEST_CASE("Log keeps every message from threads writing while it's flushed", "[logging] [fast]") {
+    FlushedLines();
+
+    // few enough that the ring never fills, however far behind the flushing falls
+    const int numThreads = 4;
+    const int numMessages = 200;
+    std::vector<std::thread> writers;
+    for (int t = 0; t < numThreads; t++) {
+        writers.emplace_back([t]() {
+            for (int m = 0; m < numMessages; m++) {
+                LOST_LOG_WARNING("thread %d message %d", t, m);
+            }
+        });
+    }
+    std::vector<std::string> lines;
+    for (int f = 0; f < 20; f++) {
+        std::vector<std::string> flushed = FlushedLines();
+        lines.insert(lines.end(), flushed.begin(), flushed.end());
+    }
+    for (std::thread &writer : writers) {
+        writer.join();
+    }
+    std::vector<std::string> flushed = FlushedLines();
+    lines.insert(lines.end(), flushed.begin(), flushed.end());
+
+    REQUIRE(lines.size() == numThreads*numMessages);
+    // each thread's messages come out once each, in the order it wrote them
+    std::vector<int> nextMessage(numThreads, 0);
+    for (const std::string &line : lines) {
+        int t, m;
+        REQUIRE(sscanf(Message(line).c_str(), "thread %d message %d", &t, &m) == 2);
+        REQUIRE(t >= 0);
+        REQUIRE(t < numThreads);
+        CHECK(m == nextMessage[t]);
+        nextMessage[t] = m + 1;
+    }
+    CHECK(nextMessage == std::vector<int>(numThreads, numMessages));
+}
@@ -0,0 +1,51 @@
+#include <random>
+
+#include <catch.hpp>
+
+#include "databases.hpp"
+#include "star-id.hpp"
+
+#include "fixtures.hpp"
+#include "utils.hpp"
+
+using namespace lost; // NOLINT
+
+#define kNonDimensionalNumImages 5
+
+TEST_CASE("Non-dimensional star-id with wrong focal length", "[non-dimensional] [fuzz]") {
+
+    // scatter a few stars across the image, project them through smolCamera to make a catalog,
+    // then identify the same centroids through smolCameraOff, whose focal length is about 9%
+    // longer. Pyramid would need a huge tolerance here, but the inner angles hardly change.
+    int numFakeStars = 25;
+
+    std::default_random_engine rng(GENERATE(take(kNonDimensionalNumImages, random(0, 1000000))));
+    std::uniform_real_distribution<decimal> posDist(DECIMAL(32.0), DECIMAL(224.0));
+
+    Stars fakeCentroids;
+    StarIdentifiers fakeStarIds;
+    Catalog fakeCatalog;
+    for (int i = 0; i < numFakeStars; i++) {
+        decimal x = posDist(rng);
+        decimal y = posDist(rng);
+        fakeCentroids.emplace_back(x, y, 1);
+        fakeCatalog.emplace_back(smolCamera.CameraToSpatial({x, y}).Normalize(), 1, i);
+        fakeStarIds.emplace_back(i, i);
+    }
+
+    SerializeContext tripleSer;
+    SerializeTripleInnerKVector(&tripleSer, fakeCatalog, DegToRad(DECIMAL(1.0)), DegToRad(DECIMAL(40.0)),
+                                DegToRad(DECIMAL(5.0)), 1000);
+    MultiDatabaseDescriptor dbEntries;
+    dbEntries.emplace_back(TripleInnerKVectorDatabase::kMagicValue, tripleSer.buffer);
+    SerializeContext ser;
+    SerializeMultiDatabase(&ser, dbEntries, 0);
+
+    NonDimensionalStarIdAlgorithm algo(DegToRad(DECIMAL(0.05)), DECIMAL(0.15), 1000);
+    StarIdentifiers starIds = algo.Go(ser.buffer.data(), fakeCentroids, fakeCatalog, smolCameraOff);
+
+    REQUIRE(starIds.size() > (size_t)numFakeStars / 2);
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.starIndex == starId.catalogIndex);
+    }
+}
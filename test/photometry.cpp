@@ -0,0 +1,120 @@
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <random>
+
+#include <catch.hpp>
+
+#include "photometry.hpp"
+#include "databases.hpp"
+#include "io.hpp"
+
+#include "fixtures.hpp"
+
+using namespace lost; // NOLINT
+
+TEST_CASE("Photometric model fits a noisy line and bands around it", "[photometry] [fast]") {
+    std::default_random_engine rng(GENERATE(take(5, random(0, 1000000))));
+    std::uniform_int_distribution<int> catalogMagnitudeDist(-100, 600);
+    std::normal_distribution<decimal> noiseDist(0, 20);
+
+    // centroid brightness proportional to flux, which is exponential in magnitude
+    PhotometricModel model(PhotometricScale::kLogarithmic, 50, 20);
+    Catalog catalog;
+    Stars stars;
+    for (int i = 0; i < 200; i++) {
+        int catalogMagnitude = catalogMagnitudeDist(rng);
+        catalog.emplace_back(Vec3{1, 0, 0}, catalogMagnitude, i);
+        decimal flux = DECIMAL_POW(10, -(catalogMagnitude + noiseDist(rng)) / 250);
+        stars.emplace_back(0, 0, 1, 1, (int)(100000 * flux));
+        CHECK(model.Ready() == (i >= 20));
+        model.Add(stars.back(), catalog.back());
+    }
+    REQUIRE(model.Ready());
+    CHECK(model.Rms() == Approx(20).epsilon(0.25));
+
+    for (int i = 0; i < (int)stars.size(); i++) {
+        CHECK(model.Predict(stars[i]) == Approx(catalog[i].magnitude).margin(100));
+        MagnitudeBand band = model.Band(stars[i]);
+        CHECK(band.max - band.min >= 100);
+        CHECK(band.Contains(catalog[i].magnitude));
+        CHECK(!band.Contains(catalog[i].magnitude + 300));
+    }
+    CHECK(model.Bands(stars).size() == stars.size());
+}
+
+TEST_CASE("Photometric model doesn't trust backwards fits", "[photometry] [fast]") {
+    PhotometricModel model(PhotometricScale::kLinear, 50, 2);
+    // brighter centroids matched with dimmer catalog stars
+    for (int i = 0; i < 10; i++) {
+        model.Add(Star(0, 0, 1, 1, i), CatalogStar(Vec3{1, 0, 0}, i * 100, i));
+    }
+    CHECK(!model.Ready());
+    CHECK(model.Bands(Stars(3)).empty());
+}
+
+/// Serves the same centroids, seen by smolCamera, on every frame
+class PhotometryPipelineInput : public PipelineInput {
+public:
+    PhotometryPipelineInput(const Catalog &catalog, const Stars &stars)
+        : catalog(catalog), stars(stars), camera(smolCamera) { }
+
+    const Catalog &GetCatalog() const override { return catalog; };
+    const Stars *InputStars() const override { return &stars; };
+    const Camera *InputCamera() const override { return &camera; };
+
+private:
+    Catalog catalog;
+    Stars stars;
+    Camera camera;
+};
+
+TEST_CASE("Pipeline fits its photometric model to catalog magnitudes from the database", "[photometry] [fast]") {
+    std::default_random_engine rng(GENERATE(1, 2, 3));
+    std::uniform_real_distribution<decimal> posDist(DECIMAL(0.0), DECIMAL(256.0));
+    std::uniform_int_distribution<int> magnitudeDist(0, 600);
+
+    Catalog catalog;
+    Stars stars;
+    for (int i = 0; i < 30; i++) {
+        Vec2 position = {posDist(rng), posDist(rng)};
+        int magnitude = magnitudeDist(rng);
+        catalog.emplace_back(smolCamera.CameraToSpatial(position).Normalize(), magnitude, i);
+        stars.emplace_back(position.x, position.y, 1, 1, 1000 - magnitude);
+    }
+
+    DatabaseOptions dbOptions;
+    dbOptions.kvector = true;
+    dbOptions.kvectorMaxDistance = 60;
+    dbOptions.threads = 1;
+    SerializeContext ser;
+    SerializeMultiDatabase(&ser, GenerateDatabases(catalog, dbOptions), 0);
+
+    char path[] = "/tmp/lost-test-database-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    REQUIRE(write(fd, ser.buffer.data(), ser.buffer.size()) == (ssize_t)ser.buffer.size());
+    close(fd);
+
+    PipelineOptions options;
+    options.databasePath = path;
+    options.idAlgo = "gv";
+    options.photometricFilter = "linear";
+    {
+        Pipeline pipeline = SetPipeline(options);
+        REQUIRE(pipeline.GetPhotometricModel() != NULL);
+        PhotometryPipelineInput input(catalog, stars);
+        for (int frame = 0; frame < 3; frame++) {
+            PipelineOutput output = pipeline.Go(input);
+            REQUIRE(output.starIds);
+            CHECK(output.starIds->size() == stars.size());
+        }
+        const PhotometricModel *model = pipeline.GetPhotometricModel();
+        REQUIRE(model->Ready());
+        for (int i = 0; i < (int)stars.size(); i++) {
+            CHECK(model->Predict(stars[i]) == Approx(catalog[i].magnitude).margin(1));
+        }
+    }
+    unlink(path);
+}
@@ -0,0 +1,33 @@
+#!/usr/bin/env bash
+
+# Compare how many pyramids Pyramid tries before finding a match, with pyramids tried in centroid
+# order and then with the brightest, best-conditioned pyramids tried first. Not run by `make test`;
+# run it by hand from the directory containing ./lost.
+
+# params: number of images (default 100), number of false stars per image (default 10)
+num_images=${1:-100}
+num_false_stars=${2:-10}
+
+# create database if not exists
+test -e pyramid-ranking-benchmark.dat || ./lost database \
+  --max-stars 5000 \
+  --kvector \
+  --kvector-min-distance 0.5 \
+  --kvector-max-distance 15 \
+  --kvector-distance-bins 10000 \
+  --output pyramid-ranking-benchmark.dat
+
+for ranked_stars in 0 8 12; do
+  echo "== --pyramid-ranked-stars $ranked_stars"
+  ./lost pipeline \
+    --generate "$num_images" \
+    --generate-random-attitudes \
+    --generate-false-stars "$num_false_stars" \
+    --fov 20 \
+    --database pyramid-ranking-benchmark.dat \
+    --star-id-algo py \
+    --pyramid-ranked-stars "$ranked_stars" \
+    --compare-star-ids \
+    --print-speed 2>/dev/null \
+    | grep -E 'starid_num_images|starid_average_patterns_tried|starid_average_ns'
+done
@@ -0,0 +1,673 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <set>
+
+#include <catch.hpp>
+
+#include "databases.hpp"
+#include "star-id.hpp"
+#include "star-id-private.hpp"
+
+#include "fixtures.hpp"
+#include "utils.hpp"
+
+using namespace lost; // NOLINT
+
+/**
+ * Add numStars centroids at random places in smolCamera's image to stars, and the catalog stars
+ * they're of, which are in front of the camera, to catalog, in the same order. The catalog stars
+ * have magnitude 1 and are named by their catalog index.
+ */
+static void FakeStarsInView(std::default_random_engine &rng, int numStars, Catalog *catalog, Stars *stars) {
+    std::uniform_real_distribution<decimal> posDist(DECIMAL(0.0), DECIMAL(256.0));
+    for (int i = 0; i < numStars; i++) {
+        Vec2 position = {posDist(rng), posDist(rng)};
+        catalog->emplace_back(smolCamera.CameraToSpatial(position).Normalize(), 1, (int)catalog->size());
+        stars->emplace_back(position.x, position.y, 1);
+    }
+}
+
+/// A pair distance kvector of the catalog, of all the distances smolCamera can see
+static MultiDatabaseEntry FakePairDistances(const Catalog &catalog) {
+    SerializeContext ser;
+    SerializePairDistanceKVector(&ser, catalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(60.0)), 10000);
+    return MultiDatabaseEntry(PairDistanceKVectorDatabase::kMagicValue, ser.buffer);
+}
+
+/// A triple inner kvector of the catalog, to go with FakePairDistances
+static MultiDatabaseEntry FakeTripleInner(const Catalog &catalog) {
+    SerializeContext ser;
+    SerializeTripleInnerKVector(&ser, catalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(60.0)), DegToRad(DECIMAL(5.0)), 1000);
+    return MultiDatabaseEntry(TripleInnerKVectorDatabase::kMagicValue, ser.buffer);
+}
+
+/// A multi-database of these sub-databases, for a PreparedDatabase, which it must outlive
+static std::vector<unsigned char> FakeMultiDatabase(const MultiDatabaseDescriptor &dbEntries) {
+    SerializeContext ser;
+    SerializeMultiDatabase(&ser, dbEntries, 0);
+    return ser.buffer;
+}
+
+TEST_CASE("Batch star-id gives the same results as one frame at a time", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(take(3, random(0, 1000000))));
+
+    // a fake catalog spread over the image, so that every frame below sees all of it
+    int numFakeStars = 20;
+    Catalog fakeCatalog;
+    Stars allStars;
+    FakeStarsInView(rng, numFakeStars, &fakeCatalog, &allStars);
+
+    std::vector<unsigned char> buffer = FakeMultiDatabase({FakePairDistances(fakeCatalog), FakeTripleInner(fakeCatalog)});
+    PreparedDatabase database(buffer.data());
+    REQUIRE(!database.HasCatalog());
+    REQUIRE(database.PairDistanceKVector() != NULL);
+    REQUIRE(database.TripleInnerKVector() != NULL);
+
+    // each frame sees the stars in a different order, and some frames are missing a few
+    std::vector<Stars> frameStars;
+    std::vector<StarIdFrame> frames;
+    for (int f = 0; f < 4; f++) {
+        std::vector<int> order;
+        for (int i = 0; i < numFakeStars; i++) {
+            order.push_back(i);
+        }
+        std::shuffle(order.begin(), order.end(), rng);
+        Stars stars;
+        for (int i = 0; i < numFakeStars - f; i++) {
+            Vec2 position = smolCamera.SpatialToCamera(fakeCatalog[order[i]].spatial);
+            stars.emplace_back(position.x, position.y, 1);
+        }
+        frameStars.push_back(stars);
+    }
+    for (const Stars &stars : frameStars) {
+        frames.push_back({&stars, &smolCamera});
+    }
+
+    GeometricVotingStarIdAlgorithm gv(DegToRad(DECIMAL(0.05)));
+    PyramidStarIdAlgorithm pyramid(DegToRad(DECIMAL(0.05)), 10, DECIMAL(0.001), 1000);
+    NonDimensionalStarIdAlgorithm nonDimensional(DegToRad(DECIMAL(0.05)), DECIMAL(0.05), 1000);
+    for (const StarIdAlgorithm *algo : std::vector<const StarIdAlgorithm *>{&gv, &pyramid, &nonDimensional}) {
+        std::vector<StarIdentifiers> batchStarIds = algo->Go(database, fakeCatalog, frames.data(), frames.size());
+        REQUIRE(batchStarIds.size() == frames.size());
+        CHECK(batchStarIds[0].size() >= 4);
+        for (int f = 0; f < (int)frames.size(); f++) {
+            StarIdentifiers starIds = algo->Go(buffer.data(), frameStars[f], fakeCatalog, smolCamera);
+            CHECK(AreStarIdentifiersEquivalent(batchStarIds[f], starIds));
+        }
+    }
+}
+
+TEST_CASE("Star-id reports progress and respects its deadline", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(take(3, random(0, 1000000))));
+
+    int numFakeStars = 12;
+    Catalog fakeCatalog;
+    Stars stars;
+    FakeStarsInView(rng, numFakeStars, &fakeCatalog, &stars);
+
+    std::vector<unsigned char> buffer = FakeMultiDatabase({FakePairDistances(fakeCatalog)});
+    PreparedDatabase database(buffer.data());
+
+    PyramidStarIdAlgorithm pyramid(DegToRad(DECIMAL(0.05)), 10, DECIMAL(0.001), 1000);
+
+    StarIdProgress progress;
+    StarIdentifiers starIds = pyramid.Go(database, stars, fakeCatalog, smolCamera, StarIdConstraints(), &progress);
+    CHECK(AreStarIdentifiersEquivalent(starIds, pyramid.Go(database, stars, fakeCatalog, smolCamera)));
+    REQUIRE(starIds.size() >= 4);
+    CHECK(!progress.deadlineReached);
+    CHECK(!progress.partial);
+    CHECK(progress.confidence > 0.99);
+    CHECK(progress.patternsTried >= 1);
+    CHECK(progress.patternsTotal == 12*11*10*9/24);
+
+    StarIdConstraints expired;
+    expired.deadline = std::chrono::steady_clock::now() - std::chrono::milliseconds(1);
+    starIds = pyramid.Go(database, stars, fakeCatalog, smolCamera, expired, &progress);
+    CHECK(starIds.empty());
+    CHECK(progress.deadlineReached);
+    CHECK(progress.patternsTried == 0);
+    CHECK(progress.Coverage() == 0);
+    CHECK(progress.confidence == 0);
+}
+
+TEST_CASE("Ranked pyramids start with the brightest, best-conditioned stars", "[star-id] [fast]") {
+    Stars stars;
+    // a big, nearly equilateral pyramid of dim stars, and a thin sliver of bright ones
+    stars.emplace_back(30, 30, 1, 1, 1);
+    stars.emplace_back(220, 40, 1, 1, 1);
+    stars.emplace_back(120, 220, 1, 1, 1);
+    stars.emplace_back(130, 110, 1, 1, 1);
+    stars.emplace_back(50, 128, 1, 1, 5);
+    stars.emplace_back(100, 130, 1, 1, 4);
+    stars.emplace_back(150, 127, 1, 1, 3);
+    stars.emplace_back(200, 131, 1, 1, 2);
+
+    std::vector<Vec3> spatials;
+    for (const Star &star : stars) {
+        spatials.push_back(smolCamera.CameraToSpatial(star.position).Normalize());
+    }
+
+    std::vector<int> brightest = BrightestStars(stars, 4);
+    REQUIRE(brightest == std::vector<int>({4, 5, 6, 7}));
+
+    std::vector<int> all = BrightestStars(stars, 100);
+    REQUIRE(all.size() == stars.size());
+    auto sortedIndices = [](const PyramidIndices &pyramid) {
+        std::vector<int> result = {pyramid.i, pyramid.j, pyramid.k, pyramid.r};
+        std::sort(result.begin(), result.end());
+        return result;
+    };
+
+    decimal tolerance = DegToRad(DECIMAL(0.05));
+    std::vector<PyramidIndices> ranked = RankPyramids(all, spatials, 0, DECIMAL_M_PI, PairTolerances(tolerance), 10, 1);
+    REQUIRE(ranked.size() == 8*7*6*5/24);
+    int bigRank = -1, sliverRank = -1;
+    for (int p = 0; p < (int)ranked.size(); p++) {
+        if (sortedIndices(ranked[p]) == std::vector<int>({0, 1, 2, 3})) {
+            bigRank = p;
+        }
+        if (sortedIndices(ranked[p]) == std::vector<int>({4, 5, 6, 7})) {
+            sliverRank = p;
+        }
+        if (p > 0) {
+            CHECK(PyramidExpectedMismatches(spatials, ranked[p-1].i, ranked[p-1].j, ranked[p-1].k, tolerance, 10)
+                  <= PyramidExpectedMismatches(spatials, ranked[p].i, ranked[p].j, ranked[p].k, tolerance, 10));
+        }
+    }
+    // the sliver's stars are nearly collinear, so it's much more likely to be mismatched
+    CHECK(bigRank < sliverRank);
+    CHECK(sliverRank == (int)ranked.size() - 1);
+
+    // nothing closer together than the database's minimum distance
+    decimal minDistance = AngleUnit(spatials[5], spatials[6]) + DECIMAL(1e-4);
+    for (const PyramidIndices &pyramid : RankPyramids(all, spatials, minDistance, DECIMAL_M_PI, PairTolerances(tolerance), 10, 1)) {
+        std::vector<int> indices = sortedIndices(pyramid);
+        CHECK(!(std::count(indices.begin(), indices.end(), 5) && std::count(indices.begin(), indices.end(), 6)));
+    }
+}
+
+TEST_CASE("Pyramid iteration visits every four centroids once, in ascending index order", "[star-id] [fast]") {
+    int numStars = GENERATE(0, 3, 4, 5, 9, 20);
+    std::set<std::vector<int>> visited;
+    long numPyramids = 0;
+    PyramidIterator pyramids(numStars);
+    PyramidIndices pyramid;
+    while (pyramids.Next(&pyramid)) {
+        REQUIRE(0 <= pyramid.i);
+        REQUIRE(pyramid.i < pyramid.j);
+        REQUIRE(pyramid.j < pyramid.k);
+        REQUIRE(pyramid.k < pyramid.r);
+        REQUIRE(pyramid.r < numStars);
+        visited.insert({pyramid.i, pyramid.j, pyramid.k, pyramid.r});
+        numPyramids++;
+    }
+    long expected = numStars < 4 ? 0 : (long)numStars*(numStars-1)*(numStars-2)*(numStars-3)/24;
+    CHECK(numPyramids == expected);
+    CHECK((long)visited.size() == expected);
+    // done is done
+    CHECK(!pyramids.Next(&pyramid));
+}
+
+TEST_CASE("Pyramid finds the same stars from pair records as from the pair distances", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(1, 2, 3));
+
+    // stars in the image, and stars all over the rest of the sky to match them by chance
+    std::normal_distribution<decimal> coordinateDist(0, 1);
+    int numFakeStars = 12;
+    Catalog fakeCatalog;
+    Stars stars;
+    FakeStarsInView(rng, numFakeStars, &fakeCatalog, &stars);
+    while (fakeCatalog.size() < 1000) {
+        Vec3 spatial = Vec3{coordinateDist(rng), coordinateDist(rng), coordinateDist(rng)}.Normalize();
+        fakeCatalog.emplace_back(spatial, 1, fakeCatalog.size());
+    }
+
+    std::vector<unsigned char> pairBuffer = FakeMultiDatabase({FakePairDistances(fakeCatalog)});
+    PreparedDatabase pairDatabase(pairBuffer.data());
+    SerializeContext recordSer;
+    SerializePairRecordKVector(&recordSer, fakeCatalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(60.0)), 10000);
+    std::vector<unsigned char> recordBuffer = FakeMultiDatabase({
+        FakePairDistances(fakeCatalog), MultiDatabaseEntry(PairRecordKVectorDatabase::kMagicValue, recordSer.buffer)});
+    PreparedDatabase recordDatabase(recordBuffer.data());
+    REQUIRE(recordDatabase.PairRecordKVector() != NULL);
+
+    PyramidStarIdAlgorithm pyramid(DegToRad(DECIMAL(0.05)), 10, DECIMAL(0.001), 1000);
+    StarIdentifiers pairStarIds = pyramid.Go(pairDatabase, stars, fakeCatalog, smolCamera);
+    StarIdentifiers recordStarIds = pyramid.Go(recordDatabase, stars, fakeCatalog, smolCamera);
+    CHECK((int)recordStarIds.size() == numFakeStars);
+    for (const StarIdentifier &starId : recordStarIds) {
+        CHECK(starId.catalogIndex == starId.starIndex);
+    }
+    CHECK(AreStarIdentifiersEquivalent(pairStarIds, recordStarIds));
+}
+
+TEST_CASE("Portfolio star-id returns a verified result from one of its algorithms", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(take(3, random(0, 1000000))));
+
+    int numFakeStars = 12;
+    Catalog fakeCatalog;
+    Stars stars;
+    FakeStarsInView(rng, numFakeStars, &fakeCatalog, &stars);
+
+    std::vector<unsigned char> buffer = FakeMultiDatabase({FakePairDistances(fakeCatalog)});
+    PreparedDatabase database(buffer.data());
+
+    decimal tolerance = DegToRad(DECIMAL(0.05));
+    std::vector<std::unique_ptr<StarIdAlgorithm>> algorithms;
+    algorithms.emplace_back(new PyramidStarIdAlgorithm(tolerance, 10, DECIMAL(0.001), 1000));
+    algorithms.emplace_back(new GeometricVotingStarIdAlgorithm(tolerance));
+    PortfolioStarIdAlgorithm portfolio(std::move(algorithms), {"py", "gv"}, 2*tolerance, 4);
+
+    StarIdProgress progress;
+    StarIdentifiers starIds = portfolio.Go(database, stars, fakeCatalog, smolCamera, StarIdConstraints(), &progress);
+    REQUIRE(starIds.size() >= 4);
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.starIndex == starId.catalogIndex);
+    }
+    REQUIRE(progress.portfolio.size() == 2);
+    CHECK(progress.portfolio[0].name == "py");
+    CHECK(progress.portfolio[1].name == "gv");
+    CHECK(progress.portfolio[0].won + progress.portfolio[1].won == 1);
+    for (const PortfolioEntry &entry : progress.portfolio) {
+        CHECK(entry.timeNs > 0);
+        if (entry.won) {
+            CHECK(entry.verified);
+        }
+    }
+
+    std::atomic<bool> cancel(true);
+    StarIdConstraints cancelled;
+    cancelled.cancel = &cancel;
+    starIds = portfolio.Go(database, stars, fakeCatalog, smolCamera, cancelled, &progress);
+    CHECK(starIds.empty());
+    CHECK(progress.cancelled);
+}
+
+TEST_CASE("Star-id verification rejects identifications that don't fit one attitude", "[star-id] [fast]") {
+    Catalog fakeCatalog;
+    Stars stars;
+    StarIdentifiers starIds;
+    for (int i = 0; i < 6; i++) {
+        Vec2 position = {DECIMAL(30.0) + 40*i, DECIMAL(20.0) + 35*(i % 3)};
+        fakeCatalog.emplace_back(smolCamera.CameraToSpatial(position).Normalize(), 1, i);
+        stars.emplace_back(position.x, position.y, 1);
+        starIds.push_back(StarIdentifier(i, i));
+    }
+    decimal tolerance = DegToRad(DECIMAL(0.1));
+
+    CHECK(VerifyStarIdentifiers(starIds, stars, fakeCatalog, smolCamera, tolerance, 4));
+    // too few to trust
+    CHECK(!VerifyStarIdentifiers(StarIdentifiers(starIds.begin(), starIds.begin() + 3),
+                                 stars, fakeCatalog, smolCamera, tolerance, 4));
+    // two stars swapped
+    std::swap(starIds[1].catalogIndex, starIds[4].catalogIndex);
+    CHECK(!VerifyStarIdentifiers(starIds, stars, fakeCatalog, smolCamera, tolerance, 4));
+}
+
+TEST_CASE("Reprojection verification accepts correct pyramids and rejects wrong ones", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(take(3, random(0, 1000000))));
+
+    int numFakeStars = 12;
+    Catalog fakeCatalog;
+    Stars stars;
+    FakeStarsInView(rng, numFakeStars, &fakeCatalog, &stars);
+    // and a false star
+    std::uniform_real_distribution<decimal> posDist(DECIMAL(0.0), DECIMAL(256.0));
+    stars.emplace_back(posDist(rng), posDist(rng), 1);
+
+    ReprojectionVerifier verifier(DegToRad(DECIMAL(0.15)), DECIMAL(0.5), 4);
+    StarIdentifiers seed = {StarIdentifier(0, 0), StarIdentifier(1, 1), StarIdentifier(2, 2), StarIdentifier(3, 3)};
+
+    StarIdentifiers identified;
+    REQUIRE(verifier.Verify(seed, stars, fakeCatalog, smolCamera, &identified) == ReprojectionOutcome::kAccept);
+    CHECK((int)identified.size() == numFakeStars);
+    for (const StarIdentifier &starId : identified) {
+        CHECK(starId.starIndex == starId.catalogIndex);
+    }
+
+    StarIdentifiers wrongSeed = seed;
+    std::swap(wrongSeed[1].catalogIndex, wrongSeed[2].catalogIndex);
+    CHECK(verifier.Verify(wrongSeed, stars, fakeCatalog, smolCamera, NULL) == ReprojectionOutcome::kReject);
+
+    Stars fewStars(stars.begin(), stars.begin() + 6);
+    CHECK(verifier.Verify(seed, fewStars, fakeCatalog, smolCamera, NULL) == ReprojectionOutcome::kInconclusive);
+
+    // Pyramid returns the same stars whether reprojection or pair distances identify the rest
+    std::vector<unsigned char> buffer = FakeMultiDatabase({FakePairDistances(fakeCatalog)});
+    PreparedDatabase database(buffer.data());
+    decimal tolerance = DegToRad(DECIMAL(0.05));
+    PyramidStarIdAlgorithm pyramid(tolerance, 10, DECIMAL(0.001), 1000);
+    PyramidStarIdAlgorithm reprojectPyramid(tolerance, 10, DECIMAL(0.001), 1000, 0, PyramidVerification::kReprojectOnly);
+    StarIdentifiers starIds = reprojectPyramid.Go(database, stars, fakeCatalog, smolCamera);
+    CHECK(starIds.size() >= 4);
+    CHECK(AreStarIdentifiersEquivalent(starIds, pyramid.Go(database, stars, fakeCatalog, smolCamera)));
+}
+
+TEST_CASE("A sky cone prior rules out matches elsewhere in the sky", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(take(3, random(0, 1000000))));
+
+    // the same stars twice: once in front of the camera, and once rotated a quarter turn around z,
+    // so that every pattern matches in two places
+    int numFakeStars = 16;
+    Catalog fakeCatalog;
+    Stars stars;
+    FakeStarsInView(rng, numFakeStars, &fakeCatalog, &stars);
+    for (int i = 0; i < numFakeStars; i++) {
+        const Vec3 &spatial = fakeCatalog[i].spatial;
+        fakeCatalog.emplace_back(Vec3{-spatial.y, spatial.x, spatial.z}, 1, numFakeStars + i);
+    }
+
+    std::vector<unsigned char> buffer = FakeMultiDatabase({FakePairDistances(fakeCatalog), FakeTripleInner(fakeCatalog)});
+    PreparedDatabase database(buffer.data());
+
+    CatalogMask ahead = SkyConeMask(fakeCatalog, smolCamera, {1, 0, 0}, DegToRad(DECIMAL(5.0)));
+    CatalogMask rotated = SkyConeMask(fakeCatalog, smolCamera, {0, 1, 0}, DegToRad(DECIMAL(5.0)));
+    CHECK(ahead.Count() == numFakeStars);
+    CHECK(rotated.Count() == numFakeStars);
+    for (int i = 0; i < numFakeStars; i++) {
+        CHECK(ahead.Test(i));
+        CHECK(!ahead.Test(numFakeStars + i));
+        CHECK(rotated.Test(numFakeStars + i));
+    }
+    CHECK(SkyConeMask(fakeCatalog, smolCamera, {1, 0, 0}, DECIMAL_M_PI).Count() == (long)fakeCatalog.size());
+
+    decimal tolerance = DegToRad(DECIMAL(0.05));
+    PyramidStarIdAlgorithm pyramid(tolerance, 10, DECIMAL(0.001), 1000);
+    // every pyramid is ambiguous without the prior
+    CHECK(pyramid.Go(database, stars, fakeCatalog, smolCamera).empty());
+
+    GeometricVotingStarIdAlgorithm gv(tolerance);
+    NonDimensionalStarIdAlgorithm nonDimensional(tolerance, DECIMAL(0.05), 1000);
+    for (const StarIdAlgorithm *algo : std::vector<const StarIdAlgorithm *>{&gv, &pyramid, &nonDimensional}) {
+        for (int offset : {0, numFakeStars}) {
+            StarIdConstraints constraints;
+            constraints.allowedStars = offset == 0 ? &ahead : &rotated;
+            StarIdentifiers starIds = algo->Go(database, stars, fakeCatalog, smolCamera, constraints, NULL);
+            CHECK(starIds.size() >= 4);
+            for (const StarIdentifier &starId : starIds) {
+                CHECK(starId.catalogIndex == starId.starIndex + offset);
+            }
+        }
+    }
+}
+
+TEST_CASE("Geometric voting with a sky cone looks up pairs in the sky cells near it", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(1, 2, 3));
+
+    // stars in the image, and stars all over the rest of the sky
+    std::normal_distribution<decimal> coordinateDist(0, 1);
+    Catalog fakeCatalog;
+    Stars stars;
+    FakeStarsInView(rng, 16, &fakeCatalog, &stars);
+    while (fakeCatalog.size() < 2000) {
+        Vec3 spatial = Vec3{coordinateDist(rng), coordinateDist(rng), coordinateDist(rng)}.Normalize();
+        if (spatial.x < DECIMAL_COS(DegToRad(DECIMAL(30.0)))) {
+            fakeCatalog.emplace_back(spatial, 1, fakeCatalog.size());
+        }
+    }
+
+    SerializeContext skyCellSer;
+    SerializeSkyCellPairs(&skyCellSer, fakeCatalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(30.0)), 3, 1000);
+    std::vector<unsigned char> buffer = FakeMultiDatabase({MultiDatabaseEntry(SkyCellPairDatabase::kMagicValue, skyCellSer.buffer)});
+    PreparedDatabase database(buffer.data());
+
+    GeometricVotingStarIdAlgorithm gv(DegToRad(DECIMAL(0.05)));
+    // without a cone, there are no pairs to look up
+    CHECK(gv.Go(database, stars, fakeCatalog, smolCamera).empty());
+
+    Vec3 center = Vec3{1, DECIMAL(0.05), 0}.Normalize();
+    CatalogMask allowedStars = SkyConeMask(fakeCatalog, smolCamera, center, DegToRad(DECIMAL(5.0)));
+    StarIdConstraints constraints;
+    constraints.allowedStars = &allowedStars;
+    constraints.skyConeCenter = center;
+    constraints.skyConeRadius = SkyConeStarRadius(smolCamera, DegToRad(DECIMAL(5.0)));
+    StarIdentifiers starIds = gv.Go(database, stars, fakeCatalog, smolCamera, constraints, NULL);
+    CHECK(starIds.size() >= 4);
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.catalogIndex == starId.starIndex);
+    }
+}
+
+TEST_CASE("Geometric voting identifies the same stars whichever pair database it has", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(1, 2, 3));
+
+    // stars in the image, and enough elsewhere in the sky that plenty of pairs match by chance
+    std::normal_distribution<decimal> coordinateDist(0, 1);
+    Catalog fakeCatalog;
+    Stars stars;
+    FakeStarsInView(rng, 16, &fakeCatalog, &stars);
+    while (fakeCatalog.size() < 1000) {
+        Vec3 spatial = Vec3{coordinateDist(rng), coordinateDist(rng), coordinateDist(rng)}.Normalize();
+        fakeCatalog.emplace_back(spatial, 1, fakeCatalog.size());
+    }
+
+    // each in a database of its own, since geometric voting prefers the cosines to the distances
+    std::vector<unsigned char> distanceBuffer = FakeMultiDatabase({FakePairDistances(fakeCatalog)});
+    SerializeContext cosineSer;
+    SerializePairCosineKVector(&cosineSer, fakeCatalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(60.0)), 10000);
+    std::vector<unsigned char> cosineBuffer = FakeMultiDatabase(
+        {MultiDatabaseEntry(PairCosineKVectorDatabase::kMagicValue, cosineSer.buffer)});
+    SerializeContext compressedSer;
+    SerializeCompressedPairKVector(&compressedSer, fakeCatalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(60.0)), 10000);
+    std::vector<unsigned char> compressedBuffer = FakeMultiDatabase(
+        {MultiDatabaseEntry(CompressedPairKVectorDatabase::kMagicValue, compressedSer.buffer)});
+    PreparedDatabase distanceDatabase(distanceBuffer.data());
+    PreparedDatabase cosineDatabase(cosineBuffer.data());
+    PreparedDatabase compressedDatabase(compressedBuffer.data());
+    REQUIRE(cosineDatabase.PairCosineKVector() != NULL);
+    REQUIRE(compressedDatabase.CompressedPairKVector() != NULL);
+
+    GeometricVotingStarIdAlgorithm gv(DegToRad(DECIMAL(0.05)));
+    StarIdentifiers expected = gv.Go(distanceDatabase, stars, fakeCatalog, smolCamera);
+    REQUIRE(expected.size() >= 4);
+    for (const StarIdentifier &starId : expected) {
+        CHECK(starId.catalogIndex == starId.starIndex);
+    }
+    CHECK(AreStarIdentifiersEquivalent(gv.Go(cosineDatabase, stars, fakeCatalog, smolCamera), expected));
+    CHECK(AreStarIdentifiersEquivalent(gv.Go(compressedDatabase, stars, fakeCatalog, smolCamera), expected));
+}
+
+TEST_CASE("Star-id rules out candidates with the wrong magnitude", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(take(3, random(0, 1000000))));
+    std::uniform_int_distribution<int> magnitudeDist(0, 300);
+
+    // the same stars twice, in the same place, but the second copy is 4 magnitudes dimmer
+    int numFakeStars = 16;
+    Catalog fakeCatalog;
+    Stars stars;
+    FakeStarsInView(rng, numFakeStars, &fakeCatalog, &stars);
+    for (int i = 0; i < numFakeStars; i++) {
+        fakeCatalog[i].magnitude = magnitudeDist(rng);
+        stars[i].magnitude = -fakeCatalog[i].magnitude;
+    }
+    for (int i = 0; i < numFakeStars; i++) {
+        fakeCatalog.emplace_back(fakeCatalog[i].spatial, fakeCatalog[i].magnitude + 400, numFakeStars + i);
+    }
+
+    std::vector<unsigned char> buffer = FakeMultiDatabase({FakePairDistances(fakeCatalog)});
+    PreparedDatabase database(buffer.data());
+
+    decimal tolerance = DegToRad(DECIMAL(0.05));
+    PyramidStarIdAlgorithm pyramid(tolerance, 10, DECIMAL(0.001), 1000);
+    GeometricVotingStarIdAlgorithm gv(tolerance);
+    // every pyramid is ambiguous without magnitudes
+    CHECK(pyramid.Go(database, stars, fakeCatalog, smolCamera).empty());
+
+    PhotometricModel model(PhotometricScale::kLinear, 100, 10);
+    StarIdConstraints constraints;
+    constraints.photometry = &model;
+    // an untrained model doesn't rule anything out
+    CHECK(pyramid.Go(database, stars, fakeCatalog, smolCamera, constraints, NULL).empty());
+
+    for (int i = 0; i < numFakeStars; i++) {
+        model.Add(stars[i], fakeCatalog[i]);
+    }
+    REQUIRE(model.Ready());
+    for (const StarIdAlgorithm *algo : std::vector<const StarIdAlgorithm *>{&gv, &pyramid}) {
+        StarIdentifiers starIds = algo->Go(database, stars, fakeCatalog, smolCamera, constraints, NULL);
+        CHECK((int)starIds.size() == numFakeStars);
+        for (const StarIdentifier &starId : starIds) {
+            CHECK(starId.catalogIndex == starId.starIndex);
+        }
+    }
+}
+
+TEST_CASE("Pair tolerances follow the centroids' uncertainties along the pair", "[star-id] [fast]") {
+    Stars stars = {
+        Star(128, 128, 1, 1, 1000),
+        Star(228, 128, 1, 1, 1000),
+        Star(128, 228, 1, 1, 1000),
+        // long and thin: twice as uncertain vertically
+        Star(28, 128, 1, 2, 100),
+        Star(128, 28, 1, 2, 100),
+        // no brightness estimate
+        Star(28, 28, 1, 1, 0),
+    };
+    decimal tolerance = DegToRad(DECIMAL(0.05));
+    std::vector<Vec2> uncertainties = CentroidUncertainties(stars, 10, DECIMAL(0.001));
+    CHECK(uncertainties[0].x == Approx(0.01));
+    CHECK(uncertainties[3].y == Approx(0.2));
+    CHECK(std::isinf(uncertainties[5].x));
+
+    PairTolerances uniform(tolerance);
+    PairTolerances tolerances(tolerance, stars, smolCamera, &uncertainties);
+    CHECK(uniform.Get(0, 1) == tolerance);
+    CHECK(tolerances.Get(0, 1) == Approx(tolerances.Get(1, 0)));
+    // the bright, compact centroids are known about 8 times better than the usual tolerance allows
+    CHECK(tolerances.Get(0, 1) < tolerance / 5);
+    CHECK(tolerances.Get(0, 3) > 5 * tolerances.Get(0, 1));
+    // centroid 3 is more uncertain along y than x
+    CHECK(tolerances.Get(3, 0) < tolerances.Get(3, 4));
+    CHECK(tolerances.Get(0, 5) == tolerance);
+}
+
+TEST_CASE("Per-centroid tolerances tell apart patterns the usual tolerance can't", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(take(3, random(0, 1000000))));
+
+    // The same pattern a second time, elsewhere in the sky and 0.1% smaller, so that no distance
+    // differs by more than the usual tolerance
+    int numFakeStars = 12;
+    Camera smallerCamera(smolCamera.FocalLength() * DECIMAL(1.001), 256, 256);
+    Quaternion elsewhere(Vec3{0, 1, 0}, DECIMAL_M_PI_2);
+    Catalog fakeCatalog;
+    Stars stars;
+    FakeStarsInView(rng, numFakeStars, &fakeCatalog, &stars);
+    // bright, so that their uncertainties are small
+    for (Star &star : stars) {
+        star.magnitude = 1000;
+    }
+    for (int i = 0; i < numFakeStars; i++) {
+        Vec3 smaller = smallerCamera.CameraToSpatial(stars[i].position).Normalize();
+        fakeCatalog.emplace_back(elsewhere.Rotate(smaller), 1, numFakeStars + i);
+    }
+
+    std::vector<unsigned char> buffer = FakeMultiDatabase({FakePairDistances(fakeCatalog)});
+    PreparedDatabase database(buffer.data());
+
+    PyramidStarIdAlgorithm pyramid(DegToRad(DECIMAL(0.05)), 10, DECIMAL(0.001), 1000);
+    CHECK(pyramid.Go(database, stars, fakeCatalog, smolCamera).empty());
+
+    std::vector<Vec2> uncertainties = CentroidUncertainties(stars, 1, DECIMAL(0.01));
+    StarIdConstraints constraints;
+    constraints.centroidUncertainties = &uncertainties;
+    StarIdProgress progress;
+    StarIdentifiers starIds = pyramid.Go(database, stars, fakeCatalog, smolCamera, constraints, &progress);
+    CHECK((int)starIds.size() == numFakeStars);
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.catalogIndex == starId.starIndex);
+    }
+    // narrower tolerances make a chance match less likely, too
+    CHECK(progress.confidence > DECIMAL(0.999));
+
+    // centroids with no brightness get the usual tolerance
+    for (Star &star : stars) {
+        star.magnitude = 0;
+    }
+    uncertainties = CentroidUncertainties(stars, 1, DECIMAL(0.01));
+    CHECK(pyramid.Go(database, stars, fakeCatalog, smolCamera, constraints, NULL).empty());
+}
+
+TEST_CASE("Grid star-id matches neighbor patterns at any attitude", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(take(3, random(0, 1000000))));
+    std::uniform_real_distribution<decimal> posDist(DECIMAL(0.0), DECIMAL(256.0));
+    std::uniform_real_distribution<decimal> unitDist(DECIMAL(-1.0), DECIMAL(1.0));
+    std::normal_distribution<decimal> noiseDist(DECIMAL(0.0), DECIMAL(0.1));
+
+    // the catalog is the image's stars, somewhere else in the sky
+    Quaternion rotation(Vec3{unitDist(rng), unitDist(rng), unitDist(rng)}.Normalize(), unitDist(rng) * DECIMAL_M_PI);
+    int numFakeStars = 80;
+    Catalog fakeCatalog;
+    Stars stars;
+    FakeStarsInView(rng, numFakeStars, &fakeCatalog, &stars);
+    for (int i = 0; i < numFakeStars; i++) {
+        fakeCatalog[i].spatial = rotation.Rotate(fakeCatalog[i].spatial);
+        Vec2 noisy = {stars[i].position.x + noiseDist(rng), stars[i].position.y + noiseDist(rng)};
+        // (the noise mustn't push a star out of the image)
+        if (smolCamera.InSensor(noisy)) {
+            stars[i].position = noisy;
+        }
+    }
+    // and a couple of false stars
+    stars.emplace_back(posDist(rng), posDist(rng), 1);
+    stars.emplace_back(posDist(rng), posDist(rng), 1);
+
+    SerializeContext gridSer;
+    SerializeGrid(&gridSer, fakeCatalog, 32, DegToRad(DECIMAL(10.0)), DegToRad(DECIMAL(0.25)));
+    std::vector<unsigned char> buffer = FakeMultiDatabase({MultiDatabaseEntry(GridDatabase::kMagicValue, gridSer.buffer)});
+    PreparedDatabase database(buffer.data());
+    const GridDatabase *grid = database.Grid();
+    REQUIRE(grid != NULL);
+    CHECK(grid->NumStars() == numFakeStars);
+
+    // the inverted index lists exactly the stars with each cell set
+    for (int cell = 0; cell < grid->GridSize()*grid->GridSize(); cell++) {
+        const int16_t *end;
+        const int16_t *cellStars = grid->StarsWithCell(cell, &end);
+        for (int16_t i = 0; i < numFakeStars; i++) {
+            bool isSet = (grid->Pattern(i)[cell / 64] >> (cell % 64)) & 1;
+            CHECK(isSet == std::binary_search(cellStars, end, i));
+        }
+    }
+
+    GridStarIdAlgorithm gridAlgorithm(DegToRad(DECIMAL(0.05)), 4);
+    StarIdentifiers starIds = gridAlgorithm.Go(database, stars, fakeCatalog, smolCamera);
+    // stars near the edge have incomplete patterns, but plenty in the middle don't
+    CHECK(starIds.size() >= 10);
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.catalogIndex == starId.starIndex);
+    }
+}
+
+TEST_CASE("Triangle star-id matches side lengths with one query", "[star-id] [fast]") {
+    std::default_random_engine rng(GENERATE(take(3, random(0, 1000000))));
+    std::uniform_real_distribution<decimal> posDist(DECIMAL(0.0), DECIMAL(256.0));
+    std::uniform_real_distribution<decimal> unitDist(DECIMAL(-1.0), DECIMAL(1.0));
+
+    Quaternion rotation(Vec3{unitDist(rng), unitDist(rng), unitDist(rng)}.Normalize(), unitDist(rng) * DECIMAL_M_PI);
+    int numFakeStars = 40;
+    Catalog fakeCatalog;
+    Stars stars;
+    FakeStarsInView(rng, numFakeStars, &fakeCatalog, &stars);
+    for (CatalogStar &catalogStar : fakeCatalog) {
+        catalogStar.spatial = rotation.Rotate(catalogStar.spatial);
+    }
+    stars.emplace_back(posDist(rng), posDist(rng), 1);
+
+    SerializeContext trianglesSer;
+    SerializeTriangles(&trianglesSer, fakeCatalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(40.0)));
+    std::vector<unsigned char> buffer = FakeMultiDatabase({MultiDatabaseEntry(TriangleDatabase::kMagicValue, trianglesSer.buffer)});
+    PreparedDatabase database(buffer.data());
+    REQUIRE(database.Triangles() != NULL);
+
+    TriangleStarIdAlgorithm triangleAlgorithm(DegToRad(DECIMAL(0.05)), 10, DECIMAL(0.001), 1000);
+    StarIdProgress progress;
+    StarIdentifiers starIds = triangleAlgorithm.Go(database, stars, fakeCatalog, smolCamera,
+                                                   StarIdConstraints(), &progress);
+    CHECK((int)starIds.size() == numFakeStars);
+    CHECK(progress.confidence > DECIMAL(0.99));
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.catalogIndex == starId.starIndex);
+    }
+}
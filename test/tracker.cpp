@@ -0,0 +1,88 @@
+#include <math.h>
+
+#include <algorithm>
+#include <random>
+
+#include <catch.hpp>
+
+#include "tracker.hpp"
+#include "fixtures.hpp"
+
+using namespace lost; // NOLINT
+
+/// Centroids of the catalog stars which smolCamera sees at this attitude, in shuffled order, and their true ids
+static void TrackerFrame(const Catalog &catalog, const Quaternion &attitude, std::default_random_engine &rng,
+                         Stars *stars, StarIdentifiers *starIds) {
+    stars->clear();
+    starIds->clear();
+    std::vector<int> order(catalog.size());
+    for (int i = 0; i < (int)catalog.size(); i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), rng);
+    for (int catalogIndex : order) {
+        Vec3 rotated = attitude.Rotate(catalog[catalogIndex].spatial);
+        if (rotated.x <= 0) {
+            continue;
+        }
+        Vec2 position = smolCamera.SpatialToCamera(rotated);
+        if (!smolCamera.InSensor(position)) {
+            continue;
+        }
+        starIds->emplace_back((int)stars->size(), catalogIndex);
+        stars->emplace_back(position.x, position.y, 1);
+    }
+}
+
+TEST_CASE("Tracker follows a steadily turning sky and measures the rate", "[tracker] [fast]") {
+    std::default_random_engine rng(GENERATE(take(5, random(0, 1000000))));
+    std::uniform_real_distribution<decimal> positionDist(0, 256);
+
+    Catalog catalog;
+    for (int i = 0; i < 30; i++) {
+        catalog.emplace_back(smolCamera.CameraToSpatial({positionDist(rng), positionDist(rng)}).Normalize(), 0, i);
+    }
+
+    // about 2 pixels per frame; the tracker doesn't know the rate until it's seen two frames
+    Quaternion step(Vec3{0.2, 0.5, -1}.Normalize(), DegToRad(0.3));
+    Tracker tracker(5, 0.7, 4);
+    Quaternion attitude(1, 0, 0, 0);
+    Stars stars;
+    StarIdentifiers trueIds;
+    StarIdentifiers tracked;
+
+    TrackerFrame(catalog, attitude, rng, &stars, &trueIds);
+    CHECK(!tracker.Track(stars, smolCamera, &tracked));
+    tracker.Update(stars, smolCamera, trueIds);
+    CHECK(tracker.HasFrame());
+    CHECK(!tracker.HasRate());
+
+    for (int frame = 1; frame < 20; frame++) {
+        attitude = step * attitude;
+        TrackerFrame(catalog, attitude, rng, &stars, &trueIds);
+        REQUIRE(tracker.Track(stars, smolCamera, &tracked));
+        CHECK(tracker.Quality() > 0.8);
+        // stars that were ambiguous once aren't tracked again until the next star-id
+        CHECK(tracked.size() > trueIds.size() / 2);
+        for (const StarIdentifier &starId : tracked) {
+            CHECK(std::find(trueIds.begin(), trueIds.end(), starId) != trueIds.end());
+        }
+        tracker.Update(stars, smolCamera, tracked);
+
+        REQUIRE(tracker.HasRate());
+        Vec3 rate = tracker.AngularRate();
+        CHECK(rate.Magnitude() == Approx(DegToRad(0.3)).epsilon(0.05));
+        CHECK(std::abs(rate.Normalize() * step.Canonicalize().Vector().Normalize()) == Approx(1).epsilon(1e-3));
+    }
+
+    // a sudden slew throws every prediction off
+    attitude = Quaternion(Vec3{0, 1, 0}, DegToRad(3)) * attitude;
+    TrackerFrame(catalog, attitude, rng, &stars, &trueIds);
+    CHECK(!tracker.Track(stars, smolCamera, &tracked));
+    CHECK(tracked.empty());
+    CHECK(tracker.Quality() < 0.7);
+
+    tracker.Reset();
+    CHECK(!tracker.HasFrame());
+    CHECK(!tracker.Track(stars, smolCamera, &tracked));
+}